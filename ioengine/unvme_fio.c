@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include </usr/include/err.h>
 
 #include "unvme.h"
@@ -179,7 +180,7 @@ static int fio_unvme_getevents(struct thread_data *td, unsigned int min,
                     TDEBUG("PUT.%d %p (%d %d)", ec, io_u->buf, min, max);
                     iocq[ec++] = io_u;
                     if (ec == max) return ec;
-                } else if (stat == -1) {
+                } else if (stat == -ETIMEDOUT) {
                     if (ec >= min) return ec;
                 } else {
                     FATAL("\nunvme_apoll return %#x", stat);
@@ -34,16 +34,22 @@
  * @brief UNVMe client library interface functions.
  */
 
-#include "unvme_core.h"
+#include <string.h>
+#include <errno.h>
+
+#include "unvme_inline.h"
 
 /**
- * Open a client session with specified number of IO queues and queue size.
+ * Open a client session with specified number of IO queues, queue size
+ * and open flags.  The queue count, size and flags only take effect when
+ * the device is first opened.
  * @param   pciname     PCI device name (as %x:%x.%x[/NSID] format)
  * @param   qcount      number of io queues
  * @param   qsize       io queue size
+ * @param   flags       open flags (UNVME_OPEN_*)
  * @return  namespace pointer or NULL if error.
  */
-const unvme_ns_t* unvme_openq(const char* pciname, int qcount, int qsize)
+const unvme_ns_t* unvme_openf(const char* pciname, int qcount, int qsize, int flags)
 {
     if (qcount < 0 || qsize < 0 || qsize == 1) {
         ERROR("invalid qcount %d or qsize %d", qcount, qsize);
@@ -58,7 +64,19 @@ const unvme_ns_t* unvme_openq(const char* pciname, int qcount, int qsize)
     }
     int pci = (b << 16) + (d << 8) + f;
 
-    return unvme_do_open(pci, nsid, qcount, qsize);
+    return unvme_do_open(pci, nsid, qcount, qsize, flags);
+}
+
+/**
+ * Open a client session with specified number of IO queues and queue size.
+ * @param   pciname     PCI device name (as %x:%x.%x[/NSID] format)
+ * @param   qcount      number of io queues
+ * @param   qsize       io queue size
+ * @return  namespace pointer or NULL if error.
+ */
+const unvme_ns_t* unvme_openq(const char* pciname, int qcount, int qsize)
+{
+    return unvme_openf(pciname, qcount, qsize, 0);
 }
 
 /**
@@ -103,6 +121,93 @@ int unvme_free(const unvme_ns_t* ns, void* buf)
     return unvme_do_free(ns, buf);
 }
 
+/**
+ * Register an already mapped buffer residing at the specified bus address
+ * (e.g. an FPGA programmable logic buffer) as an I/O buffer, so the device
+ * transfers to and from it directly.  Release it with unvme_free().
+ * @param   ns          namespace handle
+ * @param   buf         mapped buffer
+ * @param   size        buffer size
+ * @param   addr        bus address of the buffer
+ * @return  buf or NULL if failure.
+ */
+void* unvme_register_dma(const unvme_ns_t* ns, void* buf, u64 size, u64 addr)
+{
+    if (!buf) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return unvme_do_map(ns, buf, size, addr);
+}
+
+/**
+ * Map a physical address range (e.g. an FPGA programmable logic buffer)
+ * and register it as an I/O buffer.  Release it with unvme_free().
+ * @param   ns          namespace handle
+ * @param   addr        physical (bus) address
+ * @param   size        range size
+ * @return  the mapped I/O buffer or NULL if failure.
+ */
+void* unvme_map_phys(const unvme_ns_t* ns, u64 addr, u64 size)
+{
+    return unvme_do_map(ns, NULL, size, addr);
+}
+
+/**
+ * Allocate an I/O buffer that is exported as a dma-buf, so other drivers
+ * (e.g. video capture or network) may access it without a copy.
+ * The caller owns the returned descriptor, and the memory is released
+ * once both unvme_free() is called and the descriptor is closed.  As the
+ * buffer is mapped cacheable, CPU accesses must be bracketed by
+ * unvme_sync_dmabuf().
+ * @param   ns          namespace handle
+ * @param   size        buffer size
+ * @param   fd          returned dma-buf file descriptor
+ * @return  the allocated buffer or NULL if failure.
+ */
+void* unvme_alloc_dmabuf(const unvme_ns_t* ns, u64 size, int* fd)
+{
+    *fd = -1;
+    return unvme_do_dmabuf(ns, fd, size);
+}
+
+/**
+ * Import a (physically contiguous) dma-buf exported by another driver as
+ * an I/O buffer.  Release it with unvme_free().  As the buffer is mapped
+ * cacheable, CPU accesses must be bracketed by unvme_sync_dmabuf().
+ * @param   ns          namespace handle
+ * @param   fd          dma-buf file descriptor
+ * @param   size        size to import (0 for the whole dma-buf)
+ * @return  the imported I/O buffer or NULL if failure.
+ */
+void* unvme_import_dmabuf(const unvme_ns_t* ns, int fd, u64 size)
+{
+    if (fd < 0) {
+        errno = EBADF;
+        return NULL;
+    }
+    return unvme_do_dmabuf(ns, &fd, size);
+}
+
+/**
+ * Synchronize the CPU caches of a dma-buf I/O buffer around a CPU access
+ * (i.e. DMA_BUF_IOCTL_SYNC).  Unlike the uncached unvme_alloc() memory, a
+ * dma-buf is mapped cacheable, so on a non-coherent system the CPU may
+ * read stale data after a device write and the device may miss data still
+ * in the CPU cache.  A CPU access must begin with a UNVME_SYNC_START call
+ * (after the device I/O completes) and end with a UNVME_SYNC_END call
+ * with the same UNVME_SYNC_READ/WRITE flags (before the next device I/O).
+ * @param   ns          namespace handle
+ * @param   buf         I/O buffer (from unvme_alloc_dmabuf/unvme_import_dmabuf)
+ * @param   flags       UNVME_SYNC_START or UNVME_SYNC_END, and
+ *                      UNVME_SYNC_READ and/or UNVME_SYNC_WRITE
+ * @return  0 if ok else negative error code.
+ */
+int unvme_sync_dmabuf(const unvme_ns_t* ns, void* buf, int flags)
+{
+    return unvme_do_sync_dmabuf(ns, buf, flags);
+}
+
 /**
  * Submit a generic or vendor specific command.
  * @param   ns          namespace handle
@@ -112,7 +217,7 @@ int unvme_free(const unvme_ns_t* ns, void* buf)
  * @param   buf         data buffer (from unvme_alloc)
  * @param   bufsz       data buffer size
  * @param   cdw10_15    NVMe command word 10 through 15
- * @return  descriptor or NULL if failed.
+ * @return  descriptor or NULL if failed (with errno set).
  */
 inline unvme_iod_t unvme_acmd(const unvme_ns_t* ns, int qid, int opc, int nsid,
                               void* buf, u64 bufsz, u32 cdw10_15[6])
@@ -127,11 +232,11 @@ inline unvme_iod_t unvme_acmd(const unvme_ns_t* ns, int qid, int opc, int nsid,
  * @param   buf         data buffer (from unvme_alloc)
  * @param   slba        starting logical block
  * @param   nlb         number of logical blocks
- * @return  I/O descriptor or NULL if failed.
+ * @return  I/O descriptor or NULL if failed (with errno set).
  */
 inline unvme_iod_t unvme_aread(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb)
 {
-    return (unvme_iod_t)unvme_do_rw(ns, qid, NVME_CMD_READ, buf, slba, nlb);
+    return (unvme_iod_t)unvme_fast_rw(ns, qid, NVME_CMD_READ, buf, slba, nlb);
 }
 
 /**
@@ -141,37 +246,37 @@ inline unvme_iod_t unvme_aread(const unvme_ns_t* ns, int qid, void* buf, u64 slb
  * @param   buf         data buffer (from unvme_alloc)
  * @param   slba        starting logical block
  * @param   nlb         number of logical blocks
- * @return  I/O descriptor or NULL if failed.
+ * @return  I/O descriptor or NULL if failed (with errno set).
  */
 inline unvme_iod_t unvme_awrite(const unvme_ns_t* ns, int qid,
                          const void* buf, u64 slba, u32 nlb)
 {
-    return (unvme_iod_t)unvme_do_rw(ns, qid, NVME_CMD_WRITE, (void*)buf, slba, nlb);
+    return (unvme_iod_t)unvme_fast_rw(ns, qid, NVME_CMD_WRITE, (void*)buf, slba, nlb);
 }
 
 /**
  * Poll for completion status of a previous IO submission.
- * If there's no error, the descriptor will be freed.
+ * Once completed (with or without error), the descriptor will be freed.
  * @param   iod         IO descriptor
  * @param   timeout     in seconds
- * @return  0 if ok else error status (-1 for timeout).
+ * @return  0 if ok else error status (-ETIMEDOUT if not yet completed).
  */
 inline int unvme_apoll(unvme_iod_t iod, int timeout)
 {
-    return unvme_do_poll((unvme_desc_t*)iod, timeout, NULL);
+    return unvme_fast_poll((unvme_desc_t*)iod, timeout, NULL);
 }
 
 /**
  * Poll for completion status of a previous IO submission.
- * If there's no error, the descriptor will be freed.
+ * Once completed (with or without error), the descriptor will be freed.
  * @param   iod         IO descriptor
  * @param   timeout     in seconds
  * @param   cqe_cs      CQE command specific DW0 returned
- * @return  0 if ok else error status (-1 for timeout).
+ * @return  0 if ok else error status (-ETIMEDOUT if not yet completed).
  */
 inline int unvme_apoll_cs(unvme_iod_t iod, int timeout, u32* cqe_cs)
 {
-    return unvme_do_poll((unvme_desc_t*)iod, timeout, cqe_cs);
+    return unvme_fast_poll((unvme_desc_t*)iod, timeout, cqe_cs);
 }
 
 /**
@@ -184,17 +289,17 @@ inline int unvme_apoll_cs(unvme_iod_t iod, int timeout, u32* cqe_cs)
  * @param   bufsz       data buffer size
  * @param   cdw10_15    NVMe command word 10 through 15
  * @param   cqe_cs      CQE command specific DW0 returned
- * @return  descriptor or NULL if failed.
+ * @return  0 if ok else error status.
  */
 int unvme_cmd(const unvme_ns_t* ns, int qid, int opc, int nsid,
               void* buf, u64 bufsz, u32 cdw10_15[6], u32* cqe_cs)
 {
     unvme_iod_t iod = unvme_acmd(ns, qid, opc, nsid, buf, bufsz, cdw10_15);
     if (iod) {
-        sched_yield();
+        unvme_yield(((unvme_session_t*)ns->ses)->dev->rt);
         return unvme_apoll_cs(iod, UNVME_TIMEOUT, cqe_cs);
     }
-    return -1;
+    return -errno;
 }
 
 /**
@@ -210,10 +315,10 @@ int unvme_read(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb)
 {
     unvme_iod_t iod = unvme_aread(ns, qid, buf, slba, nlb);
     if (iod) {
-        sched_yield();
+        unvme_yield(((unvme_session_t*)ns->ses)->dev->rt);
         return unvme_apoll(iod, UNVME_TIMEOUT);
     }
-    return -1;
+    return -errno;
 }
 
 /**
@@ -230,9 +335,264 @@ int unvme_write(const unvme_ns_t* ns, int qid,
 {
     unvme_iod_t iod = unvme_awrite(ns, qid, buf, slba, nlb);
     if (iod) {
-        sched_yield();
+        unvme_yield(((unvme_session_t*)ns->ses)->dev->rt);
         return unvme_apoll(iod, UNVME_TIMEOUT);
     }
-    return -1;
+    return -errno;
+}
+
+
+/**
+ * Get the LBA formats supported by a namespace.
+ * @param   ns          namespace handle
+ * @param   lbaf        array of LBA formats returned
+ * @return  number of LBA formats or -1 if error.
+ */
+int unvme_get_lbaf(const unvme_ns_t* ns, unvme_lbaf_t lbaf[16])
+{
+    return unvme_do_get_lbaf(ns, lbaf);
+}
+
+/**
+ * Format a namespace with the specified LBA format (all data will be lost).
+ * @param   ns          namespace handle
+ * @param   lbaf        LBA format index (or UNVME_LBAF_BEST)
+ * @return  0 if ok else error status.
+ */
+int unvme_format(const unvme_ns_t* ns, int lbaf)
+{
+    return unvme_do_format(ns, lbaf);
+}
+
+/**
+ * Create a namespace and attach it to the controller.
+ * @param   ns          namespace handle (of the same controller)
+ * @param   nlb         namespace size in number of logical blocks
+ * @param   lbaf        LBA format index (or UNVME_LBAF_BEST)
+ * @return  the created namespace id or -1 if error.
+ */
+int unvme_ns_create(const unvme_ns_t* ns, u64 nlb, int lbaf)
+{
+    return unvme_do_ns_create(ns, nlb, lbaf);
 }
 
+/**
+ * Detach a namespace from the controller and delete it.
+ * @param   ns          namespace handle (of the same controller)
+ * @param   nsid        namespace id to delete
+ * @return  0 if ok else error status.
+ */
+int unvme_ns_delete(const unvme_ns_t* ns, int nsid)
+{
+    return unvme_do_ns_delete(ns, nsid);
+}
+
+/**
+ * Set the power state latency budget of the device.  The deepest power
+ * state whose entry plus exit latency fits the budget is selected as the
+ * idle state, and if the device supports autonomous power state transition
+ * an APST table is programmed accordingly.  A zero budget disables power
+ * management and returns the device to power state 0.
+ * @param   ns          namespace handle
+ * @param   latency     latency budget in microseconds
+ * @return  the selected idle power state or -1 if error.
+ */
+int unvme_set_power_latency(const unvme_ns_t* ns, u32 latency)
+{
+    return unvme_do_set_power_latency(ns, latency);
+}
+
+/**
+ * Enter the selected idle power state (when not autonomously managed).
+ * The device returns to power state 0 on the next I/O submission.
+ * @param   ns          namespace handle
+ * @return  0 if ok else error status.
+ */
+int unvme_power_idle(const unvme_ns_t* ns)
+{
+    return unvme_do_set_power_state(ns, 1);
+}
+
+/**
+ * Exit to the operational power state 0 ahead of an expected I/O burst so
+ * that even the first I/O does not incur the idle state exit latency.
+ * @param   ns          namespace handle
+ * @return  0 if ok else error status.
+ */
+int unvme_power_wake(const unvme_ns_t* ns)
+{
+    return unvme_do_set_power_state(ns, 0);
+}
+
+/**
+ * Adapt the interrupt coalescing of a device opened with UNVME_OPEN_INTR to
+ * the completion rates observed since the previous call (to be called
+ * periodically, e.g. every 100ms, outside of the I/O path).  Lightly loaded
+ * queues get an interrupt per completion and busy queues are coalesced.
+ * @param   ns          namespace handle
+ * @return  0 if ok else error status.
+ */
+int unvme_tune_intr(const unvme_ns_t* ns)
+{
+    return unvme_do_tune_intr(ns);
+}
+
+/**
+ * Reset the controller and recreate its queues in place.  Outstanding
+ * I/O descriptors are failed with error -EIO and may be resubmitted.
+ * @param   ns          namespace handle
+ * @return  0 if ok else -1.
+ */
+int unvme_reset(const unvme_ns_t* ns)
+{
+    return unvme_do_reset(ns);
+}
+
+/**
+ * Set the max number of automatic retries per command for retryable NVMe
+ * status (i.e. DNR clear).  The default is UNVME_RETRY_MAX.
+ * @param   ns          namespace handle
+ * @param   maxretry    max retries (0 to disable retry)
+ * @return  previous max retries.
+ */
+int unvme_set_retry(const unvme_ns_t* ns, int maxretry)
+{
+    return unvme_do_set_retry(ns, maxretry);
+}
+
+/**
+ * Get the command retry statistics of a device.
+ * @param   ns          namespace handle
+ * @param   stats       statistics returned
+ * @return  0 if ok.
+ */
+int unvme_get_retry_stats(const unvme_ns_t* ns, unvme_retry_stats_t* stats)
+{
+    return unvme_do_get_retry_stats(ns, stats);
+}
+
+/**
+ * Reap the available completions of a queue.  The I/O completed are
+ * returned (and their descriptors released), so all the I/O submitted to
+ * a queue that is reaped must be completed this way rather than polled.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   comps       returned completions
+ * @param   max         max number of completions to return
+ * @return  number of completions or negative error code.
+ */
+int unvme_reap(const unvme_ns_t* ns, int qid, unvme_comp_t* comps, int max)
+{
+    return unvme_do_reap(ns, qid, comps, max);
+}
+
+/**
+ * Set up the calling thread for real-time I/O (e.g. a completion reaper
+ * of a device opened with UNVME_OPEN_RT), by pinning it to a CPU and
+ * scheduling it with SCHED_FIFO.
+ * @param   cpu         CPU to pin to (-1 to leave the affinity)
+ * @param   priority    SCHED_FIFO priority (0 for the max)
+ * @return  0 if ok else error code.
+ */
+int unvme_rt_thread(int cpu, int priority)
+{
+    int err;
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))) {
+            ERROR("pthread_setaffinity_np cpu %d, %d", cpu, err);
+            return err;
+        }
+    }
+    struct sched_param sp = { .sched_priority = priority };
+    if (!priority) sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)))
+        ERROR("pthread_setschedparam priority %d, %d", sp.sched_priority, err);
+    return err;
+}
+
+/**
+ * Return a description of an I/O completion status.
+ * @param   err         0, negative errno value, or positive NVMe status
+ * @return  description string.
+ */
+const char* unvme_strerror(int err)
+{
+    if (err < 0) return strerror(-err);
+    if (err == 0) return "Success";
+
+    int sc = UNVME_SC(err);
+    switch (UNVME_SCT(err)) {
+    case 0:
+        switch (sc) {
+        case 0x01: return "Invalid command opcode";
+        case 0x02: return "Invalid field in command";
+        case 0x03: return "Command ID conflict";
+        case 0x04: return "Data transfer error";
+        case 0x05: return "Commands aborted due to power loss";
+        case 0x06: return "Internal error";
+        case 0x07: return "Command abort requested";
+        case 0x08: return "Command aborted due to SQ deletion";
+        case 0x0b: return "Invalid namespace or format";
+        case 0x80: return "LBA out of range";
+        case 0x81: return "Capacity exceeded";
+        case 0x82: return "Namespace not ready";
+        }
+        return "Generic command status";
+    case 1:
+        return "Command specific status";
+    case 2:
+        switch (sc) {
+        case 0x80: return "Write fault";
+        case 0x81: return "Unrecovered read error";
+        case 0x82: return "End-to-end guard check error";
+        case 0x83: return "End-to-end application tag check error";
+        case 0x84: return "End-to-end reference tag check error";
+        case 0x85: return "Compare failure";
+        case 0x86: return "Access denied";
+        case 0x87: return "Deallocated or unwritten logical block";
+        }
+        return "Media and data integrity error";
+    case 3:
+        return "Path related status";
+    }
+    return "Vendor specific status";
+}
+
+/**
+ * Take over an idle I/O queue as a raw queue (see unvme_rawq.h).
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @return  raw queue or NULL if failed (with errno set).
+ */
+unvme_rawq_t* unvme_rawq_open(const unvme_ns_t* ns, int qid)
+{
+    return unvme_do_rawq_open(ns, qid);
+}
+
+/**
+ * Return a raw queue to the regular I/O functions (recreating the queue if
+ * it was failed by a controller reset).
+ * @param   rq          raw queue
+ * @return  0 if ok else -EBUSY if there are pending commands or -EIO if
+ *          the queue could not be recreated.
+ */
+int unvme_rawq_close(unvme_rawq_t* rq)
+{
+    return unvme_do_rawq_close(rq);
+}
+
+/**
+ * Get the DMA address of an I/O buffer range for a raw queue command.
+ * @param   rq          raw queue
+ * @param   buf         buffer (from unvme_alloc)
+ * @param   bufsz       buffer size
+ * @param   addr        returned DMA address
+ * @return  0 if ok else error status.
+ */
+int unvme_rawq_map(unvme_rawq_t* rq, void* buf, u64 bufsz, u64* addr)
+{
+    return unvme_do_rawq_map(rq, buf, bufsz, addr);
+}
@@ -54,6 +54,28 @@ typedef uint64_t        u64;        ///< 64-bit unsigned
 #define UNVME_TIMEOUT   60          ///< default timeout in seconds
 #define UNVME_QSIZE     256         ///< default I/O queue size
 
+/*
+ * I/O completion status is 0 if ok, a negative errno value for driver
+ * errors (e.g. -ETIMEDOUT, -EIO, -EINVAL, -EFAULT), or a positive NVMe
+ * status (i.e. CQE status field without the phase bit) decoded as below.
+ */
+#define UNVME_SC(err)   (((err) >> 1) & 0xff)   ///< NVMe status code
+#define UNVME_SCT(err)  (((err) >> 9) & 0x7)    ///< NVMe status code type
+#define UNVME_CRD(err)  (((err) >> 12) & 0x3)   ///< NVMe command retry delay
+#define UNVME_DNR(err)  (((err) >> 15) & 0x1)   ///< NVMe do not retry bit
+
+#define UNVME_RETRY_MAX 4           ///< default max retries per command
+
+/// dma-buf CPU access flags (for unvme_sync_dmabuf, as DMA_BUF_SYNC_*)
+#define UNVME_SYNC_READ     0x1     ///< CPU reads the buffer
+#define UNVME_SYNC_WRITE    0x2     ///< CPU writes the buffer
+#define UNVME_SYNC_START    0x0     ///< begin the CPU access
+#define UNVME_SYNC_END      0x4     ///< end the CPU access
+
+/// Open flags (for unvme_openf)
+#define UNVME_OPEN_INTR 0x1         ///< wait for completions by interrupt
+#define UNVME_OPEN_RT   0x2         ///< real-time (jitter minimizing) mode
+
 /// Namespace attributes structure
 typedef struct _unvme_ns {
     u32                 pci;        ///< PCI device id
@@ -82,6 +104,25 @@ typedef struct _unvme_ns {
     void*               ses;        ///< associated session
 } unvme_ns_t;
 
+/// LBA format attributes structure
+typedef struct _unvme_lbaf {
+    u32                 blocksize;  ///< logical block size
+    u16                 ms;         ///< metadata size
+    u8                  rp;         ///< relative performance (0=best 3=degraded)
+    u8                  formatted;  ///< currently formatted flag
+} unvme_lbaf_t;
+
+/// Select the best performing LBA format (for unvme_format/unvme_ns_create)
+#define UNVME_LBAF_BEST     (-1)
+
+/// Command retry statistics
+typedef struct _unvme_retry_stats {
+    u64                 retries;    ///< number of command resubmissions
+    u64                 recovered;  ///< retried commands completed ok
+    u64                 exhausted;  ///< commands failed after max retries
+    u64                 dnr;        ///< commands failed with do not retry
+} unvme_retry_stats_t;
+
 /// I/O descriptor (not to be copied and is cleared upon apoll completion)
 typedef struct _unvme_iod {
     void*               buf;        ///< data buffer (as submitted)
@@ -92,13 +133,38 @@ typedef struct _unvme_iod {
     u32                 id;         ///< descriptor id
 } *unvme_iod_t;
 
+/// I/O completion (as returned by unvme_reap and unvme_group_poll)
+typedef struct _unvme_comp {
+    const unvme_ns_t*   ns;         ///< namespace of the I/O
+    void*               buf;        ///< data buffer (as submitted)
+    u64                 slba;       ///< starting lba (as submitted)
+    u32                 nlb;        ///< number of blocks (as submitted)
+    u32                 qid;        ///< queue id (as submitted)
+    u32                 opc;        ///< op code
+    int                 err;        ///< completion status
+} unvme_comp_t;
+
+/// Device group (devices opened together and polled as one)
+typedef struct _unvme_group {
+    int                 count;      ///< number of devices
+    int                 qcount;     ///< number of queue indexes
+    int*                next;       ///< device to poll first per queue index
+    const unvme_ns_t**  ns;         ///< namespace of each device
+} unvme_group_t;
+
 // Export functions
 const unvme_ns_t* unvme_open(const char* pciname);
 const unvme_ns_t* unvme_openq(const char* pciname, int qcount, int qsize);
+const unvme_ns_t* unvme_openf(const char* pciname, int qcount, int qsize, int flags);
 int unvme_close(const unvme_ns_t* ns);
 
 void* unvme_alloc(const unvme_ns_t* ns, u64 size);
 int unvme_free(const unvme_ns_t* ns, void* buf);
+void* unvme_register_dma(const unvme_ns_t* ns, void* buf, u64 size, u64 addr);
+void* unvme_map_phys(const unvme_ns_t* ns, u64 addr, u64 size);
+void* unvme_alloc_dmabuf(const unvme_ns_t* ns, u64 size, int* fd);
+void* unvme_import_dmabuf(const unvme_ns_t* ns, int fd, u64 size);
+int unvme_sync_dmabuf(const unvme_ns_t* ns, void* buf, int flags);
 
 int unvme_write(const unvme_ns_t* ns, int qid, const void* buf, u64 slba, u32 nlb);
 int unvme_read(const unvme_ns_t* ns, int qid, void* buf, u64 slba, u32 nlb);
@@ -110,6 +176,27 @@ unvme_iod_t unvme_acmd(const unvme_ns_t* ns, int qid, int opc, int nsid, void* b
 
 int unvme_apoll(unvme_iod_t iod, int timeout);
 int unvme_apoll_cs(unvme_iod_t iod, int timeout, u32* cqe_cs);
+int unvme_reap(const unvme_ns_t* ns, int qid, unvme_comp_t* comps, int max);
+
+unvme_group_t* unvme_group_open(const char* pcinames[], int count, int qcount, int qsize, int flags);
+int unvme_group_close(unvme_group_t* grp);
+int unvme_group_poll(unvme_group_t* grp, int qid, unvme_comp_t* comps, int max, int timeout);
+
+int unvme_get_lbaf(const unvme_ns_t* ns, unvme_lbaf_t lbaf[16]);
+int unvme_format(const unvme_ns_t* ns, int lbaf);
+int unvme_ns_create(const unvme_ns_t* ns, u64 nlb, int lbaf);
+int unvme_ns_delete(const unvme_ns_t* ns, int nsid);
+
+int unvme_set_power_latency(const unvme_ns_t* ns, u32 latency);
+int unvme_power_idle(const unvme_ns_t* ns);
+int unvme_power_wake(const unvme_ns_t* ns);
+
+int unvme_tune_intr(const unvme_ns_t* ns);
+int unvme_reset(const unvme_ns_t* ns);
+int unvme_set_retry(const unvme_ns_t* ns, int maxretry);
+int unvme_get_retry_stats(const unvme_ns_t* ns, unvme_retry_stats_t* stats);
+const char* unvme_strerror(int err);
+int unvme_rt_thread(int cpu, int priority);
 
 #endif // _UNVME_H
 
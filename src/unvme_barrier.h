@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNVMe memory barriers for queue and doorbell accesses.
+ */
+
+
+#ifndef _UNVME_BARRIER_H
+#define _UNVME_BARRIER_H
+
+#include <stdint.h>
+
+/*
+ * Submission and completion queues live in host memory that the controller
+ * accesses through DMA, while doorbells are device registers.  The required
+ * orderings are:
+ *
+ *   - SQ entry stores must be visible to the device before the doorbell
+ *     store that publishes them (unvme_dma_wmb).
+ *   - CQ entry fields must not be read before the phase bit that marks the
+ *     entry valid (unvme_load_acquire16).
+ *   - CQ entry loads must be complete before the head doorbell store that
+ *     gives the slot back to the device (unvme_dma_rmb).
+ *
+ * x86 keeps stores ordered with stores and loads ordered with loads, so only
+ * compiler barriers are needed there.  ARMv8 (e.g. Cortex-A53) is weakly
+ * ordered and needs outer shareable DMB instructions, which are required even
+ * if the queue memory happens to be mapped uncached.
+ */
+
+/// Compiler barrier
+#define unvme_barrier()     __asm__ __volatile__("" ::: "memory")
+
+#if defined(__aarch64__)
+
+/// Order prior stores before subsequent stores as observed by the device
+#define unvme_dma_wmb()     __asm__ __volatile__("dmb oshst" ::: "memory")
+/// Order prior loads before subsequent loads and stores
+#define unvme_dma_rmb()     __asm__ __volatile__("dmb oshld" ::: "memory")
+/// Full barrier as observed by the device
+#define unvme_mb()          __asm__ __volatile__("dmb osh" ::: "memory")
+/// Spin wait hint (without giving up the CPU)
+#define unvme_cpu_relax()   __asm__ __volatile__("yield" ::: "memory")
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#define unvme_dma_wmb()     unvme_barrier()
+#define unvme_dma_rmb()     unvme_barrier()
+#define unvme_mb()          __sync_synchronize()
+#define unvme_cpu_relax()   __asm__ __volatile__("pause" ::: "memory")
+
+#else
+
+#define unvme_dma_wmb()     __sync_synchronize()
+#define unvme_dma_rmb()     __sync_synchronize()
+#define unvme_mb()          __sync_synchronize()
+#define unvme_cpu_relax()   unvme_barrier()
+
+#endif
+
+/**
+ * Load a 16-bit value with acquire semantics (ldarh on ARMv8) so that
+ * subsequent loads cannot be satisfied before it.
+ * @param   addr        address
+ * @return  value.
+ */
+static inline uint16_t unvme_load_acquire16(const volatile uint16_t* addr)
+{
+    return __atomic_load_n(addr, __ATOMIC_ACQUIRE);
+}
+
+#endif  // _UNVME_BARRIER_H
+
@@ -0,0 +1,447 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe streaming capture implementation.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include "unvme_core.h"
+#include "unvme_capture.h"
+
+/// Default ring size
+#define CAPTURE_RINGSIZE    (64 << 20)
+/// Default max writes in flight per queue
+#define CAPTURE_QDEPTH      8
+
+/// Update or read a statistic (as a snapshot may be taken by any thread)
+#define STAT_ADD(cap, f, n) __atomic_fetch_add(&(cap)->stats.f, n, __ATOMIC_RELAXED)
+#define STAT_SET(cap, f, v) __atomic_store_n(&(cap)->stats.f, v, __ATOMIC_RELAXED)
+#define STAT_GET(cap, f)    __atomic_load_n(&(cap)->stats.f, __ATOMIC_RELAXED)
+
+/// Write in flight
+typedef struct _capture_io {
+    unvme_iod_t         iod;        ///< I/O descriptor
+    u64                 lba;        ///< starting lba
+    u64                 bytes;      ///< ring bytes released on completion
+    u64                 segslba;    ///< segment starting lba
+    u64                 ns;         ///< submission time (ns)
+    int                 qid;        ///< queue index
+    int                 segend;     ///< last write of a segment flag
+} capture_io_t;
+
+/// Capture context
+struct _unvme_capture {
+    const unvme_ns_t*   ns;         ///< namespace
+    unvme_capture_params_t params;  ///< parameters (with defaults applied)
+    u8*                 ring;       ///< DMA ring buffer
+    u64                 ringsize;   ///< ring size
+    u64                 chunk;      ///< write size in bytes
+    u32                 chunknlb;   ///< write size in blocks
+    u64                 endlba;     ///< end of range lba
+    u64                 highwm;     ///< high watermark in bytes
+    u64                 lowwm;      ///< low watermark in bytes
+    u64                 head;       ///< bytes committed by the producer
+    u64                 tail;       ///< bytes released by the writer
+    u64                 submitted;  ///< bytes submitted by the writer
+    u64                 nextlba;    ///< next lba to write
+    u64                 segslba;    ///< current segment starting lba
+    capture_io_t*       fifo;       ///< writes in flight (in lba order)
+    int                 fifosize;   ///< fifo size
+    int                 fifohead;   ///< oldest write index
+    int                 fifocount;  ///< number of writes in flight
+    int*                qpending;   ///< writes in flight per queue
+    int                 qnext;      ///< next queue to submit to
+    int                 closing;    ///< close requested flag
+    pthread_t           writer;     ///< writer thread
+    u64                 latsum;     ///< total write latency (ns)
+    unvme_capture_stats_t stats;    ///< statistics
+};
+
+/**
+ * Get the monotonic time in nanoseconds.
+ */
+static inline u64 capture_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Reap the completed writes in order and release their ring space.
+ * @param   cap         capture context
+ * @return  number of writes reaped.
+ */
+static int capture_reap(unvme_capture_t* cap)
+{
+    int n = 0;
+    while (cap->fifocount) {
+        capture_io_t* io = &cap->fifo[cap->fifohead];
+        int err = unvme_apoll(io->iod, 0);
+        if (err == -ETIMEDOUT) break;
+
+        u64 lat = capture_ns() - io->ns;
+        cap->latsum += lat;
+        if (lat > STAT_GET(cap, latmax)) STAT_SET(cap, latmax, lat);
+        if (err) {
+            ERROR("capture write lba %#lx error %d", io->lba, err);
+            STAT_ADD(cap, errors, 1);
+        }
+        u64 writes = STAT_ADD(cap, writes, 1) + 1;
+        STAT_SET(cap, latavg, cap->latsum / writes);
+        STAT_ADD(cap, written, io->bytes);
+        __atomic_store_n(&cap->tail, cap->tail + io->bytes, __ATOMIC_RELEASE);
+
+        if (io->segend) {
+            if (cap->params.segcb) {
+                cap->params.segcb(cap, STAT_GET(cap, segments), io->segslba,
+                                  cap->params.arg);
+            }
+            STAT_ADD(cap, segments, 1);
+        }
+        cap->qpending[io->qid]--;
+        if (++cap->fifohead == cap->fifosize) cap->fifohead = 0;
+        cap->fifocount--;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Submit the ring data as writes in lba order across the queues.
+ * A partial chunk is only written (zero padded to a block) when closing.
+ * @param   cap         capture context
+ * @return  number of writes submitted.
+ */
+static int capture_submit(unvme_capture_t* cap)
+{
+    const unvme_ns_t* ns = cap->ns;
+    int closing = __atomic_load_n(&cap->closing, __ATOMIC_ACQUIRE);
+    u64 head = __atomic_load_n(&cap->head, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (!STAT_GET(cap, stopped) && cap->fifocount < cap->fifosize) {
+        u64 bytes = head - cap->submitted;
+        if (bytes > cap->chunk) bytes = cap->chunk;
+        if (!bytes || (bytes < cap->chunk && !closing)) break;
+        int qid = cap->qnext;
+        if (cap->qpending[qid] == cap->params.qdepth) break;
+
+        u64 off = cap->submitted % cap->ringsize;
+        u32 nlb = (bytes + ns->blocksize - 1) >> ns->blockshift;
+        if (bytes < ((u64)nlb << ns->blockshift))
+            memset(cap->ring + off + bytes, 0, ((u64)nlb << ns->blockshift) - bytes);
+
+        if ((cap->nextlba + nlb) > cap->endlba) {
+            if (cap->params.flags & UNVME_CAPTURE_NOWRAP) {
+                __atomic_store_n(&cap->stats.stopped, 1, __ATOMIC_RELEASE);
+                break;
+            }
+            cap->nextlba = cap->params.slba;
+            STAT_ADD(cap, wraps, 1);
+        }
+        u64 lba = cap->nextlba;
+        if (((lba - cap->params.slba) % cap->params.segnlb) == 0)
+            cap->segslba = lba;
+
+        unvme_iod_t iod = unvme_awrite(ns, qid, cap->ring + off, lba, nlb);
+        if (!iod) break;
+
+        int i = cap->fifohead + cap->fifocount;
+        if (i >= cap->fifosize) i -= cap->fifosize;
+        capture_io_t* io = &cap->fifo[i];
+        io->iod = iod;
+        io->lba = lba;
+        io->bytes = bytes;
+        io->segslba = cap->segslba;
+        io->ns = capture_ns();
+        io->qid = qid;
+        io->segend = ((lba + nlb) == cap->endlba) ||
+                     (((lba + nlb - cap->params.slba) % cap->params.segnlb) == 0);
+        cap->fifocount++;
+        cap->qpending[qid]++;
+        if (++cap->qnext == cap->params.qcount) cap->qnext = 0;
+
+        cap->submitted += bytes;
+        cap->nextlba = lba + nlb;
+        STAT_SET(cap, nextlba, cap->nextlba);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Writer thread.
+ * @param   arg         capture context
+ */
+static void* capture_writer(void* arg)
+{
+    unvme_capture_t* cap = arg;
+
+    for (;;) {
+        int n = capture_reap(cap) + capture_submit(cap);
+        if (n) continue;
+        if (__atomic_load_n(&cap->closing, __ATOMIC_ACQUIRE) && !cap->fifocount &&
+            (STAT_GET(cap, stopped) ||
+             cap->submitted == __atomic_load_n(&cap->head, __ATOMIC_ACQUIRE)))
+            break;
+        sched_yield();
+    }
+    return NULL;
+}
+
+/**
+ * Apply the producer backpressure for adding data to the ring.
+ * @param   cap         capture context
+ * @param   size        number of bytes to add
+ * @return  0 if data may be added or -1 if it is to be dropped.
+ */
+static int capture_throttle(unvme_capture_t* cap, u64 size)
+{
+    for (;;) {
+        if (__atomic_load_n(&cap->stats.stopped, __ATOMIC_ACQUIRE)) return -1;
+        u64 fill = cap->head - __atomic_load_n(&cap->tail, __ATOMIC_ACQUIRE);
+        if (fill > STAT_GET(cap, ringpeak)) STAT_SET(cap, ringpeak, fill);
+
+        // the writer drains the ring down to a partial chunk at most,
+        // so the low watermark is at least a chunk (see open)
+        if (STAT_GET(cap, throttled)) {
+            if (fill <= cap->lowwm) STAT_SET(cap, throttled, 0);
+        } else if ((fill + size) > cap->highwm) {
+            STAT_SET(cap, throttled, 1);
+            STAT_ADD(cap, throttles, 1);
+        }
+        if (!STAT_GET(cap, throttled)) return 0;
+        if (!(cap->params.flags & UNVME_CAPTURE_BLOCK)) return -1;
+        sched_yield();
+    }
+}
+
+/**
+ * Start a streaming capture to a range of blocks.
+ * @param   ns          namespace handle
+ * @param   params      capture parameters
+ * @return  capture context or NULL if error.
+ */
+unvme_capture_t* unvme_capture_open(const unvme_ns_t* ns, const unvme_capture_params_t* params)
+{
+    unvme_capture_t* cap = zalloc(sizeof(*cap));
+    unvme_capture_params_t* p = &cap->params;
+    *p = *params;
+    cap->ns = ns;
+
+    // apply defaults and align the range, ring and segments to the write size
+    cap->chunknlb = ns->maxbpio;
+    cap->chunk = (u64)ns->maxbpio << ns->blockshift;
+    if (!p->nlb && p->slba < ns->blockcount) p->nlb = ns->blockcount - p->slba;
+    p->nlb -= p->nlb % cap->chunknlb;
+    if (!p->segnlb || p->segnlb > p->nlb) p->segnlb = p->nlb;
+    p->segnlb -= p->segnlb % cap->chunknlb;
+    if (!p->ringsize) p->ringsize = CAPTURE_RINGSIZE;
+    cap->ringsize = (p->ringsize + cap->chunk - 1) / cap->chunk * cap->chunk;
+    if (!p->qcount || p->qcount > (int)ns->qcount) p->qcount = ns->qcount;
+    if (!p->qdepth) p->qdepth = CAPTURE_QDEPTH;
+    if (p->qdepth > ns->maxiopq) p->qdepth = ns->maxiopq;
+    if (!p->highwm) p->highwm = 90;
+    if (!p->lowwm) p->lowwm = 50;
+
+    cap->highwm = cap->ringsize * p->highwm / 100;
+    cap->lowwm = cap->ringsize * p->lowwm / 100;
+
+    // only full chunks are written until closing, so a throttled producer
+    // would wait forever with a low watermark below a chunk
+    if (!p->segnlb || (p->slba + p->nlb) > ns->blockcount ||
+        p->highwm > 100 || p->lowwm >= p->highwm || cap->lowwm < cap->chunk ||
+        cap->chunk * p->qcount * p->qdepth > cap->ringsize) {
+        ERROR("invalid capture lba %#lx nlb %#lx ring %#lx", p->slba, p->nlb, p->ringsize);
+        free(cap);
+        errno = EINVAL;
+        return NULL;
+    }
+    cap->endlba = p->slba + p->nlb;
+    cap->nextlba = p->slba;
+    cap->segslba = p->slba;
+    cap->stats.ringsize = cap->ringsize;
+    cap->stats.nextlba = p->slba;
+
+    cap->ring = unvme_alloc(ns, cap->ringsize);
+    if (!cap->ring) {
+        ERROR("unvme_alloc %#lx", cap->ringsize);
+        free(cap);
+        errno = ENOMEM;
+        return NULL;
+    }
+    cap->fifosize = p->qcount * p->qdepth;
+    cap->fifo = zalloc(cap->fifosize * sizeof(capture_io_t));
+    cap->qpending = zalloc(p->qcount * sizeof(int));
+
+    int err = pthread_create(&cap->writer, NULL, capture_writer, cap);
+    if (err) {
+        ERROR("pthread_create %d", err);
+        unvme_free(ns, cap->ring);
+        free(cap->qpending);
+        free(cap->fifo);
+        free(cap);
+        errno = err;
+        return NULL;
+    }
+    DEBUG_FN("%s lba=%#lx nlb=%#lx ring=%#lx", ns->device, p->slba, p->nlb, cap->ringsize);
+    return cap;
+}
+
+/**
+ * Stop a capture after writing out the ring data (a partial last block is
+ * zero padded), and release its resources.
+ * @param   cap         capture context
+ * @param   stats       returned final statistics (may be NULL)
+ * @return  0 if ok or -EIO if any write failed.
+ */
+int unvme_capture_close(unvme_capture_t* cap, unvme_capture_stats_t* stats)
+{
+    __atomic_store_n(&cap->closing, 1, __ATOMIC_RELEASE);
+    pthread_join(cap->writer, NULL);
+    STAT_ADD(cap, dropped, cap->head - cap->submitted);
+
+    DEBUG_FN("%s written=%#lx dropped=%#lx errors=%lu", cap->ns->device,
+             cap->stats.written, cap->stats.dropped, cap->stats.errors);
+    int err = cap->stats.errors ? -EIO : 0;
+    if (stats) unvme_capture_stats(cap, stats);
+    unvme_free(cap->ns, cap->ring);
+    free(cap->qpending);
+    free(cap->fifo);
+    free(cap);
+    return err;
+}
+
+/**
+ * Copy data into the capture ring.  When throttled, the data is dropped
+ * (returning 0) or with UNVME_CAPTURE_BLOCK the call waits for ring space.
+ * @param   cap         capture context
+ * @param   data        data to capture
+ * @param   size        data size
+ * @return  number of bytes added to the ring.
+ */
+u64 unvme_capture_write(unvme_capture_t* cap, const void* data, u64 size)
+{
+    const u8* src = data;
+    u64 done = 0;
+
+    while (done < size) {
+        u64 len = size - done;
+        if (len > cap->chunk) len = cap->chunk;
+        if (capture_throttle(cap, len)) {
+            STAT_ADD(cap, dropped, size - done);
+            break;
+        }
+        u64 off = cap->head % cap->ringsize;
+        u64 n = cap->ringsize - off;
+        if (n > len) n = len;
+        memcpy(cap->ring + off, src + done, n);
+        if (n < len) memcpy(cap->ring, src + done + n, len - n);
+        __atomic_store_n(&cap->head, cap->head + len, __ATOMIC_RELEASE);
+        done += len;
+    }
+    STAT_ADD(cap, received, size);
+    return done;
+}
+
+/**
+ * Reserve contiguous ring space for the producer to fill in place
+ * (e.g. by DMA from another device), followed by unvme_capture_commit.
+ * @param   cap         capture context
+ * @param   size        desired size (returned as the reserved size, which
+ *                      may be less at the end of the ring)
+ * @return  ring pointer or NULL if throttled (the desired size is dropped).
+ */
+void* unvme_capture_reserve(unvme_capture_t* cap, u64* size)
+{
+    u64 len = *size;
+    if (len > cap->chunk) len = cap->chunk;
+    if (capture_throttle(cap, len)) {
+        STAT_ADD(cap, received, *size);
+        STAT_ADD(cap, dropped, *size);
+        *size = 0;
+        return NULL;
+    }
+    u64 off = cap->head % cap->ringsize;
+    if (len > (cap->ringsize - off)) len = cap->ringsize - off;
+    *size = len;
+    return cap->ring + off;
+}
+
+/**
+ * Commit the data filled in the space of the last unvme_capture_reserve.
+ * @param   cap         capture context
+ * @param   size        number of bytes filled
+ * @return  0 if ok or -EINVAL if more than reserved.
+ */
+int unvme_capture_commit(unvme_capture_t* cap, u64 size)
+{
+    u64 fill = cap->head - __atomic_load_n(&cap->tail, __ATOMIC_ACQUIRE);
+    if ((fill + size) > cap->ringsize ||
+        ((cap->head % cap->ringsize) + size) > cap->ringsize) return -EINVAL;
+    STAT_ADD(cap, received, size);
+    __atomic_store_n(&cap->head, cap->head + size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Get a snapshot of the capture statistics.
+ * @param   cap         capture context
+ * @param   stats       returned statistics
+ */
+void unvme_capture_stats(unvme_capture_t* cap, unvme_capture_stats_t* stats)
+{
+    stats->received = STAT_GET(cap, received);
+    stats->written = STAT_GET(cap, written);
+    stats->dropped = STAT_GET(cap, dropped);
+    stats->ringsize = cap->stats.ringsize;
+    stats->ringpeak = STAT_GET(cap, ringpeak);
+    stats->writes = STAT_GET(cap, writes);
+    stats->errors = STAT_GET(cap, errors);
+    stats->segments = STAT_GET(cap, segments);
+    stats->wraps = STAT_GET(cap, wraps);
+    stats->throttles = STAT_GET(cap, throttles);
+    stats->latavg = STAT_GET(cap, latavg);
+    stats->latmax = STAT_GET(cap, latmax);
+    stats->nextlba = STAT_GET(cap, nextlba);
+    stats->throttled = STAT_GET(cap, throttled);
+    stats->stopped = STAT_GET(cap, stopped);
+    stats->ringfill = __atomic_load_n(&cap->head, __ATOMIC_ACQUIRE) -
+                      __atomic_load_n(&cap->tail, __ATOMIC_ACQUIRE);
+}
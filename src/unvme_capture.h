@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe streaming capture interface.
+ *
+ * A capture records a continuous data stream to a range of blocks.  The
+ * producer appends data to a large DMA ring (by copying with
+ * unvme_capture_write, or in place with unvme_capture_reserve and
+ * unvme_capture_commit), and a writer thread writes the ring out in max
+ * sized chunks across the I/O queues in LBA order.  The block range is
+ * divided into segments, which are reported through a callback as they
+ * complete, and the capture wraps to the start of the range when it
+ * reaches the end (unless UNVME_CAPTURE_NOWRAP is set).
+ *
+ * When the ring fills past the high watermark, the producer is throttled
+ * until it drains below the low watermark: either data is dropped (and
+ * counted) or, with UNVME_CAPTURE_BLOCK, the producer waits.
+ *
+ * The ring is single producer (concurrent producers must serialize), and
+ * the writer thread owns the I/O queues it is given for the capture.
+ */
+
+#ifndef _UNVME_CAPTURE_H
+#define _UNVME_CAPTURE_H
+
+#include "unvme.h"
+
+/// Capture flags
+#define UNVME_CAPTURE_BLOCK     0x1     ///< block the producer when throttled
+#define UNVME_CAPTURE_NOWRAP    0x2     ///< stop (drop) at the end of range
+
+/// Capture context
+typedef struct _unvme_capture unvme_capture_t;
+
+/// Segment completion callback (seg is the segment index since start)
+typedef void (*unvme_capture_cb_t)(unvme_capture_t* cap, u64 seg, u64 slba, void* arg);
+
+/// Capture parameters (zero fields select the defaults)
+typedef struct _unvme_capture_params {
+    u64                 slba;       ///< starting lba of the capture range
+    u64                 nlb;        ///< range size in blocks (default to end)
+    u64                 ringsize;   ///< ring size in bytes (default 64MB)
+    u64                 segnlb;     ///< segment size in blocks (default range)
+    int                 qcount;     ///< number of queues to use (default all)
+    int                 qdepth;     ///< max writes in flight per queue
+    int                 highwm;     ///< high watermark percent (default 90)
+    int                 lowwm;      ///< low watermark percent (default 50, >= 1 write)
+    int                 flags;      ///< capture flags (UNVME_CAPTURE_*)
+    unvme_capture_cb_t  segcb;      ///< segment completion callback
+    void*               arg;        ///< callback argument
+} unvme_capture_params_t;
+
+/// Capture statistics
+typedef struct _unvme_capture_stats {
+    u64                 received;   ///< bytes received from the producer
+    u64                 written;    ///< bytes written to the device
+    u64                 dropped;    ///< bytes dropped (throttled or stopped)
+    u64                 ringfill;   ///< bytes currently held in the ring
+    u64                 ringsize;   ///< ring size in bytes
+    u64                 ringpeak;   ///< peak ring fill in bytes
+    u64                 writes;     ///< number of completed writes
+    u64                 errors;     ///< number of failed writes
+    u64                 segments;   ///< number of completed segments
+    u64                 wraps;      ///< number of range wraps
+    u64                 throttles;  ///< number of times throttled
+    u64                 latavg;     ///< average write latency (ns)
+    u64                 latmax;     ///< max write latency (ns)
+    u64                 nextlba;    ///< next lba to be written
+    int                 throttled;  ///< currently throttled flag
+    int                 stopped;    ///< stopped at the end of range flag
+} unvme_capture_stats_t;
+
+// Export functions
+unvme_capture_t* unvme_capture_open(const unvme_ns_t* ns, const unvme_capture_params_t* params);
+int unvme_capture_close(unvme_capture_t* cap, unvme_capture_stats_t* stats);
+u64 unvme_capture_write(unvme_capture_t* cap, const void* data, u64 size);
+void* unvme_capture_reserve(unvme_capture_t* cap, u64* size);
+int unvme_capture_commit(unvme_capture_t* cap, u64 size);
+void unvme_capture_stats(unvme_capture_t* cap, unvme_capture_stats_t* stats);
+
+#endif  // _UNVME_CAPTURE_H
@@ -35,22 +35,46 @@
  */
 
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <string.h>
 #include <signal.h>
 #include <sched.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
 
 #include "rdtsc.h"
-#include "unvme_core.h"
+#include "unvme_inline.h"
 
 /// IO descriptor debug print
 #define PDEBUG(fmt, arg...) //fprintf(stderr, fmt "\n", ##arg)
 
+/// Interrupt coalescing tuning interval (in ms)
+#define UNVME_INTR_TUNE_MS          100
+/// Completion rate (per second) above which a queue interrupt is coalesced
+#define UNVME_INTR_COALESCE_RATE    10000
+/// Max interrupt wait before rechecking a queue (in ms)
+#define UNVME_INTR_WAIT_MS          10
+/// Controller fatal status check interval while waiting (in ms)
+#define UNVME_CFS_CHECK_MS          100
+/// Initial retry delay when the controller specifies none (in us)
+#define UNVME_RETRY_BACKOFF_US      100
+/// Stack size prefaulted in real-time mode
+#define UNVME_RT_STACK              (256 * 1024)
+/// I/O memory tracker entries preallocated in real-time mode
+#define UNVME_RT_IOMEM              1024
+
 
 // Global static variables
 static const char*      unvme_log = "/dev/shm/unvme.log";   ///< Log filename
 static unvme_session_t* unvme_ses = NULL;                   ///< session list
-static unvme_lock_t     unvme_lock = 0;                     ///< session lock
+static unvme_pcidev_t*  unvme_pcidevs = NULL;               ///< PCI device list
+static unvme_lock_t     unvme_lock;                         ///< session lock
+static int              unvme_rtlocked = 0;                 ///< memory locked flag
+int                     unvme_lock_tcount = 0;              ///< lock shard threads
+__thread int            unvme_lock_tid = 0;                 ///< lock shard of thread
+
+static int unvme_recover(unvme_device_t* dev, u32 gen);
 
 
 /**
@@ -61,45 +85,191 @@ static unvme_lock_t     unvme_lock = 0;                     ///< session lock
 static unvme_desc_t* unvme_desc_get(unvme_queue_t* q)
 {
     static u32 id = 0;
-    unvme_desc_t* desc;
+    if (q->descfree) return unvme_desc_reuse(q);
 
-    if (q->descfree) {
-        desc = q->descfree;
-        LIST_DEL(q->descfree, desc);
+    unvme_desc_t* desc = zalloc(sizeof(unvme_desc_t) + q->masksize);
+    desc->id = ++id;
+    desc->q = q;
+    unvme_desc_use(q, desc);
+    return desc;
+}
+
+/**
+ * Add a descriptor whose commands have all completed to the completed list
+ * (to be returned by unvme_do_reap unless polled).
+ * @param   desc        descriptor
+ */
+static void unvme_desc_done(unvme_desc_t* desc)
+{
+    unvme_queue_t* q = desc->q;
+    if (desc->done) return;
+    desc->done = 1;
+    desc->donenext = NULL;
+    desc->doneprev = q->donetail;
+    if (q->donetail) q->donetail->donenext = desc;
+    else q->donehead = desc;
+    q->donetail = desc;
+}
+
+/**
+ * Set the interrupt coalescing of a vector.
+ * @param   dev         device context
+ * @param   iv          interrupt vector
+ * @param   cd          1 to disable or 0 to enable coalescing
+ * @return  0 if ok else error status.
+ */
+static int unvme_intr_vector(unvme_device_t* dev, int iv, int cd)
+{
+    nvme_feature_int_vector_t ivc = { .iv = iv, .cd = cd };
+    u32 val;
+    memcpy(&val, &ivc, sizeof(val));
+    int err = nvme_acmd_set_features(&dev->nvmedev, 0, NVME_FEATURE_INT_VECTOR,
+                                     0, 0, &val);
+    if (err) ERROR("%x iv=%d cd=%d failed (%#x)", dev->vfiodev.pci, iv, cd, err);
+    return err;
+}
 
-        desc->error = 0;
-        desc->cidcount = 0;
-        u64* cidmask = desc->cidmask;
-        int i = q->masksize >> 3;
-        while (i--) *cidmask++ = 0;
+/**
+ * Set the (controller wide) interrupt coalescing aggregation.
+ * @param   dev         device context
+ * @param   thr         aggregation threshold (in number of completions)
+ * @param   time        aggregation time (in 100us units)
+ * @return  0 if ok else error status.
+ */
+static int unvme_intr_coalesce(unvme_device_t* dev, int thr, int time)
+{
+    nvme_feature_int_coalescing_t ic = { .thr = thr ? thr - 1 : 0, .time = time };
+    u32 val;
+    memcpy(&val, &ic, sizeof(val));
+    int err = nvme_acmd_set_features(&dev->nvmedev, 0, NVME_FEATURE_INT_COALESCING,
+                                     0, 0, &val);
+    if (err) {
+        ERROR("%x thr=%d time=%d failed (%#x)", dev->vfiodev.pci, thr, time, err);
     } else {
-        desc = zalloc(sizeof(unvme_desc_t) + q->masksize);
-        desc->id = ++id;
-        desc->q = q;
+        dev->intrthr = thr;
+        dev->intrtime = time;
     }
-    LIST_ADD(q->desclist, desc);
-    if (desc == desc->next) q->descpend = desc; // head of pending list
-    q->desccount++;
-    return desc;
+    return err;
 }
 
 /**
- * Put a descriptor entry back by moving it from the use to the free list.
- * @param   desc    descriptor
+ * Adapt interrupt coalescing to the completion rates observed since the
+ * last tuning.  Lightly loaded queues get an immediate interrupt per
+ * completion, while busy queues are coalesced with a threshold of the
+ * completions expected within one aggregation time unit (100us).  The
+ * caller must hold the admin lock.
+ * @param   dev         device context
+ * @return  0 if ok else error status.
  */
-static void unvme_desc_put(unvme_desc_t* desc)
+static int unvme_intr_tune(unvme_device_t* dev)
 {
-    unvme_queue_t* q = desc->q;
+    // rates sampled over less than the tuning interval are too noisy
+    u64 tsc = rdtsc();
+    u64 elapsed = tsc - dev->tunetsc;
+    if (elapsed < UNVME_INTR_TUNE_MS * dev->nvmedev.rdtsec / 1000) return 0;
+    dev->tunetsc = tsc;
+
+    u64 maxrate = 0;
+    int q, err = 0;
+    for (q = 0; q < dev->ns.qcount; q++) {
+        unvme_queue_t* ioq = dev->ioqs + q;
+        u32 ncomp = ioq->ncomp;
+        u64 rate = (u64)(ncomp - ioq->ncomplast) * dev->nvmedev.rdtsec / elapsed;
+        ioq->ncomplast = ncomp;
+
+        int cd = rate < UNVME_INTR_COALESCE_RATE;
+        if (!cd && rate > maxrate) maxrate = rate;
+        if (cd != ioq->cd) {
+            if ((err = unvme_intr_vector(dev, ioq->iv, cd))) return err;
+            ioq->cd = cd;
+        }
+    }
+
+    if (maxrate) {
+        int thr = maxrate / 10000;
+        int maxthr = dev->ns.qsize >> 1;
+        if (maxthr > 256) maxthr = 256;
+        if (thr > maxthr) thr = maxthr;
+        if (thr < 2) thr = 2;
+        if (thr != dev->intrthr || dev->intrtime != 1) err = unvme_intr_coalesce(dev, thr, 1);
+    }
+    DEBUG_FN("%x rate=%lu thr=%d time=%d", dev->vfiodev.pci, maxrate, dev->intrthr, dev->intrtime);
+    return err;
+}
+
+/**
+ * Wait for a queue interrupt (or until the wait interval expires).
+ * @param   q           queue
+ * @param   endtsc      timeout expiration time
+ */
+static void unvme_intr_wait(unvme_queue_t* q, u64 endtsc)
+{
+    unvme_device_t* dev = q->dev;
+    u64 tsc = rdtsc();
+
+    // vectors may be shared by queues so bound the wait against lost wakeups
+    int ms = UNVME_INTR_WAIT_MS;
+    if (endtsc > tsc && (endtsc - tsc) < ms * dev->nvmedev.rdtsec / 1000)
+        ms = (endtsc - tsc) * 1000 / dev->nvmedev.rdtsec + 1;
+    struct pollfd pfd = { .fd = q->efd, .events = POLLIN };
+    if (poll(&pfd, 1, ms) > 0) {
+        eventfd_t val;
+        (void)eventfd_read(q->efd, &val);
+    }
+}
 
-    // check to change the pending head or clear the list
-    if (desc == q->descpend) {
-        if (desc != desc->next) q->descpend = desc->next;
-        else q->descpend = NULL;
+/**
+ * Schedule a failed command for resubmission if its status is retryable
+ * (i.e. DNR is clear) and the retry budget is not exhausted.  The command
+ * retry delay (CRD) selects a controller specified delay, otherwise the
+ * delay backs off exponentially from UNVME_RETRY_BACKOFF_US.
+ * @param   q           queue
+ * @param   cid         command id
+ * @param   err         completion status
+ * @return  1 if scheduled for resubmission else 0.
+ */
+static int unvme_retry(unvme_queue_t* q, int cid, int err)
+{
+    unvme_device_t* dev = q->dev;
+    unvme_cmdrec_t* rec = q->cmdrec + cid;
+    if (UNVME_DNR(err)) {
+        q->retrystats.dnr++;
+        return 0;
+    }
+    if (rec->retries >= dev->retrymax) {
+        q->retrystats.exhausted++;
+        return 0;
     }
 
-    LIST_DEL(q->desclist, desc);
-    LIST_ADD(q->descfree, desc);
-    q->desccount--;
+    int crd = UNVME_CRD(err);
+    u64 delay = crd ? dev->crdtsc[crd - 1] :
+                ((u64)UNVME_RETRY_BACKOFF_US << rec->retries) * dev->nvmedev.rdtsec / 1000000;
+    rec->retries++;
+    rec->retrytsc = rdtsc() + delay + 1;
+    q->retrycount++;
+    q->retrystats.retries++;
+    DEBUG_FN("q%d cid=%d stat=%#x retry=%d crd=%d", q->nvmeq->id, cid, err, rec->retries, crd);
+    return 1;
+}
+
+/**
+ * Resubmit the commands whose retry delay has expired.
+ * @param   q           queue
+ */
+static void unvme_retry_submit(unvme_queue_t* q)
+{
+    u64 tsc = rdtsc();
+    int cid, count = q->retrycount;
+    for (cid = 0; cid < q->size && count; cid++) {
+        unvme_cmdrec_t* rec = q->cmdrec + cid;
+        if (!rec->retrytsc) continue;
+        count--;
+        if (tsc < rec->retrytsc) continue;
+        rec->retrytsc = 0;
+        q->retrycount--;
+        (void)nvme_cmd_post(q->nvmeq, &rec->sqe);
+    }
+    nvme_sq_ring(q->nvmeq);
 }
 
 /**
@@ -107,115 +277,198 @@ static void unvme_desc_put(unvme_desc_t* desc)
  * @param   q           queue
  * @param   timeout     timeout in seconds
  * @param   cqe_cs      CQE command specific DW0 returned
- * @return  0 if ok else NVMe error code (-1 means timeout).
+ * @param   pdesc       returned descriptor of the completion (may be NULL)
+ * @return  the completion NVMe status (0 if ok), -ETIMEDOUT if there's no
+ *          completion, or -EIO if pending commands were failed by a reset.
  */
-static int unvme_check_completion(unvme_queue_t* q, int timeout, u32* cqe_cs)
+static int unvme_check_completion(unvme_queue_t* q, int timeout, u32* cqe_cs,
+                                  unvme_desc_t** pdesc)
 {
-    // wait for completion
-    int err, cid;
-    u64 endtsc = 0;
-    do {
-        cid = nvme_check_completion(q->nvmeq, &err, cqe_cs);
-        if (timeout == 0 || cid >= 0) break;
-        if (endtsc) sched_yield();
-        else endtsc = rdtsc() + timeout * q->nvmeq->dev->rdtsec;
-    } while (rdtsc() < endtsc);
-
-    if (cid < 0) return cid;
+    unvme_device_t* dev = q->dev;
+    u32 gen = dev->resetgen;
+    int err, cid, fatal = 0;
+    u64 endtsc = 0, cfstsc = 0;
+    unvme_desc_t* desc;
+    int b;
+    u64 mask;
+
+    for (;;) {
+        // wait for completion
+        do {
+            if (q->retrycount) unvme_retry_submit(q);
+            cid = nvme_check_completion(q->nvmeq, &err, cqe_cs);
+            if (timeout == 0 || cid >= 0) break;
+            u64 tsc = rdtsc();
+            if (!endtsc) {
+                endtsc = tsc + timeout * dev->nvmedev.rdtsec;
+                cfstsc = tsc + UNVME_CFS_CHECK_MS * dev->nvmedev.rdtsec / 1000;
+                continue;
+            }
+            if (tsc >= cfstsc) {
+                if ((fatal = nvme_ctlr_fatal(&dev->nvmedev))) break;
+                cfstsc = tsc + UNVME_CFS_CHECK_MS * dev->nvmedev.rdtsec / 1000;
+            }
 
-    // find the pending cid in the descriptor list to clear it
-    unvme_desc_t* desc = q->descpend;
-    int b = cid >> 6;
-    u64 mask = (u64)1 << (cid & 63);
-    while ((desc->cidmask[b] & mask) == 0) {
-        desc = desc->next;
-        if (desc == q->descpend)
-            FATAL("pending cid %d not found", cid);
-    }
-    if (err) desc->error = err;
+            // release the reset lock while waiting so a reset can proceed
+            unvme_unlockr(&dev->rlock);
+            if (q->efd >= 0) unvme_intr_wait(q, endtsc);
+            else unvme_yield(dev->rt);
+            unvme_lockr(&dev->rlock);
+            if (dev->resetgen != gen) return -EIO;
+        } while (rdtsc() < endtsc);
 
-    // clear cid bit used
-    desc->cidmask[b] &= ~mask;
-    desc->cidcount--;
-    q->cidmask[b] &= ~mask;
-    q->cidcount--;
-    q->cid = cid;
+        if (cid < 0) {
+            // reset on controller fatal status or lost command
+            if (fatal || (timeout >= UNVME_TIMEOUT && q->cidcount)) {
+                unvme_unlockr(&dev->rlock);
+                unvme_recover(dev, gen);
+                unvme_lockr(&dev->rlock);
+                return -EIO;
+            }
+            return -ETIMEDOUT;
+        }
+        q->ncomp++;
+
+        // find the pending cid in the descriptor list to clear it
+        desc = q->descpend;
+        b = cid >> 6;
+        mask = (u64)1 << (cid & 63);
+        while (desc && (desc->cidmask[b] & mask) == 0) {
+            desc = desc->next;
+            if (desc == q->descpend) desc = NULL;
+        }
+        if (!desc) {
+            // ignore a spurious completion and keep waiting
+            ERROR("q%d pending cid %d not found", q->nvmeq->id, cid);
+            continue;
+        }
 
-    // check to advance next pending descriptor
-    if (q->cidcount) {
-        while (q->descpend->cidcount == 0) q->descpend = q->descpend->next;
+        // keep the cid pending if the command is to be resubmitted
+        if (dev->retrymax) {
+            if (err == 0) {
+                if (q->cmdrec[cid].retries) q->retrystats.recovered++;
+            } else if (unvme_retry(q, cid, err)) {
+                continue;
+            }
+        }
+        break;
     }
+    if (err) desc->error = err;
+    unvme_cid_complete(desc, cid);
+    if (desc->cidcount == 0) unvme_desc_done(desc);
     PDEBUG("# c q%d={%d %d %#lx} d={%d %d %#lx} @%d",
            q->nvmeq->id, cid, q->cidcount, *q->cidmask,
            desc->id, desc->cidcount, *desc->cidmask, q->descpend->id);
+    if (pdesc) *pdesc = desc;
     return err;
 }
 
 /**
  * Get a free cid.  If queue is full then process currently pending submissions.
  * @param   desc        descriptor
- * @return  cid.
+ * @return  cid or -ETIMEDOUT if the queue remains full.
  */
-static u16 unvme_get_cid(unvme_desc_t* desc)
+static int unvme_get_cid(unvme_desc_t* desc)
 {
-    u16 cid;
     unvme_queue_t* q = desc->q;
-    int qsize = q->size;
 
     // if submission queue is full then process completion first
-    if ((q->cidcount + 1) == qsize) {
-        int err = unvme_check_completion(q, UNVME_TIMEOUT, NULL);
-        if (err) {
-            if (err == -1) FATAL("q%d timeout", q->nvmeq->id);
-            else ERROR("q%d error %#x", q->nvmeq->id, err);
+    if ((q->cidcount + 1) == q->size) {
+        nvme_sq_ring(q->nvmeq);
+        (void)unvme_check_completion(q, UNVME_TIMEOUT, NULL, NULL);
+        if ((q->cidcount + 1) == q->size) {
+            ERROR("q%d full", q->nvmeq->id);
+            return -ETIMEDOUT;
         }
     }
+    return unvme_cid_take(desc);
+}
 
-    // get a free cid
-    cid = q->cid;
-    while (q->cidmask[cid >> 6] & ((u64)1L << (cid & 63))) {
-        if (++cid >= qsize) cid = 0;
-    }
-
-    // set cid bit used
+/**
+ * Release a cid that was not submitted.
+ * @param   desc        descriptor
+ * @param   cid         cid
+ */
+static void unvme_put_cid(unvme_desc_t* desc, int cid)
+{
+    unvme_queue_t* q = desc->q;
     int b = cid >> 6;
     u64 mask = (u64)1 << (cid & 63);
-    desc->cidmask[b] |= mask;
-    desc->cidcount++;
-    q->cidmask[b] |= mask;
-    q->cidcount++;
-    q->cid = cid;
-    if (++q->cid >= qsize) q->cid = 0;
+    desc->cidmask[b] &= ~mask;
+    desc->cidcount--;
+    q->cidmask[b] &= ~mask;
+    q->cidcount--;
+}
+
+/**
+ * Make room for a DMA allocation in the device I/O memory tracker (write
+ * locked).  The preallocated tracker of a real-time device is not grown,
+ * so no allocation is made while it is in use.
+ * @param   dev         device context
+ * @return  0 if ok or -1 if full (with errno set).
+ */
+static int unvme_iomem_reserve(unvme_device_t* dev)
+{
+    unvme_iomem_t* iomem = &dev->iomem;
+    if (iomem->count == iomem->size) {
+        if (dev->rt) {
+            ERROR("%x I/O memory tracker full (%d)", dev->vfiodev.pci, iomem->size);
+            errno = ENOMEM;
+            return -1;
+        }
+        iomem->size += 256;
+        iomem->map = realloc(iomem->map, iomem->size * sizeof(void*));
+    }
+    return 0;
+}
 
-    return cid;
+/**
+ * Add a DMA allocation to the device I/O memory tracker (write locked,
+ * after unvme_iomem_reserve).
+ * @param   iomem       I/O memory tracker
+ * @param   dma         DMA allocation
+ */
+static void unvme_iomem_add(unvme_iomem_t* iomem, vfio_dma_t* dma)
+{
+    iomem->map[iomem->count++] = dma;
 }
 
 /**
- * Lookup DMA address associated with the user buffer.
+ * Get the DMA address of a user buffer range.  A buffer allocated on
+ * another open device may also be used, since all devices share the same
+ * DMA memory arena (e.g. to copy between devices without a data copy).
  * @param   ns          namespace handle
- * @param   buf         user data buffer
+ * @param   buf         user buffer
  * @param   bufsz       buffer size
- * @return  DMA address or -1L if error.
+ * @param   addr        returned DMA address
+ * @return  0 if ok, -EINVAL if not an I/O buffer, or -EFAULT if overrun.
  */
-static u64 unvme_map_dma(const unvme_ns_t* ns, void* buf, u64 bufsz)
+static int unvme_map_dma(const unvme_ns_t* ns, void* buf, u64 bufsz, u64* addr)
 {
     unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
-    vfio_dma_t* dma = NULL;
-    unvme_lockr(&dev->iomem.lock);
-    int i;
-    for (i = 0; i < dev->iomem.count; i++) {
-        dma = dev->iomem.map[i];
-        if (dma->buf <= buf && buf < (dma->buf + dma->size)) break;
+    vfio_dma_t* dma = unvme_iomem_find(dev, buf);
+    if (!dma) {
+        unvme_lockr(&unvme_lock);
+        unvme_session_t* ses = unvme_ses;
+        if (ses) {
+            do {
+                if (ses->dev != dev && (dma = unvme_iomem_find(ses->dev, buf)))
+                    break;
+                ses = ses->next;
+            } while (ses != unvme_ses);
+        }
+        unvme_unlockr(&unvme_lock);
     }
-    unvme_unlockr(&dev->iomem.lock);
-    if (i == dev->iomem.count)
-        FATAL("invalid I/O buffer address");
-    u64 addr = dma->addr + (u64)(buf - dma->buf);
-    if ((addr + bufsz) > (dma->addr + dma->size))
-        FATAL("buffer overrun");
-    //if ((addr & (ns->blocksize - 1)) != 0)
-    //    FATAL("unaligned buffer address");
-    return addr;
+    if (!dma) {
+        ERROR("invalid I/O buffer address %p", buf);
+        return -EINVAL;
+    }
+    *addr = dma->addr + (u64)(buf - dma->buf);
+    if ((*addr + bufsz) > (dma->addr + dma->size)) {
+        ERROR("buffer %p size %#lx overrun", buf, bufsz);
+        return -EFAULT;
+    }
+    return 0;
 }
 
 /**
@@ -227,58 +480,102 @@ static u64 unvme_map_dma(const unvme_ns_t* ns, void* buf, u64 bufsz)
  * @param   bufsz       buffer size
  * @param   prp1        returned prp1 value
  * @param   prp2        returned prp2 value
- * @return  0 if ok else -1 if buffer address error.
+ * @return  0 if ok else buffer address error (see unvme_map_dma).
  */
 static int unvme_map_prps(const unvme_ns_t* ns, unvme_queue_t* q, int cid,
                           void* buf, u64 bufsz, u64* prp1, u64* prp2)
 {
-    u64 addr = unvme_map_dma(ns, buf, bufsz);
-    if (addr == -1L) return -1;
-
-    *prp1 = addr;
-    *prp2 = 0;
-    int numpages = (bufsz + ns->pagesize - 1) >> ns->pageshift;
-    if (numpages == 2) {
-        *prp2 = addr + ns->pagesize;
-    } else if (numpages > 2) {
-        int prpoff = cid << ns->pageshift;
-        u64* prplist = q->prplist->buf + prpoff;
-        *prp2 = q->prplist->addr + prpoff;
-        int i;
-        for (i = 1; i < numpages; i++) {
-            addr += ns->pagesize;
-            *prplist++ = addr;
-        }
+    // commands without data (e.g. flush or write zeroes)
+    if (!bufsz) {
+        *prp1 = *prp2 = 0;
+        return 0;
     }
+    u64 addr;
+    int err = unvme_map_dma(ns, buf, bufsz, &addr);
+    if (err) return err;
+    unvme_prps(q, cid, addr, bufsz, ns->pageshift, prp1, prp2);
     return 0;
 }
 
 /**
- * Submit a generic (vendor specific) NVMe command.
+ * Submit the read/write commands of an I/O, split by the max transfer size.
+ * This is the template of the submit paths, which are specialized for
+ * common page and block sizes by inlining it with constant shifts.
  * @param   ns          namespace handle
  * @param   desc        descriptor
- * @param   buf         data buffer
+ * @param   addr        DMA address of the (validated) data buffer
  * @param   slba        starting lba
  * @param   nlb         number of logical blocks
- * @return  cid if ok else -1.
+ * @param   pageshift   memory page size shift
+ * @param   blockshift  block size shift
+ * @return  0 if ok else negative error code.
  */
-static int unvme_submit_io(const unvme_ns_t* ns, unvme_desc_t* desc,
-                           void* buf, u64 slba, u32 nlb)
+static inline __attribute__((always_inline))
+int unvme_rw_submit_tmpl(const unvme_ns_t* ns, unvme_desc_t* desc, u64 addr,
+                         u64 slba, u32 nlb, int pageshift, int blockshift)
 {
-    u64 prp1, prp2;
     unvme_queue_t* ioq = desc->q;
-    u16 cid = unvme_get_cid(desc);
-    u64 bufsz = (u64)nlb << ns->blockshift;
-    if (unvme_map_prps(ns, ioq, cid, buf, bufsz, &prp1, &prp2)) return -1;
-
-    // submit I/O command
-    if (nvme_cmd_rw(ioq->nvmeq, desc->opc, cid,
-                    ns->id, slba, nlb, prp1, prp2)) return -1;
-    PDEBUG("# %c %#lx %#x q%d={%d %d %#lx} d={%d %d %#lx}",
-           desc->opc == NVME_CMD_READ ? 'r' : 'w', slba, nlb,
-           ioq->nvmeq->id, cid, ioq->cidcount, *ioq->cidmask,
-           desc->id, desc->cidcount, *desc->cidmask);
-    return cid;
+    u32 maxbpio = ns->maxbpio;
+    u64 maxsize = (u64)maxbpio << blockshift;
+
+    while (nlb) {
+        u32 n = maxbpio;
+        u64 bufsz = maxsize;
+        if (nlb < maxbpio) {
+            n = nlb;
+            bufsz = (u64)n << blockshift;
+        }
+        int cid = unvme_get_cid(desc);
+        if (cid < 0) return cid;
+
+        u64 prp1, prp2;
+        unvme_prps(ioq, cid, addr, bufsz, pageshift, &prp1, &prp2);
+
+        // post I/O command (doorbell is rung by the caller)
+        if (nvme_cmd_rw_post(ioq->nvmeq, desc->opc, cid,
+                             ns->id, slba, n, prp1, prp2)) {
+            unvme_put_cid(desc, cid);
+            return -EIO;
+        }
+        unvme_cmd_save(ioq, cid);
+        PDEBUG("# %c %#lx %#x q%d={%d %d %#lx} d={%d %d %#lx}",
+               desc->opc == NVME_CMD_READ ? 'r' : 'w', slba, n,
+               ioq->nvmeq->id, cid, ioq->cidcount, *ioq->cidmask,
+               desc->id, desc->cidcount, *desc->cidmask);
+
+        addr += bufsz;
+        slba += n;
+        nlb -= n;
+    }
+    return 0;
+}
+
+/// Define a submit path specialized for a page size and block size
+#define UNVME_RW_SUBMIT(name, pageshift, blockshift)                        \
+    static int unvme_rw_submit_##name(const unvme_ns_t* ns,                 \
+                    unvme_desc_t* desc, u64 addr, u64 slba, u32 nlb)        \
+    {                                                                       \
+        return unvme_rw_submit_tmpl(ns, desc, addr, slba, nlb,              \
+                                    pageshift, blockshift);                 \
+    }
+
+UNVME_RW_SUBMIT(4k_512, 12, 9)
+UNVME_RW_SUBMIT(4k_4k, 12, 12)
+UNVME_RW_SUBMIT(generic, ns->pageshift, ns->blockshift)
+
+/**
+ * Select the submit path of a namespace by its page and block sizes.
+ * @param   ns          namespace handle
+ */
+static void unvme_rw_select(unvme_ns_t* ns)
+{
+    unvme_session_t* ses = ns->ses;
+    if (ns->pageshift == 12 && ns->blockshift == 9)
+        ses->rw_submit = unvme_rw_submit_4k_512;
+    else if (ns->pageshift == 12 && ns->blockshift == 12)
+        ses->rw_submit = unvme_rw_submit_4k_4k;
+    else
+        ses->rw_submit = unvme_rw_submit_generic;
 }
 
 /**
@@ -290,7 +587,10 @@ static int unvme_submit_io(const unvme_ns_t* ns, unvme_desc_t* desc,
 static void unvme_queue_init(unvme_device_t* dev, unvme_queue_t* q, int qsize)
 {
     memset(q, 0, sizeof(*q));
+    q->dev = dev;
     q->size = qsize;
+    q->efd = -1;
+    q->iv = -1;
 
     // allocate queue entries and PRP list
     q->sqdma = vfio_dma_alloc(&dev->vfiodev, qsize * sizeof(nvme_sq_entry_t));
@@ -302,8 +602,12 @@ static void unvme_queue_init(unvme_device_t* dev, unvme_queue_t* q, int qsize)
     // setup descriptors and pending masks
     q->masksize = ((qsize + 63) >> 6) << 3; // (qsize + 63) / 64) * sizeof(u64)
     q->cidmask = zalloc(q->masksize);
-    int i;
-    for (i = 0; i < 16; i++) unvme_desc_get(q);
+    q->cmdrec = zalloc(qsize * sizeof(unvme_cmdrec_t));
+
+    // real-time mode preallocates the max number of descriptors in use
+    // (each holds a cid), so none is allocated in the I/O path
+    int i, ndesc = dev->rt ? qsize : 16;
+    for (i = 0; i < ndesc; i++) unvme_desc_get(q);
     q->descfree = q->desclist;
     q->desclist = NULL;
     q->desccount = 0;
@@ -326,6 +630,11 @@ static void unvme_queue_cleanup(unvme_queue_t* q)
         free(desc);
     }
 
+    if (q->rawq) {
+        free(q->rawq->ctx);
+        free(q->rawq);
+    }
+    if (q->cmdrec) free(q->cmdrec);
     if (q->cidmask) free(q->cidmask);
     if (q->prplist) vfio_dma_free(q->prplist);
     if (q->cqdma) vfio_dma_free(q->cqdma);
@@ -369,10 +678,18 @@ static void unvme_ioq_create(unvme_device_t* dev, int q)
     DEBUG_FN("%x q=%d", dev->vfiodev.pci, q+1);
     unvme_queue_t* ioq = dev->ioqs + q;
     unvme_queue_init(dev, ioq, dev->ns.qsize);
+    if (dev->intr) {
+        // vector 0 is reserved for the admin queue
+        ioq->iv = 1 + q % (dev->nvec - 1);
+        ioq->efd = dev->efds[ioq->iv];
+    }
     if (!(ioq->nvmeq = nvme_ioq_create(&dev->nvmedev, NULL, q+1, ioq->size,
                                        ioq->sqdma->buf, ioq->sqdma->addr,
-                                       ioq->cqdma->buf, ioq->cqdma->addr)))
+                                       ioq->cqdma->buf, ioq->cqdma->addr,
+                                       ioq->iv)))
         FATAL("nvme_ioq_create %d failed", q+1);
+    // start with immediate interrupts until the load is known
+    if (dev->intr && unvme_intr_vector(dev, ioq->iv, 1) == 0) ioq->cd = 1;
     DEBUG_FN("%x q=%d qd=%d db=%#04lx", dev->vfiodev.pci, ioq->nvmeq->id,
              ioq->size, (u64)ioq->nvmeq->sq_doorbell - (u64)dev->nvmedev.reg);
 }
@@ -386,231 +703,937 @@ static void unvme_ioq_delete(unvme_device_t* dev, int q)
 {
     DEBUG_FN("%x %d", dev->vfiodev.pci, q+1);
     unvme_queue_t* ioq = dev->ioqs + q;
-    (void)nvme_ioq_delete(ioq->nvmeq);
+    if (ioq->lost) free(ioq->nvmeq);
+    else (void)nvme_ioq_delete(ioq->nvmeq);
     unvme_queue_cleanup(ioq);
 }
 
 /**
- * Initialize a namespace instance.
- * @param   ns          namespace context
- * @param   nsid        namespace id
+ * Provision the host memory buffer requested by a (DRAM-less) controller.
+ * The buffer is allocated from the DMA memory pool, preferably at the
+ * preferred size and otherwise at the minimum size.
+ * @param   dev         device context
+ * @param   idc         identify controller data
  */
-static void unvme_ns_init(unvme_ns_t* ns, int nsid)
+static void unvme_hmb_enable(unvme_device_t* dev, const nvme_identify_ctlr_t* idc)
 {
-    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
-    ns->id = nsid;
-    ns->maxiopq = ns->qsize - 1;
-
-    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, ns->pagesize);
-    if (nvme_acmd_identify(&dev->nvmedev, nsid, dma->addr, 0))
-        FATAL("nvme_acmd_identify %d failed", nsid);
-    nvme_identify_ns_t* idns = (nvme_identify_ns_t*)dma->buf;
-    ns->blockcount = idns->ncap;
-    ns->blockshift = idns->lbaf[idns->flbas & 0xF].lbads;
-    ns->blocksize = 1 << ns->blockshift;
-    ns->bpshift = ns->pageshift - ns->blockshift;
-    ns->nbpp = 1 << ns->bpshift;
-    ns->pagecount = ns->blockcount >> ns->bpshift;
-    ns->maxbpio = ns->maxppio << ns->bpshift;
-    vfio_dma_free(dma);
+    if (idc->hmpre == 0) return;
+
+    // HMPRE and HMMIN are in 4KB units
+    u64 size = (u64)idc->hmpre << 12;
+    dev->hmb = vfio_dma_alloc(&dev->vfiodev, size);
+    if (!dev->hmb && idc->hmmin && idc->hmmin < idc->hmpre) {
+        size = (u64)idc->hmmin << 12;
+        dev->hmb = vfio_dma_alloc(&dev->vfiodev, size);
+    }
+    if (!dev->hmb) {
+        ERROR("%x cannot allocate HMB (pre=%#x min=%#x)",
+              dev->vfiodev.pci, idc->hmpre, idc->hmmin);
+        return;
+    }
+    dev->hmbdesc = vfio_dma_alloc(&dev->vfiodev, sizeof(nvme_hmb_desc_t));
+    if (!dev->hmbdesc) {
+        vfio_dma_free(dev->hmb);
+        dev->hmb = NULL;
+        return;
+    }
 
-    sprintf(ns->device + strlen(ns->device), "/%d", nsid);
-    DEBUG_FN("%s qc=%d qd=%d bs=%d bc=%#lx mbio=%d", ns->device, ns->qcount,
-             ns->qsize, ns->blocksize, ns->blockcount, ns->maxbpio);
+    // the buffer is physically contiguous so a single descriptor suffices
+    int pageshift = dev->nvmedev.pageshift;
+    u32 hsize = size >> pageshift;
+    nvme_hmb_desc_t* desc = dev->hmbdesc->buf;
+    memset(desc, 0, dev->hmbdesc->size);
+    desc->badd = dev->hmb->addr;
+    desc->bsize = hsize;
+
+    int err = nvme_acmd_set_hmb(&dev->nvmedev, 1, hsize, dev->hmbdesc->addr, 1);
+    if (err) {
+        ERROR("%x enable HMB failed (%#x)", dev->vfiodev.pci, err);
+        vfio_dma_free(dev->hmbdesc);
+        vfio_dma_free(dev->hmb);
+        dev->hmbdesc = dev->hmb = NULL;
+        return;
+    }
+    DEBUG_FN("%x hmb=%#lx size=%#lx", dev->vfiodev.pci, dev->hmb->addr, size);
 }
 
 /**
- * Clean up.
+ * Disable the host memory buffer and release its memory (unless the
+ * controller fails to relinquish it).
+ * @param   dev         device context
  */
-static void unvme_cleanup(unvme_session_t* ses)
+static void unvme_hmb_disable(unvme_device_t* dev)
 {
-    unvme_device_t* dev = ses->dev;
-    if (--dev->refcount == 0) {
-        DEBUG_FN("%s", ses->ns.device);
-        int q;
-        for (q = 0; q < dev->ns.qcount; q++) unvme_ioq_delete(dev, q);
-        unvme_adminq_delete(dev);
-        nvme_delete(&dev->nvmedev);
-        vfio_delete(&dev->vfiodev);
-        free(dev->ioqs);
-        free(dev);
+    if (!dev->hmb) return;
+
+    // the controller must relinquish the buffer before it can be freed,
+    // otherwise the buffer is leaked since the controller may still use it
+    if (nvme_acmd_set_hmb(&dev->nvmedev, 0, 0, 0, 0)) {
+        ERROR("%x disable HMB failed (leaking %#lx bytes)",
+              dev->vfiodev.pci, dev->hmb->size);
+    } else {
+        vfio_dma_free(dev->hmbdesc);
+        vfio_dma_free(dev->hmb);
     }
-    LIST_DEL(unvme_ses, ses);
-    free(ses);
-    if (!unvme_ses) log_close();
+    dev->hmbdesc = dev->hmb = NULL;
 }
 
+/**
+ * Enable advanced command retry so that the controller reports a command
+ * retry delay (CRD) in retryable completions.
+ * @param   dev         device context
+ * @return  0 if ok else error status.
+ */
+static int unvme_acre_enable(unvme_device_t* dev)
+{
+    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, 4096);
+    if (!dma) return -1;
+    nvme_host_behavior_t* hb = dma->buf;
+    memset(hb, 0, sizeof(*hb));
+    hb->acre = 1;
+    u32 val = 0;
+    int err = nvme_acmd_set_features(&dev->nvmedev, 0, NVME_FEATURE_HOST_BEHAVIOR,
+                                     dma->addr, 0, &val);
+    vfio_dma_free(dma);
+    dev->acre = (err == 0);
+    if (err) ERROR("%x enable ACRE failed (%#x)", dev->vfiodev.pci, err);
+    return err;
+}
 
 /**
- * Open and attach to a UNVMe driver.
- * @param   pci         PCI device id
- * @param   nsid        namespace id
- * @param   qcount      number of queues (0 for max number of queues support)
- * @param   qsize       size of each queue (0 default to 65)
- * @return  namespace pointer or NULL if error.
+ * Setup the command retry policy from the controller retry delay times.
+ * @param   dev         device context
+ * @param   idc         identify controller data
  */
-unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize)
+static void unvme_retry_init(unvme_device_t* dev, const nvme_identify_ctlr_t* idc)
 {
-    unvme_lockw(&unvme_lock);
-    if (!unvme_ses) {
-        if (log_open(unvme_log, "w")) {
-            unvme_unlockw(&unvme_lock);
-            exit(1);
-        }
+    dev->retrymax = UNVME_RETRY_MAX;
+    int i, crdt = 0;
+    for (i = 0; i < 3; i++) {
+        dev->crdtsc[i] = (u64)idc->crdt[i] * dev->nvmedev.rdtsec / 10;
+        crdt |= idc->crdt[i];
     }
+    if (crdt) (void)unvme_acre_enable(dev);
+    DEBUG_FN("%x crdt=%d,%d,%d acre=%d", dev->vfiodev.pci,
+             idc->crdt[0], idc->crdt[1], idc->crdt[2], dev->acre);
+}
 
-    // check for existing opened device
-    unvme_session_t* xses = unvme_ses;
-    while (xses) {
-        if (xses->ns.pci == pci) {
-            if (nsid > xses->ns.nscount) {
-                ERROR("invalid %06x nsid %d (max %d)", pci, nsid, xses->ns.nscount);
-                return NULL;
-            }
-            if (xses->ns.id == nsid) {
-                ERROR("%06x nsid %d is in use", pci);
-                return NULL;
-            }
-            break;
-        }
-        xses = xses->next;
-        if (xses == unvme_ses) xses = NULL;
+/**
+ * Configure shadow doorbell and event index buffers so that IO queue
+ * doorbell MMIO writes are only issued when the controller requests them.
+ * Must be called before the IO queues are created.
+ * @param   dev         device context
+ * @param   qcount      number of I/O queues
+ */
+static void unvme_dbbuf_enable(unvme_device_t* dev, int qcount)
+{
+    // both buffers are one memory page covering all queue doorbells
+    u64 size = dev->ns.pagesize;
+    if ((u64)(qcount + 1) * 2 * dev->nvmedev.dbstride * sizeof(u32) > size) {
+        DEBUG_FN("%x too many queues %d for dbbuf", dev->vfiodev.pci, qcount);
+        return;
     }
 
-    unvme_device_t* dev;
-    if (xses) {
-        dev = xses->dev;
-    } else {
-        // setup controller namespace
-        dev = zalloc(sizeof(unvme_device_t));
-        vfio_create(&dev->vfiodev, pci);
-        nvme_create(&dev->nvmedev, dev->vfiodev.fd);
-        unvme_adminq_create(dev, 64);
-
-        // get controller info
-        vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, 4096);
-        if (nvme_acmd_identify(&dev->nvmedev, 0, dma->addr, 0))
-            FATAL("nvme_acmd_identify controller failed");
-        nvme_identify_ctlr_t* idc = malloc(sizeof(nvme_identify_ctlr_t));
-        memcpy(idc, dma->buf, sizeof(nvme_identify_ctlr_t));
-
-        if (nsid > idc->nn) {
-            ERROR("invalid %06x nsid %d (max %d)", pci, nsid, idc->nn);
-            return NULL;
-        }
-
-        unvme_ns_t* ns = &dev->ns;
-        ns->pci = pci;
-        ns->id = 0;
-        ns->nscount = idc->nn;
-        sprintf(ns->device, "%02x:%02x.%x", pci >> 16, (pci >> 8) & 0xff, pci & 0xff);
-        ns->maxqsize = dev->nvmedev.maxqsize;
-        ns->pageshift = dev->nvmedev.pageshift;
-        ns->pagesize = 1 << ns->pageshift;
-        int i;
-        ns->vid = idc->vid;
-        memcpy(ns->mn, idc->mn, sizeof (ns->mn));
-        for (i = sizeof (ns->mn) - 1; i > 0 && ns->mn[i] == ' '; i--) ns->mn[i] = 0;
-        memcpy(ns->sn, idc->sn, sizeof (ns->sn));
-        for (i = sizeof (ns->sn) - 1; i > 0 && ns->sn[i] == ' '; i--) ns->sn[i] = 0;
-        memcpy(ns->fr, idc->fr, sizeof (ns->fr));
-        for (i = sizeof (ns->fr) - 1; i > 0 && ns->fr[i] == ' '; i--) ns->fr[i] = 0;
-
-        // set limit to 1 PRP list page per IO submission
-        ns->maxppio = ns->pagesize / sizeof(u64);
-        if (idc->mdts) {
-            int mp = 2 << (idc->mdts - 1);
-            if (ns->maxppio > mp) ns->maxppio = mp;
-        }
-        free(idc);
-        vfio_dma_free(dma);
-
-        // get max number of queues supported
-        nvme_feature_num_queues_t nq;
-        if (nvme_acmd_get_features(&dev->nvmedev, 0,
-                                   NVME_FEATURE_NUM_QUEUES, 0, 0, (u32*)&nq))
-            FATAL("nvme_acmd_get_features number of queues failed");
-        int maxqcount = (nq.nsq < nq.ncq ? nq.nsq : nq.ncq) + 1;
-        if (qcount <= 0) qcount = maxqcount;
-        if (qsize <= 1) qsize = UNVME_QSIZE;
-        if (qsize > dev->nvmedev.maxqsize) qsize = dev->nvmedev.maxqsize;
-        ns->maxqcount = maxqcount;
-        ns->qcount = qcount;
-        ns->qsize = qsize;
-
-        // setup IO queues
-        DEBUG_FN("Creating %d IO queues (of max %d), queue size %d", qcount, maxqcount, qsize);
-        dev->ioqs = zalloc(qcount * sizeof(unvme_queue_t));
-        for (i = 0; i < qcount; i++) unvme_ioq_create(dev, i);
+    dev->dbbuf = vfio_dma_alloc(&dev->vfiodev, size);
+    dev->eibuf = vfio_dma_alloc(&dev->vfiodev, size);
+    if (!dev->dbbuf || !dev->eibuf) {
+        ERROR("vfio_dma_alloc dbbuf");
+        goto error;
     }
+    memset(dev->dbbuf->buf, 0, size);
+    memset(dev->eibuf->buf, 0, size);
 
-    // allocate new session
-    unvme_session_t* ses = zalloc(sizeof(unvme_session_t));
-    ses->dev = dev;
-    dev->refcount++;
-    memcpy(&ses->ns, &ses->dev->ns, sizeof(unvme_ns_t));
-    ses->ns.ses = ses;
-    unvme_ns_init(&ses->ns, nsid);
-    LIST_ADD(unvme_ses, ses);
-
-    INFO_FN("%s (%.40s) is ready", ses->ns.device, ses->ns.mn);
-    unvme_unlockw(&unvme_lock);
-    return &ses->ns;
+    if (nvme_acmd_dbbuf_config(&dev->nvmedev, dev->dbbuf->buf, dev->dbbuf->addr,
+                                              dev->eibuf->buf, dev->eibuf->addr)) {
+        ERROR("nvme_acmd_dbbuf_config failed");
+        goto error;
+    }
+    DEBUG_FN("%x dbbuf=%#lx eibuf=%#lx", dev->vfiodev.pci,
+             dev->dbbuf->addr, dev->eibuf->addr);
+    return;
+
+error:
+    if (dev->eibuf) vfio_dma_free(dev->eibuf);
+    if (dev->dbbuf) vfio_dma_free(dev->dbbuf);
+    dev->eibuf = dev->dbbuf = NULL;
 }
 
 /**
- * Close and detach from a UNVMe driver.
- * @param   ns          namespace handle
- * @return  0 if ok else -1.
+ * Release the shadow doorbell buffers (after the IO queues are deleted).
+ * @param   dev         device context
  */
-int unvme_do_close(const unvme_ns_t* ns)
+static void unvme_dbbuf_disable(unvme_device_t* dev)
 {
-    DEBUG_FN("%s", ns->device);
-    unvme_session_t* ses = ns->ses;
-    if (ns->pci != ses->dev->vfiodev.pci) return -1;
-    unvme_lockw(&unvme_lock);
-    unvme_cleanup(ses);
-    unvme_unlockw(&unvme_lock);
-    return 0;
+    if (!dev->dbbuf) return;
+    dev->nvmedev.dbbuf = dev->nvmedev.eibuf = NULL;
+    vfio_dma_free(dev->eibuf);
+    vfio_dma_free(dev->dbbuf);
+    dev->eibuf = dev->dbbuf = NULL;
 }
 
 /**
- * Allocate an I/O buffer.
- * @param   ns          namespace handle
- * @param   size        buffer size
- * @return  the allocated buffer or NULL if failure.
+ * Enable MSI-X interrupts with an eventfd per vector for completion waits.
+ * Fall back to polled mode if the device has no usable vectors or the
+ * eventfds cannot be created.
+ * @param   dev         device context
+ * @param   qcount      number of I/O queues
  */
-void* unvme_do_alloc(const unvme_ns_t* ns, u64 size)
+static void unvme_intr_enable(unvme_device_t* dev, int qcount)
 {
-    DEBUG_FN("%s %#lx", ns->device, size);
-    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
-    unvme_iomem_t* iomem = &dev->iomem;
-    void* buf = NULL;
+    int nvec = dev->vfiodev.msixsize;
+    if (nvec < 2) {
+        ERROR("%x has no MSI-X vector for I/O queues (polled mode)", dev->vfiodev.pci);
+        return;
+    }
+    if (nvec > qcount + 1) nvec = qcount + 1;
 
-    unvme_lockw(&iomem->lock);
-    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, size);
-    if (dma) {
-        if (iomem->count == iomem->size) {
-            iomem->size += 256;
-            iomem->map = realloc(iomem->map, iomem->size * sizeof(void*));
+    dev->efds = zalloc(nvec * sizeof(int));
+    dev->efds[0] = -1;
+    int i;
+    for (i = 1; i < nvec; i++) {
+        if ((dev->efds[i] = eventfd(0, EFD_NONBLOCK)) < 0) {
+            ERROR("%x eventfd: %s (polled mode)", dev->vfiodev.pci, strerror(errno));
+            while (--i > 0) close(dev->efds[i]);
+            free(dev->efds);
+            dev->efds = NULL;
+            return;
         }
-        iomem->map[iomem->count++] = dma;
-        buf = dma->buf;
     }
-    unvme_unlockw(&iomem->lock);
-    return buf;
+    vfio_msix_enable(&dev->vfiodev, 0, nvec, dev->efds);
+    dev->nvec = nvec;
+    dev->intr = 1;
+    dev->tunetsc = rdtsc();
+    unvme_intr_coalesce(dev, 0, 0);
+    DEBUG_FN("%x nvec=%d", dev->vfiodev.pci, nvec);
 }
 
 /**
- * Free an I/O buffer.
- * @param   ns          namespace handle
- * @param   buf         buffer pointer
- * @return  0 if ok else -1.
+ * Disable MSI-X interrupts and close the eventfds.
+ * @param   dev         device context
  */
-int unvme_do_free(const unvme_ns_t* ns, void* buf)
+static void unvme_intr_disable(unvme_device_t* dev)
 {
-    DEBUG_FN("%s %p", ns->device, buf);
-    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (!dev->intr) return;
+    vfio_msix_disable(&dev->vfiodev);
+    int i;
+    for (i = 1; i < dev->nvec; i++) close(dev->efds[i]);
+    free(dev->efds);
+    dev->efds = NULL;
+    dev->nvec = 0;
+    dev->intr = 0;
+}
+
+/**
+ * Return the maximum power of a power state (in 0.0001W units).
+ * @param   ps          power state descriptor
+ * @return  maximum power.
+ */
+static inline u32 unvme_ps_power(const nvme_power_state_t* ps)
+{
+    return ps->mxps ? ps->mp : ps->mp * 100;
+}
+
+/**
+ * Restore power state 0 and disable autonomous transition if enabled.
+ * @param   dev         device context
+ */
+static void unvme_power_reset(unvme_device_t* dev)
+{
+    if (!dev->pslatency) return;
+    u32 val = 0;
+    if (dev->apst &&
+        nvme_acmd_set_features(&dev->nvmedev, 0, NVME_FEATURE_AUTO_PST, 0, 0, &val))
+        ERROR("%x disable APST failed", dev->vfiodev.pci);
+    val = 0;
+    if (nvme_acmd_set_features(&dev->nvmedev, 0, NVME_FEATURE_POWER_MGMT, 0, 0, &val))
+        ERROR("%x set power state 0 failed", dev->vfiodev.pci);
+    dev->pslatency = 0;
+    dev->psidle = dev->pscur = dev->apst = 0;
+}
+
+/**
+ * Identify a controller or namespace and copy out the returned data.
+ * @param   dev         device context
+ * @param   nsid        namespace id (0 for controller)
+ * @param   data        4K identify data returned
+ * @return  0 if ok else error status.
+ */
+static int unvme_identify(unvme_device_t* dev, int nsid, void* data)
+{
+    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, 4096);
+    if (!dma) return -1;
+    int err = nvme_acmd_identify(&dev->nvmedev, nsid, dma->addr, 0);
+    if (!err) memcpy(data, dma->buf, 4096);
+    vfio_dma_free(dma);
+    return err;
+}
+
+/**
+ * Set the power state latency budget (with the admin lock held).
+ * @param   dev         device context
+ * @param   latency     latency budget in microseconds (0 to disable)
+ * @return  the selected idle power state or -1 if error.
+ */
+static int unvme_power_latency(unvme_device_t* dev, u32 latency)
+{
+    if (latency == 0) {
+        unvme_power_reset(dev);
+        return 0;
+    }
+
+    nvme_identify_ctlr_t* idc = zalloc(sizeof(*idc));
+    if (unvme_identify(dev, 0, idc)) {
+        ERROR("%s identify controller failed", dev->ns.device);
+        free(idc);
+        return -1;
+    }
+
+    // select the lowest power state whose entry and exit latency fit
+    int ps, npss = idc->npss < 32 ? idc->npss : 31;
+    int idle = 0;
+    for (ps = 1; ps <= npss; ps++) {
+        const nvme_power_state_t* psd = &idc->psd[ps];
+        if ((u64)psd->enlat + psd->exlat > latency) continue;
+        if (unvme_ps_power(psd) <= unvme_ps_power(&idc->psd[idle])) idle = ps;
+    }
+
+    int apst = 0;
+    if (idc->apsta & 1) {
+        vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, 4096);
+        if (!dma) {
+            free(idc);
+            return -1;
+        }
+        nvme_feature_auto_pst_data_t* apstd = dma->buf;
+        memset(apstd, 0, sizeof(*apstd));
+
+        // each state transitions to the deepest non-operational state
+        // (within budget) below it after idling for 50 times that state's
+        // total latency, same as the Linux kernel policy
+        int itps = 0, itpt = 0;
+        for (ps = npss; ps >= 0; ps--) {
+            if (itps) {
+                apstd->entry[ps].itps = itps;
+                apstd->entry[ps].itpt = itpt;
+            }
+            const nvme_power_state_t* psd = &idc->psd[ps];
+            u64 total = (u64)psd->enlat + psd->exlat;
+            if (!psd->nops || total > latency) continue;
+            u64 ms = (total + 19) / 20;
+            itpt = ms > 0xffffff ? 0xffffff : ms;
+            itps = ps;
+        }
+        apst = itps != 0;
+
+        u32 val = apst;
+        int err = nvme_acmd_set_features(&dev->nvmedev, 0, NVME_FEATURE_AUTO_PST,
+                                         dma->addr, 0, &val);
+        vfio_dma_free(dma);
+        if (err) {
+            ERROR("%s set APST failed (%#x)", dev->ns.device, err);
+            apst = 0;
+        }
+    }
+    free(idc);
+
+    dev->pslatency = latency;
+    dev->apst = apst;
+    dev->psidle = apst ? 0 : idle;
+    DEBUG_FN("%s latency=%u idle=%d apst=%d", dev->ns.device, latency, idle, apst);
+    return idle;
+}
+
+/**
+ * Transition to the idle or operational power state (with the admin lock
+ * held).
+ * @param   dev         device context
+ * @param   idle        1 for the idle state or 0 for power state 0
+ * @return  0 if ok else error status.
+ */
+static int unvme_power_state(unvme_device_t* dev, int idle)
+{
+    if (!dev->pslatency) return 0;
+
+    // under APST the current state is unknown so always force a wake
+    int ps = idle ? dev->psidle : 0;
+    if (ps == dev->pscur && (idle || !dev->apst)) return 0;
+
+    u32 val = ps;
+    int err = nvme_acmd_set_features(&dev->nvmedev, 0, NVME_FEATURE_POWER_MGMT,
+                                     0, 0, &val);
+    if (err) ERROR("%s set power state %d failed (%#x)", dev->ns.device, ps, err);
+    else __atomic_store_n(&dev->pscur, ps, __ATOMIC_RELAXED);
+    return err;
+}
+
+/**
+ * Leave the host managed idle power state upon the first submission after
+ * it was entered, predicting that a burst follows, so the device does not
+ * stay in or fall back to a state with exit latency during the burst.
+ * @param   dev         device context
+ */
+static void unvme_power_autowake(unvme_device_t* dev)
+{
+    if (!__atomic_load_n(&dev->pscur, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&dev->adminlock);
+    (void)unvme_power_state(dev, 0);
+    pthread_mutex_unlock(&dev->adminlock);
+}
+
+/**
+ * Select the best performing LBA format, i.e. the one without metadata
+ * having the best relative performance, preferring the largest block size
+ * that does not exceed the memory page size.
+ * @param   idns        identify namespace data
+ * @param   pageshift   memory page size shift value
+ * @return  LBA format index or -1 if none is suitable.
+ */
+static int unvme_lbaf_best(const nvme_identify_ns_t* idns, int pageshift)
+{
+    int i, best = -1;
+    for (i = 0; i <= idns->nlbaf && i < 16; i++) {
+        const nvme_lba_format_t* lbaf = &idns->lbaf[i];
+        if (lbaf->ms || lbaf->lbads < 9 || lbaf->lbads > pageshift) continue;
+        if (best < 0 || lbaf->rp < idns->lbaf[best].rp ||
+            (lbaf->rp == idns->lbaf[best].rp &&
+             lbaf->lbads > idns->lbaf[best].lbads)) best = i;
+    }
+    return best;
+}
+
+/**
+ * Set namespace block attributes from its formatted LBA format.
+ * @param   ns          namespace context
+ * @param   idns        identify namespace data
+ */
+static void unvme_ns_set_format(unvme_ns_t* ns, const nvme_identify_ns_t* idns)
+{
+    ns->blockcount = idns->ncap;
+    ns->blockshift = idns->lbaf[idns->flbas & 0xF].lbads;
+    ns->blocksize = 1 << ns->blockshift;
+    ns->bpshift = ns->pageshift - ns->blockshift;
+    ns->nbpp = 1 << ns->bpshift;
+    ns->pagecount = ns->blockcount >> ns->bpshift;
+    ns->maxbpio = ns->maxppio << ns->bpshift;
+    unvme_rw_select(ns);
+}
+
+/**
+ * Initialize a namespace instance.
+ * @param   ns          namespace context
+ * @param   nsid        namespace id
+ */
+static void unvme_ns_init(unvme_ns_t* ns, int nsid)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    ns->id = nsid;
+    ns->maxiopq = ns->qsize - 1;
+
+    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, ns->pagesize);
+    if (nvme_acmd_identify(&dev->nvmedev, nsid, dma->addr, 0))
+        FATAL("nvme_acmd_identify %d failed", nsid);
+    unvme_ns_set_format(ns, (nvme_identify_ns_t*)dma->buf);
+    vfio_dma_free(dma);
+
+    sprintf(ns->device + strlen(ns->device), "/%d", nsid);
+    DEBUG_FN("%s qc=%d qd=%d bs=%d bc=%#lx mbio=%d", ns->device, ns->qcount,
+             ns->qsize, ns->blocksize, ns->blockcount, ns->maxbpio);
+}
+
+/**
+ * Fail all pending commands of a queue (after a controller reset).
+ * @param   q           queue
+ */
+static void unvme_queue_fail(unvme_queue_t* q)
+{
+    unvme_desc_t* desc = q->desclist;
+    if (desc) {
+        do {
+            if (desc->cidcount) {
+                desc->error = -EIO;
+                desc->cidcount = 0;
+                memset(desc->cidmask, 0, q->masksize);
+                unvme_desc_done(desc);
+            }
+            desc = desc->next;
+        } while (desc != q->desclist);
+    }
+    memset(q->cidmask, 0, q->masksize);
+    q->cidcount = 0;
+    int cid;
+    for (cid = 0; cid < q->size; cid++) q->cmdrec[cid].retrytsc = 0;
+    q->retrycount = 0;
+
+    // raw queue commands are dropped, which is only flagged since the
+    // queue is used by the application thread without a lock
+    if (q->rawq) __atomic_add_fetch(&q->rawq->resets, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reset the controller and recreate the admin and IO queues in place,
+ * then restore the host memory buffer, doorbell buffers, interrupt and
+ * power settings.  Submitters are quiesced by the device reset lock, and
+ * all outstanding descriptors are failed (error -EIO) so that the callers
+ * may resubmit them.
+ * @param   dev         device context
+ * @param   gen         reset generation observed by the caller
+ * @return  0 if ok else -1.
+ */
+static int unvme_recover(unvme_device_t* dev, u32 gen)
+{
+    unvme_lockw(&dev->rlock);
+    if (dev->resetgen != gen) {
+        // already recovered by another thread
+        unvme_unlockw(&dev->rlock);
+        return 0;
+    }
+    pthread_mutex_lock(&dev->adminlock);
+    ERROR("%x resetting controller", dev->vfiodev.pci);
+    u64 tsc = rdtsc();
+
+    int err = 0;
+    unvme_queue_t* adminq = &dev->adminq;
+    unvme_queue_fail(adminq);
+    if (!nvme_adminq_setup(&dev->nvmedev, adminq->size,
+                           adminq->sqdma->buf, adminq->sqdma->addr,
+                           adminq->cqdma->buf, adminq->cqdma->addr)) {
+        ERROR("%x nvme_adminq_setup failed", dev->vfiodev.pci);
+        err = -1;
+    }
+    int q;
+    for (q = 0; q < dev->ns.qcount; q++) unvme_queue_fail(dev->ioqs + q);
+    if (err) goto done;
+
+    if (dev->hmb) {
+        nvme_hmb_desc_t* desc = dev->hmbdesc->buf;
+        if (nvme_acmd_set_hmb(&dev->nvmedev, 1, desc->bsize, dev->hmbdesc->addr, 1))
+            ERROR("%x enable HMB failed", dev->vfiodev.pci);
+    }
+    if (dev->acre) (void)unvme_acre_enable(dev);
+    if (dev->dbbuf) {
+        memset(dev->dbbuf->buf, 0, dev->dbbuf->size);
+        memset(dev->eibuf->buf, 0, dev->eibuf->size);
+        if (nvme_acmd_dbbuf_config(&dev->nvmedev, dev->dbbuf->buf, dev->dbbuf->addr,
+                                                  dev->eibuf->buf, dev->eibuf->addr)) {
+            ERROR("%x nvme_acmd_dbbuf_config failed", dev->vfiodev.pci);
+            unvme_dbbuf_disable(dev);
+        }
+    }
+    if (dev->intr && dev->intrthr)
+        unvme_intr_coalesce(dev, dev->intrthr, dev->intrtime);
+
+    for (q = 0; q < dev->ns.qcount; q++) {
+        unvme_queue_t* ioq = dev->ioqs + q;
+        // a raw queue is left failed until it is closed (by its application
+        // thread), since recreating it would reset the queue state under it
+        if (ioq->rawq) {
+            ioq->lost = 1;
+            continue;
+        }
+        if (nvme_ioq_recreate(ioq->nvmeq, ioq->sqdma->addr, ioq->cqdma->addr)) {
+            ERROR("%x nvme_ioq_recreate %d failed", dev->vfiodev.pci, q+1);
+            err = -1;
+            goto done;
+        }
+        if (dev->intr && ioq->cd) unvme_intr_vector(dev, ioq->iv, 1);
+    }
+
+    if (dev->pslatency) {
+        u32 latency = dev->pslatency;
+        dev->pslatency = 0;
+        dev->psidle = dev->pscur = dev->apst = 0;
+        unvme_power_latency(dev, latency);
+    }
+
+done:
+    dev->resetgen++;
+    pthread_mutex_unlock(&dev->adminlock);
+    unvme_unlockw(&dev->rlock);
+    if (err) ERROR("%x reset failed", dev->vfiodev.pci);
+    else INFO_FN("%x reset completed in %lu ms", dev->vfiodev.pci,
+                 (rdtsc() - tsc) * 1000 / dev->nvmedev.rdtsec);
+    return err;
+}
+
+/**
+ * Prefault the stack pages (which are then locked by mlockall).
+ */
+static void __attribute__((noinline)) unvme_rt_prefault(void)
+{
+    u8 stack[UNVME_RT_STACK];
+    memset(stack, 0, sizeof(stack));
+    __asm__ __volatile__("" :: "r"(stack) : "memory");
+}
+
+/**
+ * Enable the real-time mode for a device: preallocate its I/O memory
+ * tracker and lock all current and future process memory (prefaulting it
+ * along with the stack).  The device's polling waits spin instead of
+ * yielding the CPU (see unvme_yield).  The memory stays locked after the
+ * device is closed, since unlocking would also undo any locking by the
+ * application.
+ * @param   dev         device context
+ */
+static void unvme_rt_enable(unvme_device_t* dev)
+{
+    DEBUG_FN("%x", dev->vfiodev.pci);
+    unvme_iomem_t* iomem = &dev->iomem;
+    if (iomem->size < UNVME_RT_IOMEM) {
+        iomem->size = UNVME_RT_IOMEM;
+        iomem->map = realloc(iomem->map, iomem->size * sizeof(void*));
+    }
+
+    if (!unvme_rtlocked) {
+        unvme_rtlocked = 1;
+        if (mlockall(MCL_CURRENT | MCL_FUTURE))
+            ERROR("mlockall, %d", errno);
+    }
+    unvme_rt_prefault();
+}
+
+/**
+ * Get the open lock entry of a PCI device (which is created upon first use
+ * and kept, so it outlives the device contexts that it guards).
+ * @param   pci         PCI device id
+ * @return  the PCI device entry.
+ */
+static unvme_pcidev_t* unvme_pcidev_get(int pci)
+{
+    unvme_lockr(&unvme_lock);
+    unvme_pcidev_t* pd = unvme_pcidevs;
+    while (pd && pd->pci != pci) pd = pd->next;
+    unvme_unlockr(&unvme_lock);
+    if (pd) return pd;
+
+    unvme_lockw(&unvme_lock);
+    for (pd = unvme_pcidevs; pd && pd->pci != pci; pd = pd->next);
+    if (!pd) {
+        pd = zalloc(sizeof(*pd));
+        pd->pci = pci;
+        pthread_mutex_init(&pd->lock, NULL);
+        pd->next = unvme_pcidevs;
+        unvme_pcidevs = pd;
+    }
+    unvme_unlockw(&unvme_lock);
+    return pd;
+}
+
+/**
+ * Initialize a device context and create its I/O queues.
+ * @param   pci         PCI device id
+ * @param   qcount      number of queues (0 for max number of queues support)
+ * @param   qsize       size of each queue (0 default to 65)
+ * @param   flags       open flags
+ * @return  device context.
+ */
+static unvme_device_t* unvme_device_create(int pci, int qcount, int qsize, int flags)
+{
+    // setup controller namespace
+    unvme_device_t* dev = zalloc(sizeof(unvme_device_t));
+    dev->rt = (flags & UNVME_OPEN_RT) != 0;
+    pthread_mutex_init(&dev->adminlock, NULL);
+    vfio_create(&dev->vfiodev, pci);
+    nvme_create(&dev->nvmedev, dev->vfiodev.fd);
+    unvme_adminq_create(dev, 64);
+
+    // get controller info
+    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, 4096);
+    if (nvme_acmd_identify(&dev->nvmedev, 0, dma->addr, 0))
+        FATAL("nvme_acmd_identify controller failed");
+    nvme_identify_ctlr_t* idc = malloc(sizeof(nvme_identify_ctlr_t));
+    memcpy(idc, dma->buf, sizeof(nvme_identify_ctlr_t));
+
+    unvme_ns_t* ns = &dev->ns;
+    ns->pci = pci;
+    ns->id = 0;
+    ns->nscount = idc->nn;
+    sprintf(ns->device, "%02x:%02x.%x", pci >> 16, (pci >> 8) & 0xff, pci & 0xff);
+    ns->maxqsize = dev->nvmedev.maxqsize;
+    ns->pageshift = dev->nvmedev.pageshift;
+    ns->pagesize = 1 << ns->pageshift;
+    int i;
+    ns->vid = idc->vid;
+    memcpy(ns->mn, idc->mn, sizeof (ns->mn));
+    for (i = sizeof (ns->mn) - 1; i > 0 && ns->mn[i] == ' '; i--) ns->mn[i] = 0;
+    memcpy(ns->sn, idc->sn, sizeof (ns->sn));
+    for (i = sizeof (ns->sn) - 1; i > 0 && ns->sn[i] == ' '; i--) ns->sn[i] = 0;
+    memcpy(ns->fr, idc->fr, sizeof (ns->fr));
+    for (i = sizeof (ns->fr) - 1; i > 0 && ns->fr[i] == ' '; i--) ns->fr[i] = 0;
+
+    // set limit to 1 PRP list page per IO submission
+    ns->maxppio = ns->pagesize / sizeof(u64);
+    if (idc->mdts) {
+        int mp = 2 << (idc->mdts - 1);
+        if (ns->maxppio > mp) ns->maxppio = mp;
+    }
+    u16 oacs = idc->oacs;
+    vfio_dma_free(dma);
+    unvme_hmb_enable(dev, idc);
+    unvme_retry_init(dev, idc);
+    free(idc);
+
+    // get max number of queues supported
+    nvme_feature_num_queues_t nq;
+    if (nvme_acmd_get_features(&dev->nvmedev, 0,
+                               NVME_FEATURE_NUM_QUEUES, 0, 0, (u32*)&nq))
+        FATAL("nvme_acmd_get_features number of queues failed");
+    int maxqcount = (nq.nsq < nq.ncq ? nq.nsq : nq.ncq) + 1;
+    if (qcount <= 0) qcount = maxqcount;
+    if (qsize <= 1) qsize = UNVME_QSIZE;
+    if (qsize > dev->nvmedev.maxqsize) qsize = dev->nvmedev.maxqsize;
+    ns->maxqcount = maxqcount;
+    ns->qcount = qcount;
+    ns->qsize = qsize;
+
+    // setup IO queues
+    DEBUG_FN("Creating %d IO queues (of max %d), queue size %d", qcount, maxqcount, qsize);
+    dev->ioqs = zalloc(qcount * sizeof(unvme_queue_t));
+    if (oacs & NVME_OACS_DBBUF_CONFIG) unvme_dbbuf_enable(dev, qcount);
+    if (flags & UNVME_OPEN_INTR) unvme_intr_enable(dev, qcount);
+    for (i = 0; i < qcount; i++) unvme_ioq_create(dev, i);
+    return dev;
+}
+
+/**
+ * Shut down a device and free its context.
+ * @param   dev         device context
+ */
+static void unvme_device_delete(unvme_device_t* dev)
+{
+    DEBUG_FN("%x", dev->vfiodev.pci);
+    int q;
+    for (q = 0; q < dev->ns.qcount; q++) unvme_ioq_delete(dev, q);
+    unvme_dbbuf_disable(dev);
+    unvme_intr_disable(dev);
+    unvme_power_reset(dev);
+    unvme_hmb_disable(dev);
+    unvme_adminq_delete(dev);
+    nvme_delete(&dev->nvmedev);
+    vfio_delete(&dev->vfiodev);
+    pthread_mutex_destroy(&dev->adminlock);
+    free(dev->ioqs);
+    free(dev);
+}
+
+/**
+ * Open and attach to a UNVMe driver.  Only the device open lock is held
+ * while a device is being initialized, so different devices may be opened
+ * (and closed) concurrently.
+ * @param   pci         PCI device id
+ * @param   nsid        namespace id
+ * @param   qcount      number of queues (0 for max number of queues support)
+ * @param   qsize       size of each queue (0 default to 65)
+ * @param   flags       open flags
+ * @return  namespace pointer or NULL if error.
+ */
+unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize, int flags)
+{
+    if (log_open(unvme_log, "w")) exit(1);
+
+    unvme_pcidev_t* pd = unvme_pcidev_get(pci);
+    pthread_mutex_lock(&pd->lock);
+    unvme_device_t* dev = pd->dev;
+    int created = 0;
+    if (!dev) {
+        dev = unvme_device_create(pci, qcount, qsize, flags);
+        created = 1;
+    }
+
+    // check for the namespace already opened
+    if (nsid > dev->ns.nscount) {
+        ERROR("invalid %06x nsid %d (max %d)", pci, nsid, dev->ns.nscount);
+        goto error;
+    }
+    unvme_lockr(&unvme_lock);
+    unvme_session_t* xses = unvme_ses;
+    while (xses) {
+        if (xses->dev == dev && xses->ns.id == nsid) break;
+        xses = xses->next;
+        if (xses == unvme_ses) xses = NULL;
+    }
+    unvme_unlockr(&unvme_lock);
+    if (xses) {
+        ERROR("%06x nsid %d is in use", pci, nsid);
+        goto error;
+    }
+
+    // allocate new session
+    unvme_session_t* ses = zalloc(sizeof(unvme_session_t));
+    ses->dev = dev;
+    memcpy(&ses->ns, &ses->dev->ns, sizeof(unvme_ns_t));
+    ses->ns.ses = ses;
+    unvme_ns_init(&ses->ns, nsid);
+
+    unvme_lockw(&unvme_lock);
+    if (created) {
+        pd->dev = dev;
+        if (dev->rt) unvme_rt_enable(dev);
+    }
+    dev->refcount++;
+    LIST_ADD(unvme_ses, ses);
+    unvme_unlockw(&unvme_lock);
+    pthread_mutex_unlock(&pd->lock);
+
+    INFO_FN("%s (%.40s) is ready", ses->ns.device, ses->ns.mn);
+    return &ses->ns;
+
+error:
+    if (created) unvme_device_delete(dev);
+    pthread_mutex_unlock(&pd->lock);
+    log_close();
+    return NULL;
+}
+
+/**
+ * Close and detach from a UNVMe driver.
+ * @param   ns          namespace handle
+ * @return  0 if ok else -1.
+ */
+int unvme_do_close(const unvme_ns_t* ns)
+{
+    DEBUG_FN("%s", ns->device);
+    unvme_session_t* ses = ns->ses;
+    unvme_device_t* dev = ses->dev;
+    if (ns->pci != dev->vfiodev.pci) return -1;
+
+    unvme_pcidev_t* pd = unvme_pcidev_get(ns->pci);
+    pthread_mutex_lock(&pd->lock);
+    unvme_lockw(&unvme_lock);
+    LIST_DEL(unvme_ses, ses);
+    int last = (--dev->refcount == 0);
+    if (last) pd->dev = NULL;
+    unvme_unlockw(&unvme_lock);
+    if (last) unvme_device_delete(dev);
+    pthread_mutex_unlock(&pd->lock);
+
+    free(ses);
+    log_close();
+    return 0;
+}
+
+/**
+ * Allocate an I/O buffer.
+ * @param   ns          namespace handle
+ * @param   size        buffer size
+ * @return  the allocated buffer or NULL if failure.
+ */
+void* unvme_do_alloc(const unvme_ns_t* ns, u64 size)
+{
+    DEBUG_FN("%s %#lx", ns->device, size);
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_iomem_t* iomem = &dev->iomem;
+    void* buf = NULL;
+
+    unvme_lockw(&iomem->lock);
+    vfio_dma_t* dma = unvme_iomem_reserve(dev) ? NULL :
+                      vfio_dma_alloc(&dev->vfiodev, size);
+    if (dma) {
+        unvme_iomem_add(iomem, dma);
+        buf = dma->buf;
+    }
+    unvme_unlockw(&iomem->lock);
+    return buf;
+}
+
+/**
+ * Register an externally provided DMA range (e.g. a programmable logic
+ * buffer for peer-to-peer transfers) as an I/O buffer.  If buf is NULL,
+ * the physical range is mapped through /dev/mem.
+ * @param   ns          namespace handle
+ * @param   buf         premapped buffer (or NULL)
+ * @param   size        range size
+ * @param   addr        bus address of the range
+ * @return  the I/O buffer or NULL if failure.
+ */
+void* unvme_do_map(const unvme_ns_t* ns, void* buf, u64 size, u64 addr)
+{
+    DEBUG_FN("%s %p %#lx %#lx", ns->device, buf, size, addr);
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_iomem_t* iomem = &dev->iomem;
+
+    // PRPs may start at any dword offset in a page (see unvme_prp_build)
+    if (!size || (addr & 3) || ((u64)buf & 3)) {
+        ERROR("invalid DMA range %p %#lx %#lx", buf, addr, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    unvme_lockw(&iomem->lock);
+    vfio_dma_t* dma = unvme_iomem_reserve(dev) ? NULL :
+                      buf ? vfio_dma_map(&dev->vfiodev, size, buf, addr)
+                          : vfio_dma_map_phys(&dev->vfiodev, size, addr);
+    if (dma) {
+        unvme_iomem_add(iomem, dma);
+        buf = dma->buf;
+    } else {
+        buf = NULL;
+    }
+    unvme_unlockw(&iomem->lock);
+    return buf;
+}
+
+/**
+ * Import a dma-buf as an I/O buffer, or if *fd is negative, allocate an
+ * I/O buffer exported as a dma-buf (returning its descriptor in *fd).
+ * @param   ns          namespace handle
+ * @param   fd          dma-buf file descriptor
+ * @param   size        buffer size (0 to import the whole dma-buf)
+ * @return  the I/O buffer or NULL if failure.
+ */
+void* unvme_do_dmabuf(const unvme_ns_t* ns, int* fd, u64 size)
+{
+    DEBUG_FN("%s %d %#lx", ns->device, *fd, size);
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_iomem_t* iomem = &dev->iomem;
+    void* buf = NULL;
+
+    unvme_lockw(&iomem->lock);
+    vfio_dma_t* dma = unvme_iomem_reserve(dev) ? NULL :
+                      (*fd < 0) ? vfio_dma_export(&dev->vfiodev, size, fd)
+                                : vfio_dma_import(&dev->vfiodev, *fd, size);
+    if (dma) {
+        unvme_iomem_add(iomem, dma);
+        buf = dma->buf;
+    }
+    unvme_unlockw(&iomem->lock);
+    return buf;
+}
+
+/**
+ * Synchronize the CPU caches of a dma-buf I/O buffer.
+ * @param   ns          namespace handle
+ * @param   buf         I/O buffer (from unvme_alloc_dmabuf/unvme_import_dmabuf)
+ * @param   flags       UNVME_SYNC_* flags
+ * @return  0 if ok else negative error code.
+ */
+int unvme_do_sync_dmabuf(const unvme_ns_t* ns, void* buf, int flags)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_iomem_t* iomem = &dev->iomem;
+    int err = -EINVAL;
+
+    unvme_lockr(&iomem->lock);
+    int i;
+    for (i = 0; i < iomem->count; i++) {
+        if (buf == iomem->map[i]->buf) {
+            err = vfio_dma_sync(iomem->map[i], flags) ? -errno : 0;
+            break;
+        }
+    }
+    unvme_unlockr(&iomem->lock);
+    return err;
+}
+
+/**
+ * Free an I/O buffer (or unregister an external DMA range).
+ * @param   ns          namespace handle
+ * @param   buf         buffer pointer
+ * @return  0 if ok else -1.
+ */
+int unvme_do_free(const unvme_ns_t* ns, void* buf)
+{
+    DEBUG_FN("%s %p", ns->device, buf);
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
     unvme_iomem_t* iomem = &dev->iomem;
 
     unvme_lockw(&iomem->lock);
@@ -631,31 +1654,96 @@ int unvme_do_free(const unvme_ns_t* ns, void* buf)
 
 /**
  * Poll for completion status of a previous IO submission.
- * If there's no error, the descriptor will be released.
+ * Once all of its commands are completed, the descriptor will be released
+ * and its status returned.
  * @param   desc        IO descriptor
  * @param   timeout     in seconds
  * @param   cqe_cs      CQE command specific DW0 returned
- * @return  0 if ok else error status (-1 means timeout).
+ * @return  0 if ok, positive NVMe status, or negative error code
+ *          (-ETIMEDOUT if not completed, -EIO if failed by a reset,
+ *          -EINVAL if bad descriptor).
  */
 int unvme_do_poll(unvme_desc_t* desc, int timeout, u32* cqe_cs)
 {
-    if (desc->sentinel != desc)
-        FATAL("bad IO descriptor");
+    if (!desc || desc->sentinel != desc) {
+        ERROR("bad IO descriptor %p", desc);
+        return -EINVAL;
+    }
 
     PDEBUG("# POLL d={%d %d %#lx}", desc->id, desc->cidcount, *desc->cidmask);
+    unvme_device_t* dev = desc->q->dev;
+    unvme_lockr(&dev->rlock);
     int err = 0;
     while (desc->cidcount) {
-        if ((err = unvme_check_completion(desc->q, timeout, cqe_cs)) != 0) break;
+        // NVMe errors are recorded in their own descriptors
+        if ((err = unvme_check_completion(desc->q, timeout, cqe_cs, NULL)) < 0) break;
     }
-    if (desc->cidcount == 0) unvme_desc_put(desc);
+    if (desc->cidcount == 0) {
+        err = desc->error;
+        if (cqe_cs && desc->q == &dev->adminq) *cqe_cs = desc->cs;
+        unvme_desc_put(desc);
+    }
+    unvme_unlockr(&dev->rlock);
     PDEBUG("# q%d +%d", desc->q->nvmeq->id, desc->q->desccount);
 
     return err;
 }
 
+/**
+ * Record a completed descriptor and release it.
+ * @param   ns          namespace handle
+ * @param   desc        completed descriptor
+ * @param   comp        returned completion
+ */
+static void unvme_reap_desc(const unvme_ns_t* ns, unvme_desc_t* desc, unvme_comp_t* comp)
+{
+    comp->ns = ns;
+    comp->buf = desc->buf;
+    comp->slba = desc->slba;
+    comp->nlb = desc->nlb;
+    comp->qid = desc->qid;
+    comp->opc = desc->opc;
+    comp->err = desc->error;
+    unvme_desc_put(desc);
+}
+
+/**
+ * Reap the available completions of a queue, returning the I/O completed
+ * (instead of polling their descriptors, which are released).
+ * @param   ns          namespace handle
+ * @param   qid         queue id
+ * @param   comps       returned completions
+ * @param   max         max number of completions to return
+ * @return  number of completions or -EINVAL/-EBUSY if bad queue.
+ */
+int unvme_do_reap(const unvme_ns_t* ns, int qid, unvme_comp_t* comps, int max)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (qid < 0 || qid >= ns->qcount) return -EINVAL;
+    unvme_queue_t* q = dev->ioqs + qid;
+    if (q->rawq) return -EBUSY;
+
+    // descriptors are added to the completed list wherever they complete
+    // (including while submitting to a full queue or failed by a reset)
+    unvme_lockr(&dev->rlock);
+    int n = 0;
+    while (n < max) {
+        if (q->donehead) {
+            unvme_reap_desc(ns, q->donehead, comps + n++);
+            continue;
+        }
+        int err = unvme_check_completion(q, 0, NULL, NULL);
+        if (err == -ETIMEDOUT || (err == -EIO && !q->donehead)) break;
+    }
+    unvme_unlockr(&dev->rlock);
+    return n;
+}
+
 /**
  * Submit a read/write command that may require multiple I/O submissions
- * and processing some completions.
+ * and processing some completions.  On error, errno is set to the error
+ * code if no command was submitted, otherwise the error is returned by
+ * polling the descriptor.
  * @param   ns          namespace handle
  * @param   qid         queue id
  * @param   opc         op code
@@ -667,7 +1755,30 @@ int unvme_do_poll(unvme_desc_t* desc, int timeout, u32* cqe_cs)
 unvme_desc_t* unvme_do_rw(const unvme_ns_t* ns, int qid, int opc,
                           void* buf, u64 slba, u32 nlb)
 {
-    unvme_queue_t* q = ((unvme_session_t*)ns->ses)->dev->ioqs + qid;
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (qid < 0 || qid >= ns->qcount || nlb == 0 ||
+        (slba + nlb) > ns->blockcount) {
+        ERROR("%s invalid q%d lba=%#lx nlb=%#x", ns->device, qid, slba, nlb);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // validate the whole buffer so the I/O cannot fail part way through
+    u64 addr;
+    int err = unvme_map_dma(ns, buf, (u64)nlb << ns->blockshift, &addr);
+    if (err) {
+        errno = -err;
+        return NULL;
+    }
+
+    unvme_queue_t* q = dev->ioqs + qid;
+    if (q->rawq) {
+        ERROR("%s q%d is a raw queue", ns->device, qid);
+        errno = EBUSY;
+        return NULL;
+    }
+    unvme_power_autowake(dev);
+    unvme_lockr(&dev->rlock);
     unvme_desc_t* desc = unvme_desc_get(q);
     desc->opc = opc;
     desc->buf = buf;
@@ -678,29 +1789,48 @@ unvme_desc_t* unvme_do_rw(const unvme_ns_t* ns, int qid, int opc,
 
     PDEBUG("# %s %#lx %#x @%d +%d", opc == NVME_CMD_READ ? "READ" : "WRITE",
            slba, nlb, desc->id, q->desccount);
-    while (nlb) {
-        int n = ns->maxbpio;
-        if (n > nlb) n = nlb;
-        int cid = unvme_submit_io(ns, desc, buf, slba, n);
-        if (cid < 0) {
-            // poll currently pending descriptor
-            int err = unvme_do_poll(desc, UNVME_TIMEOUT, NULL);
-            if (err) {
-                if (err == -1) FATAL("q%d timeout", q->nvmeq->id);
-                else ERROR("q%d error %#x", q->nvmeq->id, err);
-            }
+    err = ((unvme_session_t*)ns->ses)->rw_submit(ns, desc, addr, slba, nlb);
+    if (err) {
+        ERROR("q%d lba=%#lx nlb=%#x error %d", q->nvmeq->id, slba, nlb, err);
+        if (desc->cidcount == 0) {
+            unvme_desc_put(desc);
+            unvme_unlockr(&dev->rlock);
+            errno = -err;
+            return NULL;
         }
-
-        buf += n << ns->blockshift;
-        slba += n;
-        nlb -= n;
+        desc->error = err;
     }
+    nvme_sq_ring(q->nvmeq);
+    unvme_unlockr(&dev->rlock);
 
     return desc;
 }
 
 /**
- * Submit a generic or vendor specific command.
+ * Wait for an admin command completion without releasing the admin lock.
+ * The completion is recorded in the descriptor (for the poll to return).
+ * @param   q           admin queue
+ * @param   desc        command descriptor
+ * @return  0 if completed else -ETIMEDOUT.
+ */
+static int unvme_admin_wait(unvme_queue_t* q, unvme_desc_t* desc)
+{
+    unvme_device_t* dev = q->dev;
+    u64 endtsc = rdtsc() + UNVME_TIMEOUT * dev->nvmedev.rdtsec;
+    while (desc->cidcount) {
+        if (unvme_check_completion(q, 0, &desc->cs, NULL) != -ETIMEDOUT) continue;
+        if (rdtsc() >= endtsc) {
+            ERROR("%x admin opc %#x timed out", dev->vfiodev.pci, desc->opc);
+            return -ETIMEDOUT;
+        }
+        unvme_yield(dev->rt);
+    }
+    return 0;
+}
+
+/**
+ * Submit a generic or vendor specific command.  On error, errno is set
+ * to the error code.  An admin command is completed before returning.
  * @param   ns          namespace handle
  * @param   qid         client queue index (-1 for admin queue)
  * @param   opc         command op code
@@ -714,7 +1844,24 @@ unvme_desc_t* unvme_do_cmd(const unvme_ns_t* ns, int qid, int opc, int nsid,
                            void* buf, u64 bufsz, u32 cdw10_15[6])
 {
     unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (qid < -1 || qid >= ns->qcount) {
+        ERROR("%s invalid q%d", ns->device, qid);
+        errno = EINVAL;
+        return NULL;
+    }
     unvme_queue_t* q = (qid == -1) ? &dev->adminq : &dev->ioqs[qid];
+    if (q->rawq) {
+        ERROR("%s q%d is a raw queue", ns->device, qid);
+        errno = EBUSY;
+        return NULL;
+    }
+    if (qid >= 0) unvme_power_autowake(dev);
+    unvme_lockr(&dev->rlock);
+    u32 gen = dev->resetgen;
+
+    // the admin queue is shared with the library's synchronous admin
+    // commands, so an admin command runs to completion under the admin lock
+    if (qid == -1) pthread_mutex_lock(&dev->adminlock);
     unvme_desc_t* desc = unvme_desc_get(q);
     desc->opc = opc;
     desc->buf = buf;
@@ -722,12 +1869,30 @@ unvme_desc_t* unvme_do_cmd(const unvme_ns_t* ns, int qid, int opc, int nsid,
     desc->sentinel = desc;
 
     u64 prp1, prp2;
-    u16 cid = unvme_get_cid(desc);
-    if (unvme_map_prps(ns, q, cid, buf, bufsz, &prp1, &prp2) ||
-        nvme_cmd_vs(q->nvmeq, opc, cid, nsid, prp1, prp2, cdw10_15)) {
+    int err, cid = unvme_get_cid(desc);
+    if (cid < 0) {
+        err = cid;
+    } else if ((err = unvme_map_prps(ns, q, cid, buf, bufsz, &prp1, &prp2)) ||
+               (err = nvme_cmd_vs(q->nvmeq, opc, cid, nsid, prp1, prp2, cdw10_15))) {
+        if (err > 0) err = -EIO;
+        unvme_put_cid(desc, cid);
+    }
+    if (err) {
         unvme_desc_put(desc);
+        if (qid == -1) pthread_mutex_unlock(&dev->adminlock);
+        unvme_unlockr(&dev->rlock);
+        errno = -err;
         return NULL;
     }
+    unvme_cmd_save(q, cid);
+    if (qid == -1) {
+        err = unvme_admin_wait(q, desc);
+        pthread_mutex_unlock(&dev->adminlock);
+    }
+    unvme_unlockr(&dev->rlock);
+
+    // a lost admin command is failed by resetting the controller
+    if (err) unvme_recover(dev, gen);
 
     PDEBUG("# CMD=%#x %d q%d={%d %d %#lx} d={%d %d %#lx}",
            opc, nsid, q->nvmeq->id, cid, q->cidcount, *q->cidmask,
@@ -735,3 +1900,394 @@ unvme_desc_t* unvme_do_cmd(const unvme_ns_t* ns, int qid, int opc, int nsid,
     return desc;
 }
 
+
+/**
+ * Get the LBA formats supported by a namespace.
+ * @param   ns          namespace handle
+ * @param   lbaf        array of LBA formats returned
+ * @return  number of LBA formats or -1 if error.
+ */
+int unvme_do_get_lbaf(const unvme_ns_t* ns, unvme_lbaf_t lbaf[16])
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    nvme_identify_ns_t* idns = zalloc(sizeof(*idns));
+    pthread_mutex_lock(&dev->adminlock);
+    int err = unvme_identify(dev, ns->id, idns);
+    pthread_mutex_unlock(&dev->adminlock);
+    if (err) {
+        ERROR("%s identify namespace failed", ns->device);
+        free(idns);
+        return -1;
+    }
+
+    int i, count = idns->nlbaf + 1;
+    if (count > 16) count = 16;
+    for (i = 0; i < count; i++) {
+        lbaf[i].blocksize = 1 << idns->lbaf[i].lbads;
+        lbaf[i].ms = idns->lbaf[i].ms;
+        lbaf[i].rp = idns->lbaf[i].rp;
+        lbaf[i].formatted = (idns->flbas & 0xF) == i;
+    }
+    free(idns);
+    return count;
+}
+
+/**
+ * Format a namespace with the specified LBA format.
+ * @param   ns          namespace handle
+ * @param   lbaf        LBA format index (or UNVME_LBAF_BEST)
+ * @return  0 if ok else error status.
+ */
+int unvme_do_format(const unvme_ns_t* ns, int lbaf)
+{
+    unvme_session_t* ses = ns->ses;
+    unvme_device_t* dev = ses->dev;
+
+    // the I/O queues are shared by all sessions of the controller, whose
+    // submitters are held off by the reset lock while formatting (a raw
+    // queue cannot be held off, so it must be closed)
+    unvme_lockw(&dev->rlock);
+    int q;
+    for (q = 0; q < dev->ns.qcount; q++) {
+        if (dev->ioqs[q].cidcount || dev->ioqs[q].rawq) {
+            ERROR("%s has pending I/O on q%d", ns->device, q);
+            unvme_unlockw(&dev->rlock);
+            return -1;
+        }
+    }
+
+    nvme_identify_ns_t* idns = zalloc(sizeof(*idns));
+    pthread_mutex_lock(&dev->adminlock);
+    int err = unvme_identify(dev, ns->id, idns);
+    if (err) {
+        ERROR("%s identify namespace failed", ns->device);
+        goto done;
+    }
+    if (lbaf == UNVME_LBAF_BEST) lbaf = unvme_lbaf_best(idns, ns->pageshift);
+    if (lbaf < 0 || lbaf > idns->nlbaf || idns->lbaf[lbaf].lbads > ns->pageshift) {
+        ERROR("%s unsupported LBA format %d", ns->device, lbaf);
+        err = -1;
+        goto done;
+    }
+
+    INFO_FN("%s lbaf=%d bs=%d ms=%d rp=%d", ns->device, lbaf,
+            1 << idns->lbaf[lbaf].lbads, idns->lbaf[lbaf].ms, idns->lbaf[lbaf].rp);
+    if ((err = nvme_acmd_format_nvm(&dev->nvmedev, ns->id, lbaf, 0)) != 0) {
+        ERROR("%s format lbaf %d failed (%#x)", ns->device, lbaf, err);
+        goto done;
+    }
+    if ((err = unvme_identify(dev, ns->id, idns)) != 0) {
+        ERROR("%s identify namespace failed", ns->device);
+        goto done;
+    }
+    unvme_ns_set_format(&ses->ns, idns);
+
+done:
+    pthread_mutex_unlock(&dev->adminlock);
+    unvme_unlockw(&dev->rlock);
+    free(idns);
+    return err;
+}
+
+/**
+ * Create a namespace and attach it to the controller.
+ * @param   ns          namespace handle
+ * @param   nlb         namespace size in number of logical blocks
+ * @param   lbaf        LBA format index (or UNVME_LBAF_BEST)
+ * @return  the created namespace id or -1 if error.
+ */
+int unvme_do_ns_create(const unvme_ns_t* ns, u64 nlb, int lbaf)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    nvme_identify_ctlr_t* idc = zalloc(sizeof(*idc));
+    nvme_identify_ns_t* idns = zalloc(sizeof(*idns));
+    vfio_dma_t* dma = NULL;
+    u32 nsid = 0;
+
+    pthread_mutex_lock(&dev->adminlock);
+    if (unvme_identify(dev, 0, idc)) {
+        ERROR("%s identify controller failed", ns->device);
+        goto error;
+    }
+    if (!(idc->oacs & NVME_OACS_NS_MGMT)) {
+        ERROR("%s namespace management not supported", ns->device);
+        goto error;
+    }
+
+    // the LBA formats are the capabilities common to all namespaces
+    if (unvme_identify(dev, NVME_NSID_ALL, idns)) {
+        ERROR("%s identify common namespace capabilities failed", ns->device);
+        goto error;
+    }
+    if (lbaf == UNVME_LBAF_BEST) lbaf = unvme_lbaf_best(idns, ns->pageshift);
+    if (lbaf < 0 || lbaf > idns->nlbaf || idns->lbaf[lbaf].lbads > ns->pageshift) {
+        ERROR("%s unsupported LBA format %d", ns->device, lbaf);
+        goto error;
+    }
+
+    dma = vfio_dma_alloc(&dev->vfiodev, 4096);
+    if (!dma) goto error;
+    nvme_identify_ns_t* nsdata = dma->buf;
+    memset(nsdata, 0, 4096);
+    nsdata->nsze = nlb;
+    nsdata->ncap = nlb;
+    nsdata->flbas = lbaf;
+    int err = nvme_acmd_ns_create(&dev->nvmedev, dma->addr, &nsid);
+    if (err) {
+        ERROR("%s create namespace nlb=%#lx lbaf=%d failed (%#x)",
+              ns->device, nlb, lbaf, err);
+        nsid = 0;
+        goto error;
+    }
+
+    nvme_ctlr_list_t* ctlrs = dma->buf;
+    memset(ctlrs, 0, 4096);
+    ctlrs->count = 1;
+    ctlrs->id[0] = idc->cntlid;
+    err = nvme_acmd_ns_attach(&dev->nvmedev, nsid, 0, dma->addr);
+    if (err) {
+        ERROR("%s attach namespace %d failed (%#x)", ns->device, nsid, err);
+        (void)nvme_acmd_ns_delete(&dev->nvmedev, nsid);
+        nsid = 0;
+        goto error;
+    }
+    INFO_FN("%s nsid=%d nlb=%#lx lbaf=%d", ns->device, nsid, nlb, lbaf);
+
+error:
+    pthread_mutex_unlock(&dev->adminlock);
+    if (dma) vfio_dma_free(dma);
+    free(idns);
+    free(idc);
+    return nsid ? nsid : -1;
+}
+
+/**
+ * Detach a namespace from the controller and delete it.
+ * @param   ns          namespace handle
+ * @param   nsid        namespace id to delete
+ * @return  0 if ok else error status.
+ */
+int unvme_do_ns_delete(const unvme_ns_t* ns, int nsid)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+
+    // refuse to delete a namespace that is currently opened
+    unvme_lockr(&unvme_lock);
+    unvme_session_t* ses = unvme_ses;
+    while (ses) {
+        if (ses->dev == dev && ses->ns.id == nsid) break;
+        ses = ses->next;
+        if (ses == unvme_ses) ses = NULL;
+    }
+    unvme_unlockr(&unvme_lock);
+    if (ses) {
+        ERROR("%s nsid %d is in use", ns->device, nsid);
+        return -1;
+    }
+
+    vfio_dma_t* dma = vfio_dma_alloc(&dev->vfiodev, 4096);
+    if (!dma) return -1;
+    nvme_ctlr_list_t* ctlrs = dma->buf;
+    nvme_identify_ctlr_t* idc = zalloc(sizeof(*idc));
+    pthread_mutex_lock(&dev->adminlock);
+    int err = unvme_identify(dev, 0, idc);
+    if (!err) {
+        memset(ctlrs, 0, 4096);
+        ctlrs->count = 1;
+        ctlrs->id[0] = idc->cntlid;
+        err = nvme_acmd_ns_attach(&dev->nvmedev, nsid, 1, dma->addr);
+        if (err) ERROR("%s detach namespace %d failed (%#x)", ns->device, nsid, err);
+    }
+    if (!err) {
+        err = nvme_acmd_ns_delete(&dev->nvmedev, nsid);
+        if (err) ERROR("%s delete namespace %d failed (%#x)", ns->device, nsid, err);
+    }
+    pthread_mutex_unlock(&dev->adminlock);
+    free(idc);
+    vfio_dma_free(dma);
+    return err;
+}
+
+/**
+ * Set the power state latency budget of a device.
+ * @param   ns          namespace handle
+ * @param   latency     latency budget in microseconds (0 to disable)
+ * @return  the selected idle power state or -1 if error.
+ */
+int unvme_do_set_power_latency(const unvme_ns_t* ns, u32 latency)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    pthread_mutex_lock(&dev->adminlock);
+    int idle = unvme_power_latency(dev, latency);
+    pthread_mutex_unlock(&dev->adminlock);
+    return idle;
+}
+
+/**
+ * Transition a device to its idle or operational power state.
+ * @param   ns          namespace handle
+ * @param   idle        1 for the idle state or 0 for power state 0
+ * @return  0 if ok else error status.
+ */
+int unvme_do_set_power_state(const unvme_ns_t* ns, int idle)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    pthread_mutex_lock(&dev->adminlock);
+    int err = unvme_power_state(dev, idle);
+    pthread_mutex_unlock(&dev->adminlock);
+    return err;
+}
+
+/**
+ * Tune the interrupt coalescing of a device opened with UNVME_OPEN_INTR.
+ * @param   ns          namespace handle
+ * @return  0 if ok (or not in interrupt mode) else error status.
+ */
+int unvme_do_tune_intr(const unvme_ns_t* ns)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (!dev->intr) return 0;
+    pthread_mutex_lock(&dev->adminlock);
+    int err = unvme_intr_tune(dev);
+    pthread_mutex_unlock(&dev->adminlock);
+    return err;
+}
+
+/**
+ * Reset the controller and recreate its queues.  All outstanding commands
+ * are failed with error -EIO.
+ * @param   ns          namespace handle
+ * @return  0 if ok else -1.
+ */
+int unvme_do_reset(const unvme_ns_t* ns)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    return unvme_recover(dev, dev->resetgen);
+}
+
+/**
+ * Set the max number of retries per command.
+ * @param   ns          namespace handle
+ * @param   maxretry    max retries (0 to disable retry)
+ * @return  previous max retries.
+ */
+int unvme_do_set_retry(const unvme_ns_t* ns, int maxretry)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    unvme_lockw(&dev->rlock);
+    int prev = dev->retrymax;
+    dev->retrymax = maxretry > 0 ? maxretry : 0;
+    unvme_unlockw(&dev->rlock);
+    return prev;
+}
+
+/**
+ * Get the command retry statistics of a device (summed over all queues).
+ * @param   ns          namespace handle
+ * @param   stats       statistics returned
+ * @return  0.
+ */
+int unvme_do_get_retry_stats(const unvme_ns_t* ns, unvme_retry_stats_t* stats)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    *stats = dev->adminq.retrystats;
+    int q;
+    for (q = 0; q < dev->ns.qcount; q++) {
+        const unvme_retry_stats_t* rs = &dev->ioqs[q].retrystats;
+        stats->retries += rs->retries;
+        stats->recovered += rs->recovered;
+        stats->exhausted += rs->exhausted;
+        stats->dnr += rs->dnr;
+    }
+    return 0;
+}
+
+/**
+ * Take over an I/O queue as a raw queue.  The queue must be idle and is
+ * then no longer available to the descriptor based I/O functions.
+ * On error, errno is set to the error code.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @return  raw queue or NULL if error.
+ */
+unvme_rawq_t* unvme_do_rawq_open(const unvme_ns_t* ns, int qid)
+{
+    DEBUG_FN("%s q%d", ns->device, qid);
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    if (qid < 0 || qid >= ns->qcount) {
+        ERROR("%s invalid q%d", ns->device, qid);
+        errno = EINVAL;
+        return NULL;
+    }
+    unvme_queue_t* q = dev->ioqs + qid;
+    unvme_lockr(&dev->rlock);
+    if (q->rawq || q->desccount || q->cidcount) {
+        unvme_unlockr(&dev->rlock);
+        ERROR("%s q%d is busy", ns->device, qid);
+        errno = EBUSY;
+        return NULL;
+    }
+    unvme_rawq_t* rq = zalloc(sizeof(*rq));
+    rq->nvmeq = q->nvmeq;
+    rq->ns = ns;
+    rq->qid = qid;
+    rq->size = q->size;
+    rq->pageshift = ns->pageshift;
+    rq->prplist = q->prplist->buf;
+    rq->prpaddr = q->prplist->addr;
+    rq->ctx = zalloc(q->size * sizeof(void*));
+    q->rawq = rq;
+    unvme_unlockr(&dev->rlock);
+    return rq;
+}
+
+/**
+ * Return a raw queue to the descriptor based I/O functions, recreating the
+ * queue if it was left failed by a controller reset.
+ * @param   rq          raw queue
+ * @return  0 if ok else -EBUSY if there are pending commands or -EIO if
+ *          the queue could not be recreated.
+ */
+int unvme_do_rawq_close(unvme_rawq_t* rq)
+{
+    DEBUG_FN("%s q%d", rq->ns->device, rq->qid);
+    unvme_device_t* dev = ((unvme_session_t*)rq->ns->ses)->dev;
+    unvme_rawq_check_reset(rq);
+    if (rq->pending) return -EBUSY;
+
+    // recreate the queue if it was left failed by a reset
+    unvme_queue_t* q = dev->ioqs + rq->qid;
+    unvme_lockw(&dev->rlock);
+    if (q->lost) {
+        pthread_mutex_lock(&dev->adminlock);
+        int err = nvme_ioq_recreate(q->nvmeq, q->sqdma->addr, q->cqdma->addr);
+        if (!err) {
+            q->lost = 0;
+            if (dev->intr && q->cd) unvme_intr_vector(dev, q->iv, 1);
+        }
+        pthread_mutex_unlock(&dev->adminlock);
+        if (err) {
+            unvme_unlockw(&dev->rlock);
+            ERROR("%s nvme_ioq_recreate %d failed", rq->ns->device, rq->qid+1);
+            return -EIO;
+        }
+    }
+    q->rawq = NULL;
+    unvme_unlockw(&dev->rlock);
+    free(rq->ctx);
+    free(rq);
+    return 0;
+}
+
+/**
+ * Get the DMA address of an I/O buffer range for a raw queue command.
+ * @param   rq          raw queue
+ * @param   buf         buffer (from unvme_alloc)
+ * @param   bufsz       buffer size
+ * @param   addr        returned DMA address
+ * @return  0 if ok else buffer address error (see unvme_map_dma).
+ */
+int unvme_do_rawq_map(unvme_rawq_t* rq, void* buf, u64 bufsz, u64* addr)
+{
+    return unvme_map_dma(rq->ns, buf, bufsz, addr);
+}
@@ -44,6 +44,7 @@
 #include "unvme_nvme.h"
 #include "unvme_lock.h"
 #include "unvme.h"
+#include "unvme_rawq.h"
 
 /// Doubly linked list add node
 #define LIST_ADD(head, node)                                    \
@@ -93,13 +94,25 @@ typedef struct _unvme_desc {
     struct _unvme_queue*    q;          ///< queue context owner
     struct _unvme_desc*     prev;       ///< previous descriptor node
     struct _unvme_desc*     next;       ///< next descriptor node
+    struct _unvme_desc*     doneprev;   ///< previous completed descriptor
+    struct _unvme_desc*     donenext;   ///< next completed descriptor
+    int                     done;       ///< on the completed list
+    u32                     cs;         ///< command specific result (admin)
     int                     error;      ///< error status
     int                     cidcount;   ///< number of pending cids
     u64                     cidmask[];  ///< cid pending bit mask
 } unvme_desc_t;
 
+/// Submitted command record (for retry)
+typedef struct _unvme_cmdrec {
+    nvme_sq_entry_t         sqe;        ///< submitted command
+    u64                     retrytsc;   ///< resubmission time (0 if none)
+    int                     retries;    ///< number of retries
+} unvme_cmdrec_t;
+
 /// IO queue entry
 typedef struct _unvme_queue {
+    struct _unvme_device*   dev;        ///< device owner
     nvme_queue_t*           nvmeq;      ///< NVMe associated queue
     vfio_dma_t*             sqdma;      ///< submission queue mem
     vfio_dma_t*             cqdma;      ///< completion queue mem
@@ -113,6 +126,18 @@ typedef struct _unvme_queue {
     unvme_desc_t*           desclist;   ///< used descriptor list
     unvme_desc_t*           descfree;   ///< free descriptor list
     unvme_desc_t*           descpend;   ///< pending descriptor list
+    unvme_desc_t*           donehead;   ///< completed descriptor list (to reap)
+    unvme_desc_t*           donetail;   ///< last completed descriptor
+    int                     efd;        ///< interrupt eventfd (-1 if polled)
+    int                     iv;         ///< interrupt vector
+    int                     cd;         ///< interrupt coalescing disabled
+    u32                     ncomp;      ///< number of completions
+    u32                     ncomplast;  ///< completions at last tuning
+    unvme_cmdrec_t*         cmdrec;     ///< command record per cid
+    int                     retrycount; ///< number of cids pending resubmission
+    unvme_retry_stats_t     retrystats; ///< retry statistics
+    unvme_rawq_t*           rawq;       ///< raw queue (NULL if not raw)
+    int                     lost;       ///< not recreated after a reset (raw)
 } unvme_queue_t;
 
 /// Device context
@@ -124,23 +149,74 @@ typedef struct _unvme_device {
     unvme_iomem_t           iomem;      ///< IO memory tracker
     unvme_ns_t              ns;         ///< controller namespace (id=0)
     unvme_queue_t*          ioqs;       ///< pointer to IO queues
+    vfio_dma_t*             hmb;        ///< host memory buffer
+    vfio_dma_t*             hmbdesc;    ///< host memory buffer descriptor list
+    vfio_dma_t*             dbbuf;      ///< shadow doorbell buffer
+    vfio_dma_t*             eibuf;      ///< event index buffer
+    u32                     pslatency;  ///< power state latency budget (us)
+    int                     psidle;     ///< host managed idle power state
+    int                     pscur;      ///< host managed current power state
+    int                     apst;       ///< autonomous power transition enabled
+    pthread_mutex_t         adminlock;  ///< admin command lock
+    int                     intr;       ///< interrupt completion mode
+    int                     nvec;       ///< number of MSI-X vectors used
+    int*                    efds;       ///< eventfd per MSI-X vector
+    u64                     tunetsc;    ///< last interrupt tuning time
+    int                     intrthr;    ///< interrupt aggregation threshold
+    int                     intrtime;   ///< interrupt aggregation time
+    unvme_lock_t            rlock;      ///< reset lock (read held by I/O paths)
+    u32                     resetgen;   ///< controller reset generation
+    int                     retrymax;   ///< max retries per command
+    int                     acre;       ///< advanced command retry enabled
+    u64                     crdtsc[3];  ///< command retry delay times (in tsc)
+    int                     rt;         ///< real-time mode
 } unvme_device_t;
 
+/// PCI device open lock entry
+typedef struct _unvme_pcidev {
+    struct _unvme_pcidev*   next;       ///< next entry
+    int                     pci;        ///< PCI device id
+    pthread_mutex_t         lock;       ///< device open and close lock
+    unvme_device_t*         dev;        ///< device context (NULL if closed)
+} unvme_pcidev_t;
+
+/// Read/write submit path (specialized by page and block size)
+typedef int (*unvme_rw_submit_t)(const unvme_ns_t* ns, unvme_desc_t* desc,
+                                 u64 addr, u64 slba, u32 nlb);
+
 /// Session context
 typedef struct _unvme_session {
     struct _unvme_session*  prev;       ///< previous session node
     struct _unvme_session*  next;       ///< next session node
     unvme_device_t*         dev;        ///< device context
     unvme_ns_t              ns;         ///< namespace
+    unvme_rw_submit_t       rw_submit;  ///< read/write submit path
 } unvme_session_t;
 
-unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize);
+unvme_ns_t* unvme_do_open(int pci, int nsid, int qcount, int qsize, int flags);
 int unvme_do_close(const unvme_ns_t* ns);
 void* unvme_do_alloc(const unvme_ns_t* ns, u64 size);
+void* unvme_do_map(const unvme_ns_t* ns, void* buf, u64 size, u64 addr);
+void* unvme_do_dmabuf(const unvme_ns_t* ns, int* fd, u64 size);
+int unvme_do_sync_dmabuf(const unvme_ns_t* ns, void* buf, int flags);
 int unvme_do_free(const unvme_ns_t* ses, void* buf);
 int unvme_do_poll(unvme_desc_t* desc, int sec, u32* cqe_cs);
+int unvme_do_reap(const unvme_ns_t* ns, int qid, unvme_comp_t* comps, int max);
 unvme_desc_t* unvme_do_cmd(const unvme_ns_t* ns, int qid, int opc, int nsid, void* buf, u64 bufsz, u32 cdw10_15[6]);
 unvme_desc_t* unvme_do_rw(const unvme_ns_t* ns, int qid, int opc, void* buf, u64 slba, u32 nlb);
+int unvme_do_get_lbaf(const unvme_ns_t* ns, unvme_lbaf_t lbaf[16]);
+int unvme_do_format(const unvme_ns_t* ns, int lbaf);
+int unvme_do_ns_create(const unvme_ns_t* ns, u64 nlb, int lbaf);
+int unvme_do_ns_delete(const unvme_ns_t* ns, int nsid);
+int unvme_do_set_power_latency(const unvme_ns_t* ns, u32 latency);
+int unvme_do_set_power_state(const unvme_ns_t* ns, int idle);
+int unvme_do_tune_intr(const unvme_ns_t* ns);
+int unvme_do_reset(const unvme_ns_t* ns);
+int unvme_do_set_retry(const unvme_ns_t* ns, int maxretry);
+int unvme_do_get_retry_stats(const unvme_ns_t* ns, unvme_retry_stats_t* stats);
+unvme_rawq_t* unvme_do_rawq_open(const unvme_ns_t* ns, int qid);
+int unvme_do_rawq_close(unvme_rawq_t* rq);
+int unvme_do_rawq_map(unvme_rawq_t* rq, void* buf, u64 bufsz, u64* addr);
 
 #endif  // _UNVME_CORE_H
 
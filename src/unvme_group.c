@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe device group functions.
+ *
+ * A device group opens several controllers concurrently (each on its own
+ * thread, since device initialization is mostly waiting on the controller)
+ * and reaps the completions of the same queue index of all the devices in
+ * one poll, so a single thread can drive multiple devices.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "unvme_core.h"
+
+/// Device open thread argument
+typedef struct _unvme_group_arg {
+    pthread_t           thread;     ///< open thread
+    int                 started;    ///< thread started flag
+    const char*         pciname;    ///< device name
+    int                 qcount;     ///< number of queues
+    int                 qsize;      ///< queue size
+    int                 flags;      ///< open flags
+    const unvme_ns_t*   ns;         ///< opened namespace
+} unvme_group_arg_t;
+
+/**
+ * Device open thread.
+ * @param   arg         device open argument
+ */
+static void* unvme_group_opener(void* arg)
+{
+    unvme_group_arg_t* ga = arg;
+    ga->ns = unvme_openf(ga->pciname, ga->qcount, ga->qsize, ga->flags);
+    return NULL;
+}
+
+/**
+ * Open a group of devices concurrently.
+ * @param   pcinames    PCI device names (as %x:%x.%x[/NSID] format)
+ * @param   count       number of devices
+ * @param   qcount      number of io queues (per device)
+ * @param   qsize       io queue size
+ * @param   flags       open flags (UNVME_OPEN_*)
+ * @return  device group or NULL if any device failed to open.
+ */
+unvme_group_t* unvme_group_open(const char* pcinames[], int count, int qcount, int qsize, int flags)
+{
+    if (count <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    unvme_group_arg_t* ga = zalloc(count * sizeof(*ga));
+    int i, err = 0;
+    for (i = 0; i < count; i++) {
+        ga[i].pciname = pcinames[i];
+        ga[i].qcount = qcount;
+        ga[i].qsize = qsize;
+        ga[i].flags = flags;
+        ga[i].started = !pthread_create(&ga[i].thread, NULL, unvme_group_opener, ga + i);
+        if (!ga[i].started) unvme_group_opener(ga + i);
+    }
+    for (i = 0; i < count; i++) {
+        if (ga[i].started) pthread_join(ga[i].thread, NULL);
+        if (!ga[i].ns) err = ENODEV;
+    }
+
+    unvme_group_t* grp = NULL;
+    if (err) {
+        for (i = 0; i < count; i++) if (ga[i].ns) unvme_close(ga[i].ns);
+        errno = err;
+    } else {
+        grp = zalloc(sizeof(*grp));
+        grp->count = count;
+        grp->ns = zalloc(count * sizeof(unvme_ns_t*));
+        for (i = 0; i < count; i++) {
+            grp->ns[i] = ga[i].ns;
+            if (grp->qcount < ga[i].ns->qcount) grp->qcount = ga[i].ns->qcount;
+        }
+        // the rotation is per queue index since each may be polled by
+        // a different thread
+        grp->next = zalloc(grp->qcount * sizeof(int));
+    }
+    free(ga);
+    return grp;
+}
+
+/**
+ * Close a device group.
+ * @param   grp         device group
+ * @return  0 if ok else -1.
+ */
+int unvme_group_close(unvme_group_t* grp)
+{
+    int i, err = 0;
+    for (i = 0; i < grp->count; i++) {
+        if (unvme_close(grp->ns[i])) err = -1;
+    }
+    free(grp->next);
+    free(grp->ns);
+    free(grp);
+    return err;
+}
+
+/**
+ * Reap the completions of a queue index across all the devices of a group.
+ * Each sweep visits the devices in turn starting from a device rotating
+ * per queue index (so different threads may poll different indexes), and
+ * gives each an equal share of the remaining completion slots, which
+ * it fills from its completion queue in one batch.
+ * @param   grp         device group
+ * @param   qid         client queue index (of each device)
+ * @param   comps       returned completions
+ * @param   max         max number of completions to return
+ * @param   timeout     seconds to wait for a first completion (0 for none)
+ * @return  number of completions or negative error code.
+ */
+int unvme_group_poll(unvme_group_t* grp, int qid, unvme_comp_t* comps, int max, int timeout)
+{
+    if (qid < 0 || qid >= grp->qcount) return -EINVAL;
+    int* next = grp->next + qid;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout;
+
+    for (;;) {
+        int n = 0, i;
+        int d = *next;
+        for (i = grp->count; i > 0 && n < max; i--) {
+            int share = (max - n + i - 1) / i;
+            int err = unvme_do_reap(grp->ns[d], qid, comps + n, share);
+            if (err < 0) return err;
+            n += err;
+            if (++d == grp->count) d = 0;
+        }
+        if (++*next == grp->count) *next = 0;
+        if (n || !timeout) return n;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > end.tv_sec ||
+            (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec)) return 0;
+        unvme_yield(((unvme_session_t*)grp->ns[0]->ses)->dev->rt);
+    }
+}
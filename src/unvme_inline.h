@@ -0,0 +1,344 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNVMe inline I/O paths.
+ *
+ * This internal header holds the queue and descriptor operations of the
+ * I/O paths as always inline functions, shared by the library submission
+ * and completion paths (unvme_core.c) and the public read/write and poll
+ * entry points (unvme.c), so there is one implementation of each.
+ *
+ * The entry points take a fast path for an I/O that fits a single NVMe
+ * command on a queue in steady state (its buffer mapped, a free command
+ * slot and a recycled descriptor, and no command resubmission pending),
+ * and for a ready, successful completion of the polled descriptor.  Such
+ * an I/O is submitted and reaped without any further call, and everything
+ * else (including all error reporting) is left to unvme_do_rw and
+ * unvme_do_poll.  An application building the library statically with
+ * link time optimization (make -C src lto) may also inline the entry points.
+ */
+
+#ifndef _UNVME_INLINE_H
+#define _UNVME_INLINE_H
+
+#include <string.h>
+#include <errno.h>
+
+#include "unvme_core.h"
+
+
+/**
+ * Compose the PRP entries of a DMA address range (using the PRP list page
+ * of the cid as necessary).
+ * @param   q           queue
+ * @param   cid         queue entry index
+ * @param   addr        DMA address
+ * @param   bufsz       buffer size
+ * @param   pageshift   memory page size shift
+ * @param   prp1        returned prp1 value
+ * @param   prp2        returned prp2 value
+ */
+static inline __attribute__((always_inline))
+void unvme_prps(unvme_queue_t* q, int cid, u64 addr, u64 bufsz,
+                int pageshift, u64* prp1, u64* prp2)
+{
+    u64 prpoff = (u64)cid << pageshift;
+    unvme_prp_build((u64*)((u8*)q->prplist->buf + prpoff),
+                    q->prplist->addr + prpoff, addr, bufsz, pageshift, prp1, prp2);
+}
+
+/**
+ * Record a submitted command for possible resubmission.
+ * @param   q           queue
+ * @param   cid         command id
+ */
+static inline __attribute__((always_inline))
+void unvme_cmd_save(unvme_queue_t* q, int cid)
+{
+    nvme_queue_t* nvmeq = q->nvmeq;
+    int tail = nvmeq->sq_tail ? nvmeq->sq_tail - 1 : nvmeq->size - 1;
+    unvme_cmdrec_t* rec = q->cmdrec + cid;
+    memcpy(&rec->sqe, &nvmeq->sq[tail], sizeof(rec->sqe));
+    rec->retrytsc = 0;
+    rec->retries = 0;
+}
+
+/**
+ * Find the DMA allocation of a device containing a user buffer address.
+ * @param   dev         device context
+ * @param   buf         user buffer
+ * @return  the DMA allocation or NULL if not found.
+ */
+static inline __attribute__((always_inline))
+vfio_dma_t* unvme_iomem_find(unvme_device_t* dev, void* buf)
+{
+    vfio_dma_t* dma = NULL;
+    unvme_lockr(&dev->iomem.lock);
+    int i;
+    for (i = 0; i < dev->iomem.count; i++) {
+        if (dev->iomem.map[i]->buf <= buf &&
+            buf < (dev->iomem.map[i]->buf + dev->iomem.map[i]->size)) {
+            dma = dev->iomem.map[i];
+            break;
+        }
+    }
+    unvme_unlockr(&dev->iomem.lock);
+    return dma;
+}
+
+/**
+ * Add a descriptor to the use list.
+ * @param   q           queue
+ * @param   desc        descriptor
+ */
+static inline __attribute__((always_inline))
+void unvme_desc_use(unvme_queue_t* q, unvme_desc_t* desc)
+{
+    LIST_ADD(q->desclist, desc);
+    if (desc == desc->next) q->descpend = desc; // head of pending list
+    q->desccount++;
+}
+
+/**
+ * Recycle the first descriptor of the free list into the use list.
+ * @param   q           queue (with a free descriptor)
+ * @return  the descriptor.
+ */
+static inline __attribute__((always_inline))
+unvme_desc_t* unvme_desc_reuse(unvme_queue_t* q)
+{
+    unvme_desc_t* desc = q->descfree;
+    LIST_DEL(q->descfree, desc);
+
+    desc->error = 0;
+    desc->cidcount = 0;
+    int i = q->masksize >> 3;
+    while (i--) desc->cidmask[i] = 0;
+    unvme_desc_use(q, desc);
+    return desc;
+}
+
+/**
+ * Remove a descriptor from the completed list.
+ * @param   desc        descriptor
+ */
+static inline void unvme_desc_undone(unvme_desc_t* desc)
+{
+    unvme_queue_t* q = desc->q;
+    if (desc->doneprev) desc->doneprev->donenext = desc->donenext;
+    else q->donehead = desc->donenext;
+    if (desc->donenext) desc->donenext->doneprev = desc->doneprev;
+    else q->donetail = desc->doneprev;
+    desc->done = 0;
+}
+
+/**
+ * Put a descriptor entry back to the free list.
+ * @param   desc        descriptor
+ */
+static inline __attribute__((always_inline))
+void unvme_desc_put(unvme_desc_t* desc)
+{
+    unvme_queue_t* q = desc->q;
+    if (desc->done) unvme_desc_undone(desc);
+
+    // check to change the pending head or clear the list
+    if (desc == q->descpend) {
+        if (desc != desc->next) q->descpend = desc->next;
+        else q->descpend = NULL;
+    }
+
+    LIST_DEL(q->desclist, desc);
+    LIST_ADD(q->descfree, desc);
+    q->desccount--;
+}
+
+/**
+ * Take the next free cid of a queue (which must not be full) for a
+ * descriptor.
+ * @param   desc        descriptor
+ * @return  the cid.
+ */
+static inline __attribute__((always_inline))
+int unvme_cid_take(unvme_desc_t* desc)
+{
+    unvme_queue_t* q = desc->q;
+    int qsize = q->size;
+
+    // get a free cid
+    int cid = q->cid;
+    while (q->cidmask[cid >> 6] & ((u64)1 << (cid & 63))) {
+        if (++cid >= qsize) cid = 0;
+    }
+
+    // a descriptor completed while submitting its commands is pending again
+    if (desc->done) unvme_desc_undone(desc);
+
+    // set cid bit used
+    int b = cid >> 6;
+    u64 mask = (u64)1 << (cid & 63);
+    desc->cidmask[b] |= mask;
+    desc->cidcount++;
+    q->cidmask[b] |= mask;
+    q->cidcount++;
+    q->cid = (cid + 1) < qsize ? cid + 1 : 0;
+    return cid;
+}
+
+/**
+ * Clear the cid of a completed command and advance the pending list head
+ * past the descriptors with no more pending cids.
+ * @param   desc        descriptor
+ * @param   cid         completed cid
+ */
+static inline __attribute__((always_inline))
+void unvme_cid_complete(unvme_desc_t* desc, int cid)
+{
+    unvme_queue_t* q = desc->q;
+    int b = cid >> 6;
+    u64 mask = (u64)1 << (cid & 63);
+    desc->cidmask[b] &= ~mask;
+    desc->cidcount--;
+    q->cidmask[b] &= ~mask;
+    q->cidcount--;
+    q->cid = cid;
+    if (q->cidcount) {
+        while (q->descpend->cidcount == 0) q->descpend = q->descpend->next;
+    }
+}
+
+/**
+ * Submit a read/write in the fast path, or else by unvme_do_rw.
+ * @param   ns          namespace handle
+ * @param   qid         client queue index
+ * @param   opc         op code
+ * @param   buf         data buffer (from unvme_alloc)
+ * @param   slba        starting logical block
+ * @param   nlb         number of logical blocks
+ * @return  I/O descriptor or NULL if failed (with errno set).
+ */
+static inline __attribute__((always_inline))
+unvme_desc_t* unvme_fast_rw(const unvme_ns_t* ns, int qid,
+                            int opc, void* buf, u64 slba, u32 nlb)
+{
+    unvme_device_t* dev = ((unvme_session_t*)ns->ses)->dev;
+    u64 bufsz = (u64)nlb << ns->blockshift;
+    if ((u32)qid >= ns->qcount || (nlb - 1) >= ns->maxbpio ||
+        (slba + nlb) > ns->blockcount)
+        goto slow;
+    vfio_dma_t* dma = unvme_iomem_find(dev, buf);
+    if (!dma || (u64)(buf - dma->buf) + bufsz > dma->size) goto slow;
+    u64 addr = dma->addr + (u64)(buf - dma->buf);
+
+    // the slow path also leaves the host managed idle power state
+    if (__atomic_load_n(&dev->pscur, __ATOMIC_RELAXED)) goto slow;
+
+    unvme_queue_t* q = dev->ioqs + qid;
+    unvme_lockr(&dev->rlock);
+    if (!q->descfree || q->rawq || q->retrycount || (q->cidcount + 1) >= q->size) {
+        unvme_unlockr(&dev->rlock);
+        goto slow;
+    }
+    unvme_desc_t* desc = unvme_desc_reuse(q);
+    desc->buf = buf;
+    desc->slba = slba;
+    desc->nlb = nlb;
+    desc->qid = qid;
+    desc->opc = opc;
+    desc->sentinel = desc;
+
+    int cid = unvme_cid_take(desc);
+    u64 prp1, prp2;
+    unvme_prps(q, cid, addr, bufsz, ns->pageshift, &prp1, &prp2);
+    (void)nvme_cmd_rw_post(q->nvmeq, opc, cid, ns->id, slba, nlb, prp1, prp2);
+    unvme_cmd_save(q, cid);
+    nvme_sq_ring(q->nvmeq);
+    unvme_unlockr(&dev->rlock);
+    return desc;
+
+slow:
+    return unvme_do_rw(ns, qid, opc, buf, slba, nlb);
+}
+
+/**
+ * Poll for completion of an I/O in the fast path, or else by unvme_do_poll.
+ * Ready successful completions of the descriptor are reaped here, and the
+ * rest (waiting, errors, other descriptors' completions, admin commands)
+ * by unvme_do_poll.
+ * @param   desc        I/O descriptor
+ * @param   timeout     in seconds
+ * @param   cqe_cs      CQE command specific DW0 returned
+ * @return  0 if ok else error status (-ETIMEDOUT if not yet completed).
+ */
+static inline __attribute__((always_inline))
+int unvme_fast_poll(unvme_desc_t* desc, int timeout, u32* cqe_cs)
+{
+    if (!desc || desc->sentinel != desc) goto slow;
+    unvme_queue_t* q = desc->q;
+    unvme_device_t* dev = q->dev;
+    if (q == &dev->adminq) goto slow;
+
+    nvme_queue_t* nvmeq = q->nvmeq;
+    unvme_lockr(&dev->rlock);
+    while (desc->cidcount && !q->retrycount) {
+        nvme_cq_entry_t* cqe = nvme_cq_peek(nvmeq);
+        if (!cqe) {
+            // not completed and not to wait
+            if (timeout == 0) {
+                unvme_unlockr(&dev->rlock);
+                return -ETIMEDOUT;
+            }
+            break;
+        }
+        int cid = cqe->cid;
+        if ((cqe->psf & 0xfffe) || !(desc->cidmask[cid >> 6] & ((u64)1 << (cid & 63))))
+            break;
+        if (cqe_cs) *cqe_cs = cqe->cs;
+        nvme_cq_pop(nvmeq);
+        q->ncomp++;
+        if (dev->retrymax && q->cmdrec[cid].retries) q->retrystats.recovered++;
+        unvme_cid_complete(desc, cid);
+    }
+    if (desc->cidcount == 0) {
+        int err = desc->error;
+        unvme_desc_put(desc);
+        unvme_unlockr(&dev->rlock);
+        return err;
+    }
+    unvme_unlockr(&dev->rlock);
+
+slow:
+    return unvme_do_poll(desc, timeout, cqe_cs);
+}
+
+#endif  // _UNVME_INLINE_H
@@ -0,0 +1,1315 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe key-value store implementation.
+ *
+ * Store layout (in blocks):  the superblock at slba, followed by the log
+ * segments.  A segment starts with a header holding its sequence number,
+ * followed by the records appended to it (8-byte aligned).  Each record
+ * carries the low 32 bits of the segment sequence number and a checksum,
+ * so the end of the records in a segment is found on replay.  The log is
+ * circular, with segments opened in order and cleaned from the oldest.
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "unvme_core.h"
+#include "unvme_kv.h"
+
+/// Store superblock magic ("UNVMEKV")
+#define KV_MAGIC            0x564b454d564e55UL
+/// Store layout version
+#define KV_VERSION          1
+/// Default segment size in bytes
+#define KV_SEGSIZE          (8 << 20)
+/// Default max number of keys
+#define KV_MAXKEYS          (1 << 20)
+/// Default max value length
+#define KV_MAXVLEN          (64 << 10)
+/// Min number of segments
+#define KV_MINSEGS          8
+/// Segment header size (offset of the first record)
+#define KV_SEGHDR           64
+/// Number of free segments reserved for cleaning
+#define KV_GCRESERVE        1
+/// Max number of log writes in flight
+#define KV_MAXWRITES        16
+/// Max number of reads submitted together by a multiple get
+#define KV_MGETMAX          32
+/// Max number of fingerprint matches per lookup
+#define KV_MAXCAND          4
+/// Max number of lookup retries (when records are moved)
+#define KV_RETRIES          8
+/// Number of slots per index bucket
+#define KV_BUCKETSLOTS      4
+
+/// Record flags
+enum {
+    KV_DELETE           = 0x1,      ///< delete record (of key only)
+};
+
+/// Store superblock
+typedef struct _kv_sb {
+    u64                 magic;      ///< KV_MAGIC
+    u32                 version;    ///< KV_VERSION
+    u32                 blocksize;  ///< block size
+    u32                 segnlb;     ///< segment size in blocks
+    u32                 segcount;   ///< number of segments
+} kv_sb_t;
+
+/// Segment header
+typedef struct _kv_seghdr {
+    u64                 magic;      ///< KV_MAGIC
+    u64                 seq;        ///< segment sequence number
+} kv_seghdr_t;
+
+/// Record header (followed by the key and value)
+typedef struct _kv_rec {
+    u32                 sum;        ///< checksum of the rest of the record
+    u32                 seq;        ///< segment sequence number (low 32 bits)
+    u32                 vlen;       ///< value length
+    u16                 klen;       ///< key length
+    u16                 flags;      ///< record flags
+} kv_rec_t;
+
+/// Index slot
+typedef struct _kv_slot {
+    u64                 loc;        ///< record location (log byte offset)
+    u32                 len;        ///< record length
+    u32                 fp;         ///< key fingerprint (0 if free)
+} kv_slot_t;
+
+/// Index bucket (a cache line)
+typedef struct _kv_bucket {
+    kv_slot_t           slot[KV_BUCKETSLOTS]; ///< slots
+} kv_bucket_t;
+
+/// Key-value store context
+struct _unvme_kv {
+    const unvme_ns_t*   ns;         ///< namespace
+    u64                 slba;       ///< starting lba
+    kv_sb_t             sb;         ///< superblock
+    u64                 segsize;    ///< segment size in bytes
+    int                 qid;        ///< log write queue
+    int                 gcqid;      ///< log cleaning queue
+    u32                 maxvlen;    ///< max value length
+    u32                 slotsize;   ///< read buffer size per record
+    kv_bucket_t*        buckets;    ///< index buckets
+    u8*                 overflow;   ///< bucket overflowed flags
+    u64                 bmask;      ///< bucket index mask
+    u64                 keys;       ///< number of keys
+    u64                 maxkeys;    ///< max number of keys
+    unvme_lock_t        ilock;      ///< index lock (write held by updates)
+    u64*                segseq;     ///< sequence number per segment (0 if free)
+    u64*                live;       ///< live record bytes per segment
+    u64                 livebytes;  ///< total live record bytes
+    u64                 maxlive;    ///< max live record bytes
+    int                 head;       ///< open segment (-1 if none)
+    int                 headrsv;    ///< open segment reserved for cleaning
+    u32                 last;       ///< last opened segment
+    u32                 tail;       ///< oldest segment
+    u32                 segfree;    ///< number of free segments
+    u32                 gcthresh;   ///< free segment count to start cleaning
+    u64                 nextseq;    ///< next segment sequence number
+    u64                 logwaits;   ///< number of waits for log space
+    void*               segbuf;     ///< open segment buffer
+    u64                 segoff;     ///< open segment append offset
+    u64                 flushoff;   ///< open segment write offset
+    unvme_iod_t         wiods[KV_MAXWRITES]; ///< log writes in flight
+    int                 wcount;     ///< number of log writes in flight
+    void*               wbuf;       ///< record read buffer (log lock held)
+    void*               gcbuf;      ///< cleaning segment buffer
+    void*               zblock;     ///< zero block
+    u32*                dsmrange;   ///< dataset management range
+    void**              rbufs;      ///< get read buffers per queue
+    pthread_mutex_t     loglock;    ///< log lock
+    pthread_cond_t      logcond;    ///< log space available signal
+    pthread_cond_t      gccond;     ///< cleaning needed signal
+    pthread_t           gcthread;   ///< cleaning thread
+    int                 gcstart;    ///< cleaning thread started flag
+    int                 gcstop;     ///< cleaning thread stop flag
+    u64                 puts;       ///< number of puts
+    u64                 deletes;    ///< number of deletes
+    u64                 gets;       ///< number of gets
+    u64                 writes;     ///< number of log writes
+    u64                 gcsegs;     ///< number of segments cleaned
+    u64                 gcbytes;    ///< bytes of live records moved
+};
+
+
+/**
+ * Hash a byte string (FNV-1a with a final mix).
+ * @param   data        data
+ * @param   len         data length
+ * @param   basis       hash offset basis
+ * @return  64-bit hash.
+ */
+static u64 kv_hash_basis(const void* data, u32 len, u64 basis)
+{
+    const u8* p = data;
+    u64 h = basis;
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3UL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Hash a key.
+ * @param   key         key
+ * @param   klen        key length
+ * @return  64-bit hash.
+ */
+static inline u64 kv_hash(const void* key, u32 klen)
+{
+    return kv_hash_basis(key, klen, 0xcbf29ce484222325UL);
+}
+
+/**
+ * Get the fingerprint of a key hash (the bucket is selected by the low bits).
+ * @param   h           key hash
+ * @return  non-zero fingerprint.
+ */
+static inline u32 kv_fp(u64 h)
+{
+    u32 fp = h >> 32;
+    return fp ? fp : 1;
+}
+
+/**
+ * Get the aligned length of a record.
+ * @param   len         record length
+ * @return  aligned length.
+ */
+static inline u32 kv_alen(u32 len)
+{
+    return (len + 7) & ~7;
+}
+
+/**
+ * Get the segment of a record location.
+ * @param   kv          store
+ * @param   loc         record location
+ * @return  segment.
+ */
+static inline u32 kv_seg(unvme_kv_t* kv, u64 loc)
+{
+    return loc / kv->segsize;
+}
+
+/**
+ * Get the starting lba of a segment.
+ * @param   kv          store
+ * @param   seg         segment
+ * @return  lba.
+ */
+static inline u64 kv_seglba(unvme_kv_t* kv, u32 seg)
+{
+    return kv->slba + 1 + (u64)seg * kv->sb.segnlb;
+}
+
+/**
+ * Get the checksum of a record.
+ * @param   rec         record
+ * @param   len         record length
+ * @return  checksum.
+ */
+static inline u32 kv_sum(const kv_rec_t* rec, u32 len)
+{
+    return kv_hash(&rec->seq, len - sizeof(rec->sum));
+}
+
+/**
+ * Read or write a range of blocks synchronously (split by max I/O size).
+ * @param   ns          namespace
+ * @param   qid         queue
+ * @param   opc         NVME_CMD_READ or NVME_CMD_WRITE
+ * @param   buf         I/O buffer
+ * @param   slba        starting lba
+ * @param   nlb         number of blocks
+ * @return  0 if ok else error status.
+ */
+static int kv_io(const unvme_ns_t* ns, int qid, int opc, void* buf, u64 slba, u64 nlb)
+{
+    while (nlb) {
+        u32 n = nlb < ns->maxbpio ? nlb : ns->maxbpio;
+        int err = (opc == NVME_CMD_READ) ? unvme_read(ns, qid, buf, slba, n)
+                                         : unvme_write(ns, qid, buf, slba, n);
+        if (err) {
+            ERROR("%s %s lba %#lx nlb %#x, %s", ns->device,
+                  opc == NVME_CMD_READ ? "read" : "write", slba, n, unvme_strerror(err));
+            return err;
+        }
+        buf += (u64)n << ns->blockshift;
+        slba += n;
+        nlb -= n;
+    }
+    return 0;
+}
+
+/**
+ * Look up the index slots matching a key fingerprint.
+ * @param   kv          store
+ * @param   h           key hash
+ * @param   cand        returned candidate slots
+ * @return  number of candidates.
+ */
+static int kv_index_lookup(unvme_kv_t* kv, u64 h, kv_slot_t cand[KV_MAXCAND])
+{
+    u32 fp = kv_fp(h);
+    u64 b = h & kv->bmask;
+    u64 i;
+    int s, n = 0;
+    for (i = 0; i <= kv->bmask; i++) {
+        kv_bucket_t* bk = kv->buckets + b;
+        for (s = 0; s < KV_BUCKETSLOTS; s++) {
+            if (bk->slot[s].fp == fp && n < KV_MAXCAND) cand[n++] = bk->slot[s];
+        }
+        if (!kv->overflow[b]) break;
+        b = (b + 1) & kv->bmask;
+    }
+    return n;
+}
+
+/**
+ * Find the index slot of a record.
+ * @param   kv          store
+ * @param   h           key hash
+ * @param   loc         record location
+ * @return  slot or NULL if not found.
+ */
+static kv_slot_t* kv_index_find(unvme_kv_t* kv, u64 h, u64 loc)
+{
+    u32 fp = kv_fp(h);
+    u64 b = h & kv->bmask;
+    u64 i;
+    int s;
+    for (i = 0; i <= kv->bmask; i++) {
+        kv_bucket_t* bk = kv->buckets + b;
+        for (s = 0; s < KV_BUCKETSLOTS; s++) {
+            if (bk->slot[s].fp == fp && bk->slot[s].loc == loc) return &bk->slot[s];
+        }
+        if (!kv->overflow[b]) break;
+        b = (b + 1) & kv->bmask;
+    }
+    return NULL;
+}
+
+/**
+ * Insert an index slot for a key (marking the full buckets passed over).
+ * @param   kv          store
+ * @param   h           key hash
+ * @return  slot or NULL if the index is full.
+ */
+static kv_slot_t* kv_index_insert(unvme_kv_t* kv, u64 h)
+{
+    u64 b = h & kv->bmask;
+    u64 i;
+    int s;
+    for (i = 0; i <= kv->bmask; i++) {
+        kv_bucket_t* bk = kv->buckets + b;
+        for (s = 0; s < KV_BUCKETSLOTS; s++) {
+            if (!bk->slot[s].fp) {
+                bk->slot[s].fp = kv_fp(h);
+                return &bk->slot[s];
+            }
+        }
+        kv->overflow[b] = 1;
+        b = (b + 1) & kv->bmask;
+    }
+    return NULL;
+}
+
+/**
+ * Check a record read for a key.
+ * @param   kv          store
+ * @param   rec         record
+ * @param   loc         record location
+ * @param   len         record length
+ * @param   key         key
+ * @param   klen        key length
+ * @return  1 if it is a valid record of the key else 0.
+ */
+static int kv_rec_check(unvme_kv_t* kv, const kv_rec_t* rec, u64 loc, u32 len,
+                        const void* key, u32 klen)
+{
+    u32 seq = __atomic_load_n(&kv->segseq[kv_seg(kv, loc)], __ATOMIC_ACQUIRE);
+    return rec->seq == seq && rec->klen == klen &&
+           len == sizeof(kv_rec_t) + klen + rec->vlen &&
+           !(rec->flags & KV_DELETE) && !memcmp(rec + 1, key, klen) &&
+           rec->sum == kv_sum(rec, len);
+}
+
+/**
+ * Get the next record of a segment buffer.
+ * @param   kv          store
+ * @param   segbuf      segment buffer
+ * @param   seq         segment sequence number
+ * @param   off         record offset (updated to the next record)
+ * @return  record or NULL if no more records.
+ */
+static kv_rec_t* kv_rec_next(unvme_kv_t* kv, void* segbuf, u64 seq, u64* off)
+{
+    if ((*off + sizeof(kv_rec_t)) > kv->segsize) return NULL;
+    kv_rec_t* rec = segbuf + *off;
+    u64 len = sizeof(kv_rec_t) + rec->klen + (u64)rec->vlen;
+    if (rec->seq != (u32)seq || !rec->klen || (*off + len) > kv->segsize ||
+        rec->sum != kv_sum(rec, len)) return NULL;
+    *off += kv_alen(len);
+    return rec;
+}
+
+/**
+ * Read a record, from the open segment buffer or else from the device.
+ * @param   kv          store
+ * @param   qid         queue
+ * @param   buf         read buffer (of slotsize)
+ * @param   loc         record location
+ * @param   len         record length
+ * @param   locked      log lock held flag
+ * @param   prec        returned record pointer (in buf)
+ * @return  0 if ok else error status.
+ */
+static int kv_rec_read(unvme_kv_t* kv, int qid, void* buf, u64 loc, u32 len,
+                       int locked, kv_rec_t** prec)
+{
+    const unvme_ns_t* ns = kv->ns;
+    u32 seg = kv_seg(kv, loc);
+    u64 off = loc - (u64)seg * kv->segsize;
+    if (!locked) pthread_mutex_lock(&kv->loglock);
+    if ((int)seg == kv->head) {
+        memcpy(buf, kv->segbuf + off, len);
+        if (!locked) pthread_mutex_unlock(&kv->loglock);
+        *prec = buf;
+        return 0;
+    }
+    if (!locked) pthread_mutex_unlock(&kv->loglock);
+    u32 boff = off & (ns->blocksize - 1);
+    u32 nlb = (boff + len + ns->blocksize - 1) >> ns->blockshift;
+    *prec = buf + boff;
+    return unvme_read(ns, qid, buf, kv_seglba(kv, seg) + (off >> ns->blockshift), nlb);
+}
+
+/**
+ * Find the index slot of a key, reading the records of fingerprint matches.
+ * The log lock must be held.
+ * @param   kv          store
+ * @param   h           key hash
+ * @param   key         key
+ * @param   klen        key length
+ * @param   slot        returned slot
+ * @return  1 if found, 0 if not found, or error status.
+ */
+static int kv_index_get(unvme_kv_t* kv, u64 h, const void* key, u32 klen, kv_slot_t* slot)
+{
+    kv_slot_t cand[KV_MAXCAND];
+    int i, n = kv_index_lookup(kv, h, cand);
+    for (i = 0; i < n; i++) {
+        kv_rec_t* rec;
+        int err = kv_rec_read(kv, kv->qid, kv->wbuf, cand[i].loc, cand[i].len, 1, &rec);
+        if (err) return err;
+        if (kv_rec_check(kv, rec, cand[i].loc, cand[i].len, key, klen)) {
+            *slot = cand[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find the record of a key without the log lock, reading the records of
+ * the fingerprint matches on the caller's queue.  The lookup is retried if
+ * a record read has been moved by cleaning.
+ * @param   kv          store
+ * @param   qid         queue
+ * @param   buf         read buffer
+ * @param   h           key hash
+ * @param   key         key
+ * @param   klen        key length
+ * @param   cand        returned candidate slots (of the last lookup)
+ * @param   ncand       returned number of candidates
+ * @param   prec        returned record of the key (in buf)
+ * @return  index of the candidate found, -ENOENT if not found, -EAGAIN if
+ *          the candidates kept moving, or error status.
+ */
+static int kv_key_find(unvme_kv_t* kv, int qid, void* buf, u64 h, const void* key, u32 klen,
+                       kv_slot_t cand[KV_MAXCAND], int* ncand, kv_rec_t** prec)
+{
+    int retry;
+    for (retry = 0; retry < KV_RETRIES; retry++) {
+        unvme_lockr(&kv->ilock);
+        int i, n = kv_index_lookup(kv, h, cand);
+        unvme_unlockr(&kv->ilock);
+        *ncand = n;
+
+        int stale = 0;
+        for (i = 0; i < n; i++) {
+            int err = kv_rec_read(kv, qid, buf, cand[i].loc, cand[i].len, 0, prec);
+            if (err) return err;
+            if (kv_rec_check(kv, *prec, cand[i].loc, cand[i].len, key, klen)) return i;
+            unvme_lockr(&kv->ilock);
+            if (!kv_index_find(kv, h, cand[i].loc)) stale = 1;
+            unvme_unlockr(&kv->ilock);
+        }
+        if (!stale) return -ENOENT;
+    }
+    return -EAGAIN;
+}
+
+/**
+ * Revalidate the result of kv_key_find against the index (without reading
+ * records).  The key is still at the record found if that is still indexed,
+ * and still not found if no fingerprint match has been added since.
+ * The log lock must be held.
+ * @param   kv          store
+ * @param   h           key hash
+ * @param   cand        candidate slots of kv_key_find
+ * @param   n           number of candidates
+ * @param   match       kv_key_find result
+ * @return  1 if found, 0 if not found, or -EAGAIN if the index has changed.
+ */
+static int kv_index_check(unvme_kv_t* kv, u64 h, const kv_slot_t* cand, int n, int match)
+{
+    if (match >= 0) return kv_index_find(kv, h, cand[match].loc) ? 1 : -EAGAIN;
+    if (match != -ENOENT) return -EAGAIN;
+    kv_slot_t cur[KV_MAXCAND];
+    int i, j, nc = kv_index_lookup(kv, h, cur);
+    for (i = 0; i < nc; i++) {
+        for (j = 0; j < n && cand[j].loc != cur[i].loc; j++);
+        if (j == n) return -EAGAIN;
+    }
+    return 0;
+}
+
+/**
+ * Update the index slot of a key and the live record accounting.
+ * The log lock must be held.
+ * @param   kv          store
+ * @param   h           key hash
+ * @param   old         current slot of the key (NULL if none)
+ * @param   loc         new record location
+ * @param   len         new record length
+ * @param   flags       new record flags
+ * @return  0 if ok else error status.
+ */
+static int kv_index_update(unvme_kv_t* kv, u64 h, const kv_slot_t* old,
+                           u64 loc, u32 len, int flags)
+{
+    int err = 0;
+    unvme_lockw(&kv->ilock);
+    kv_slot_t* slot = old ? kv_index_find(kv, h, old->loc) : NULL;
+    if (slot) {
+        kv->live[kv_seg(kv, slot->loc)] -= kv_alen(slot->len);
+        kv->livebytes -= kv_alen(slot->len);
+    }
+    if (flags & KV_DELETE) {
+        if (slot) {
+            slot->fp = 0;
+            kv->keys--;
+        }
+    } else {
+        if (!slot && (slot = kv_index_insert(kv, h))) kv->keys++;
+        if (slot) {
+            slot->loc = loc;
+            slot->len = len;
+            kv->live[kv_seg(kv, loc)] += kv_alen(len);
+            kv->livebytes += kv_alen(len);
+        } else {
+            err = -ENOSPC;
+        }
+    }
+    unvme_unlockw(&kv->ilock);
+    return err;
+}
+
+/**
+ * Complete the log writes in flight.
+ * @param   kv          store
+ * @return  0 if ok else error status.
+ */
+static int kv_write_wait(unvme_kv_t* kv)
+{
+    int i, err = 0;
+    for (i = 0; i < kv->wcount; i++) {
+        int stat = unvme_apoll(kv->wiods[i], UNVME_TIMEOUT);
+        if (stat && !err) err = stat;
+    }
+    kv->wcount = 0;
+    if (err) ERROR("%s log write, %s", kv->ns->device, unvme_strerror(err));
+    return err;
+}
+
+/**
+ * Submit a log write of the open segment.
+ * @param   kv          store
+ * @param   off         segment offset (block aligned)
+ * @param   size        write size (blocks, up to the max I/O size)
+ * @return  0 if ok else error status.
+ */
+static int kv_write(unvme_kv_t* kv, u64 off, u64 size)
+{
+    const unvme_ns_t* ns = kv->ns;
+    int err;
+    if (kv->wcount == KV_MAXWRITES && (err = kv_write_wait(kv))) return err;
+    unvme_iod_t iod = unvme_awrite(ns, kv->qid, kv->segbuf + off,
+                                   kv_seglba(kv, kv->head) + (off >> ns->blockshift),
+                                   size >> ns->blockshift);
+    if (!iod) return -errno;
+    kv->wiods[kv->wcount++] = iod;
+    kv->writes++;
+    return 0;
+}
+
+/**
+ * Write out the open segment by max size writes as it fills, or (all)
+ * up to the last record and wait for the writes to complete.  The last
+ * partial block is rewritten by the next writes.
+ * @param   kv          store
+ * @param   all         write out all records flag
+ * @return  0 if ok else error status.
+ */
+static int kv_flush(unvme_kv_t* kv, int all)
+{
+    const unvme_ns_t* ns = kv->ns;
+    if (kv->head < 0) return 0;
+    u64 unit = (u64)ns->maxbpio << ns->blockshift;
+    int err = 0;
+    while (!err && (kv->segoff - kv->flushoff) >= unit) {
+        err = kv_write(kv, kv->flushoff, unit);
+        kv->flushoff += unit;
+    }
+    if (all) {
+        u64 end = (kv->segoff + ns->blocksize - 1) & ~(u64)(ns->blocksize - 1);
+        if (!err && end > kv->flushoff) {
+            memset(kv->segbuf + kv->segoff, 0, end - kv->segoff);
+            err = kv_write(kv, kv->flushoff, end - kv->flushoff);
+        }
+        int stat = kv_write_wait(kv);
+        if (!err) err = stat;
+        kv->flushoff = kv->segoff & ~(u64)(ns->blocksize - 1);
+    }
+    return err;
+}
+
+/**
+ * Seal the open segment and open the next free segment, or wait for one
+ * to be cleaned.  The log lock must be held.
+ * @param   kv          store
+ * @param   gc          for cleaning flag (may use the reserved segments)
+ * @return  0 if ok (or after waiting) else error status.
+ */
+static int kv_seg_next(unvme_kv_t* kv, int gc)
+{
+    if (kv->head >= 0) {
+        int err = kv_flush(kv, 1);
+        if (err) return err;
+        kv->head = -1;
+        kv->headrsv = 0;
+    }
+    if (kv->segfree <= (gc ? 0 : KV_GCRESERVE)) {
+        if (gc || kv->gcstop) return -ENOSPC;
+        pthread_cond_signal(&kv->gccond);
+        pthread_cond_wait(&kv->logcond, &kv->loglock);
+        kv->logwaits++;
+        return 0;
+    }
+
+    u32 seg = (kv->last + 1) % kv->sb.segcount;
+    kv->headrsv = kv->segfree <= KV_GCRESERVE;
+    kv->last = seg;
+    kv->segfree--;
+    kv->live[seg] = 0;
+    __atomic_store_n(&kv->segseq[seg], kv->nextseq++, __ATOMIC_RELEASE);
+    memset(kv->segbuf, 0, KV_SEGHDR);
+    kv_seghdr_t* hdr = kv->segbuf;
+    hdr->magic = KV_MAGIC;
+    hdr->seq = kv->segseq[seg];
+    kv->segoff = KV_SEGHDR;
+    kv->flushoff = 0;
+    kv->head = seg;
+    if (kv->segfree <= kv->gcthresh) pthread_cond_signal(&kv->gccond);
+    return 0;
+}
+
+/**
+ * Append a record to the log.  The log lock must be held.
+ * @param   kv          store
+ * @param   key         key
+ * @param   klen        key length
+ * @param   val         value
+ * @param   vlen        value length
+ * @param   flags       record flags
+ * @param   gc          for cleaning flag
+ * @param   loc         returned record location
+ * @return  0 if ok else error status.
+ */
+static int kv_append(unvme_kv_t* kv, const void* key, u32 klen, const void* val,
+                     u32 vlen, int flags, int gc, u64* loc)
+{
+    u32 len = sizeof(kv_rec_t) + klen + vlen;
+    int err;
+    while (kv->head < 0 || (kv->segoff + kv_alen(len)) > kv->segsize ||
+           (kv->headrsv && !gc)) {
+        if (kv->headrsv && !gc) {
+            // a reserved segment is left for cleaning to complete
+            if (kv->gcstop) return -ENOSPC;
+            pthread_cond_signal(&kv->gccond);
+            pthread_cond_wait(&kv->logcond, &kv->loglock);
+            kv->logwaits++;
+        } else if ((err = kv_seg_next(kv, gc))) {
+            return err;
+        }
+    }
+    kv_rec_t* rec = kv->segbuf + kv->segoff;
+    rec->seq = kv->segseq[kv->head];
+    rec->vlen = vlen;
+    rec->klen = klen;
+    rec->flags = flags;
+    memcpy(rec + 1, key, klen);
+    if (vlen) memcpy((u8*)(rec + 1) + klen, val, vlen);
+    rec->sum = kv_sum(rec, len);
+    *loc = (u64)kv->head * kv->segsize + kv->segoff;
+    kv->segoff += kv_alen(len);
+    return kv_flush(kv, 0);
+}
+
+/**
+ * Drop a cleaned segment, by invalidating its header and deallocating it.
+ * @param   kv          store
+ * @param   seg         segment
+ * @return  0 if ok else error status.
+ */
+static int kv_seg_drop(unvme_kv_t* kv, u32 seg)
+{
+    const unvme_ns_t* ns = kv->ns;
+    u64 lba = kv_seglba(kv, seg);
+    int err = unvme_write(ns, kv->gcqid, kv->zblock, lba, 1);
+    if (err) return err;
+    u32* range = kv->dsmrange;
+    range[0] = 0;
+    range[1] = kv->sb.segnlb - 1;
+    range[2] = lba + 1;
+    range[3] = (lba + 1) >> 32;
+    u32 cdw10_15[6] = { 0, 0x4, 0, 0, 0, 0 };   // 1 range, deallocate
+    if (unvme_cmd(ns, kv->gcqid, NVME_CMD_DS_MGMT, ns->id, range, 16, cdw10_15, NULL))
+        DEBUG_FN("%s segment %u deallocate failed", ns->device, seg);
+    return 0;
+}
+
+/**
+ * Log cleaning thread.  When few segments are free, the oldest segment is
+ * read, its live records (those still indexed) are appended to the log,
+ * and once they are written out the segment is dropped.
+ * @param   arg         store
+ */
+static void* kv_gc(void* arg)
+{
+    unvme_kv_t* kv = arg;
+    const unvme_ns_t* ns = kv->ns;
+    pthread_mutex_lock(&kv->loglock);
+    while (!kv->gcstop) {
+        u32 seg = kv->tail;
+        if (kv->segfree > kv->gcthresh || kv->segfree == kv->sb.segcount ||
+            (int)seg == kv->head) {
+            pthread_cond_wait(&kv->gccond, &kv->loglock);
+            continue;
+        }
+        u64 seq = kv->segseq[seg];
+        pthread_mutex_unlock(&kv->loglock);
+        int err = kv_io(ns, kv->gcqid, NVME_CMD_READ, kv->gcbuf,
+                        kv_seglba(kv, seg), kv->sb.segnlb);
+        pthread_mutex_lock(&kv->loglock);
+
+        u64 off = KV_SEGHDR;
+        kv_rec_t* rec;
+        while (!err && (rec = kv_rec_next(kv, kv->gcbuf, seq, &off))) {
+            if (rec->flags & KV_DELETE) continue;
+            u64 loc = (u64)seg * kv->segsize + ((void*)rec - kv->gcbuf);
+            u64 h = kv_hash(rec + 1, rec->klen);
+            kv_slot_t* slot = kv_index_find(kv, h, loc);
+            if (!slot) continue;
+            kv_slot_t old = *slot;
+            u64 newloc;
+            err = kv_append(kv, rec + 1, rec->klen, (u8*)(rec + 1) + rec->klen,
+                            rec->vlen, 0, 1, &newloc);
+            if (!err) err = kv_index_update(kv, h, &old, newloc, old.len, 0);
+            if (!err) kv->gcbytes += old.len;
+
+            // let the foreground in between records
+            pthread_mutex_unlock(&kv->loglock);
+            pthread_mutex_lock(&kv->loglock);
+        }
+        if (!err) err = kv_flush(kv, 1);
+        if (!err) err = kv_seg_drop(kv, seg);
+        if (err) {
+            // fail the puts waiting for log space
+            ERROR("%s segment %u cleaning, %s", ns->device, seg, unvme_strerror(err));
+            kv->gcstop = 1;
+            pthread_cond_broadcast(&kv->logcond);
+            break;
+        }
+        __atomic_store_n(&kv->segseq[seg], 0, __ATOMIC_RELEASE);
+        kv->live[seg] = 0;
+        kv->tail = (seg + 1) % kv->sb.segcount;
+        kv->segfree++;
+        if (kv->segfree > KV_GCRESERVE) kv->headrsv = 0;
+        kv->gcsegs++;
+        pthread_cond_broadcast(&kv->logcond);
+    }
+    pthread_mutex_unlock(&kv->loglock);
+    return NULL;
+}
+
+/**
+ * Find the index slot of a key being replayed, by its fingerprint and a
+ * second 64-bit key hash kept per slot (instead of reading the records).
+ * @param   kv          store
+ * @param   h           key hash
+ * @param   h2          second key hash
+ * @param   rhash       second key hash per slot
+ * @return  slot or NULL if not found.
+ */
+static kv_slot_t* kv_replay_find(unvme_kv_t* kv, u64 h, u64 h2, const u64* rhash)
+{
+    u32 fp = kv_fp(h);
+    u64 b = h & kv->bmask;
+    u64 i;
+    int s;
+    for (i = 0; i <= kv->bmask; i++) {
+        kv_bucket_t* bk = kv->buckets + b;
+        for (s = 0; s < KV_BUCKETSLOTS; s++) {
+            if (bk->slot[s].fp == fp && rhash[b * KV_BUCKETSLOTS + s] == h2)
+                return &bk->slot[s];
+        }
+        if (!kv->overflow[b]) break;
+        b = (b + 1) & kv->bmask;
+    }
+    return NULL;
+}
+
+/**
+ * Rebuild the index by replaying the log segments in sequence.  The keys
+ * replayed are matched by their 96-bit hash (the fingerprint with a second
+ * hash), so an overwrite costs no record read.
+ * @param   kv          store
+ * @return  0 if ok else error status.
+ */
+static int kv_replay(unvme_kv_t* kv)
+{
+    const unvme_ns_t* ns = kv->ns;
+    u32 segcount = kv->sb.segcount;
+    u32 s, k, n = 0;
+    int err;
+
+    kv->tail = 0;
+    for (s = 0; s < segcount; s++) {
+        if ((err = unvme_read(ns, kv->qid, kv->gcbuf, kv_seglba(kv, s), 1))) return err;
+        kv_seghdr_t* hdr = kv->gcbuf;
+        if (hdr->magic != KV_MAGIC || !hdr->seq) continue;
+        kv->segseq[s] = hdr->seq;
+        if (!n++ || hdr->seq < kv->segseq[kv->tail]) kv->tail = s;
+    }
+    kv->segfree = segcount - n;
+    kv->last = (kv->tail + n + segcount - 1) % segcount;
+    kv->nextseq = 1;
+    u64* rhash = malloc((kv->bmask + 1) * KV_BUCKETSLOTS * sizeof(u64));
+    if (!rhash) return -ENOMEM;
+
+    // the segments in use are consecutive (circularly) from the oldest
+    err = 0;
+    for (k = 0; k < n && !err; k++) {
+        s = (kv->tail + k) % segcount;
+        if (!kv->segseq[s] || (k && kv->segseq[s] < kv->nextseq)) {
+            ERROR("%s log segment %u out of sequence", ns->device, s);
+            err = -EINVAL;
+            break;
+        }
+        kv->nextseq = kv->segseq[s] + 1;
+        if ((err = kv_io(ns, kv->qid, NVME_CMD_READ, kv->gcbuf, kv_seglba(kv, s), kv->sb.segnlb)))
+            break;
+
+        u64 off = KV_SEGHDR;
+        kv_rec_t* rec;
+        while ((rec = kv_rec_next(kv, kv->gcbuf, kv->segseq[s], &off))) {
+            if (rec->klen > UNVME_KV_MAXKLEN || rec->vlen > kv->maxvlen) {
+                ERROR("%s record exceeds max value length %u", ns->device, kv->maxvlen);
+                err = -EINVAL;
+                break;
+            }
+            u64 loc = (u64)s * kv->segsize + ((void*)rec - kv->gcbuf);
+            u32 len = sizeof(kv_rec_t) + rec->klen + rec->vlen;
+            u64 h = kv_hash(rec + 1, rec->klen);
+            u64 h2 = kv_hash_basis(rec + 1, rec->klen, 0x84222325cbf29ce4UL);
+            kv_slot_t* slot = kv_replay_find(kv, h, h2, rhash);
+            kv_slot_t old;
+            if (slot) old = *slot;
+            if ((err = kv_index_update(kv, h, slot ? &old : NULL, loc, len, rec->flags)))
+                break;
+            if (!(rec->flags & KV_DELETE)) {
+                slot = kv_index_find(kv, h, loc);
+                rhash[slot - kv->buckets[0].slot] = h2;
+            }
+        }
+    }
+    free(rhash);
+    if (!err) DEBUG_FN("%s segments %u keys %lu", ns->device, n, kv->keys);
+    return err;
+}
+
+/**
+ * Format a namespace range as an empty key-value store.
+ * @param   ns          namespace handle
+ * @param   params      parameters (slba, nlb and segnlb, and qid to use)
+ * @return  0 if ok else error status.
+ */
+int unvme_kv_format(const unvme_ns_t* ns, const unvme_kv_params_t* params)
+{
+    kv_sb_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = KV_MAGIC;
+    sb.version = KV_VERSION;
+    sb.blocksize = ns->blocksize;
+    sb.segnlb = params->segnlb ? params->segnlb : (KV_SEGSIZE >> ns->blockshift);
+    u64 slba = params->slba;
+    u64 nlb = params->nlb;
+    if (slba >= ns->blockcount) return -EINVAL;
+    if (!nlb || nlb > (ns->blockcount - slba)) nlb = ns->blockcount - slba;
+    if (sb.segnlb < 2 || ((u64)sb.segnlb << ns->blockshift) > 0x80000000UL) {
+        ERROR("invalid segment size %u blocks", sb.segnlb);
+        return -EINVAL;
+    }
+    u64 segcount = (nlb - 1) / sb.segnlb;
+    if (segcount < KV_MINSEGS || segcount > 0xffffffffUL) {
+        ERROR("%s invalid store size (%lu segments)", ns->device, segcount);
+        return -EINVAL;
+    }
+    sb.segcount = segcount;
+
+    // invalidate the segment headers and then write the superblock
+    void* buf = unvme_alloc(ns, ns->blocksize);
+    if (!buf) return -ENOMEM;
+    memset(buf, 0, ns->blocksize);
+    int err = 0;
+    u32 s;
+    for (s = 0; s < sb.segcount && !err; s++) {
+        err = unvme_write(ns, params->qid, buf, slba + 1 + (u64)s * sb.segnlb, 1);
+    }
+    if (!err) {
+        memcpy(buf, &sb, sizeof(sb));
+        err = unvme_write(ns, params->qid, buf, slba, 1);
+    }
+    unvme_free(ns, buf);
+    if (err) ERROR("%s format, %s", ns->device, unvme_strerror(err));
+    else INFO_FN("%s store %u segments of %u blocks", ns->device, sb.segcount, sb.segnlb);
+    return err;
+}
+
+/**
+ * Close a key-value store (writing out the log).
+ * @param   kv          store
+ * @return  0 if ok else error status.
+ */
+int unvme_kv_close(unvme_kv_t* kv)
+{
+    const unvme_ns_t* ns = kv->ns;
+    pthread_mutex_lock(&kv->loglock);
+    kv->gcstop = 1;
+    pthread_cond_signal(&kv->gccond);
+    pthread_cond_broadcast(&kv->logcond);
+    pthread_mutex_unlock(&kv->loglock);
+    if (kv->gcstart) pthread_join(kv->gcthread, NULL);
+
+    int err = kv_flush(kv, 1);
+    if (kv->rbufs) {
+        int q;
+        for (q = 0; q < ns->qcount; q++) {
+            if (kv->rbufs[q]) unvme_free(ns, kv->rbufs[q]);
+        }
+        free(kv->rbufs);
+    }
+    if (kv->dsmrange) unvme_free(ns, kv->dsmrange);
+    if (kv->zblock) unvme_free(ns, kv->zblock);
+    if (kv->gcbuf) unvme_free(ns, kv->gcbuf);
+    if (kv->wbuf) unvme_free(ns, kv->wbuf);
+    if (kv->segbuf) unvme_free(ns, kv->segbuf);
+    free(kv->live);
+    free(kv->segseq);
+    free(kv->overflow);
+    free(kv->buckets);
+    pthread_cond_destroy(&kv->gccond);
+    pthread_cond_destroy(&kv->logcond);
+    pthread_mutex_destroy(&kv->loglock);
+    free(kv);
+    return err;
+}
+
+/**
+ * Open a key-value store, rebuilding the index from the log.
+ * @param   ns          namespace handle
+ * @param   params      parameters
+ * @return  store or NULL if error (errno set).
+ */
+unvme_kv_t* unvme_kv_open(const unvme_ns_t* ns, const unvme_kv_params_t* params)
+{
+    unvme_kv_t* kv = zalloc(sizeof(*kv));
+    kv->ns = ns;
+    kv->slba = params->slba;
+    kv->qid = params->qid;
+    kv->gcqid = params->gcqid ? params->gcqid : params->qid + 1;
+    kv->maxkeys = params->maxkeys ? params->maxkeys : KV_MAXKEYS;
+    kv->maxvlen = params->maxvlen ? params->maxvlen : KV_MAXVLEN;
+    kv->head = -1;
+    pthread_mutex_init(&kv->loglock, NULL);
+    pthread_cond_init(&kv->logcond, NULL);
+    pthread_cond_init(&kv->gccond, NULL);
+
+    int err = -EINVAL;
+    if (kv->qid < 0 || kv->qid >= ns->qcount || kv->gcqid < 0 ||
+        kv->gcqid >= ns->qcount || kv->gcqid == kv->qid) {
+        ERROR("%s invalid queues %d and %d (of %d)", ns->device, kv->qid, kv->gcqid, ns->qcount);
+        goto error;
+    }
+    err = -ENOMEM;
+    void* buf = unvme_alloc(ns, ns->blocksize);
+    if (!buf) goto error;
+    err = unvme_read(ns, kv->qid, buf, kv->slba, 1);
+    memcpy(&kv->sb, buf, sizeof(kv->sb));
+    unvme_free(ns, buf);
+    if (err) goto error;
+    kv_sb_t* sb = &kv->sb;
+    if (sb->magic != KV_MAGIC || sb->version != KV_VERSION || sb->blocksize != ns->blocksize ||
+        sb->segcount < KV_MINSEGS ||
+        (kv->slba + 1 + (u64)sb->segcount * sb->segnlb) > ns->blockcount) {
+        ERROR("%s is not a key-value store", ns->device);
+        err = -EINVAL;
+        goto error;
+    }
+    kv->segsize = (u64)sb->segnlb << ns->blockshift;
+    kv->slotsize = ((sizeof(kv_rec_t) + UNVME_KV_MAXKLEN + kv->maxvlen +
+                    ns->blocksize - 1) & ~(ns->blocksize - 1)) + ns->blocksize;
+    if ((KV_SEGHDR + sizeof(kv_rec_t) + UNVME_KV_MAXKLEN + kv->maxvlen) > kv->segsize) {
+        ERROR("%s max value length %u exceeds segment", ns->device, kv->maxvlen);
+        err = -EINVAL;
+        goto error;
+    }
+
+    // index of 75% max load
+    u64 nb = 1;
+    while ((nb * KV_BUCKETSLOTS * 3) < (kv->maxkeys * 4)) nb <<= 1;
+    kv->bmask = nb - 1;
+    err = -ENOMEM;
+    if (posix_memalign((void**)&kv->buckets, sizeof(kv_bucket_t), nb * sizeof(kv_bucket_t)))
+        goto error;
+    memset(kv->buckets, 0, nb * sizeof(kv_bucket_t));
+    kv->overflow = zalloc(nb);
+    kv->segseq = zalloc(sb->segcount * sizeof(u64));
+    kv->live = zalloc(sb->segcount * sizeof(u64));
+    kv->rbufs = zalloc(ns->qcount * sizeof(void*));
+    kv->segbuf = unvme_alloc(ns, kv->segsize);
+    kv->gcbuf = unvme_alloc(ns, kv->segsize);
+    kv->wbuf = unvme_alloc(ns, kv->slotsize);
+    kv->zblock = unvme_alloc(ns, ns->blocksize);
+    kv->dsmrange = unvme_alloc(ns, 16);
+    if (!kv->segbuf || !kv->gcbuf || !kv->wbuf || !kv->zblock || !kv->dsmrange) goto error;
+    memset(kv->zblock, 0, ns->blocksize);
+
+    if ((err = kv_replay(kv))) goto error;
+    kv->gcthresh = sb->segcount / 16 + 2;
+    kv->maxlive = (u64)(sb->segcount - kv->gcthresh - 2) * (kv->segsize - KV_SEGHDR);
+    if ((err = -pthread_create(&kv->gcthread, NULL, kv_gc, kv))) goto error;
+    kv->gcstart = 1;
+    return kv;
+
+error:
+    unvme_kv_close(kv);
+    errno = err < 0 ? -err : EIO;
+    return NULL;
+}
+
+/**
+ * Get the read buffer of a queue.
+ * @param   kv          store
+ * @param   qid         queue
+ * @return  buffer or NULL if error.
+ */
+static void* kv_rbuf(unvme_kv_t* kv, int qid)
+{
+    if (qid < 0 || qid >= kv->ns->qcount) return NULL;
+    if (!kv->rbufs[qid]) {
+        pthread_mutex_lock(&kv->loglock);
+        if (!kv->rbufs[qid])
+            kv->rbufs[qid] = unvme_alloc(kv->ns, (u64)kv->slotsize * KV_MGETMAX);
+        pthread_mutex_unlock(&kv->loglock);
+    }
+    return kv->rbufs[qid];
+}
+
+/**
+ * Append a put or delete record and update the index.  The current record
+ * of the key is read on the caller's queue outside the log lock, and only
+ * revalidated by its location under the lock (falling back to reading the
+ * records under the lock if the index has changed in between).
+ * @param   kv          store
+ * @param   qid         client queue index
+ * @param   key         key
+ * @param   klen        key length
+ * @param   val         value
+ * @param   vlen        value length
+ * @param   flags       record flags
+ * @return  0 if ok else error status.
+ */
+static int kv_update(unvme_kv_t* kv, int qid, const void* key, u32 klen,
+                     const void* val, u32 vlen, int flags)
+{
+    if (!klen || klen > UNVME_KV_MAXKLEN || vlen > kv->maxvlen) return -EINVAL;
+    void* rbuf = kv_rbuf(kv, qid);
+    if (!rbuf) return -EINVAL;
+    u64 h = kv_hash(key, klen);
+    u32 len = sizeof(kv_rec_t) + klen + vlen;
+    kv_slot_t cand[KV_MAXCAND];
+    kv_rec_t* rec;
+    int nc;
+    int match = kv_key_find(kv, qid, rbuf, h, key, klen, cand, &nc, &rec);
+    if (match < 0 && match != -ENOENT && match != -EAGAIN) return match;
+
+    pthread_mutex_lock(&kv->loglock);
+    kv_slot_t old;
+    int found = kv_index_check(kv, h, cand, nc, match);
+    if (found == 1) old = cand[match];
+    else if (found < 0) found = kv_index_get(kv, h, key, klen, &old);
+    int err = found < 0 ? found : 0;
+    if (!err) {
+        if (flags & KV_DELETE) {
+            if (!found) err = -ENOENT;
+        } else if (!found && kv->keys >= kv->maxkeys) {
+            err = -ENOSPC;
+        } else if ((kv->livebytes + kv_alen(len)) > (kv->maxlive + (found ? kv_alen(old.len) : 0))) {
+            err = -ENOSPC;
+        }
+    }
+    u64 loc, waits = kv->logwaits;
+    if (!err) err = kv_append(kv, key, klen, val, vlen, flags, 0, &loc);
+
+    // the record may have been moved or replaced while waiting for log space
+    if (!err && kv->logwaits != waits && (found = kv_index_get(kv, h, key, klen, &old)) < 0)
+        err = found;
+    if (!err) err = kv_index_update(kv, h, found ? &old : NULL, loc, len, flags);
+    if (!err) {
+        if (flags & KV_DELETE) kv->deletes++;
+        else kv->puts++;
+    }
+    pthread_mutex_unlock(&kv->loglock);
+    return err;
+}
+
+/**
+ * Put a key value (replacing the current value).
+ * @param   kv          store
+ * @param   qid         client queue index
+ * @param   key         key
+ * @param   klen        key length
+ * @param   val         value
+ * @param   vlen        value length
+ * @return  0 if ok else error status (-ENOSPC if the store is full).
+ */
+int unvme_kv_put(unvme_kv_t* kv, int qid, const void* key, u32 klen,
+                 const void* val, u32 vlen)
+{
+    return kv_update(kv, qid, key, klen, val, vlen, 0);
+}
+
+/**
+ * Delete a key.
+ * @param   kv          store
+ * @param   qid         client queue index
+ * @param   key         key
+ * @param   klen        key length
+ * @return  0 if ok else error status (-ENOENT if not found).
+ */
+int unvme_kv_delete(unvme_kv_t* kv, int qid, const void* key, u32 klen)
+{
+    return kv_update(kv, qid, key, klen, NULL, 0, KV_DELETE);
+}
+
+/**
+ * Return the value of a record read for a get item.
+ * @param   rec         record
+ * @param   it          item
+ * @return  0 if ok or -EOVERFLOW if the value buffer is too small.
+ */
+static int kv_value(const kv_rec_t* rec, unvme_kv_item_t* it)
+{
+    it->vlen = rec->vlen;
+    if (rec->vlen > it->vsize) return -EOVERFLOW;
+    memcpy(it->val, (u8*)(rec + 1) + rec->klen, rec->vlen);
+    return 0;
+}
+
+/**
+ * Get a key value, reading each fingerprint match until the key is found.
+ * @param   kv          store
+ * @param   qid         queue
+ * @param   buf         read buffer
+ * @param   it          item
+ * @return  0 if ok else error status.
+ */
+static int kv_get_one(unvme_kv_t* kv, int qid, void* buf, unvme_kv_item_t* it)
+{
+    kv_slot_t cand[KV_MAXCAND];
+    kv_rec_t* rec;
+    int n;
+    int i = kv_key_find(kv, qid, buf, kv_hash(it->key, it->klen), it->key, it->klen,
+                        cand, &n, &rec);
+    return i < 0 ? i : kv_value(rec, it);
+}
+
+/**
+ * Get multiple key values, with the record reads submitted together.
+ * @param   kv          store
+ * @param   qid         client queue index
+ * @param   items       items (with the status and value returned per item)
+ * @param   count       number of items
+ * @return  number of items found or error status.
+ */
+int unvme_kv_mget(unvme_kv_t* kv, int qid, unvme_kv_item_t* items, int count)
+{
+    const unvme_ns_t* ns = kv->ns;
+    void* rbuf = kv_rbuf(kv, qid);
+    if (!rbuf) return -EINVAL;
+
+    int b, i, found = 0;
+    for (b = 0; b < count; b += KV_MGETMAX) {
+        int n = (count - b) < KV_MGETMAX ? (count - b) : KV_MGETMAX;
+        unvme_iod_t iods[KV_MGETMAX];
+        kv_slot_t cands[KV_MGETMAX];
+
+        // submit the reads of keys with a single fingerprint match on the device
+        for (i = 0; i < n; i++) {
+            unvme_kv_item_t* it = items + b + i;
+            kv_slot_t cand[KV_MAXCAND];
+            unvme_lockr(&kv->ilock);
+            int nc = kv_index_lookup(kv, kv_hash(it->key, it->klen), cand);
+            unvme_unlockr(&kv->ilock);
+            iods[i] = NULL;
+            it->stat = nc ? 1 : -ENOENT;
+            if (nc != 1 || (int)kv_seg(kv, cand[0].loc) == __atomic_load_n(&kv->head, __ATOMIC_ACQUIRE))
+                continue;
+            u32 seg = kv_seg(kv, cand[0].loc);
+            u64 off = cand[0].loc - (u64)seg * kv->segsize;
+            u32 nlb = ((off & (ns->blocksize - 1)) + cand[0].len + ns->blocksize - 1) >> ns->blockshift;
+            cands[i] = cand[0];
+            iods[i] = unvme_aread(ns, qid, rbuf + (u64)i * kv->slotsize,
+                                  kv_seglba(kv, seg) + (off >> ns->blockshift), nlb);
+        }
+
+        // check the records read, and get the rest one at a time
+        for (i = 0; i < n; i++) {
+            unvme_kv_item_t* it = items + b + i;
+            void* buf = rbuf + (u64)i * kv->slotsize;
+            if (iods[i]) {
+                int err = unvme_apoll(iods[i], UNVME_TIMEOUT);
+                kv_rec_t* rec = buf + (cands[i].loc & (ns->blocksize - 1));
+                if (err) it->stat = err;
+                else if (kv_rec_check(kv, rec, cands[i].loc, cands[i].len, it->key, it->klen))
+                    it->stat = kv_value(rec, it);
+            }
+            if (it->stat > 0) it->stat = kv_get_one(kv, qid, buf, it);
+            if (!it->stat) found++;
+        }
+    }
+    __atomic_add_fetch(&kv->gets, count, __ATOMIC_RELAXED);
+    return found;
+}
+
+/**
+ * Get a key value.
+ * @param   kv          store
+ * @param   qid         client queue index
+ * @param   key         key
+ * @param   klen        key length
+ * @param   val         value buffer
+ * @param   vsize       value buffer size
+ * @param   vlen        returned value length
+ * @return  0 if ok else error status (-ENOENT if not found).
+ */
+int unvme_kv_get(unvme_kv_t* kv, int qid, const void* key, u32 klen,
+                 void* val, u32 vsize, u32* vlen)
+{
+    unvme_kv_item_t it = { .key = key, .klen = klen, .vsize = vsize, .val = val };
+    int err = unvme_kv_mget(kv, qid, &it, 1);
+    if (err < 0) return err;
+    if (vlen) *vlen = it.vlen;
+    return it.stat;
+}
+
+/**
+ * Write out the log, making all puts and deletes persistent.
+ * @param   kv          store
+ * @return  0 if ok else error status.
+ */
+int unvme_kv_sync(unvme_kv_t* kv)
+{
+    pthread_mutex_lock(&kv->loglock);
+    int err = kv_flush(kv, 1);
+    pthread_mutex_unlock(&kv->loglock);
+    return err;
+}
+
+/**
+ * Get the store statistics.
+ * @param   kv          store
+ * @param   stats       returned statistics
+ */
+void unvme_kv_stats(unvme_kv_t* kv, unvme_kv_stats_t* stats)
+{
+    pthread_mutex_lock(&kv->loglock);
+    stats->keys = kv->keys;
+    stats->maxkeys = kv->maxkeys;
+    stats->livebytes = kv->livebytes;
+    stats->segnlb = kv->sb.segnlb;
+    stats->segcount = kv->sb.segcount;
+    stats->segfree = kv->segfree;
+    stats->puts = kv->puts;
+    stats->deletes = kv->deletes;
+    stats->gets = __atomic_load_n(&kv->gets, __ATOMIC_RELAXED);
+    stats->writes = kv->writes;
+    stats->gcsegs = kv->gcsegs;
+    stats->gcbytes = kv->gcbytes;
+    pthread_mutex_unlock(&kv->loglock);
+}
@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe key-value store interface.
+ *
+ * A log-structured hash store on a namespace range.  Records (key and
+ * value) are appended to a circular log of segments, which is written out
+ * with large asynchronous writes as it fills, and located by an in-memory
+ * hash index.  The index keeps only a 32-bit fingerprint of each key with
+ * the record location (16 bytes per key), and the key is verified when
+ * the record is read (which is one read of a few blocks per lookup).
+ * Multiple gets are batched with their reads submitted together.
+ *
+ * Puts and deletes are buffered in the open segment, and are persistent
+ * once written out by the log or by unvme_kv_sync().  A background thread
+ * reclaims the oldest segment when few are left free, by appending its
+ * live records to the log and deallocating it (dataset management).
+ * The index is rebuilt by replaying the log when the store is opened.
+ *
+ * The log is written on its own queue and cleaned on another, while the
+ * reads of gets (and of puts and deletes, for the current record of the
+ * key) are done on the queue given by the caller, with each queue used by
+ * one thread at a time.
+ */
+
+#ifndef _UNVME_KV_H
+#define _UNVME_KV_H
+
+#include "unvme.h"
+
+/// Max key length
+#define UNVME_KV_MAXKLEN    256
+
+/// Key-value store context
+typedef struct _unvme_kv unvme_kv_t;
+
+/// Store parameters (zero fields select the defaults)
+typedef struct _unvme_kv_params {
+    u64                 slba;       ///< starting lba of the store
+    u64                 nlb;        ///< store size in blocks (format, default to end)
+    u32                 segnlb;     ///< segment size in blocks (format, default 8MB)
+    u32                 maxkeys;    ///< max number of keys (default 1M)
+    u32                 maxvlen;    ///< max value length (default 64KB)
+    int                 qid;        ///< queue for writing the log
+    int                 gcqid;      ///< queue for cleaning the log (default qid + 1)
+} unvme_kv_params_t;
+
+/// Multiple get item
+typedef struct _unvme_kv_item {
+    const void*         key;        ///< key
+    u32                 klen;       ///< key length
+    u32                 vsize;      ///< value buffer size
+    void*               val;        ///< value buffer
+    u32                 vlen;       ///< returned value length
+    int                 stat;       ///< returned status (0, -ENOENT or error)
+} unvme_kv_item_t;
+
+/// Store statistics
+typedef struct _unvme_kv_stats {
+    u64                 keys;       ///< number of keys
+    u64                 maxkeys;    ///< max number of keys
+    u64                 livebytes;  ///< bytes of live records
+    u32                 segnlb;     ///< segment size in blocks
+    u32                 segcount;   ///< number of segments
+    u32                 segfree;    ///< number of free segments
+    u64                 puts;       ///< number of puts
+    u64                 deletes;    ///< number of deletes
+    u64                 gets;       ///< number of gets
+    u64                 writes;     ///< number of log writes
+    u64                 gcsegs;     ///< number of segments cleaned
+    u64                 gcbytes;    ///< bytes of live records moved by cleaning
+} unvme_kv_stats_t;
+
+// Export functions
+int unvme_kv_format(const unvme_ns_t* ns, const unvme_kv_params_t* params);
+unvme_kv_t* unvme_kv_open(const unvme_ns_t* ns, const unvme_kv_params_t* params);
+int unvme_kv_close(unvme_kv_t* kv);
+int unvme_kv_put(unvme_kv_t* kv, int qid, const void* key, u32 klen, const void* val, u32 vlen);
+int unvme_kv_delete(unvme_kv_t* kv, int qid, const void* key, u32 klen);
+int unvme_kv_get(unvme_kv_t* kv, int qid, const void* key, u32 klen, void* val, u32 vsize, u32* vlen);
+int unvme_kv_mget(unvme_kv_t* kv, int qid, unvme_kv_item_t* items, int count);
+int unvme_kv_sync(unvme_kv_t* kv);
+void unvme_kv_stats(unvme_kv_t* kv, unvme_kv_stats_t* stats);
+
+#endif  // _UNVME_KV_H
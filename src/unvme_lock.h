@@ -29,19 +29,96 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 /**
  * @file
  * @brief UNVMe fast read lock with occasional writes.
+ *
+ * The reader count is sharded across cache lines, with each thread using
+ * its own shard, so read locking only writes a line that is not shared
+ * with the readers of other threads (and the read side cost stays flat
+ * as the number of threads grows).  A writer sets the writer flag, which
+ * turns new readers back, and then waits for the sum of the shards to
+ * drain.  A read lock may be released on another thread than the one that
+ * took it, since only the sum of the shards counts the readers (a shard
+ * may go below zero).
+ *
+ * A lock takes (UNVME_LOCK_SHARDS + 1) cache lines and is cache line
+ * aligned, so it does not share a line with the fields next to it (the
+ * structures embedding a lock are allocated aligned by zalloc).
  */
 
 #include <sched.h>
+#include <time.h>
+
+#include "unvme_barrier.h"
+
+/// Number of reader shards (power of 2, a cache line each per lock)
+#define UNVME_LOCK_SHARDS   8
+/// Number of CPU spin hints (and then yields) before a lock wait sleeps
+#define UNVME_LOCK_SPINS    1024
+
+/// Reader count shard (one per cache line)
+typedef struct _unvme_lock_shard {
+    unsigned            count;      ///< reader count (modulo 2^32)
+} __attribute__((aligned(64))) unvme_lock_shard_t;
+
+/// Read write lock with sharded reader counts
+typedef struct _unvme_lock {
+    unvme_lock_shard_t  shard[UNVME_LOCK_SHARDS]; ///< reader count shards
+    unsigned            writer __attribute__((aligned(64))); ///< writer flag
+} unvme_lock_t;
+
+/// Reader shard of the thread (plus 1, 0 if not yet assigned)
+extern __thread int unvme_lock_tid __attribute__((tls_model("initial-exec")));
+/// Number of threads assigned a reader shard
+extern int unvme_lock_tcount;
 
-/// Lock write bit
-#define UNVME_LOCKWBIT      0x80000000
 
-/// Simple read write lock
-typedef unsigned unvme_lock_t;
+/**
+ * Wait briefly in a polling loop, by a CPU spin hint for a real-time
+ * device (to avoid the scheduler latency) or else by yielding the CPU.
+ * @param   spin    spin flag
+ */
+static inline void unvme_yield(int spin)
+{
+    if (spin) unvme_cpu_relax();
+    else sched_yield();
+}
+
+/**
+ * Wait for a lock holder, by spinning briefly, then yielding the CPU, and
+ * then sleeping, so that a holder of lower priority (e.g. preempted by a
+ * SCHED_FIFO waiter on the same CPU) gets to run and release the lock.
+ * @param   spins   wait count (initially 0)
+ */
+static inline void unvme_lock_wait(unsigned* spins)
+{
+    unsigned n = (*spins)++;
+    if (n < UNVME_LOCK_SPINS) {
+        unvme_cpu_relax();
+    } else if (n < 2 * UNVME_LOCK_SPINS) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
 
+/**
+ * Get the reader count shard of the calling thread.
+ * @param   lock    lock variable
+ * @return  reader count.
+ */
+static inline unsigned* unvme_lock_count(unvme_lock_t* lock)
+{
+    int tid = unvme_lock_tid;
+    if (!tid) {
+        tid = 1 + (__sync_fetch_and_add(&unvme_lock_tcount, 1) & (UNVME_LOCK_SHARDS - 1));
+        unvme_lock_tid = tid;
+    }
+    return &lock->shard[tid - 1].count;
+}
 
 /**
  * Increment read lock and wait if pending write.
@@ -49,10 +126,13 @@ typedef unsigned unvme_lock_t;
  */
 static inline void unvme_lockr(unvme_lock_t* lock)
 {
+    unsigned* count = unvme_lock_count(lock);
+    unsigned spins = 0;
     for (;;) {
-        if (!(__sync_fetch_and_add(lock, 1) & UNVME_LOCKWBIT)) return;
-        __sync_fetch_and_sub(lock, 1);
-        sched_yield();
+        __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST)) return;
+        __atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&lock->writer, __ATOMIC_RELAXED)) unvme_lock_wait(&spins);
     }
 }
 
@@ -62,25 +142,30 @@ static inline void unvme_lockr(unvme_lock_t* lock)
  */
 static inline void unvme_unlockr(unvme_lock_t* lock)
 {
-    __sync_fetch_and_sub(lock, 1);
+    __atomic_sub_fetch(unvme_lock_count(lock), 1, __ATOMIC_RELEASE);
 }
 
 /**
- * Acquire write lock and wait for all pending read/write.
+ * Acquire write lock and wait for all pending read/write.  The readers
+ * are counted by the sum of the shards, as a reader may lock and unlock
+ * on different shards.  A reader counted in one shard before the writer
+ * flag is set can only be cancelled out by its own unlock, and readers
+ * turned back by the flag lock and unlock on the same shard.
  * @param   lock    lock variable
  */
 static inline void unvme_lockw(unvme_lock_t* lock)
 {
+    unsigned spins = 0;
+    while (__atomic_exchange_n(&lock->writer, 1, __ATOMIC_SEQ_CST)) {
+        while (__atomic_load_n(&lock->writer, __ATOMIC_RELAXED)) unvme_lock_wait(&spins);
+    }
     for (;;) {
-        int val = __sync_fetch_and_or(lock, UNVME_LOCKWBIT);
-        if (val == 0) return;
-        sched_yield();
-
-        // if not pending write then just wait for all reads to clear
-        if (!(val & UNVME_LOCKWBIT)) {
-            while (*lock != UNVME_LOCKWBIT) sched_yield();
-            return;
-        }
+        unsigned readers = 0;
+        int i;
+        for (i = 0; i < UNVME_LOCK_SHARDS; i++)
+            readers += __atomic_load_n(&lock->shard[i].count, __ATOMIC_SEQ_CST);
+        if (!readers) break;
+        unvme_lock_wait(&spins);
     }
 }
 
@@ -90,6 +175,5 @@ static inline void unvme_lockw(unvme_lock_t* lock)
  */
 static inline void unvme_unlockw(unvme_lock_t* lock)
 {
-    __sync_fetch_and_and(lock, ~UNVME_LOCKWBIT);
+    __atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
 }
-
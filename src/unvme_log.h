@@ -39,6 +39,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 
 /// @cond
@@ -99,15 +100,17 @@ static inline void hex_dump(void* buf, int len)
 }
 
 /**
- * Invoke calloc and terminated on failure.
+ * Allocate zeroed memory aligned to a cache line (as required by the
+ * structures embedding a lock) and terminate on failure.
  */
 static inline void* zalloc(int size)
 {
-    void* mem = calloc(1, size);
-    if (!mem) {
-        ERROR("calloc");
+    void* mem;
+    if (posix_memalign(&mem, 64, size)) {
+        ERROR("posix_memalign");
         abort();
     }
+    memset(mem, 0, size);
     return mem;
 }
 
@@ -41,6 +41,7 @@
 #include "rdtsc.h"
 #include "unvme_log.h"
 #include "unvme_nvme.h"
+#include "unvme_barrier.h"
 
 
 /// @cond
@@ -55,7 +56,7 @@ static inline u32 r32(nvme_device_t* dev, u32* addr)
 static inline void w32(nvme_device_t* dev, u32* addr, u32 val)
 {
     DEBUG("w32 %#lx %#x", (u64) addr - (u64) dev->reg, val);
-    *addr = val;
+    *(volatile u32*)addr = val;
 }
 
 static inline u64 r64(nvme_device_t* dev, u64* addr)
@@ -82,9 +83,10 @@ static inline void w64(nvme_device_t* dev, u64* addr, u64 val)
  */
 static int nvme_ctlr_wait_ready(nvme_device_t* dev, int ready)
 {
+    // poll in 10ms steps (timeout is in 500ms units) to minimize reset time
     int i;
-    for (i = 0; i < dev->timeout; i++) {
-        usleep(500000);
+    for (i = 0; i < dev->timeout * 50; i++) {
+        usleep(10000);
         nvme_controller_status_t csts;
         csts.val = r32(dev, &dev->reg->csts.val);
         if (csts.rdy == ready) return 0;
@@ -123,6 +125,23 @@ static int nvme_ctlr_enable(nvme_device_t* dev, nvme_controller_config_t cc)
     return nvme_ctlr_wait_ready(dev, 1);
 }
 
+/**
+ * Check if the controller has encountered a fatal status or is no longer
+ * accessible (i.e. register reads all 1s).
+ * @param   dev         device context
+ * @return  1 if fatal else 0.
+ */
+int nvme_ctlr_fatal(nvme_device_t* dev)
+{
+    nvme_controller_status_t csts;
+    csts.val = r32(dev, &dev->reg->csts.val);
+    if (csts.val == 0xffffffff || csts.cfs) {
+        ERROR("controller fatal status csts=%#x", csts.val);
+        return 1;
+    }
+    return 0;
+}
+
 /**
  * Submit an entry at submission queue tail.
  * @param   q           queue
@@ -130,24 +149,14 @@ static int nvme_ctlr_enable(nvme_device_t* dev, nvme_controller_config_t cc)
  */
 static int nvme_submit_cmd(nvme_queue_t* q)
 {
-    int tail = q->sq_tail;
-    //HEX_DUMP(&q->sq[tail], sizeof(nvme_sq_entry_t));
-    if (++tail == q->size) tail = 0;
-#if 0
-    // Some SSD does not advance sq_head properly (e.g. Intel DC D3600)
-    // so let the upper layer detect queue full error condition
-    if (tail == q->sq_head) {
-        ERROR("sq full at %d", tail);
-        return -1;
-    }
-#endif
-    q->sq_tail = tail;
-    w32(q->dev, q->sq_doorbell, tail);
+    if (nvme_post_cmd(q)) return -1;
+    nvme_sq_ring(q);
     return 0;
 }
 
 /**
- * Check a completion queue and return the completed command id and status.
+ * Check a completion queue and return the completed command id and status
+ * (consuming the entry as nvme_cq_pop).
  * @param   q           queue
  * @param   stat        completion status returned
  * @param   cqe_cs      CQE command specific DW0 returned
@@ -156,16 +165,13 @@ static int nvme_submit_cmd(nvme_queue_t* q)
 int nvme_check_completion(nvme_queue_t* q, int* stat, u32* cqe_cs)
 {
     *stat = 0;
-    nvme_cq_entry_t* cqe = &q->cq[q->cq_head];
-    if (cqe->p == q->cq_phase) return -1;
+    nvme_cq_entry_t* cqe = nvme_cq_peek(q);
+    if (!cqe) return -1;
 
     *stat = cqe->psf & 0xfffe;
-    if (++q->cq_head == q->size) {
-        q->cq_head = 0;
-        q->cq_phase = !q->cq_phase;
-    }
     if (cqe_cs) *cqe_cs = cqe->cs;
-    w32(q->dev, q->cq_doorbell, q->cq_head);
+    int cid = cqe->cid;
+    nvme_cq_pop(q);
 
 #if 0
     // Some SSD does not advance sq_head properly (e.g. Intel DC D3600)
@@ -180,7 +186,7 @@ int nvme_check_completion(nvme_queue_t* q, int* stat, u32* cqe_cs)
               q->id, q->cq_head, q->sq_head, q->sq_tail, cqe->cid, *stat, cqe->dnr, cqe->m, cqe->sct, cqe->sc);
     }
 
-    return cqe->cid;
+    return cid;
 }
 
 /**
@@ -344,14 +350,85 @@ int nvme_acmd_set_features(nvme_device_t* dev, int nsid,
     return err;
 }
 
+/**
+ * NVMe set features command to enable or disable the host memory buffer.
+ * Submit the command and wait for completion.
+ * @param   dev         device context
+ * @param   enable      1 to enable or 0 to disable
+ * @param   hsize       host memory buffer size (in memory page size)
+ * @param   hmdla       host memory descriptor list address
+ * @param   hmdlec      host memory descriptor list entry count
+ * @return  completion status (0 if ok).
+ */
+int nvme_acmd_set_hmb(nvme_device_t* dev, int enable, u32 hsize, u64 hmdla, u32 hmdlec)
+{
+    nvme_queue_t* adminq = &dev->adminq;
+    int cid = adminq->sq_tail;
+    nvme_acmd_set_features_t* cmd = &adminq->sq[cid].set_features;
+
+    memset(cmd, 0, sizeof (*cmd));
+    cmd->common.opc = NVME_ACMD_SET_FEATURES;
+    cmd->common.cid = cid;
+    cmd->fid = NVME_FEATURE_HOST_MEM_BUF;
+    if (enable) {
+        cmd->val = 1;   // EHM
+        cmd->cdw12_15[0] = hsize;
+        cmd->cdw12_15[1] = (u32)hmdla;
+        cmd->cdw12_15[2] = (u32)(hmdla >> 32);
+        cmd->cdw12_15[3] = hmdlec;
+    }
+
+    DEBUG_FN("sq=%d-%d cid=%#x ehm=%d hsize=%#x hmdla=%#lx hmdlec=%d",
+             adminq->sq_head, adminq->sq_tail, cid, enable, hsize, hmdla, hmdlec);
+    int err = nvme_submit_cmd(adminq);
+    if (!err) err = nvme_wait_completion(adminq, cid, 30);
+    return err;
+}
+
+/**
+ * NVMe doorbell buffer config command.
+ * Submit the command and wait for completion.  On success, subsequently
+ * created IO queues will use the shadow doorbell and event index buffers.
+ * @param   dev         device context
+ * @param   dbbuf       shadow doorbell buffer
+ * @param   dbpa        shadow doorbell buffer IO physical address
+ * @param   eibuf       event index buffer
+ * @param   eipa        event index buffer IO physical address
+ * @return  completion status (0 if ok).
+ */
+int nvme_acmd_dbbuf_config(nvme_device_t* dev, void* dbbuf, u64 dbpa,
+                           void* eibuf, u64 eipa)
+{
+    nvme_queue_t* adminq = &dev->adminq;
+    int cid = adminq->sq_tail;
+    nvme_command_vs_t* cmd = &adminq->sq[cid].vs;
+
+    memset(cmd, 0, sizeof (*cmd));
+    cmd->common.opc = NVME_ACMD_DBBUF_CONFIG;
+    cmd->common.cid = cid;
+    cmd->common.prp1 = dbpa;
+    cmd->common.prp2 = eipa;
+
+    DEBUG_FN("sq=%d-%d cid=%#x dbbuf=%#lx eibuf=%#lx",
+             adminq->sq_head, adminq->sq_tail, cid, dbpa, eipa);
+    int err = nvme_submit_cmd(adminq);
+    if (!err) err = nvme_wait_completion(adminq, cid, 30);
+    if (!err) {
+        dev->dbbuf = dbbuf;
+        dev->eibuf = eibuf;
+    }
+    return err;
+}
+
 /**
  * NVMe create I/O completion queue command.
  * Submit the command and wait for completion.
  * @param   ioq         io queue
  * @param   prp         PRP1 address
+ * @param   iv          interrupt vector (-1 for polled queue)
  * @return  0 if ok, else -1.
  */
-int nvme_acmd_create_cq(nvme_queue_t* ioq, u64 prp)
+int nvme_acmd_create_cq(nvme_queue_t* ioq, u64 prp, int iv)
 {
     nvme_queue_t* adminq = &ioq->dev->adminq;
     int cid = adminq->sq_tail;
@@ -364,8 +441,12 @@ int nvme_acmd_create_cq(nvme_queue_t* ioq, u64 prp)
     cmd->pc = 1;
     cmd->qid = ioq->id;
     cmd->qsize = ioq->size - 1;
+    if (iv >= 0) {
+        cmd->ien = 1;
+        cmd->iv = iv;
+    }
 
-    DEBUG_FN("sq=%d-%d cid=%#x cq=%d qs=%d", adminq->sq_head, adminq->sq_tail, cid, ioq->id, ioq->size);
+    DEBUG_FN("sq=%d-%d cid=%#x cq=%d qs=%d iv=%d", adminq->sq_head, adminq->sq_tail, cid, ioq->id, ioq->size, iv);
     int err = nvme_submit_cmd(adminq);
     if (!err) err = nvme_wait_completion(adminq, cid, 30);
     return err;
@@ -447,6 +528,110 @@ int nvme_acmd_delete_sq(nvme_queue_t* ioq)
     return nvme_acmd_delete_ioq(ioq, NVME_ACMD_DELETE_SQ);
 }
 
+/**
+ * NVMe format NVM command.
+ * Submit the command and wait for completion.
+ * @param   dev         device context
+ * @param   nsid        namespace id (0xffffffff for all namespaces)
+ * @param   lbaf        LBA format index
+ * @param   ses         secure erase setting (0=none 1=user data 2=crypto)
+ * @return  completion status (0 if ok).
+ */
+int nvme_acmd_format_nvm(nvme_device_t* dev, int nsid, int lbaf, int ses)
+{
+    nvme_queue_t* adminq = &dev->adminq;
+    int cid = adminq->sq_tail;
+    nvme_acmd_format_nvm_t* cmd = &adminq->sq[cid].format_nvm;
+
+    memset(cmd, 0, sizeof (*cmd));
+    cmd->common.opc = NVME_ACMD_FORMAT_NVM;
+    cmd->common.cid = cid;
+    cmd->common.nsid = nsid;
+    cmd->lbaf = lbaf;
+    cmd->ses = ses;
+
+    DEBUG_FN("sq=%d-%d cid=%#x nsid=%d lbaf=%d ses=%d",
+             adminq->sq_head, adminq->sq_tail, cid, nsid, lbaf, ses);
+    int err = nvme_submit_cmd(adminq);
+    // formatting a large namespace (especially with secure erase) may take
+    // considerably longer than any other admin command
+    if (!err) err = nvme_wait_completion(adminq, cid, 600);
+    return err;
+}
+
+/**
+ * NVMe namespace management or attachment command.
+ * Submit the command and wait for completion.
+ * @param   dev         device context
+ * @param   opc         op code
+ * @param   nsid        namespace id
+ * @param   sel         select field
+ * @param   prp1        PRP1 address
+ * @param   res         dword 0 value returned (may be NULL)
+ * @return  completion status (0 if ok).
+ */
+static int nvme_acmd_ns_mgmt(nvme_device_t* dev, int opc, int nsid,
+                             int sel, u64 prp1, u32* res)
+{
+    nvme_queue_t* adminq = &dev->adminq;
+    int cid = adminq->sq_tail;
+    nvme_acmd_ns_mgmt_t* cmd = &adminq->sq[cid].ns_mgmt;
+
+    memset(cmd, 0, sizeof (*cmd));
+    cmd->common.opc = opc;
+    cmd->common.cid = cid;
+    cmd->common.nsid = nsid;
+    cmd->common.prp1 = prp1;
+    cmd->sel = sel;
+
+    DEBUG_FN("sq=%d-%d cid=%#x opc=%#x nsid=%d sel=%d",
+             adminq->sq_head, adminq->sq_tail, cid, opc, nsid, sel);
+    int err = nvme_submit_cmd(adminq);
+    if (!err) err = nvme_wait_completion(adminq, cid, 30);
+    if (!err && res) *res = adminq->cq[cid].cs;
+    return err;
+}
+
+/**
+ * NVMe create namespace command.
+ * Submit the command and wait for completion.
+ * @param   dev         device context
+ * @param   prp1        PRP1 address of the identify namespace data
+ *                      (nsze, ncap, flbas, dps and nmic are used)
+ * @param   nsid        created namespace id returned
+ * @return  completion status (0 if ok).
+ */
+int nvme_acmd_ns_create(nvme_device_t* dev, u64 prp1, u32* nsid)
+{
+    return nvme_acmd_ns_mgmt(dev, NVME_ACMD_NS_MGMT, 0, 0, prp1, nsid);
+}
+
+/**
+ * NVMe delete namespace command.
+ * Submit the command and wait for completion.
+ * @param   dev         device context
+ * @param   nsid        namespace id
+ * @return  completion status (0 if ok).
+ */
+int nvme_acmd_ns_delete(nvme_device_t* dev, int nsid)
+{
+    return nvme_acmd_ns_mgmt(dev, NVME_ACMD_NS_MGMT, nsid, 1, 0, NULL);
+}
+
+/**
+ * NVMe namespace attach or detach command.
+ * Submit the command and wait for completion.
+ * @param   dev         device context
+ * @param   nsid        namespace id
+ * @param   detach      0 to attach or 1 to detach
+ * @param   prp1        PRP1 address of the controller list
+ * @return  completion status (0 if ok).
+ */
+int nvme_acmd_ns_attach(nvme_device_t* dev, int nsid, int detach, u64 prp1)
+{
+    return nvme_acmd_ns_mgmt(dev, NVME_ACMD_NS_ATTACH, nsid, detach, prp1, NULL);
+}
+
 /**
  * NVMe submit a vendor specific (i.e. generic) command.
  * @param   q           NVMe (admin or IO) queue
@@ -475,6 +660,21 @@ int nvme_cmd_vs(nvme_queue_t* q, int opc, u16 cid, int nsid,
     return nvme_submit_cmd(q);
 }
 
+/**
+ * NVMe post a previously composed command (e.g. for resubmission) without
+ * ringing the doorbell.
+ * @param   q           NVMe (admin or IO) queue
+ * @param   sqe         submission queue entry
+ * @return  0 if ok else -1.
+ */
+int nvme_cmd_post(nvme_queue_t* q, const nvme_sq_entry_t* sqe)
+{
+    memcpy(&q->sq[q->sq_tail], sqe, sizeof(*sqe));
+    DEBUG_FN("q=%d sq=%d-%d cid=%#x opc=%#x",
+             q->id, q->sq_head, q->sq_tail, sqe->vs.common.cid, sqe->vs.common.opc);
+    return nvme_post_cmd(q);
+}
+
 /**
  * NVMe submit a read write command.
  * @param   ioq         io queue
@@ -490,20 +690,9 @@ int nvme_cmd_vs(nvme_queue_t* q, int opc, u16 cid, int nsid,
 int nvme_cmd_rw(nvme_queue_t* ioq, int opc, u16 cid, int nsid,
                 u64 slba, int nlb, u64 prp1, u64 prp2)
 {
-    nvme_command_rw_t* cmd = &ioq->sq[ioq->sq_tail].rw;
-
-    memset(cmd, 0, sizeof (*cmd));
-    cmd->common.opc = opc;
-    cmd->common.cid = cid;
-    cmd->common.nsid = nsid;
-    cmd->common.prp1 = prp1;
-    cmd->common.prp2 = prp2;
-    cmd->slba = slba;
-    cmd->nlb = nlb - 1;
-    DEBUG_FN("q=%d sq=%d-%d cid=%#x nsid=%d lba=%#lx nb=%#x prp=%#lx.%#lx (%c)",
-             ioq->id, ioq->sq_head, ioq->sq_tail, cid, nsid, slba, nlb, prp1, prp2,
-             opc == NVME_CMD_READ? 'R' : 'W');
-    return nvme_submit_cmd(ioq);
+    if (nvme_cmd_rw_post(ioq, opc, cid, nsid, slba, nlb, prp1, prp2)) return -1;
+    nvme_sq_ring(ioq);
+    return 0;
 }
 
 /**
@@ -540,6 +729,26 @@ int nvme_cmd_write(nvme_queue_t* ioq, u16 cid, int nsid,
     return nvme_cmd_rw(ioq, NVME_CMD_WRITE, cid, nsid, slba, nlb, prp1, prp2);
 }
 
+/**
+ * Setup an IO queue shadow doorbells if doorbell buffers are configured.
+ * @param   ioq         io queue
+ */
+static void nvme_ioq_init_shadow(nvme_queue_t* ioq)
+{
+    nvme_device_t* dev = ioq->dev;
+    if (!dev->dbbuf) {
+        ioq->sq_shadow = ioq->cq_shadow = NULL;
+        ioq->sq_eventidx = ioq->cq_eventidx = NULL;
+        return;
+    }
+    ioq->sq_shadow = dev->dbbuf + (2 * ioq->id * dev->dbstride);
+    ioq->cq_shadow = ioq->sq_shadow + dev->dbstride;
+    ioq->sq_eventidx = dev->eibuf + (2 * ioq->id * dev->dbstride);
+    ioq->cq_eventidx = ioq->sq_eventidx + dev->dbstride;
+    *ioq->sq_shadow = *ioq->cq_shadow = 0;
+    *ioq->sq_eventidx = *ioq->cq_eventidx = 0;
+}
+
 /**
  * Create an IO submission-completion queue pair.
  * @param   dev         device context
@@ -550,10 +759,11 @@ int nvme_cmd_write(nvme_queue_t* ioq, u16 cid, int nsid,
  * @param   sqpa        submission queue IO physical address
  * @param   cqbuf       completion queue buffer
  * @param   cqpa        admin completion IO physical address
+ * @param   iv          interrupt vector (-1 for polled queue)
  * @return  pointer to the created io queue or NULL if failure.
  */
-nvme_queue_t* nvme_ioq_create(nvme_device_t* dev, nvme_queue_t* ioq,
-            int id, int qsize, void* sqbuf, u64 sqpa, void* cqbuf, u64 cqpa)
+nvme_queue_t* nvme_ioq_create(nvme_device_t* dev, nvme_queue_t* ioq, int id,
+            int qsize, void* sqbuf, u64 sqpa, void* cqbuf, u64 cqpa, int iv)
 {
     if (!ioq) ioq = zalloc(sizeof(*ioq));
     else ioq->ext = 1;
@@ -565,14 +775,36 @@ nvme_queue_t* nvme_ioq_create(nvme_device_t* dev, nvme_queue_t* ioq,
     ioq->cq = cqbuf;
     ioq->sq_doorbell = dev->reg->sq0tdbl + (2 * id * dev->dbstride);
     ioq->cq_doorbell = ioq->sq_doorbell + dev->dbstride;
+    ioq->iv = iv;
+    nvme_ioq_init_shadow(ioq);
 
-    if (nvme_acmd_create_cq(ioq, cqpa) || nvme_acmd_create_sq(ioq, sqpa)) {
-        free(ioq);
+    if (nvme_acmd_create_cq(ioq, cqpa, iv) || nvme_acmd_create_sq(ioq, sqpa)) {
+        if (!ioq->ext) free(ioq);
         return NULL;
     }
     return ioq;
 }
 
+/**
+ * Recreate an IO submission-completion queue pair in place (i.e. reusing
+ * the same queue memory) after a controller reset.
+ * @param   ioq         io queue
+ * @param   sqpa        submission queue IO physical address
+ * @param   cqpa        completion queue IO physical address
+ * @return  0 if ok else error status.
+ */
+int nvme_ioq_recreate(nvme_queue_t* ioq, u64 sqpa, u64 cqpa)
+{
+    ioq->sq_head = ioq->sq_tail = ioq->sq_db = 0;
+    ioq->cq_head = ioq->cq_phase = 0;
+    memset(ioq->cq, 0, ioq->size * sizeof(nvme_cq_entry_t));
+    nvme_ioq_init_shadow(ioq);
+
+    int err = nvme_acmd_create_cq(ioq, cqpa, ioq->iv);
+    if (!err) err = nvme_acmd_create_sq(ioq, sqpa);
+    return err;
+}
+
 /**
  * Delete an IO submission-completion queue pair.
  * @param   ioq         io queue to delete
@@ -601,12 +833,18 @@ nvme_queue_t* nvme_adminq_setup(nvme_device_t* dev, int qsize,
 {
     if (nvme_ctlr_disable(dev)) return NULL;
 
+    // a controller reset also clears the doorbell buffer config
+    dev->dbbuf = dev->eibuf = NULL;
+
     nvme_queue_t* adminq = &dev->adminq;
     adminq->dev = dev;
     adminq->id = 0;
     adminq->size = qsize;
     adminq->sq = sqbuf;
     adminq->cq = cqbuf;
+    adminq->sq_head = adminq->sq_tail = adminq->sq_db = 0;
+    adminq->cq_head = adminq->cq_phase = 0;
+    memset(cqbuf, 0, qsize * sizeof(nvme_cq_entry_t));
     adminq->sq_doorbell = dev->reg->sq0tdbl;
     adminq->cq_doorbell = adminq->sq_doorbell + dev->dbstride;
 
@@ -38,6 +38,9 @@
 #define _UNVME_NVME_H
 
 #include <stdint.h>
+#include <string.h>
+
+#include "unvme_barrier.h"
 
 #if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
     #pragma error "only support little endian CPU architecture"
@@ -64,6 +67,7 @@ enum {
     NVME_CMD_READ           = 0x2,      ///< read
     NVME_CMD_WRITE_UNCOR    = 0x4,      ///< write uncorrectable
     NVME_CMD_COMPARE        = 0x5,      ///< compare
+    NVME_CMD_WRITE_ZEROES   = 0x8,      ///< write zeroes
     NVME_CMD_DS_MGMT        = 0x9,      ///< dataset management
 };
 
@@ -79,10 +83,26 @@ enum {
     NVME_ACMD_SET_FEATURES  = 0x9,      ///< set features
     NVME_ACMD_GET_FEATURES  = 0xA,      ///< get features
     NVME_ACMD_ASYNC_EVENT   = 0xC,      ///< asynchronous event
+    NVME_ACMD_NS_MGMT       = 0xD,      ///< namespace management
     NVME_ACMD_FW_ACTIVATE   = 0x10,     ///< firmware activate
     NVME_ACMD_FW_DOWNLOAD   = 0x11,     ///< firmware image download
+    NVME_ACMD_NS_ATTACH     = 0x15,     ///< namespace attachment
+    NVME_ACMD_DBBUF_CONFIG  = 0x7C,     ///< doorbell buffer config
+    NVME_ACMD_FORMAT_NVM    = 0x80,     ///< format NVM
+};
+
+/// NVMe optional admin command support (identify controller oacs bits)
+enum {
+    NVME_OACS_SECURITY      = 0x1,      ///< security send/receive
+    NVME_OACS_FORMAT        = 0x2,      ///< format NVM
+    NVME_OACS_FIRMWARE      = 0x4,      ///< firmware download/commit
+    NVME_OACS_NS_MGMT       = 0x8,      ///< namespace management/attachment
+    NVME_OACS_DBBUF_CONFIG  = 0x100,    ///< doorbell buffer config
 };
 
+/// NVMe broadcast namespace id (all namespaces or their common capabilities)
+#define NVME_NSID_ALL           0xffffffff
+
 /// NVMe feature identifiers
 enum {
     NVME_FEATURE_ARBITRATION = 0x1,     ///< arbitration
@@ -96,6 +116,9 @@ enum {
     NVME_FEATURE_INT_VECTOR = 0x9,      ///< interrupt vector config
     NVME_FEATURE_WRITE_ATOMICITY = 0xA, ///< write atomicity
     NVME_FEATURE_ASYNC_EVENT = 0xB,     ///< async event config
+    NVME_FEATURE_AUTO_PST = 0xC,        ///< autonomous power state transition
+    NVME_FEATURE_HOST_MEM_BUF = 0xD,    ///< host memory buffer
+    NVME_FEATURE_HOST_BEHAVIOR = 0x16,  ///< host behavior support
 };
 
 /// Version
@@ -307,6 +330,60 @@ typedef struct _nvme_acmd_abort {
     u32                     cdw11_15[5]; ///< reserved (cdw 11-15)
 } nvme_acmd_abort_t;
 
+/// Admin command:  Format NVM
+typedef struct _nvme_acmd_format_nvm {
+    nvme_command_common_t   common;     ///< common cdw 0
+    u32                     lbaf : 4;   ///< LBA format (cdw 10)
+    u32                     mset : 1;   ///< metadata settings
+    u32                     pi : 3;     ///< protection information
+    u32                     pil : 1;    ///< protection information location
+    u32                     ses : 3;    ///< secure erase settings
+    u32                     rsvd10 : 20; ///< reserved (in cdw 10)
+    u32                     cdw11_15[5]; ///< reserved (cdw 11-15)
+} nvme_acmd_format_nvm_t;
+
+/// Admin command:  Namespace Management & Namespace Attachment
+typedef struct _nvme_acmd_ns_mgmt {
+    nvme_command_common_t   common;     ///< common cdw 0
+    u32                     sel : 4;    ///< select (cdw 10)
+    u32                     rsvd10 : 28; ///< reserved (in cdw 10)
+    u32                     cdw11_15[5]; ///< reserved (cdw 11-15)
+} nvme_acmd_ns_mgmt_t;
+
+/// Admin data:  Namespace Attachment Controller List
+typedef struct _nvme_ctlr_list {
+    u16                     count;      ///< number of identifiers
+    u16                     id[2047];   ///< controller identifiers
+} nvme_ctlr_list_t;
+
+/// Admin data:  Identify Controller - Power State Descriptor
+typedef struct _nvme_power_state {
+    u16                     mp;         ///< maximum power
+    u8                      rsvd2;      ///< reserved
+    u8                      mxps : 1;   ///< max power scale (0=0.01W 1=0.0001W)
+    u8                      nops : 1;   ///< non-operational state
+    u8                      rsvd3 : 6;  ///< reserved
+    u32                     enlat;      ///< entry latency (in microseconds)
+    u32                     exlat;      ///< exit latency (in microseconds)
+    u8                      rrt : 5;    ///< relative read throughput
+    u8                      rsvd12 : 3; ///< reserved
+    u8                      rrl : 5;    ///< relative read latency
+    u8                      rsvd13 : 3; ///< reserved
+    u8                      rwt : 5;    ///< relative write throughput
+    u8                      rsvd14 : 3; ///< reserved
+    u8                      rwl : 5;    ///< relative write latency
+    u8                      rsvd15 : 3; ///< reserved
+    u16                     idlp;       ///< idle power
+    u8                      rsvd18 : 6; ///< reserved
+    u8                      ips : 2;    ///< idle power scale
+    u8                      rsvd19;     ///< reserved
+    u16                     actp;       ///< active power
+    u8                      apw : 3;    ///< active power workload
+    u8                      rsvd22 : 3; ///< reserved
+    u8                      aps : 2;    ///< active power scale
+    u8                      rsvd23[9];  ///< reserved
+} nvme_power_state_t;
+
 /// Admin data:  Identify Controller Data
 typedef struct _nvme_identify_ctlr {
     u16                     vid;        ///< PCI vendor id
@@ -318,7 +395,18 @@ typedef struct _nvme_identify_ctlr {
     u8                      ieee[3];    ///< IEEE OUI identifier
     u8                      mic;        ///< multi-interface capabilities
     u8                      mdts;       ///< max data transfer size
-    u8                      rsvd78[178]; ///< reserved (78-255)
+    u16                     cntlid;     ///< controller id
+    u32                     ver;        ///< version
+    u32                     rtd3r;      ///< RTD3 resume latency
+    u32                     rtd3e;      ///< RTD3 entry latency
+    u32                     oaes;       ///< optional async events supported
+    u32                     ctratt;     ///< controller attributes
+    u16                     rrls;       ///< read recovery levels supported
+    u8                      rsvd102[9]; ///< reserved (102-110)
+    u8                      cntrltype;  ///< controller type
+    u8                      fguid[16];  ///< FRU globally unique identifier
+    u16                     crdt[3];    ///< command retry delay times (100ms)
+    u8                      rsvd134[122]; ///< reserved (134-255)
     u16                     oacs;       ///< optional admin command support
     u8                      acl;        ///< abort command limit
     u8                      aerl;       ///< async event request limit
@@ -327,7 +415,26 @@ typedef struct _nvme_identify_ctlr {
     u8                      elpe;       ///< error log page entries
     u8                      npss;       ///< number of power states support
     u8                      avscc;      ///< admin vendor specific config
-    u8                      rsvd265[247]; ///< reserved (265-511)
+    u8                      apsta;      ///< autonomous power state transition
+    u16                     wctemp;     ///< warning composite temp threshold
+    u16                     cctemp;     ///< critical composite temp threshold
+    u16                     mtfa;       ///< max time for firmware activation
+    u32                     hmpre;      ///< host memory buffer preferred size
+    u32                     hmmin;      ///< host memory buffer minimum size
+    u8                      tnvmcap[16]; ///< total NVM capacity
+    u8                      unvmcap[16]; ///< unallocated NVM capacity
+    u32                     rpmbs;      ///< replay protected memory block
+    u16                     edstt;      ///< extended device self-test time
+    u8                      dsto;       ///< device self-test options
+    u8                      fwug;       ///< firmware update granularity
+    u16                     kas;        ///< keep alive support
+    u16                     hctma;      ///< host controlled thermal management
+    u16                     mntmt;      ///< minimum thermal management temp
+    u16                     mxtmt;      ///< maximum thermal management temp
+    u32                     sanicap;    ///< sanitize capabilities
+    u32                     hmminds;    ///< host memory buffer min descriptor size
+    u16                     hmmaxd;     ///< host memory buffer max descriptors
+    u8                      rsvd338[174]; ///< reserved (338-511)
     u8                      sqes;       ///< submission queue entry size
     u8                      cqes;       ///< completion queue entry size
     u8                      rsvd514[2]; ///< reserved (514-515)
@@ -341,7 +448,7 @@ typedef struct _nvme_identify_ctlr {
     u8                      nvscc;      ///< NVM vendor specific config
     u8                      rsvd531[173]; ///< reserved (531-703)
     u8                      rsvd704[1344]; ///< reserved (704-2047)
-    u8                      psd[1024];  ///< power state 0-31 descriptors
+    nvme_power_state_t      psd[32];    ///< power state 0-31 descriptors
     u8                      vs[1024];   ///< vendor specific
 } nvme_identify_ctlr_t;
 
@@ -364,7 +471,8 @@ typedef struct _nvme_identify_ns {
     u8                      mc;         ///< metadata capabilities
     u8                      dpc;        ///< data protection capabilities
     u8                      dps;        ///< data protection settings
-    u8                      rsvd30[98]; ///< reserved (30-127)
+    u8                      nmic;       ///< multi-path and sharing capabilities
+    u8                      rsvd31[97]; ///< reserved (31-127)
     nvme_lba_format_t       lbaf[16];   ///< lba format support
     u8                      rsvd192[192]; ///< reserved (383-192)
     u8                      vs[3712];   ///< vendor specific
@@ -429,6 +537,22 @@ typedef struct _nvme_feature_power_mgmt {
     u32                     rsvd: 27;   ///< reserved
 } nvme_feature_power_mgmt_t;
 
+/// Admin feature:  Autonomous Power State Transition
+typedef struct _nvme_feature_auto_pst {
+    u32                     apste: 1;   ///< autonomous power state enable
+    u32                     rsvd: 31;   ///< reserved
+} nvme_feature_auto_pst_t;
+
+/// Admin feature:  Autonomous Power State Transition Data
+typedef struct _nvme_feature_auto_pst_data {
+    struct {
+        u64                 rsvd0: 3;   ///< reserved
+        u64                 itps: 5;    ///< idle transition power state
+        u64                 itpt: 24;   ///< idle time prior to transition (ms)
+        u64                 rsvd32: 32; ///< reserved
+    } entry[32];                        ///< entry for each power state
+} nvme_feature_auto_pst_data_t;
+
 /// Admin feature:  LBA Range Type Data
 typedef struct _nvme_feature_lba_data {
     struct {
@@ -498,6 +622,26 @@ typedef struct _nvme_feature_async_event {
     u8                      rsvd[3];    ///< reserved
 } nvme_feature_async_event_t;
 
+/// Admin feature:  Host Memory Buffer
+typedef struct _nvme_feature_host_mem_buf {
+    u32                     ehm: 1;     ///< enable host memory
+    u32                     mr: 1;      ///< memory return
+    u32                     rsvd: 30;   ///< reserved
+} nvme_feature_host_mem_buf_t;
+
+/// Admin data:  Host Memory Buffer Descriptor Entry
+typedef struct _nvme_hmb_desc {
+    u64                     badd;       ///< buffer address
+    u32                     bsize;      ///< buffer size (in memory page size)
+    u32                     rsvd;       ///< reserved
+} nvme_hmb_desc_t;
+
+/// Admin data:  Host Behavior Support
+typedef struct _nvme_host_behavior {
+    u8                      acre;       ///< advanced command retry enable
+    u8                      rsvd[511];  ///< reserved
+} nvme_host_behavior_t;
+
 /// Admin command:  Get Feature
 typedef struct _nvme_acmd_get_features {
     nvme_command_common_t   common;     ///< common cdw 0
@@ -511,6 +655,7 @@ typedef struct _nvme_acmd_set_features {
     u8                      fid;        ///< feature id (cdw 10:0-7)
     u8                      rsvd10[3];  ///< reserved (cdw 10:8-31)
     u32                     val;        ///< cdw 11
+    u32                     cdw12_15[4]; ///< feature specific (cdw 12-15)
 } nvme_acmd_set_features_t;
 
 /// Submission queue entry
@@ -526,6 +671,8 @@ typedef union _nvme_sq_entry {
     nvme_acmd_get_log_page_t get_log_page; ///< get log page command
     nvme_acmd_get_features_t get_features; ///< get feature
     nvme_acmd_set_features_t set_features; ///< set feature
+    nvme_acmd_format_nvm_t  format_nvm; ///< format NVM command
+    nvme_acmd_ns_mgmt_t     ns_mgmt;    ///< namespace management/attachment
 } nvme_sq_entry_t;
 
 /// Completion queue entry
@@ -541,7 +688,7 @@ typedef struct _nvme_cq_entry {
             u16             p : 1;      ///< phase tag id
             u16             sc : 8;     ///< status code
             u16             sct : 3;    ///< status code type
-            u16             rsvd3 : 2;  ///< reserved
+            u16             crd : 2;    ///< command retry delay
             u16             m : 1;      ///< more
             u16             dnr : 1;    ///< do not retry
         };
@@ -559,11 +706,17 @@ typedef struct _nvme_queue {
     nvme_cq_entry_t*        cq;         ///< completion queue entries
     u32*                    sq_doorbell; ///< submission queue doorbell
     u32*                    cq_doorbell; ///< completion queue doorbell
+    u32*                    sq_shadow;  ///< submission queue shadow doorbell
+    u32*                    cq_shadow;  ///< completion queue shadow doorbell
+    u32*                    sq_eventidx; ///< submission queue event index
+    u32*                    cq_eventidx; ///< completion queue event index
     int                     sq_head;    ///< submission queue head
     int                     sq_tail;    ///< submission queue tail
+    int                     sq_db;      ///< submission queue tail last rung
     int                     cq_head;    ///< completion queue head
     u16                     cq_phase;   ///< completion queue phase bit
     u16                     ext;        ///< externally allocated flag
+    int                     iv;         ///< interrupt vector (-1 if polled)
 } nvme_queue_t;
 
 /// Device context
@@ -581,6 +734,8 @@ typedef struct _nvme_device {
     u16                     mpsmin;     ///< MPSMIN
     u16                     mpsmax;     ///< MPSMAX
     u16                     ext;        ///< externally allocated flag
+    u32*                    dbbuf;      ///< shadow doorbell buffer
+    u32*                    eibuf;      ///< event index buffer
 } nvme_device_t;
 
 
@@ -588,20 +743,29 @@ typedef struct _nvme_device {
 nvme_device_t* nvme_create(nvme_device_t* dev, int mapfd);
 void nvme_delete(nvme_device_t* dev);
 
+int nvme_ctlr_fatal(nvme_device_t* dev);
 nvme_queue_t* nvme_adminq_setup(nvme_device_t* dev, int qsize, void* sqbuf, u64 sqpa, void* cqbuf, u64 cqpa);
-nvme_queue_t* nvme_ioq_create(nvme_device_t* dev, nvme_queue_t* ioq, int id, int qsize, void* sqbuf, u64 sqpa, void* cqbuf, u64 cqpa);
+nvme_queue_t* nvme_ioq_create(nvme_device_t* dev, nvme_queue_t* ioq, int id, int qsize, void* sqbuf, u64 sqpa, void* cqbuf, u64 cqpa, int iv);
+int nvme_ioq_recreate(nvme_queue_t* ioq, u64 sqpa, u64 cqpa);
 int nvme_ioq_delete(nvme_queue_t* ioq);
 
 int nvme_acmd_identify(nvme_device_t* dev, int nsid, u64 prp1, u64 prp2);
 int nvme_acmd_get_log_page(nvme_device_t* dev, int nsid, int lid, int numd, u64 prp1, u64 prp2);
 int nvme_acmd_get_features(nvme_device_t* dev, int nsid, int fid, u64 prp1, u64 prp2, u32* res);
 int nvme_acmd_set_features(nvme_device_t* dev, int nsid, int fid, u64 prp1, u64 prp2, u32* res);
-int nvme_acmd_create_cq(nvme_queue_t* ioq, u64 prp);
+int nvme_acmd_dbbuf_config(nvme_device_t* dev, void* dbbuf, u64 dbpa, void* eibuf, u64 eipa);
+int nvme_acmd_set_hmb(nvme_device_t* dev, int enable, u32 hsize, u64 hmdla, u32 hmdlec);
+int nvme_acmd_create_cq(nvme_queue_t* ioq, u64 prp, int iv);
 int nvme_acmd_create_sq(nvme_queue_t* ioq, u64 prp);
 int nvme_acmd_delete_cq(nvme_queue_t* ioq);
 int nvme_acmd_delete_sq(nvme_queue_t* ioq);
+int nvme_acmd_format_nvm(nvme_device_t* dev, int nsid, int lbaf, int ses);
+int nvme_acmd_ns_create(nvme_device_t* dev, u64 prp1, u32* nsid);
+int nvme_acmd_ns_delete(nvme_device_t* dev, int nsid);
+int nvme_acmd_ns_attach(nvme_device_t* dev, int nsid, int detach, u64 prp1);
 
 int nvme_cmd_vs(nvme_queue_t* q, int opc, u16 cid, int nsid, u64 prp1, u64 prp2, u32 cdw10_15[6]);
+int nvme_cmd_post(nvme_queue_t* q, const nvme_sq_entry_t* sqe);
 int nvme_cmd_rw(nvme_queue_t* ioq, int opc, u16 cid, int nsid, u64 slba, int nlb, u64 prp1, u64 prp2);
 int nvme_cmd_read(nvme_queue_t* ioq, u16 cid, int nsid, u64 slba, int nlb, u64 prp1, u64 prp2);
 int nvme_cmd_write(nvme_queue_t* ioq, u16 cid, int nsid, u64 slba, int nlb, u64 prp1, u64 prp2);
@@ -609,5 +773,153 @@ int nvme_cmd_write(nvme_queue_t* ioq, u16 cid, int nsid, u64 slba, int nlb, u64
 int nvme_check_completion(nvme_queue_t* q, int* stat, u32* cqe_cs);
 int nvme_wait_completion(nvme_queue_t* q, int cid, int timeout);
 
+
+/*
+ * The queue entry and doorbell accesses of the I/O path are inlined into
+ * all their users (the NVMe module, the library I/O paths and raw queues).
+ */
+
+/**
+ * Update a queue doorbell.  If shadow doorbells are configured, write the
+ * shadow doorbell and only write the MMIO doorbell if the controller's
+ * event index indicates that it needs to be notified.
+ * The caller must have issued the barrier ordering its prior queue entry
+ * accesses before the doorbell update.
+ * @param   db          doorbell register
+ * @param   shadow      shadow doorbell (NULL if not configured)
+ * @param   ei          event index
+ * @param   val         new doorbell value
+ */
+static inline __attribute__((always_inline))
+void nvme_ring_doorbell(u32* db, u32* shadow, u32* ei, u16 val)
+{
+    if (shadow) {
+        u16 old = *(volatile u32*)shadow;
+        *(volatile u32*)shadow = val;
+        unvme_mb();
+        u16 eventidx = *(volatile u32*)ei;
+        if ((u16)(val - eventidx - 1) >= (u16)(val - old)) return;
+    }
+    *(volatile u32*)db = val;
+}
+
+/**
+ * Ring the submission queue doorbell for all entries posted since the
+ * last ring.  This is the only place where submission queue entry stores
+ * are ordered before the doorbell, so a batch of commands costs a single
+ * barrier and MMIO write.
+ * @param   q           queue
+ */
+static inline __attribute__((always_inline))
+void nvme_sq_ring(nvme_queue_t* q)
+{
+    if (q->sq_db == q->sq_tail) return;
+    q->sq_db = q->sq_tail;
+    unvme_dma_wmb();
+    nvme_ring_doorbell(q->sq_doorbell, q->sq_shadow, q->sq_eventidx, q->sq_db);
+}
+
+/**
+ * Post an entry at submission queue tail without ringing the doorbell.
+ * @param   q           queue
+ * @return  0 if ok else -1.
+ */
+static inline __attribute__((always_inline))
+int nvme_post_cmd(nvme_queue_t* q)
+{
+    int tail = q->sq_tail;
+    if (++tail == q->size) tail = 0;
+#if 0
+    // Some SSD does not advance sq_head properly (e.g. Intel DC D3600)
+    // so let the upper layer detect queue full error condition
+    if (tail == q->sq_head) return -1;
+#endif
+    q->sq_tail = tail;
+    return 0;
+}
+
+/**
+ * Fill in a read write command entry.
+ * @param   sqe         submission queue entry
+ * @param   opc         op code
+ * @param   cid         command id
+ * @param   nsid        namespace
+ * @param   slba        startling logical block address
+ * @param   nlb         number of logical blocks
+ * @param   prp1        PRP1 address
+ * @param   prp2        PRP2 address
+ */
+static inline __attribute__((always_inline))
+void nvme_cmd_rw_fill(nvme_sq_entry_t* sqe, int opc, u16 cid, int nsid,
+                      u64 slba, int nlb, u64 prp1, u64 prp2)
+{
+    nvme_command_rw_t* cmd = &sqe->rw;
+
+    memset(cmd, 0, sizeof (*cmd));
+    cmd->common.opc = opc;
+    cmd->common.cid = cid;
+    cmd->common.nsid = nsid;
+    cmd->common.prp1 = prp1;
+    cmd->common.prp2 = prp2;
+    cmd->slba = slba;
+    cmd->nlb = nlb - 1;
+}
+
+/**
+ * NVMe post a read write command without ringing the doorbell.
+ * Call nvme_sq_ring() after the last command of a batch is posted.
+ * @param   ioq         io queue
+ * @param   opc         op code
+ * @param   cid         command id
+ * @param   nsid        namespace
+ * @param   slba        startling logical block address
+ * @param   nlb         number of logical blocks
+ * @param   prp1        PRP1 address
+ * @param   prp2        PRP2 address
+ * @return  0 if ok else -1.
+ */
+static inline __attribute__((always_inline))
+int nvme_cmd_rw_post(nvme_queue_t* ioq, int opc, u16 cid, int nsid,
+                     u64 slba, int nlb, u64 prp1, u64 prp2)
+{
+    nvme_cmd_rw_fill(&ioq->sq[ioq->sq_tail], opc, cid, nsid, slba, nlb, prp1, prp2);
+    return nvme_post_cmd(ioq);
+}
+
+/**
+ * Get the completion queue head entry if the controller has posted it.
+ * @param   q           queue
+ * @return  the completion entry or NULL if there's no completion.
+ */
+static inline __attribute__((always_inline))
+nvme_cq_entry_t* nvme_cq_peek(nvme_queue_t* q)
+{
+    nvme_cq_entry_t* cqe = &q->cq[q->cq_head];
+    u16 psf = unvme_load_acquire16(&cqe->psf);
+    return (psf & 1) == q->cq_phase ? NULL : cqe;
+}
+
+/**
+ * Consume the completion queue head entry (after reading it).  The head
+ * doorbell is only rung when no further completion is ready, so a batch
+ * of completions costs a single barrier and MMIO write.  Deferring it is
+ * safe since the completion queue can never fill up (there can be at most
+ * size - 1 outstanding commands).
+ * @param   q           queue
+ */
+static inline __attribute__((always_inline))
+void nvme_cq_pop(nvme_queue_t* q)
+{
+    if (++q->cq_head == q->size) {
+        q->cq_head = 0;
+        q->cq_phase = !q->cq_phase;
+    }
+    u16 psf = unvme_load_acquire16(&q->cq[q->cq_head].psf);
+    if ((psf & 1) == q->cq_phase) {
+        unvme_dma_rmb();
+        nvme_ring_doorbell(q->cq_doorbell, q->cq_shadow, q->cq_eventidx, q->cq_head);
+    }
+}
+
 #endif  // _UNVME_NVME_H
 
@@ -0,0 +1,259 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNVMe raw queue interface.
+ *
+ * A raw queue hands an I/O queue over to the application, which tracks its
+ * own requests instead of using the unvme descriptors.  The application
+ * reserves submission queue slots, writes the entries directly (with the
+ * read/write and PRP helpers below), publishes them with one doorbell, and
+ * then peeks and consumes the completion entries, mapping each command id
+ * to its own context (e.g. using the ctx table).  Command ids are chosen by
+ * the application and must be unique among its outstanding commands and
+ * less than the queue size (which selects the PRP list page of a command).
+ *
+ * A raw queue is not recovered by the driver, so all of its outstanding
+ * commands are dropped upon a controller reset.  The reset only increments
+ * resets and leaves the queue failed, without recreating it or touching its
+ * state (which belongs to the application thread).  Once the inline
+ * functions below see a reset, they drop the pending and reserved counts
+ * and no longer access the queue, i.e. no slot is reserved, no doorbell is
+ * rung and no completion is returned.  The application should then close
+ * the raw queue, which recreates the queue, and reopen it.
+ */
+
+#ifndef _UNVME_RAWQ_H
+#define _UNVME_RAWQ_H
+
+#include <string.h>
+
+#include "unvme.h"
+#include "unvme_nvme.h"
+#include "unvme_barrier.h"
+
+/// Raw queue context
+typedef struct _unvme_rawq {
+    nvme_queue_t*       nvmeq;      ///< NVMe queue
+    const unvme_ns_t*   ns;         ///< namespace
+    int                 qid;        ///< client queue index
+    int                 size;       ///< queue size
+    int                 pending;    ///< number of submitted commands
+    int                 reserved;   ///< number of reserved free slots
+    u32                 resets;     ///< number of controller resets
+    u32                 resetseen;  ///< resets accounted for by the application
+    u16                 pageshift;  ///< page size shift value
+    void*               prplist;    ///< PRP list pages (one page per cid)
+    u64                 prpaddr;    ///< PRP list pages DMA address
+    void**              ctx;        ///< per cid application context table
+} unvme_rawq_t;
+
+// Export functions
+unvme_rawq_t* unvme_rawq_open(const unvme_ns_t* ns, int qid);
+int unvme_rawq_close(unvme_rawq_t* rq);
+int unvme_rawq_map(unvme_rawq_t* rq, void* buf, u64 bufsz, u64* addr);
+
+
+/**
+ * Compose the PRP entries of a DMA address range in a PRP list page.
+ * The range may start at any dword offset in a page (as PRP1 does), and
+ * the entries after the first are of the following whole pages.
+ * @param   prplist     PRP list page
+ * @param   prpaddr     PRP list page DMA address
+ * @param   addr        DMA address (dword aligned)
+ * @param   bufsz       buffer size
+ * @param   pageshift   memory page size shift
+ * @param   prp1        returned prp1 value
+ * @param   prp2        returned prp2 value
+ */
+static inline __attribute__((always_inline))
+void unvme_prp_build(u64* prplist, u64 prpaddr, u64 addr, u64 bufsz,
+                     int pageshift, u64* prp1, u64* prp2)
+{
+    u64 pagesize = (u64)1 << pageshift;
+    u64 first = pagesize - (addr & (pagesize - 1));
+    *prp1 = addr;
+    *prp2 = 0;
+    if (bufsz <= first) return;
+    u64 page = addr + first;
+    u64 numpages = (bufsz - first + pagesize - 1) >> pageshift;
+    if (numpages == 1) {
+        *prp2 = page;
+    } else {
+        *prp2 = prpaddr;
+        u64 i;
+        for (i = 0; i < numpages; i++) {
+            *prplist++ = page;
+            page += pagesize;
+        }
+    }
+}
+
+/**
+ * Drop the pending and reserved commands if a controller reset happened.
+ * @param   rq          raw queue
+ * @return  1 if a reset happened since the last check else 0.
+ */
+static inline int unvme_rawq_check_reset(unvme_rawq_t* rq)
+{
+    u32 resets = __atomic_load_n(&rq->resets, __ATOMIC_ACQUIRE);
+    if (resets == rq->resetseen) return 0;
+    rq->resetseen = resets;
+    rq->pending = 0;
+    rq->reserved = 0;
+    return 1;
+}
+
+/**
+ * Check if the raw queue was failed by a controller reset.
+ * @param   rq          raw queue
+ * @return  1 if failed else 0.
+ */
+static inline int unvme_rawq_failed(unvme_rawq_t* rq)
+{
+    unvme_rawq_check_reset(rq);
+    return rq->resetseen != 0;
+}
+
+/**
+ * Reserve free submission queue slots.
+ * @param   rq          raw queue
+ * @param   count       number of slots wanted
+ * @return  the number of slots reserved (may be less than count, or 0 if
+ *          the queue was failed by a reset).
+ */
+static inline int unvme_rawq_reserve(unvme_rawq_t* rq, int count)
+{
+    if (unvme_rawq_failed(rq)) return 0;
+    int avail = rq->size - 1 - rq->pending - rq->reserved;
+    if (count > avail) count = avail;
+    rq->reserved += count;
+    return count;
+}
+
+/**
+ * Get the next reserved submission queue entry to be filled in.  The entry
+ * is not visible to the controller until unvme_rawq_publish is called.
+ * @param   rq          raw queue
+ * @return  the submission queue entry or NULL if none reserved (or the
+ *          reservation was dropped by a reset).
+ */
+static inline nvme_sq_entry_t* unvme_rawq_sqe(unvme_rawq_t* rq)
+{
+    if (unvme_rawq_failed(rq) || !rq->reserved) return NULL;
+    nvme_queue_t* q = rq->nvmeq;
+    nvme_sq_entry_t* sqe = &q->sq[q->sq_tail];
+    if (++q->sq_tail == q->size) q->sq_tail = 0;
+    rq->reserved--;
+    rq->pending++;
+    return sqe;
+}
+
+/**
+ * Get the PRP entries of a data buffer for a command.
+ * @param   rq          raw queue
+ * @param   cid         command id (selecting its PRP list page)
+ * @param   addr        buffer DMA address (see unvme_rawq_map)
+ * @param   bufsz       buffer size
+ * @param   prp1        returned prp1 value
+ * @param   prp2        returned prp2 value
+ */
+static inline void unvme_rawq_prps(unvme_rawq_t* rq, u16 cid, u64 addr,
+                                   u64 bufsz, u64* prp1, u64* prp2)
+{
+    u64 prpoff = (u64)cid << rq->pageshift;
+    unvme_prp_build((u64*)((u8*)rq->prplist + prpoff), rq->prpaddr + prpoff,
+                    addr, bufsz, rq->pageshift, prp1, prp2);
+}
+
+/**
+ * Fill in a read/write command entry.
+ * @param   rq          raw queue
+ * @param   sqe         submission queue entry (from unvme_rawq_sqe)
+ * @param   opc         op code (NVME_CMD_READ or NVME_CMD_WRITE)
+ * @param   cid         command id
+ * @param   addr        buffer DMA address (see unvme_rawq_map)
+ * @param   slba        starting logical block
+ * @param   nlb         number of logical blocks
+ */
+static inline void unvme_rawq_rw(unvme_rawq_t* rq, nvme_sq_entry_t* sqe,
+                                 int opc, u16 cid, u64 addr, u64 slba, u32 nlb)
+{
+    u64 prp1, prp2;
+    unvme_rawq_prps(rq, cid, addr, (u64)nlb << rq->ns->blockshift, &prp1, &prp2);
+    nvme_cmd_rw_fill(sqe, opc, cid, rq->ns->id, slba, nlb, prp1, prp2);
+}
+
+/**
+ * Publish all the filled submission queue entries with one doorbell.
+ * @param   rq          raw queue
+ */
+static inline void unvme_rawq_publish(unvme_rawq_t* rq)
+{
+    if (!unvme_rawq_failed(rq)) nvme_sq_ring(rq->nvmeq);
+}
+
+/**
+ * Peek at the next completion queue entry.
+ * @param   rq          raw queue
+ * @return  the completion entry or NULL if none is ready (or the queue was
+ *          failed by a reset).
+ */
+static inline nvme_cq_entry_t* unvme_rawq_peek(unvme_rawq_t* rq)
+{
+    if (unvme_rawq_failed(rq)) return NULL;
+    return nvme_cq_peek(rq->nvmeq);
+}
+
+/**
+ * Consume the next completion queue entry.
+ * @param   rq          raw queue
+ * @param   stat        completion status returned (0 if ok)
+ * @param   cqe_cs      CQE command specific DW0 returned (may be NULL)
+ * @return  the completed command id or -1 if none is ready (or the queue
+ *          was failed by a reset).
+ */
+static inline int unvme_rawq_consume(unvme_rawq_t* rq, int* stat, u32* cqe_cs)
+{
+    *stat = 0;
+    if (unvme_rawq_failed(rq)) return -1;
+    nvme_cq_entry_t* cqe = nvme_cq_peek(rq->nvmeq);
+    if (!cqe) return -1;
+    *stat = cqe->psf & 0xfffe;
+    if (cqe_cs) *cqe_cs = cqe->cs;
+    int cid = cqe->cid;
+    nvme_cq_pop(rq->nvmeq);
+    if (rq->pending) rq->pending--;
+    return cid;
+}
+
+#endif  // _UNVME_RAWQ_H
@@ -38,6 +38,8 @@
 #include <sys/mman.h>
 #include <sys/eventfd.h>
 #include <linux/pci.h>
+#include <linux/dma-heap.h>
+#include <linux/dma-buf.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
@@ -56,9 +58,21 @@
 /// Size of UIO buffer/device
 #define UIO_SIZE 0x40000000
 
+/// DMA heap for exported (dma-buf) buffers
+#define DMA_HEAP "/dev/dma_heap/linux,cma"
+
 /// IRQ index names
 const char* vfio_irq_names[] = { "INTX", "MSI", "MSIX", "ERR", "REQ" };
 
+/// UIO memory arena shared by all devices of the process
+static struct {
+    pthread_mutex_t         lock;       ///< arena lock
+    int                     refcount;   ///< number of devices using it
+    int                     fd;         ///< UIO device file descriptor
+    void*                   buf;        ///< UIO memory mapping
+    vfio_mem_t*             memlist;    ///< allocations in address order
+} vfio_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
 
 /**
  * Read a vfio device.
@@ -87,39 +101,16 @@ static void vfio_write(vfio_device_t* dev, void* buf, size_t len, off_t off)
 }
 
 /**
- * Allocate VFIO memory.  The size will be rounded to page aligned size.
- * If pmb is set, it indicates memory has been premapped.
+ * Add a memory entry to the device memory list.
  * @param   dev         device context
- * @param   size        size
- * @param   pmb         premapped buffer
- * @return  memory structure pointer or NULL if error.
+ * @param   mem         memory entry
  */
-static vfio_mem_t* vfio_mem_alloc(vfio_device_t* dev, size_t size, void* pmb)
+static void vfio_mem_add(vfio_device_t* dev, vfio_mem_t* mem)
 {
-    vfio_mem_t* mem = zalloc(sizeof(*mem));
-    mem->size = size;
-    size_t mask = dev->pagesize - 1;
-    size = (size + mask) & ~mask;
-
-    if (pmb) {
-        mem->dma.buf = pmb;
-    } else {
-        if (dev->uiobufoff + size > UIO_SIZE) {
-            ERROR("Out of UIO memory space (next allocation would use %#lx of %#lx)", dev->uiobufoff + size, UIO_SIZE);
-            free(mem);
-            return NULL;
-        }
-        mem->dma.buf = dev->uiobuf + dev->uiobufoff;
-        dev->uiobufoff += size;
-    }
-
-    pthread_mutex_lock(&dev->lock);
-    mem->dma.size = size;
-    mem->dma.addr = dev->iovanext;
     mem->dma.mem = mem;
     mem->dev = dev;
 
-    // add node to the memory list
+    pthread_mutex_lock(&dev->lock);
     if (!dev->memlist) {
         mem->prev = mem;
         mem->next = mem;
@@ -130,10 +121,49 @@ static vfio_mem_t* vfio_mem_alloc(vfio_device_t* dev, size_t size, void* pmb)
         dev->memlist->prev->next = mem;
         dev->memlist->prev = mem;
     }
-    dev->iovanext += size;
-    DEBUG_FN("%x %#lx %#lx %#lx %#lx", dev->pci, mem->dma.addr, size, dev->iovanext, dev->uiobufoff);
+    DEBUG_FN("%x %#lx %#lx", dev->pci, mem->dma.addr, mem->dma.size);
     pthread_mutex_unlock(&dev->lock);
+}
 
+/**
+ * Allocate VFIO memory from the UIO arena.  The size will be rounded to
+ * page aligned size.
+ * @param   dev         device context
+ * @param   size        size
+ * @return  memory structure pointer or NULL if error.
+ */
+static vfio_mem_t* vfio_mem_alloc(vfio_device_t* dev, size_t size)
+{
+    vfio_mem_t* mem = zalloc(sizeof(*mem));
+    mem->size = size;
+    size_t mask = dev->pagesize - 1;
+    size = (size + mask) & ~mask;
+
+    // find the first arena gap that fits (the arena is shared by all
+    // devices, so a buffer has the same DMA address for any of them)
+    pthread_mutex_lock(&vfio_arena.lock);
+    vfio_mem_t** link = &vfio_arena.memlist;
+    size_t off = 0;
+    while (*link) {
+        size_t start = (*link)->dma.addr - UIO_BASE;
+        if ((start - off) >= size) break;
+        off = start + (*link)->dma.size;
+        link = &(*link)->anext;
+    }
+    if ((off + size) > UIO_SIZE) {
+        pthread_mutex_unlock(&vfio_arena.lock);
+        ERROR("Out of UIO memory space (allocation of %#lx)", size);
+        free(mem);
+        return NULL;
+    }
+    mem->anext = *link;
+    *link = mem;
+    pthread_mutex_unlock(&vfio_arena.lock);
+
+    mem->dma.buf = vfio_arena.buf + off;
+    mem->dma.size = size;
+    mem->dma.addr = UIO_BASE + off;
+    vfio_mem_add(dev, mem);
     return mem;
 }
 
@@ -146,43 +176,229 @@ int vfio_mem_free(vfio_mem_t* mem)
 {
     vfio_device_t* dev = mem->dev;
 
-    // remove node from memory list
+    // remove node from device memory list
     pthread_mutex_lock(&dev->lock);
-    if (mem->next == dev->memlist) { // If removing last item in list
-        dev->iovanext -= mem->dma.size;
-        dev->uiobufoff -= mem->dma.size;
-    }
-    if (mem->next == mem) { // If removing only item in list
+    if (mem->next == mem) {
         dev->memlist = NULL;
-        dev->iovanext = dev->iovabase;
-        dev->uiobufoff = 0;
-    } else { // If there are other items in list
+    } else {
         mem->next->prev = mem->prev;
         mem->prev->next = mem->next;
-        if (dev->memlist == mem) { // If first item in list
-            dev->memlist = mem->next;
-        }
-        dev->iovanext = dev->memlist->prev->dma.addr + dev->memlist->prev->dma.size; // IOVA next is after last item in list
-        dev->uiobufoff = dev->iovanext - dev->iovabase; // UIO buffer offset is same as IOVA offset
+        if (dev->memlist == mem) dev->memlist = mem->next;
     }
-    DEBUG_FN("%x %#lx %#lx %#lx %#lx", dev->pci, mem->dma.addr, mem->dma.size, dev->iovanext, dev->uiobufoff);
+    DEBUG_FN("%x %#lx %#lx", dev->pci, mem->dma.addr, mem->dma.size);
     pthread_mutex_unlock(&dev->lock);
 
+    // release the arena range (or unmap an external range)
+    if (mem->ext) {
+        if (mem->mmap) {
+            size_t pageoff = (size_t)mem->dma.buf & (dev->pagesize - 1);
+            munmap(mem->dma.buf - pageoff, mem->dma.size + pageoff);
+        }
+        if (mem->dmabuf) close(mem->dmafd);
+    } else {
+        pthread_mutex_lock(&vfio_arena.lock);
+        vfio_mem_t** link = &vfio_arena.memlist;
+        while (*link && *link != mem) link = &(*link)->anext;
+        if (*link) *link = mem->anext;
+        pthread_mutex_unlock(&vfio_arena.lock);
+    }
+
     free(mem);
     return 0;
 }
 
 /**
- * Map a premapped buffer and return a DMA buffer.
+ * Map a premapped buffer (e.g. a programmable logic memory window) at its
+ * device bus address and return a DMA buffer.  Without an IOMMU, the bus
+ * address is the physical address of the buffer.
  * @param   dev         device context
- * @param   size        allocation size
+ * @param   size        buffer size
  * @param   pmb         premapped buffer
- * @return  0 if ok else -1.
+ * @param   addr        bus address of the buffer
+ * @return  DMA buffer or NULL if error.
  */
-vfio_dma_t* vfio_dma_map(vfio_device_t* dev, size_t size, void* pmb)
+vfio_dma_t* vfio_dma_map(vfio_device_t* dev, size_t size, void* pmb, __u64 addr)
 {
-    vfio_mem_t* mem = vfio_mem_alloc(dev, size, pmb);
-    return mem ? &mem->dma : NULL;
+    vfio_mem_t* mem = zalloc(sizeof(*mem));
+    mem->size = size;
+    mem->ext = 1;
+    mem->dma.buf = pmb;
+    mem->dma.size = size;
+    mem->dma.addr = addr;
+    vfio_mem_add(dev, mem);
+    return &mem->dma;
+}
+
+/**
+ * Map a physical address range (through /dev/mem) and return a DMA buffer.
+ * The mapping is removed when the buffer is freed.
+ * @param   dev         device context
+ * @param   size        range size
+ * @param   addr        physical (bus) address
+ * @return  DMA buffer or NULL if error.
+ */
+vfio_dma_t* vfio_dma_map_phys(vfio_device_t* dev, size_t size, __u64 addr)
+{
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0) {
+        ERROR("open /dev/mem, %d", errno);
+        return NULL;
+    }
+    size_t pageoff = addr & (dev->pagesize - 1);
+    void* buf = mmap(NULL, size + pageoff, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, addr - pageoff);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        ERROR("mmap /dev/mem %#lx %#lx, %d", addr, size, errno);
+        return NULL;
+    }
+    vfio_dma_t* dma = vfio_dma_map(dev, size, buf + pageoff, addr);
+    dma->mem->mmap = 1;
+    return dma;
+}
+
+/**
+ * Get the physical address of a mapped range via /proc/self/pagemap.
+ * @param   buf         mapped (and populated) range
+ * @param   size        range size
+ * @param   pagesize    page size
+ * @param   addr        returned physical address
+ * @return  0 if ok or -1 if not resident and contiguous.
+ */
+static int vfio_phys_addr(void* buf, size_t size, int pagesize, __u64* addr)
+{
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) {
+        ERROR("open /proc/self/pagemap, %d", errno);
+        return -1;
+    }
+    int err = 0;
+    size_t off;
+    for (off = 0; off < size; off += pagesize) {
+        __u64 ent;
+        off_t pos = ((size_t)buf + off) / pagesize * sizeof(ent);
+        if (pread(fd, &ent, sizeof(ent), pos) != sizeof(ent) ||
+            !(ent & (1ULL << 63))) {
+            ERROR("no physical page at %p", buf + off);
+            err = -1;
+            break;
+        }
+        __u64 pa = (ent & ((1ULL << 55) - 1)) * pagesize;
+        if (off == 0) {
+            *addr = pa;
+        } else if (pa != *addr + off) {
+            ERROR("%p %#lx not physically contiguous", buf, size);
+            err = -1;
+            break;
+        }
+    }
+    close(fd);
+    return err;
+}
+
+/**
+ * Import a dma-buf and return a DMA buffer.  The dma-buf must be physically
+ * contiguous (e.g. allocated from a CMA heap), since it is addressed by its
+ * physical address without an IOMMU.  The caller retains its descriptor,
+ * and the mapping (which holds a dma-buf reference and a duplicate of the
+ * descriptor for vfio_dma_sync) is removed when the buffer is freed.
+ * Unlike the uncached arena, the mapping is cacheable, so CPU accesses must
+ * be bracketed by vfio_dma_sync on a non-coherent system.
+ * @param   dev         device context
+ * @param   fd          dma-buf file descriptor
+ * @param   size        size to map (0 for the whole dma-buf)
+ * @return  DMA buffer or NULL if error.
+ */
+vfio_dma_t* vfio_dma_import(vfio_device_t* dev, int fd, size_t size)
+{
+    if (!size) {
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end <= 0) {
+            ERROR("dma-buf fd %d size, %d", fd, errno);
+            return NULL;
+        }
+        size = end;
+    }
+    void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (buf == MAP_FAILED) {
+        ERROR("mmap dma-buf fd %d %#lx, %d", fd, size, errno);
+        return NULL;
+    }
+    __u64 addr;
+    if (vfio_phys_addr(buf, size, dev->pagesize, &addr)) {
+        munmap(buf, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    int dmafd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dmafd < 0) {
+        ERROR("dup dma-buf fd %d, %d", fd, errno);
+        munmap(buf, size);
+        return NULL;
+    }
+    vfio_dma_t* dma = vfio_dma_map(dev, size, buf, addr);
+    dma->mem->mmap = 1;
+    dma->mem->dmabuf = 1;
+    dma->mem->dmafd = dmafd;
+    return dma;
+}
+
+/**
+ * Allocate a DMA buffer from the CMA heap and export it as a dma-buf.
+ * @param   dev         device context
+ * @param   size        allocation size
+ * @param   fd          returned dma-buf file descriptor (owned by caller)
+ * @return  DMA buffer or NULL if error.
+ */
+vfio_dma_t* vfio_dma_export(vfio_device_t* dev, size_t size, int* fd)
+{
+    int heapfd = open(DMA_HEAP, O_RDONLY | O_CLOEXEC);
+    if (heapfd < 0) {
+        ERROR("open %s, %d", DMA_HEAP, errno);
+        return NULL;
+    }
+    size_t mask = dev->pagesize - 1;
+    struct dma_heap_allocation_data data = {
+        .len = (size + mask) & ~mask,
+        .fd_flags = O_RDWR | O_CLOEXEC,
+    };
+    int err = ioctl(heapfd, DMA_HEAP_IOCTL_ALLOC, &data);
+    close(heapfd);
+    if (err) {
+        ERROR("%s alloc %#lx, %d", DMA_HEAP, size, errno);
+        return NULL;
+    }
+    vfio_dma_t* dma = vfio_dma_import(dev, data.fd, data.len);
+    if (!dma) {
+        close(data.fd);
+        return NULL;
+    }
+    *fd = data.fd;
+    return dma;
+}
+
+/**
+ * Synchronize the CPU caches of a dma-buf mapping (DMA_BUF_IOCTL_SYNC).
+ * A CPU access is bracketed by a DMA_BUF_SYNC_START and a DMA_BUF_SYNC_END
+ * call with the same DMA_BUF_SYNC_READ/WRITE flags.  Other (uncached)
+ * buffers need no synchronization.
+ * @param   dma         DMA buffer
+ * @param   flags       DMA_BUF_SYNC_* flags
+ * @return  0 if ok else -1 (with errno set).
+ */
+int vfio_dma_sync(vfio_dma_t* dma, int flags)
+{
+    vfio_mem_t* mem = dma->mem;
+    if (!mem->dmabuf) return 0;
+
+    struct dma_buf_sync sync = { .flags = flags };
+    int err;
+    do {
+        err = ioctl(mem->dmafd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (err && (errno == EINTR || errno == EAGAIN));
+    if (err) ERROR("dma-buf sync %#x, %d", flags, errno);
+    return err;
 }
 
 /**
@@ -203,7 +419,7 @@ int vfio_dma_unmap(vfio_dma_t* dma)
  */
 vfio_dma_t* vfio_dma_alloc(vfio_device_t* dev, size_t size)
 {
-    vfio_mem_t* mem = vfio_mem_alloc(dev, size, 0);
+    vfio_mem_t* mem = vfio_mem_alloc(dev, size);
     return mem ? &mem->dma : NULL;
 }
 
@@ -303,7 +519,6 @@ vfio_device_t* vfio_create(vfio_device_t* dev, int pci)
     dev->pci = pci;
     dev->pagesize = sysconf(_SC_PAGESIZE);
     dev->iovabase = UIO_BASE;
-    dev->iovanext = dev->iovabase;
     if (pthread_mutex_init(&dev->lock, 0)) return NULL;
 
     // map vfio context
@@ -391,16 +606,22 @@ vfio_device_t* vfio_create(vfio_device_t* dev, int pci)
             FATAL("VFIO_DEVICE_GET_IRQ_INFO MSIX count %d != %d", irq.count, dev->msixsize);
     }
 
-    // Open and map UIO device as memory buffer
-    dev->uiofd = open("/dev/uio0", O_RDWR | O_SYNC);
-    if (dev->uiofd == -1)
-        FATAL("unable to open /dev/uio0, %d", errno);
-    dev->uiobuf = mmap(NULL, UIO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, dev->uiofd, 0);
-    if (dev->uiobuf == MAP_FAILED)
-        FATAL("unable to mmap /dev/uio0, %d", errno);
-
-    if (mlock(dev->uiobuf, UIO_SIZE) == -1)
-        FATAL("unable to mlock, %d", errno);
+    // Open and map UIO device as memory buffer (once for all devices)
+    pthread_mutex_lock(&vfio_arena.lock);
+    if (vfio_arena.refcount++ == 0) {
+        vfio_arena.fd = open("/dev/uio0", O_RDWR | O_SYNC);
+        if (vfio_arena.fd == -1)
+            FATAL("unable to open /dev/uio0, %d", errno);
+        vfio_arena.buf = mmap(NULL, UIO_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, vfio_arena.fd, 0);
+        if (vfio_arena.buf == MAP_FAILED)
+            FATAL("unable to mmap /dev/uio0, %d", errno);
+
+        if (mlock(vfio_arena.buf, UIO_SIZE) == -1)
+            FATAL("unable to mlock, %d", errno);
+    }
+    dev->uiobuf = vfio_arena.buf;
+    pthread_mutex_unlock(&vfio_arena.lock);
 
     return (vfio_device_t*)dev;
 }
@@ -414,14 +635,19 @@ void vfio_delete(vfio_device_t* dev)
     if (!dev) return;
     DEBUG_FN("%x", dev->pci);
 
-    // Close and unmap UIO buffer
-    munlock(dev->uiobuf, UIO_SIZE);
-    munmap(dev->uiobuf, UIO_SIZE);
-    close(dev->uiofd);
-
     // free all memory associated with the device
     while (dev->memlist) vfio_mem_free(dev->memlist);
 
+    // Close and unmap UIO buffer when no longer used by any device
+    pthread_mutex_lock(&vfio_arena.lock);
+    if (--vfio_arena.refcount == 0) {
+        munlock(vfio_arena.buf, UIO_SIZE);
+        munmap(vfio_arena.buf, UIO_SIZE);
+        close(vfio_arena.fd);
+        vfio_arena.buf = NULL;
+    }
+    pthread_mutex_unlock(&vfio_arena.lock);
+
     if (dev->fd) {
         close(dev->fd);
         dev->fd = 0;
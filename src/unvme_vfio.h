@@ -53,10 +53,14 @@ typedef struct _vfio_dma {
 typedef struct _vfio_mem {
     struct _vfio_device*    dev;        ///< device owner
     int                     mmap;       ///< mmap indication flag
+    int                     ext;        ///< external (non arena) range flag
+    int                     dmabuf;     ///< dma-buf mapping flag
+    int                     dmafd;      ///< dma-buf descriptor (if dmabuf)
     vfio_dma_t              dma;        ///< dma mapped memory
     size_t                  size;       ///< size
     struct _vfio_mem*       prev;       ///< previous entry
     struct _vfio_mem*       next;       ///< next entry
+    struct _vfio_mem*       anext;      ///< next entry in arena address order
 } vfio_mem_t;
 
 /// VFIO device structure
@@ -70,13 +74,10 @@ typedef struct _vfio_device {
     int                     pagesize;   ///< system page size
     int                     ext;        ///< externally allocated flag
     __u64                   iovabase;   ///< IO virtual address base
-    __u64                   iovanext;   ///< next IO virtual address to use
     __u64                   iovamask;   ///< max IO virtual address mask
     pthread_mutex_t         lock;       ///< multithreaded lock
     vfio_mem_t*             memlist;    ///< memory allocated list
-    int                     uiofd;      ///< file descriptor of UIO device
-    void*                   uiobuf;     ///< UIO buffer pointer
-    off_t                   uiobufoff;  ///< UIO buffer offset
+    void*                   uiobuf;     ///< UIO buffer pointer (shared arena)
 } vfio_device_t;
 
 // Export functions
@@ -85,7 +86,11 @@ void vfio_delete(vfio_device_t* dev);
 void vfio_msix_enable(vfio_device_t* dev, int start, int nvec, __s32* efds);
 void vfio_msix_disable(vfio_device_t* dev);
 int vfio_mem_free(vfio_mem_t* mem);
-vfio_dma_t* vfio_dma_map(vfio_device_t* dev, size_t size, void* pmb);
+vfio_dma_t* vfio_dma_map(vfio_device_t* dev, size_t size, void* pmb, __u64 addr);
+vfio_dma_t* vfio_dma_map_phys(vfio_device_t* dev, size_t size, __u64 addr);
+vfio_dma_t* vfio_dma_import(vfio_device_t* dev, int fd, size_t size);
+vfio_dma_t* vfio_dma_export(vfio_device_t* dev, size_t size, int* fd);
+int vfio_dma_sync(vfio_dma_t* dma, int flags);
 int vfio_dma_unmap(vfio_dma_t* dma);
 vfio_dma_t* vfio_dma_alloc(vfio_device_t* dev, size_t size);
 int vfio_dma_free(vfio_dma_t* dma);
@@ -0,0 +1,1184 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe thin provisioned volume implementation.
+ *
+ * Pool layout (in blocks):  the superblock at lba 0, followed by the volume
+ * table, the block map region of each volume slot, and the data extents
+ * (aligned to the extent size).  A block map entry holds the data extent
+ * number (starting at 1) of a volume extent, or 0 if unmapped.
+ *
+ * A snapshot gets a copy of the block map of its origin, with the data
+ * extents shared by reference counts.  A write to a shared extent is
+ * redirected to a new extent (copying the rest of the old extent), so
+ * neither the snapshot nor the origin is ever overwritten in place.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "unvme_core.h"
+#include "unvme_vol.h"
+
+/// Pool superblock magic ("UNVMEVOL")
+#define VOL_MAGIC           0x4c4f56454d564e55UL
+/// Pool layout version
+#define VOL_VERSION         1
+/// Default extent size in bytes
+#define VOL_EXTSIZE         (1 << 20)
+/// Default max number of volumes
+#define VOL_MAXVOLS         64
+/// Max extent size in blocks (a write zeroes command)
+#define VOL_MAXEXTNLB       65536
+/// Max number of commands in flight per volume I/O
+#define VOL_MAXIOS          16
+/// Max number of commands in flight per snapshot read
+#define VOL_SNAPIOS         4
+/// Max number of ranges per dataset management command
+#define VOL_DSMRANGES       256
+/// Delay between volume deletion batches (in usec)
+#define VOL_DELDELAY        1000
+/// Extent reference count of an extent being freed
+#define VOL_REFFREE         0xffffffff
+
+/// Volume entry flags
+enum {
+    VOL_SNAPSHOT        = UNVME_VOL_SNAPSHOT, ///< snapshot (read-only) volume
+    VOL_DELETING        = 0x2,      ///< deletion in progress
+};
+
+/// Pool superblock
+typedef struct _vol_sb {
+    u64                 magic;      ///< VOL_MAGIC
+    u32                 version;    ///< VOL_VERSION
+    u32                 blocksize;  ///< block size
+    u32                 extnlb;     ///< extent size in blocks
+    u32                 maxvols;    ///< number of volume slots
+    u64                 maxvext;    ///< max volume size in extents
+    u64                 vtslba;     ///< volume table lba
+    u64                 vtnlb;      ///< volume table size in blocks
+    u64                 mapslba;    ///< block map region lba
+    u64                 mapnlb;     ///< block map size per volume slot
+    u64                 dataslba;   ///< data extents lba
+    u64                 extcount;   ///< number of data extents
+} vol_sb_t;
+
+/// Volume table entry
+typedef struct _vol_entry {
+    char                name[UNVME_VOL_NAMELEN]; ///< volume name
+    u64                 nlb;        ///< volume size in blocks
+    u64                 ctime;      ///< creation time
+    u32                 inuse;      ///< slot in use flag
+    u32                 flags;      ///< volume flags
+    u32                 rsvd[2];    ///< reserved
+} vol_entry_t;
+
+/// Pool context
+struct _unvme_pool {
+    const unvme_ns_t*   ns;         ///< namespace
+    int                 qid;        ///< queue for management I/O
+    vol_sb_t            sb;         ///< superblock
+    int                 extshift;   ///< extent size shift
+    vol_entry_t*        vt;         ///< volume table (I/O buffer)
+    u32*                refs;       ///< reference count per data extent
+    u64                 extused;    ///< number of extents allocated
+    u64                 allochint;  ///< next extent to check for allocation
+    u64*                mapped;     ///< number of extents mapped per slot
+    unvme_vol_t**       vols;       ///< open volume per slot
+    void*               zbuf;       ///< zero buffer
+    int                 nowz;       ///< write zeroes not supported flag
+    pthread_mutex_t     lock;       ///< management lock
+    pthread_mutex_t     alloclock;  ///< extent allocation lock
+    pthread_cond_t      delcond;    ///< volume deletion signal
+    pthread_t           delthread;  ///< volume deletion thread
+    int                 delstart;   ///< deletion thread started flag
+    int                 delstop;    ///< deletion thread stop flag
+    u32*                delmap;     ///< deletion block map buffer
+    u32*                delranges;  ///< deletion dataset management ranges
+};
+
+/// Volume context
+struct _unvme_vol {
+    unvme_pool_t*       pool;       ///< pool
+    int                 slot;       ///< volume slot
+    u64                 nlb;        ///< size in blocks
+    u64                 vext;       ///< size in extents
+    u32*                map;        ///< block map (I/O buffer)
+    u64                 mapslba;    ///< block map lba
+    int                 snapshot;   ///< snapshot (read-only) flag
+    pthread_mutex_t     maplock;    ///< block map update lock
+    unvme_lock_t        iolock;     ///< I/O lock (held by snapshot and reclaim)
+    u32*                retired;    ///< unmapped extents pending release
+    int                 retcount;   ///< number of retired extents
+    int                 retsize;    ///< retired extents array size
+};
+
+
+/**
+ * Read or write a range of blocks synchronously (split by max I/O size).
+ * @param   ns          namespace
+ * @param   qid         queue
+ * @param   opc         NVME_CMD_READ or NVME_CMD_WRITE
+ * @param   buf         I/O buffer
+ * @param   slba        starting lba
+ * @param   nlb         number of blocks
+ * @return  0 if ok else error status.
+ */
+static int vol_io(const unvme_ns_t* ns, int qid, int opc, void* buf, u64 slba, u64 nlb)
+{
+    while (nlb) {
+        u32 n = nlb < ns->maxbpio ? nlb : ns->maxbpio;
+        int err = (opc == NVME_CMD_READ) ? unvme_read(ns, qid, buf, slba, n)
+                                         : unvme_write(ns, qid, buf, slba, n);
+        if (err) {
+            ERROR("%s %s lba %#lx nlb %#x, %s", ns->device,
+                  opc == NVME_CMD_READ ? "read" : "write", slba, n, unvme_strerror(err));
+            return err;
+        }
+        buf += (u64)n << ns->blockshift;
+        slba += n;
+        nlb -= n;
+    }
+    return 0;
+}
+
+/**
+ * Zero a range of blocks (by write zeroes, or writes if not supported).
+ * @param   pool        pool
+ * @param   qid         queue
+ * @param   slba        starting lba
+ * @param   nlb         number of blocks
+ * @return  0 if ok else error status.
+ */
+static int vol_zero(unvme_pool_t* pool, int qid, u64 slba, u64 nlb)
+{
+    const unvme_ns_t* ns = pool->ns;
+    while (nlb && !pool->nowz) {
+        u32 n = nlb < VOL_MAXEXTNLB ? nlb : VOL_MAXEXTNLB;
+        u32 cdw10_15[6] = { slba, slba >> 32, n - 1, 0, 0, 0 };
+        int err = unvme_cmd(ns, qid, NVME_CMD_WRITE_ZEROES, ns->id, NULL, 0, cdw10_15, NULL);
+        if (err > 0 && UNVME_SCT(err) == 0 && (UNVME_SC(err) == 0x01 || UNVME_SC(err) == 0x02)) {
+            INFO_FN("%s write zeroes not supported", ns->device);
+            pool->nowz = 1;
+            break;
+        }
+        if (err) return err;
+        slba += n;
+        nlb -= n;
+    }
+    while (nlb) {
+        u32 n = nlb < ns->maxbpio ? nlb : ns->maxbpio;
+        int err = unvme_write(ns, qid, pool->zbuf, slba, n);
+        if (err) return err;
+        slba += n;
+        nlb -= n;
+    }
+    return 0;
+}
+
+/**
+ * Set a dataset management range.
+ * @param   range       range entry (16 bytes)
+ * @param   slba        starting lba
+ * @param   nlb         number of blocks
+ */
+static inline void vol_dsm_range(u32* range, u64 slba, u32 nlb)
+{
+    range[0] = 0;
+    range[1] = nlb;
+    range[2] = slba;
+    range[3] = slba >> 32;
+}
+
+/**
+ * Deallocate ranges of blocks on the device (dataset management).
+ * @param   pool        pool
+ * @param   qid         queue
+ * @param   ranges      range list (I/O buffer)
+ * @param   nr          number of ranges
+ * @return  0 if ok else error status.
+ */
+static int vol_dsm(unvme_pool_t* pool, int qid, u32* ranges, int nr)
+{
+    const unvme_ns_t* ns = pool->ns;
+    u32 cdw10_15[6] = { nr - 1, 0x4, 0, 0, 0, 0 };  // deallocate
+    return unvme_cmd(ns, qid, NVME_CMD_DS_MGMT, ns->id, ranges, nr * 16, cdw10_15, NULL);
+}
+
+/**
+ * Get the lba of a data extent.
+ * @param   pool        pool
+ * @param   ext         data extent number
+ * @return  starting lba.
+ */
+static inline u64 vol_extlba(unvme_pool_t* pool, u32 ext)
+{
+    return pool->sb.dataslba + ((u64)(ext - 1) << pool->extshift);
+}
+
+/**
+ * Allocate a free data extent.
+ * @param   pool        pool
+ * @return  data extent number or 0 if the pool is full.
+ */
+static u32 vol_ext_alloc(unvme_pool_t* pool)
+{
+    u32 ext = 0;
+    pthread_mutex_lock(&pool->alloclock);
+    if (pool->extused < pool->sb.extcount) {
+        u64 i = pool->allochint;
+        while (__atomic_load_n(&pool->refs[i], __ATOMIC_ACQUIRE)) {
+            if (++i > pool->sb.extcount) i = 1;
+        }
+        __atomic_store_n(&pool->refs[i], 1, __ATOMIC_RELEASE);
+        pool->extused++;
+        pool->allochint = (i == pool->sb.extcount) ? 1 : i + 1;
+        ext = i;
+    }
+    pthread_mutex_unlock(&pool->alloclock);
+    return ext;
+}
+
+/**
+ * Check if a data extent is shared (by a snapshot).
+ * @param   pool        pool
+ * @param   ext         data extent number
+ * @return  1 if shared else 0.
+ */
+static inline int vol_ext_shared(unvme_pool_t* pool, u32 ext)
+{
+    return __atomic_load_n(&pool->refs[ext], __ATOMIC_ACQUIRE) > 1;
+}
+
+/**
+ * Drop a reference to a data extent.  The last reference marks the extent
+ * as being freed (so it is not reallocated before deallocation).
+ * @param   pool        pool
+ * @param   ext         data extent number
+ * @return  1 if the extent is to be freed by vol_ext_release else 0.
+ */
+static int vol_ext_unref(unvme_pool_t* pool, u32 ext)
+{
+    u32 refs = __atomic_load_n(&pool->refs[ext], __ATOMIC_ACQUIRE);
+    for (;;) {
+        u32 newrefs = (refs == 1) ? VOL_REFFREE : refs - 1;
+        if (__atomic_compare_exchange_n(&pool->refs[ext], &refs, newrefs, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return refs == 1;
+    }
+}
+
+/**
+ * Return an unreferenced (and deallocated) data extent to the pool.
+ * @param   pool        pool
+ * @param   ext         data extent number
+ */
+static void vol_ext_release(unvme_pool_t* pool, u32 ext)
+{
+    pthread_mutex_lock(&pool->alloclock);
+    __atomic_store_n(&pool->refs[ext], 0, __ATOMIC_RELEASE);
+    pool->extused--;
+    pthread_mutex_unlock(&pool->alloclock);
+}
+
+/**
+ * Release a reference to a data extent, deallocating it on the device
+ * when it is no longer referenced.
+ * @param   pool        pool
+ * @param   qid         queue
+ * @param   ext         data extent number
+ */
+static void vol_ext_put(unvme_pool_t* pool, int qid, u32 ext)
+{
+    if (!vol_ext_unref(pool, ext)) return;
+    u32* range = unvme_alloc(pool->ns, 16);
+    if (range) {
+        vol_dsm_range(range, vol_extlba(pool, ext), pool->sb.extnlb);
+        vol_dsm(pool, qid, range, 1);
+        unvme_free(pool->ns, range);
+    }
+    vol_ext_release(pool, ext);
+}
+
+/**
+ * Retire a data extent unmapped from a volume.  The extent may still be
+ * in use by the I/O that looked it up before it was unmapped, so it is
+ * only released by vol_reclaim after that I/O has drained.
+ * The volume map lock must be held.
+ * @param   vol         volume
+ * @param   ext         data extent number
+ */
+static void vol_ext_retire(unvme_vol_t* vol, u32 ext)
+{
+    if (vol->retcount == vol->retsize) {
+        int size = vol->retsize ? vol->retsize * 2 : 64;
+        u32* retired = realloc(vol->retired, size * sizeof(u32));
+        if (!retired) {
+            // the extent is unreferenced on disk and is freed on pool open
+            ERROR("%s extent %#x retire, %s", vol->pool->ns->device, ext, strerror(ENOMEM));
+            return;
+        }
+        vol->retired = retired;
+        vol->retsize = size;
+    }
+    vol->retired[vol->retcount] = ext;
+    __atomic_store_n(&vol->retcount, vol->retcount + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Release the retired extents of a volume.  Taking the I/O lock for
+ * writing waits for the I/O in flight, which is all the I/O that could
+ * have looked up the extents retired so far.
+ * @param   vol         volume
+ * @param   qid         queue
+ */
+static void vol_reclaim(unvme_vol_t* vol, int qid)
+{
+    if (!__atomic_load_n(&vol->retcount, __ATOMIC_ACQUIRE)) return;
+    unvme_lockw(&vol->iolock);
+    pthread_mutex_lock(&vol->maplock);
+    u32* retired = vol->retired;
+    int n = vol->retcount;
+    vol->retired = NULL;
+    vol->retcount = vol->retsize = 0;
+    pthread_mutex_unlock(&vol->maplock);
+    unvme_unlockw(&vol->iolock);
+
+    int i;
+    for (i = 0; i < n; i++) vol_ext_put(vol->pool, qid, retired[i]);
+    free(retired);
+}
+
+/**
+ * Copy a data extent.
+ * @param   pool        pool
+ * @param   qid         queue
+ * @param   src         source data extent number
+ * @param   dst         destination data extent number
+ * @return  0 if ok else error status.
+ */
+static int vol_ext_copy(unvme_pool_t* pool, int qid, u32 src, u32 dst)
+{
+    const unvme_ns_t* ns = pool->ns;
+    void* buf = unvme_alloc(ns, (u64)pool->sb.extnlb << ns->blockshift);
+    if (!buf) return -ENOMEM;
+    int err = vol_io(ns, qid, NVME_CMD_READ, buf, vol_extlba(pool, src), pool->sb.extnlb);
+    if (!err) err = vol_io(ns, qid, NVME_CMD_WRITE, buf, vol_extlba(pool, dst), pool->sb.extnlb);
+    unvme_free(ns, buf);
+    return err;
+}
+
+/**
+ * Write the volume table.
+ * @param   pool        pool
+ * @return  0 if ok else error status.
+ */
+static int vol_table_write(unvme_pool_t* pool)
+{
+    return vol_io(pool->ns, pool->qid, NVME_CMD_WRITE, pool->vt,
+                  pool->sb.vtslba, pool->sb.vtnlb);
+}
+
+/**
+ * Find a volume slot by name.
+ * @param   pool        pool
+ * @param   name        volume name
+ * @return  slot or -1 if not found.
+ */
+static int vol_find(unvme_pool_t* pool, const char* name)
+{
+    int i;
+    for (i = 0; i < pool->sb.maxvols; i++) {
+        if (pool->vt[i].inuse && !(pool->vt[i].flags & VOL_DELETING) &&
+            !strncmp(pool->vt[i].name, name, UNVME_VOL_NAMELEN)) return i;
+    }
+    return -1;
+}
+
+/**
+ * Get the block map size of a volume.
+ * @param   pool        pool
+ * @param   vext        volume size in extents
+ * @return  block map size in blocks.
+ */
+static inline u64 vol_mapnlb(unvme_pool_t* pool, u64 vext)
+{
+    u32 bs = pool->ns->blocksize;
+    return (vext * sizeof(u32) + bs - 1) / bs;
+}
+
+/**
+ * Write the block map block containing an extent entry.
+ * @param   vol         volume
+ * @param   qid         queue
+ * @param   vext        volume extent
+ * @return  0 if ok else error status.
+ */
+static int vol_map_write(unvme_vol_t* vol, int qid, u64 vext)
+{
+    const unvme_ns_t* ns = vol->pool->ns;
+    u64 blk = (vext * sizeof(u32)) >> ns->blockshift;
+    return unvme_write(ns, qid, (u8*)vol->map + (blk << ns->blockshift),
+                       vol->mapslba + blk, 1);
+}
+
+/**
+ * Map a volume extent for writing to a newly allocated data extent, if it
+ * is unmapped or shared with a snapshot, and persist the block map entry.
+ * Unless the extent is to be fully written, the new extent is zeroed or
+ * gets a copy of the shared extent.
+ * @param   vol         volume
+ * @param   qid         queue
+ * @param   vext        volume extent
+ * @param   full        extent to be fully written flag
+ * @return  data extent number or 0 if error (errno set).
+ */
+static u32 vol_map_alloc(unvme_vol_t* vol, int qid, u64 vext, int full)
+{
+    unvme_pool_t* pool = vol->pool;
+    pthread_mutex_lock(&vol->maplock);
+    u32 old = vol->map[vext];
+    u32 ext = old;
+    if (!old || vol_ext_shared(pool, old)) {
+        int err = 0;
+        if (!(ext = vol_ext_alloc(pool))) {
+            err = -ENOSPC;
+        } else if (!full && (err = old ? vol_ext_copy(pool, qid, old, ext) :
+                             vol_zero(pool, qid, vol_extlba(pool, ext), pool->sb.extnlb))) {
+            vol_ext_put(pool, qid, ext);
+            ext = 0;
+        } else {
+            __atomic_store_n(&vol->map[vext], ext, __ATOMIC_RELEASE);
+            if ((err = vol_map_write(vol, qid, vext))) {
+                __atomic_store_n(&vol->map[vext], old, __ATOMIC_RELEASE);
+                vol_ext_retire(vol, ext);
+                ext = 0;
+            } else if (old) {
+                vol_ext_retire(vol, old);
+            } else {
+                __atomic_add_fetch(&pool->mapped[vol->slot], 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (err) {
+            ERROR("%s extent %#lx allocation, %s", pool->ns->device, vext, unvme_strerror(err));
+            errno = err < 0 ? -err : EIO;
+        }
+    }
+    pthread_mutex_unlock(&vol->maplock);
+    return ext;
+}
+
+/**
+ * Complete the commands of a volume I/O.
+ * @param   iods        I/O descriptors
+ * @param   n           number of descriptors
+ * @param   err         error status so far
+ * @return  the first error status or 0 if ok.
+ */
+static int vol_wait(unvme_iod_t* iods, int n, int err)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        int stat = unvme_apoll(iods[i], UNVME_TIMEOUT);
+        if (stat && !err) err = stat;
+    }
+    return err;
+}
+
+/**
+ * Read or write a volume, with the extents of the I/O submitted together.
+ * The I/O lock is held for reading, so that the extents looked up are not
+ * released (by trim or by redirected writes) until the I/O has completed.
+ * @param   vol         volume
+ * @param   qid         queue
+ * @param   opc         NVME_CMD_READ or NVME_CMD_WRITE
+ * @param   buf         I/O buffer
+ * @param   slba        starting volume lba
+ * @param   nlb         number of blocks
+ * @return  0 if ok else error status.
+ */
+static int vol_rw(unvme_vol_t* vol, int qid, int opc, void* buf, u64 slba, u32 nlb)
+{
+    unvme_pool_t* pool = vol->pool;
+    const unvme_ns_t* ns = pool->ns;
+    if (nlb == 0 || (slba + nlb) > vol->nlb) return -EINVAL;
+    if (opc == NVME_CMD_WRITE && vol->snapshot) return -EROFS;
+    unvme_lockr(&vol->iolock);
+
+    // snapshot reads (e.g. by backup) are paced with fewer smaller commands
+    int maxios = vol->snapshot ? VOL_SNAPIOS : VOL_MAXIOS;
+    u32 maxnlb = vol->snapshot ? ns->maxbpio : pool->sb.extnlb;
+    unvme_iod_t iods[VOL_MAXIOS];
+    int n = 0, err = 0;
+    u32 mask = pool->sb.extnlb - 1;
+    while (nlb) {
+        u64 vext = slba >> pool->extshift;
+        u32 off = slba & mask;
+        u32 cnt = pool->sb.extnlb - off;
+        if (cnt > nlb) cnt = nlb;
+        if (cnt > maxnlb) cnt = maxnlb;
+        u64 size = (u64)cnt << ns->blockshift;
+
+        u32 ext = __atomic_load_n(&vol->map[vext], __ATOMIC_ACQUIRE);
+        if (!ext && opc == NVME_CMD_READ) {
+            memset(buf, 0, size);
+        } else {
+            if (opc == NVME_CMD_WRITE && (!ext || vol_ext_shared(pool, ext)) &&
+                !(ext = vol_map_alloc(vol, qid, vext, cnt == pool->sb.extnlb))) {
+                err = -errno;
+                break;
+            }
+            if (n == maxios) {
+                err = vol_wait(iods, n, err);
+                n = 0;
+            }
+            u64 lba = vol_extlba(pool, ext) + off;
+            iods[n] = (opc == NVME_CMD_READ) ? unvme_aread(ns, qid, buf, lba, cnt)
+                                             : unvme_awrite(ns, qid, buf, lba, cnt);
+            if (!iods[n]) {
+                err = -errno;
+                break;
+            }
+            n++;
+        }
+        buf += size;
+        slba += cnt;
+        nlb -= cnt;
+    }
+    err = vol_wait(iods, n, err);
+    unvme_unlockr(&vol->iolock);
+    vol_reclaim(vol, qid);
+    return err;
+}
+
+/**
+ * Volume deletion thread.  The data extents of deleted volumes are
+ * released in batches, each deallocated by a dataset management command
+ * (merging adjacent extents) and followed by a delay, so as not to
+ * disturb the foreground I/O.  The volume slot is freed when done.
+ * The pool lock is held per batch for using the pool queue.
+ * @param   arg         pool
+ */
+static void* vol_deleter(void* arg)
+{
+    unvme_pool_t* pool = arg;
+    const unvme_ns_t* ns = pool->ns;
+    vol_sb_t* sb = &pool->sb;
+    u32* map = pool->delmap;
+    u32* ranges = pool->delranges;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->delstop) {
+        int slot;
+        for (slot = 0; slot < sb->maxvols; slot++) {
+            if (pool->vt[slot].inuse && (pool->vt[slot].flags & VOL_DELETING)) break;
+        }
+        if (slot == sb->maxvols) {
+            pthread_cond_wait(&pool->delcond, &pool->lock);
+            continue;
+        }
+        vol_entry_t* ve = &pool->vt[slot];
+        u64 vext = (ve->nlb + sb->extnlb - 1) / sb->extnlb;
+        int err = vol_io(ns, pool->qid, NVME_CMD_READ, map,
+                         sb->mapslba + slot * sb->mapnlb, vol_mapnlb(pool, vext));
+        u64 v = 0;
+        while (!err && v < vext && !pool->delstop) {
+            int i, nr = 0;
+            for (; v < vext && nr < VOL_DSMRANGES; v++) {
+                if (!map[v] || !vol_ext_unref(pool, map[v])) continue;
+                u64 lba = vol_extlba(pool, map[v]);
+                u32* r = ranges + (nr - 1) * 4;
+                if (nr && (r[2] + ((u64)r[3] << 32) + r[1]) == lba &&
+                    r[1] <= (0xffffffff - sb->extnlb)) {
+                    r[1] += sb->extnlb;
+                } else {
+                    vol_dsm_range(ranges + nr++ * 4, lba, sb->extnlb);
+                }
+                pool->mapped[slot]--;
+            }
+            if (!nr) continue;
+            vol_dsm(pool, pool->qid, ranges, nr);
+            for (i = 0; i < nr; i++) {
+                u32* r = ranges + i * 4;
+                u32 ext = ((r[2] + ((u64)r[3] << 32) - sb->dataslba) >> pool->extshift) + 1;
+                u32 n = r[1] >> pool->extshift;
+                while (n--) vol_ext_release(pool, ext++);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            usleep(VOL_DELDELAY);
+            pthread_mutex_lock(&pool->lock);
+        }
+        if (pool->delstop) break;
+        if (!err) {
+            ve->inuse = 0;
+            ve->flags = 0;
+            err = vol_table_write(pool);
+        }
+        if (err) {
+            // deletion resumes when the pool is next opened
+            ERROR("%s volume %.32s deletion, %s", ns->device, ve->name, unvme_strerror(err));
+            break;
+        }
+        DEBUG_FN("%s slot %d deleted", ns->device, slot);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Format a namespace as an empty volume pool.
+ * @param   ns          namespace handle
+ * @param   qid         queue
+ * @param   params      format parameters (NULL for the defaults)
+ * @return  0 if ok else error status.
+ */
+int unvme_pool_format(const unvme_ns_t* ns, int qid, const unvme_pool_params_t* params)
+{
+    unvme_pool_params_t p;
+    memset(&p, 0, sizeof(p));
+    if (params) p = *params;
+
+    vol_sb_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = VOL_MAGIC;
+    sb.version = VOL_VERSION;
+    sb.blocksize = ns->blocksize;
+    sb.extnlb = p.extnlb ? p.extnlb : (VOL_EXTSIZE >> ns->blockshift);
+    sb.maxvols = p.maxvols ? p.maxvols : VOL_MAXVOLS;
+    if (!p.maxvnlb) p.maxvnlb = ns->blockcount;
+    if (!sb.extnlb || (sb.extnlb & (sb.extnlb - 1)) || sb.extnlb > VOL_MAXEXTNLB) {
+        ERROR("invalid extent size %u (power of 2 up to %u)", sb.extnlb, VOL_MAXEXTNLB);
+        return -EINVAL;
+    }
+    sb.maxvext = (p.maxvnlb + sb.extnlb - 1) / sb.extnlb;
+    sb.vtslba = 1;
+    sb.vtnlb = (sb.maxvols * sizeof(vol_entry_t) + ns->blocksize - 1) / ns->blocksize;
+    sb.mapslba = sb.vtslba + sb.vtnlb;
+    sb.mapnlb = (sb.maxvext * sizeof(u32) + ns->blocksize - 1) / ns->blocksize;
+    sb.dataslba = sb.mapslba + sb.maxvols * sb.mapnlb;
+    sb.dataslba = (sb.dataslba + sb.extnlb - 1) & ~(u64)(sb.extnlb - 1);
+    if (sb.dataslba < ns->blockcount)
+        sb.extcount = (ns->blockcount - sb.dataslba) / sb.extnlb;
+    if (!sb.extcount || sb.extcount >= 0xffffffff) {
+        ERROR("%s invalid pool layout (%lu extents)", ns->device, sb.extcount);
+        return -EINVAL;
+    }
+
+    // write an empty volume table and then the superblock
+    void* buf = unvme_alloc(ns, sb.vtnlb << ns->blockshift);
+    if (!buf) return -ENOMEM;
+    memset(buf, 0, sb.vtnlb << ns->blockshift);
+    int err = vol_io(ns, qid, NVME_CMD_WRITE, buf, sb.vtslba, sb.vtnlb);
+    if (!err) {
+        memcpy(buf, &sb, sizeof(sb));
+        err = vol_io(ns, qid, NVME_CMD_WRITE, buf, 0, 1);
+    }
+    unvme_free(ns, buf);
+    INFO_FN("%s pool %lu extents of %u blocks, %u volumes", ns->device,
+            sb.extcount, sb.extnlb, sb.maxvols);
+    return err;
+}
+
+/**
+ * Close a volume pool.
+ * @param   pool        pool
+ * @return  0 if ok or -EBUSY if a volume is open.
+ */
+int unvme_pool_close(unvme_pool_t* pool)
+{
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->sb.maxvols; i++) {
+        if (pool->vols && pool->vols[i]) {
+            pthread_mutex_unlock(&pool->lock);
+            return -EBUSY;
+        }
+    }
+    pool->delstop = 1;
+    pthread_cond_signal(&pool->delcond);
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->delstart) pthread_join(pool->delthread, NULL);
+
+    const unvme_ns_t* ns = pool->ns;
+    if (pool->delranges) unvme_free(ns, pool->delranges);
+    if (pool->delmap) unvme_free(ns, pool->delmap);
+    if (pool->zbuf) unvme_free(ns, pool->zbuf);
+    if (pool->vt) unvme_free(ns, pool->vt);
+    free(pool->vols);
+    free(pool->mapped);
+    free(pool->refs);
+    pthread_cond_destroy(&pool->delcond);
+    pthread_mutex_destroy(&pool->alloclock);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return 0;
+}
+
+/**
+ * Open a volume pool, rebuilding the extent allocation from the volume
+ * block maps (and resuming any volume deletion).
+ * @param   ns          namespace handle
+ * @param   qid         queue for pool management I/O
+ * @return  pool or NULL if error (errno set).
+ */
+unvme_pool_t* unvme_pool_open(const unvme_ns_t* ns, int qid)
+{
+    unvme_pool_t* pool = zalloc(sizeof(*pool));
+    pool->ns = ns;
+    pool->qid = qid;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->alloclock, NULL);
+    pthread_cond_init(&pool->delcond, NULL);
+
+    u32* map = NULL;
+    int err = -ENOMEM;
+    void* buf = unvme_alloc(ns, ns->blocksize);
+    if (buf) {
+        err = vol_io(ns, qid, NVME_CMD_READ, buf, 0, 1);
+        memcpy(&pool->sb, buf, sizeof(pool->sb));
+        unvme_free(ns, buf);
+    }
+    vol_sb_t* sb = &pool->sb;
+    if (!err && (sb->magic != VOL_MAGIC || sb->version != VOL_VERSION ||
+                 sb->blocksize != ns->blocksize ||
+                 (sb->dataslba + (sb->extcount * sb->extnlb)) > ns->blockcount)) {
+        ERROR("%s is not a volume pool", ns->device);
+        err = -EINVAL;
+    }
+    if (err) goto error;
+    while ((1U << pool->extshift) < sb->extnlb) pool->extshift++;
+
+    err = -ENOMEM;
+    pool->vt = unvme_alloc(ns, sb->vtnlb << ns->blockshift);
+    pool->zbuf = unvme_alloc(ns, (u64)ns->maxbpio << ns->blockshift);
+    map = unvme_alloc(ns, sb->mapnlb << ns->blockshift);
+    if (!pool->vt || !pool->zbuf || !map) goto error;
+    memset(pool->zbuf, 0, (u64)ns->maxbpio << ns->blockshift);
+    if ((err = vol_io(ns, qid, NVME_CMD_READ, pool->vt, sb->vtslba, sb->vtnlb))) goto error;
+    pool->refs = zalloc((sb->extcount + 1) * sizeof(u32));
+    pool->mapped = zalloc(sb->maxvols * sizeof(u64));
+    pool->vols = zalloc(sb->maxvols * sizeof(unvme_vol_t*));
+    pool->allochint = 1;
+
+    // count the data extent references of all volumes
+    int i;
+    for (i = 0; i < sb->maxvols; i++) {
+        vol_entry_t* ve = &pool->vt[i];
+        if (!ve->inuse) continue;
+        u64 vext = (ve->nlb + sb->extnlb - 1) / sb->extnlb;
+        err = vol_io(ns, qid, NVME_CMD_READ, map,
+                     sb->mapslba + i * sb->mapnlb, vol_mapnlb(pool, vext));
+        if (err) goto error;
+        u64 v;
+        for (v = 0; v < vext; v++) {
+            if (!map[v]) continue;
+            if (map[v] > sb->extcount) {
+                ERROR("%s volume %.32s bad extent %#x", ns->device, ve->name, map[v]);
+                err = -EINVAL;
+                goto error;
+            }
+            if (pool->refs[map[v]]++ == 0) pool->extused++;
+            pool->mapped[i]++;
+        }
+    }
+
+    // the block map buffer is kept for the deletion thread
+    pool->delmap = map;
+    map = NULL;
+    err = -ENOMEM;
+    if (!(pool->delranges = unvme_alloc(ns, VOL_DSMRANGES * 16))) goto error;
+    if ((err = -pthread_create(&pool->delthread, NULL, vol_deleter, pool))) goto error;
+    pool->delstart = 1;
+    DEBUG_FN("%s extents %lu used %lu", ns->device, sb->extcount, pool->extused);
+    return pool;
+
+error:
+    if (map) unvme_free(ns, map);
+    unvme_pool_close(pool);
+    errno = err < 0 ? -err : EIO;
+    return NULL;
+}
+
+/**
+ * Get the pool statistics.
+ * @param   pool        pool
+ * @param   stats       returned statistics
+ */
+void unvme_pool_stats(unvme_pool_t* pool, unvme_pool_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&pool->lock);
+    stats->blocksize = pool->sb.blocksize;
+    stats->extnlb = pool->sb.extnlb;
+    stats->extcount = pool->sb.extcount;
+    stats->extused = pool->extused;
+    stats->maxvnlb = pool->sb.maxvext * pool->sb.extnlb;
+    stats->maxvols = pool->sb.maxvols;
+    int i;
+    for (i = 0; i < pool->sb.maxvols; i++) {
+        if (!pool->vt[i].inuse) continue;
+        if (pool->vt[i].flags & VOL_DELETING) stats->delcount++;
+        else stats->volcount++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * List the volumes of a pool.
+ * @param   pool        pool
+ * @param   info        returned volume information
+ * @param   max         max number of volumes to return
+ * @return  number of volumes returned.
+ */
+int unvme_pool_list(unvme_pool_t* pool, unvme_vol_info_t* info, int max)
+{
+    int i, n = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->sb.maxvols && n < max; i++) {
+        vol_entry_t* ve = &pool->vt[i];
+        if (!ve->inuse || (ve->flags & VOL_DELETING)) continue;
+        memcpy(info[n].name, ve->name, UNVME_VOL_NAMELEN);
+        info[n].nlb = ve->nlb;
+        info[n].mapped = pool->mapped[i];
+        info[n].flags = ve->flags & VOL_SNAPSHOT;
+        n++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+/**
+ * Create a (thin provisioned) volume.
+ * @param   pool        pool
+ * @param   name        volume name
+ * @param   nlb         volume size in blocks
+ * @return  0 if ok else error status.
+ */
+int unvme_vol_create(unvme_pool_t* pool, const char* name, u64 nlb)
+{
+    vol_sb_t* sb = &pool->sb;
+    u64 vext = (nlb + sb->extnlb - 1) / sb->extnlb;
+    if (!nlb || vext > sb->maxvext || !*name || strlen(name) >= UNVME_VOL_NAMELEN)
+        return -EINVAL;
+
+    pthread_mutex_lock(&pool->lock);
+    int i, err = 0;
+    if (vol_find(pool, name) >= 0) {
+        err = -EEXIST;
+    } else {
+        for (i = 0; i < sb->maxvols && pool->vt[i].inuse; i++);
+        if (i == sb->maxvols) err = -ENOSPC;
+    }
+    if (!err) {
+        // clear the block map before adding the volume
+        err = vol_zero(pool, pool->qid, sb->mapslba + i * sb->mapnlb, vol_mapnlb(pool, vext));
+    }
+    if (!err) {
+        vol_entry_t* ve = &pool->vt[i];
+        memset(ve, 0, sizeof(*ve));
+        strcpy(ve->name, name);
+        ve->nlb = nlb;
+        ve->ctime = time(NULL);
+        ve->inuse = 1;
+        pool->mapped[i] = 0;
+        if ((err = vol_table_write(pool))) ve->inuse = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return err;
+}
+
+/**
+ * Delete a volume.  The volume is removed at once, and its extents are
+ * returned to the pool in the background.
+ * @param   pool        pool
+ * @param   name        volume name
+ * @return  0 if ok else error status (-EBUSY if the volume is open).
+ */
+int unvme_vol_delete(unvme_pool_t* pool, const char* name)
+{
+    pthread_mutex_lock(&pool->lock);
+    int slot = vol_find(pool, name);
+    int err = 0;
+    if (slot < 0) {
+        err = -ENOENT;
+    } else if (pool->vols[slot]) {
+        err = -EBUSY;
+    } else {
+        pool->vt[slot].flags |= VOL_DELETING;
+        if ((err = vol_table_write(pool))) pool->vt[slot].flags &= ~VOL_DELETING;
+        else pthread_cond_signal(&pool->delcond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return err;
+}
+
+/**
+ * Create a snapshot of a volume, which may be open and being written.
+ * The snapshot is a read-only volume sharing the data extents of the
+ * volume at this point in time (with the writes in progress completed).
+ * @param   pool        pool
+ * @param   name        volume name
+ * @param   snapname    snapshot volume name
+ * @return  0 if ok else error status.
+ */
+int unvme_vol_snapshot(unvme_pool_t* pool, const char* name, const char* snapname)
+{
+    const unvme_ns_t* ns = pool->ns;
+    vol_sb_t* sb = &pool->sb;
+    if (!*snapname || strlen(snapname) >= UNVME_VOL_NAMELEN) return -EINVAL;
+
+    pthread_mutex_lock(&pool->lock);
+    int src = vol_find(pool, name);
+    int i = 0, err = 0;
+    unvme_vol_t* vol = NULL;
+    u32* map = NULL;
+    if (src < 0) {
+        err = -ENOENT;
+    } else if (vol_find(pool, snapname) >= 0) {
+        err = -EEXIST;
+    } else {
+        for (i = 0; i < sb->maxvols && pool->vt[i].inuse; i++);
+        if (i == sb->maxvols) err = -ENOSPC;
+    }
+    if (err) goto out;
+
+    vol_entry_t* ve = &pool->vt[src];
+    u64 vext = (ve->nlb + sb->extnlb - 1) / sb->extnlb;
+    u64 mapnlb = vol_mapnlb(pool, vext);
+    if ((vol = pool->vols[src])) {
+        // hold off the writes of the open volume
+        unvme_lockw(&vol->iolock);
+        map = vol->map;
+    } else if (!(map = unvme_alloc(ns, mapnlb << ns->blockshift))) {
+        err = -ENOMEM;
+        goto out;
+    } else if ((err = vol_io(ns, pool->qid, NVME_CMD_READ, map,
+                             sb->mapslba + src * sb->mapnlb, mapnlb))) {
+        goto out;
+    }
+
+    u64 v;
+    for (v = 0; v < vext; v++) {
+        if (map[v]) __atomic_add_fetch(&pool->refs[map[v]], 1, __ATOMIC_ACQ_REL);
+    }
+    err = vol_io(ns, pool->qid, NVME_CMD_WRITE, map, sb->mapslba + i * sb->mapnlb, mapnlb);
+    if (!err) {
+        vol_entry_t* se = &pool->vt[i];
+        memset(se, 0, sizeof(*se));
+        strcpy(se->name, snapname);
+        se->nlb = ve->nlb;
+        se->ctime = time(NULL);
+        se->inuse = 1;
+        se->flags = VOL_SNAPSHOT;
+        pool->mapped[i] = pool->mapped[src];
+        if ((err = vol_table_write(pool))) se->inuse = 0;
+    }
+    if (err) {
+        for (v = 0; v < vext; v++) {
+            if (map[v]) vol_ext_put(pool, pool->qid, map[v]);
+        }
+    }
+    if (vol) unvme_unlockw(&vol->iolock);
+
+out:
+    if (map && !vol) unvme_free(ns, map);
+    pthread_mutex_unlock(&pool->lock);
+    return err;
+}
+
+/**
+ * Open a volume (loading its block map).
+ * @param   pool        pool
+ * @param   name        volume name
+ * @return  volume or NULL if error (errno set).
+ */
+unvme_vol_t* unvme_vol_open(unvme_pool_t* pool, const char* name)
+{
+    const unvme_ns_t* ns = pool->ns;
+    vol_sb_t* sb = &pool->sb;
+    unvme_vol_t* vol = NULL;
+    int err = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    int slot = vol_find(pool, name);
+    if (slot < 0) {
+        err = ENOENT;
+    } else if (pool->vols[slot]) {
+        err = EBUSY;
+    } else {
+        vol = zalloc(sizeof(*vol));
+        vol->pool = pool;
+        vol->slot = slot;
+        vol->nlb = pool->vt[slot].nlb;
+        vol->vext = (vol->nlb + sb->extnlb - 1) / sb->extnlb;
+        vol->mapslba = sb->mapslba + slot * sb->mapnlb;
+        vol->snapshot = (pool->vt[slot].flags & VOL_SNAPSHOT) != 0;
+        pthread_mutex_init(&vol->maplock, NULL);
+        u64 mapnlb = vol_mapnlb(pool, vol->vext);
+        if (!(vol->map = unvme_alloc(ns, mapnlb << ns->blockshift))) {
+            err = ENOMEM;
+        } else if (vol_io(ns, pool->qid, NVME_CMD_READ, vol->map, vol->mapslba, mapnlb)) {
+            err = EIO;
+        } else {
+            pool->vols[slot] = vol;
+        }
+        if (err) {
+            if (vol->map) unvme_free(ns, vol->map);
+            pthread_mutex_destroy(&vol->maplock);
+            free(vol);
+            vol = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (err) errno = err;
+    return vol;
+}
+
+/**
+ * Close a volume.
+ * @param   vol         volume
+ * @return  0 if ok.
+ */
+int unvme_vol_close(unvme_vol_t* vol)
+{
+    unvme_pool_t* pool = vol->pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->vols[vol->slot] = NULL;
+    vol_reclaim(vol, pool->qid);
+    pthread_mutex_unlock(&pool->lock);
+    unvme_free(pool->ns, vol->map);
+    pthread_mutex_destroy(&vol->maplock);
+    free(vol);
+    return 0;
+}
+
+/**
+ * Get the volume information.
+ * @param   vol         volume
+ * @param   info        returned information
+ */
+void unvme_vol_info(unvme_vol_t* vol, unvme_vol_info_t* info)
+{
+    unvme_pool_t* pool = vol->pool;
+    memcpy(info->name, pool->vt[vol->slot].name, UNVME_VOL_NAMELEN);
+    info->nlb = vol->nlb;
+    info->mapped = __atomic_load_n(&pool->mapped[vol->slot], __ATOMIC_RELAXED);
+    info->flags = vol->snapshot ? UNVME_VOL_SNAPSHOT : 0;
+}
+
+/**
+ * Read from a volume (unwritten blocks read as zeroes).
+ * @param   vol         volume
+ * @param   qid         client queue index
+ * @param   buf         data buffer (from unvme_alloc)
+ * @param   slba        starting logical block
+ * @param   nlb         number of logical blocks
+ * @return  0 if ok else error status.
+ */
+int unvme_vol_read(unvme_vol_t* vol, int qid, void* buf, u64 slba, u32 nlb)
+{
+    return vol_rw(vol, qid, NVME_CMD_READ, buf, slba, nlb);
+}
+
+/**
+ * Write to a volume (allocating the extents written for the first time,
+ * and redirecting the writes of extents shared with a snapshot).
+ * @param   vol         volume
+ * @param   qid         client queue index
+ * @param   buf         data buffer (from unvme_alloc)
+ * @param   slba        starting logical block
+ * @param   nlb         number of logical blocks
+ * @return  0 if ok else error status (-ENOSPC if the pool is full).
+ */
+int unvme_vol_write(unvme_vol_t* vol, int qid, const void* buf, u64 slba, u32 nlb)
+{
+    return vol_rw(vol, qid, NVME_CMD_WRITE, (void*)buf, slba, nlb);
+}
+
+/**
+ * Trim a range of a volume.  Whole extents are unmapped and returned to
+ * the pool (and deallocated on the device) once the I/O in flight on them
+ * has completed, and the blocks of partially trimmed extents are zeroed.
+ * @param   vol         volume
+ * @param   qid         client queue index
+ * @param   slba        starting logical block
+ * @param   nlb         number of logical blocks
+ * @return  0 if ok else error status.
+ */
+int unvme_vol_trim(unvme_vol_t* vol, int qid, u64 slba, u64 nlb)
+{
+    unvme_pool_t* pool = vol->pool;
+    if (nlb == 0 || (slba + nlb) > vol->nlb) return -EINVAL;
+    if (vol->snapshot) return -EROFS;
+
+    unvme_lockr(&vol->iolock);
+    u32 mask = pool->sb.extnlb - 1;
+    int err = 0;
+    while (nlb && !err) {
+        u64 vext = slba >> pool->extshift;
+        u32 off = slba & mask;
+        u32 cnt = pool->sb.extnlb - off;
+        if (cnt > nlb) cnt = nlb;
+
+        u32 ext = __atomic_load_n(&vol->map[vext], __ATOMIC_ACQUIRE);
+        if (ext && cnt < pool->sb.extnlb) {
+            // a shared extent is redirected before zeroing
+            if (vol_ext_shared(pool, ext) && !(ext = vol_map_alloc(vol, qid, vext, 0)))
+                err = -errno;
+            else
+                err = vol_zero(pool, qid, vol_extlba(pool, ext) + off, cnt);
+        } else if (ext) {
+            pthread_mutex_lock(&vol->maplock);
+            ext = vol->map[vext];
+            if (ext) {
+                __atomic_store_n(&vol->map[vext], 0, __ATOMIC_RELEASE);
+                if ((err = vol_map_write(vol, qid, vext))) {
+                    __atomic_store_n(&vol->map[vext], ext, __ATOMIC_RELEASE);
+                    ext = 0;
+                } else {
+                    __atomic_sub_fetch(&pool->mapped[vol->slot], 1, __ATOMIC_RELAXED);
+                    vol_ext_retire(vol, ext);
+                }
+            }
+            pthread_mutex_unlock(&vol->maplock);
+        }
+        slba += cnt;
+        nlb -= cnt;
+    }
+    unvme_unlockr(&vol->iolock);
+    vol_reclaim(vol, qid);
+    return err;
+}
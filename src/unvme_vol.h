@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe thin provisioned volume interface.
+ *
+ * A namespace formatted as a volume pool is carved into named volumes,
+ * whose blocks are mapped in units of extents to the pool data area on
+ * first write (allocate-on-write), so the volumes may be provisioned for
+ * more than the pool capacity.  A volume reads zeroes where it has not
+ * been written, and trimmed extents are returned to the pool and
+ * deallocated on the device (dataset management).
+ *
+ * Each volume has a persistent block map (one entry per extent), which
+ * is fully cached in memory while the volume is open.  Map lookups on
+ * the I/O path take no lock; only allocating and releasing extents
+ * serializes on the volume.  Extent allocation is rebuilt from the maps
+ * when the pool is opened, so it needs no persistent state of its own.
+ *
+ * A snapshot is a read-only volume sharing the data extents of its origin
+ * volume, with reference counts.  The writes to shared extents are
+ * redirected to new extents (redirect-on-write), so snapshots are taken
+ * at once, even of volumes being written.  Snapshot reads are paced with
+ * fewer commands in flight, to leave the device to the foreground I/O
+ * (which is best done on other queues).  Deleted volumes are removed at
+ * once and their extents reclaimed by a background thread, deallocating
+ * them in batches.
+ *
+ * Volume I/O may be done concurrently on different queues (with each
+ * queue used by one thread at a time).  Pool management calls use the
+ * queue given to unvme_pool_open (and serialize on the pool).
+ */
+
+#ifndef _UNVME_VOL_H
+#define _UNVME_VOL_H
+
+#include "unvme.h"
+
+/// Max volume name length (including the terminating null)
+#define UNVME_VOL_NAMELEN   32
+/// Volume information flag of a snapshot
+#define UNVME_VOL_SNAPSHOT  0x1
+
+/// Pool context
+typedef struct _unvme_pool unvme_pool_t;
+/// Volume context
+typedef struct _unvme_vol unvme_vol_t;
+
+/// Pool format parameters (zero fields select the defaults)
+typedef struct _unvme_pool_params {
+    u32                 extnlb;     ///< extent size in blocks (default 1MB)
+    u32                 maxvols;    ///< max number of volumes (default 64)
+    u64                 maxvnlb;    ///< max volume size in blocks (default pool size)
+} unvme_pool_params_t;
+
+/// Volume information
+typedef struct _unvme_vol_info {
+    char                name[UNVME_VOL_NAMELEN]; ///< volume name
+    u64                 nlb;        ///< volume size in blocks
+    u64                 mapped;     ///< number of extents mapped
+    u32                 flags;      ///< UNVME_VOL_SNAPSHOT if a snapshot
+} unvme_vol_info_t;
+
+/// Pool statistics
+typedef struct _unvme_pool_stats {
+    u32                 blocksize;  ///< block size
+    u32                 extnlb;     ///< extent size in blocks
+    u64                 extcount;   ///< number of data extents
+    u64                 extused;    ///< number of extents allocated
+    u64                 maxvnlb;    ///< max volume size in blocks
+    int                 maxvols;    ///< max number of volumes
+    int                 volcount;   ///< number of volumes
+    int                 delcount;   ///< number of volumes being deleted
+} unvme_pool_stats_t;
+
+// Export functions
+int unvme_pool_format(const unvme_ns_t* ns, int qid, const unvme_pool_params_t* params);
+unvme_pool_t* unvme_pool_open(const unvme_ns_t* ns, int qid);
+int unvme_pool_close(unvme_pool_t* pool);
+void unvme_pool_stats(unvme_pool_t* pool, unvme_pool_stats_t* stats);
+int unvme_pool_list(unvme_pool_t* pool, unvme_vol_info_t* info, int max);
+
+int unvme_vol_create(unvme_pool_t* pool, const char* name, u64 nlb);
+int unvme_vol_delete(unvme_pool_t* pool, const char* name);
+int unvme_vol_snapshot(unvme_pool_t* pool, const char* name, const char* snapname);
+unvme_vol_t* unvme_vol_open(unvme_pool_t* pool, const char* name);
+int unvme_vol_close(unvme_vol_t* vol);
+void unvme_vol_info(unvme_vol_t* vol, unvme_vol_info_t* info);
+
+int unvme_vol_read(unvme_vol_t* vol, int qid, void* buf, u64 slba, u32 nlb);
+int unvme_vol_write(unvme_vol_t* vol, int qid, const void* buf, u64 slba, u32 nlb);
+int unvme_vol_trim(unvme_vol_t* vol, int qid, u64 slba, u64 nlb);
+
+#endif  // _UNVME_VOL_H
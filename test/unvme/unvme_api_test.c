@@ -40,6 +40,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <err.h>
 
 #include "unvme.h"
@@ -48,6 +50,111 @@
 #define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
 
 
+/**
+ * Write and read back blocks from buffer addresses at various offsets into
+ * a page (e.g. following blocks of a buffer), and verify.
+ * @param   ns          namespace handle
+ * @param   buf         I/O buffer
+ * @param   size        buffer size
+ * @param   what        buffer description
+ */
+static void offset_test(const unvme_ns_t* ns, void* buf, u64 size, const char* what)
+{
+    u64 offs[] = { 0, 4, ns->blocksize, ns->pagesize - ns->blocksize, ns->pagesize - 4 };
+    u64 i, w;
+    printf("Test %s offsets\n", what);
+    for (i = 0; i < sizeof(offs) / sizeof(offs[0]); i++) {
+        if (offs[i] + ns->blocksize > size) continue;
+        u32 nlb = (size - offs[i]) / ns->blocksize;
+        if (nlb > ns->maxbpio) nlb = ns->maxbpio;
+        u64* p = buf + offs[i];
+        u64 n = (u64)nlb * ns->blocksize / sizeof(u64);
+        for (w = 0; w < n; w++) p[w] = (w << 32) + offs[i];
+        if (unvme_write(ns, 0, p, 0, nlb))
+            errx(1, "%s write offset %#lx nlb %#x failed", what, offs[i], nlb);
+        for (w = 0; w < n; w++) p[w] = 0;
+        if (unvme_read(ns, 0, p, 0, nlb))
+            errx(1, "%s read offset %#lx nlb %#x failed", what, offs[i], nlb);
+        for (w = 0; w < n; w++) {
+            if (p[w] != ((w << 32) + offs[i]))
+                errx(1, "%s miscompare offset %#lx at %#lx", what, offs[i], w * sizeof(w));
+        }
+    }
+}
+
+/**
+ * Test I/O on an external physical range, mapped by the driver and
+ * registered as premapped.
+ * @param   ns          namespace handle
+ * @param   addr        physical (bus) address
+ * @param   size        range size
+ */
+static void phys_test(const unvme_ns_t* ns, u64 addr, u64 size)
+{
+    void* buf = unvme_map_phys(ns, addr, size);
+    if (!buf) errx(1, "map_phys %#lx %#lx failed", addr, size);
+    offset_test(ns, buf, size, "map_phys");
+    if (unvme_free(ns, buf)) errx(1, "map_phys free failed");
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0) err(1, "/dev/mem");
+    u64 off = addr & (ns->pagesize - 1);
+    void* map = mmap(NULL, size + off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, addr - off);
+    close(fd);
+    if (map == MAP_FAILED) err(1, "mmap /dev/mem %#lx", addr);
+    if (!(buf = unvme_register_dma(ns, map + off, size, addr)))
+        errx(1, "register_dma %#lx %#lx failed", addr, size);
+    offset_test(ns, buf, size, "register_dma");
+    if (unvme_free(ns, buf)) errx(1, "register_dma free failed");
+    munmap(map, size + off);
+}
+
+/**
+ * Test I/O on an exported dma-buf, read back through a second import of
+ * the same dma-buf, with the CPU accesses bracketed by unvme_sync_dmabuf.
+ * @param   ns          namespace handle
+ */
+static void dmabuf_test(const unvme_ns_t* ns)
+{
+    u32 nlb = ns->maxbpio;
+    u64 size = (u64)nlb * ns->blocksize;
+    u64 w, n = size / sizeof(u64);
+    int fd;
+
+    printf("Test dma-buf\n");
+    u64* wbuf = unvme_alloc_dmabuf(ns, size, &fd);
+    if (!wbuf) errx(1, "alloc_dmabuf %#lx failed", size);
+    u64* rbuf = unvme_import_dmabuf(ns, fd, 0);
+    if (!rbuf) errx(1, "import_dmabuf failed");
+
+    if (unvme_sync_dmabuf(ns, wbuf, UNVME_SYNC_START | UNVME_SYNC_WRITE))
+        errx(1, "dma-buf sync start failed");
+    for (w = 0; w < n; w++) wbuf[w] = (w << 32) + ~w;
+    if (unvme_sync_dmabuf(ns, wbuf, UNVME_SYNC_END | UNVME_SYNC_WRITE))
+        errx(1, "dma-buf sync end failed");
+    if (unvme_write(ns, 0, wbuf, 0, nlb)) errx(1, "dma-buf write failed");
+
+    if (unvme_sync_dmabuf(ns, rbuf, UNVME_SYNC_START | UNVME_SYNC_WRITE))
+        errx(1, "dma-buf import sync start failed");
+    memset(rbuf, 0, size);
+    if (unvme_sync_dmabuf(ns, rbuf, UNVME_SYNC_END | UNVME_SYNC_WRITE))
+        errx(1, "dma-buf import sync end failed");
+    if (unvme_read(ns, 0, rbuf, 0, nlb)) errx(1, "dma-buf read failed");
+
+    if (unvme_sync_dmabuf(ns, rbuf, UNVME_SYNC_START | UNVME_SYNC_READ))
+        errx(1, "dma-buf import sync start failed");
+    for (w = 0; w < n; w++) {
+        if (rbuf[w] != (w << 32) + ~w)
+            errx(1, "dma-buf miscompare at %#lx", w * sizeof(w));
+    }
+    if (unvme_sync_dmabuf(ns, rbuf, UNVME_SYNC_END | UNVME_SYNC_READ))
+        errx(1, "dma-buf import sync end failed");
+
+    if (unvme_free(ns, rbuf) || unvme_free(ns, wbuf))
+        errx(1, "dma-buf free failed");
+    close(fd);
+}
+
 /**
  * Main.
  */
@@ -56,18 +163,30 @@ int main(int argc, char** argv)
     const char* usage = "Usage: %s [OPTION]... PCINAME\n\
            -v         verbose\n\
            -r RATIO   max blocks per I/O ratio (default 4)\n\
+           -p ADDR:SIZE  also test I/O on an external physical range\n\
+           -d         also test I/O on a dma-buf (from the CMA dma-heap)\n\
            PCINAME    PCI device name (as 01:00.0[/1] format)";
 
-    int opt, ratio=4, verbose=0;
+    int opt, ratio=4, verbose=0, dmabuf=0;
+    u64 physaddr = 0, physsize = 0;
+    char* s;
     const char* prog = strrchr(argv[0], '/');
     prog = prog ? prog + 1 : argv[0];
 
-    while ((opt = getopt(argc, argv, "r:v")) != -1) {
+    while ((opt = getopt(argc, argv, "r:p:dv")) != -1) {
         switch (opt) {
         case 'r':
             ratio = strtol(optarg, 0, 0);
             if (ratio <= 0) errx(1, "r must be > 0");
             break;
+        case 'p':
+            physaddr = strtoull(optarg, &s, 0);
+            if (*s != ':' || !(physsize = strtoull(s + 1, 0, 0)))
+                errx(1, "p must be ADDR:SIZE");
+            break;
+        case 'd':
+            dmabuf = 1;
+            break;
         case 'v':
             verbose = 1;
             break;
@@ -183,6 +302,14 @@ int main(int argc, char** argv)
         }
     }
 
+    size = ((u64)ns->maxbpio + 1) * ns->blocksize;
+    void* obuf = unvme_alloc(ns, size);
+    if (!obuf) errx(1, "alloc failed");
+    offset_test(ns, obuf, size, "buffer");
+    unvme_free(ns, obuf);
+    if (physsize) phys_test(ns, physaddr, physsize);
+    if (dmabuf) dmabuf_test(ns);
+
     free(buf);
     free(iod);
     unvme_close(ns);
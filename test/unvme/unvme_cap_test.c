@@ -0,0 +1,250 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe streaming capture test.
+ *
+ * A producer generates a data stream (at a given rate or as fast as
+ * possible) into a capture, which records it to the device, and the
+ * capture statistics are printed periodically.  Each block of the stream
+ * is stamped with its block offset in the stream, so the capture range
+ * can be read back and verified after closing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "unvme.h"
+#include "unvme_capture.h"
+
+/// Producer record size
+#define RECSIZE     (64 * 1024)
+
+/*
+ * Get the monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Stamp each block of produced data with its block offset in the stream.
+ */
+static void stamp(void* buf, u64 len, u64 pos, u32 blocksize)
+{
+    u64 off;
+    for (off = 0; off < len; off += blocksize)
+        *(u64*)(buf + off) = (pos + off) / blocksize;
+}
+
+/*
+ * Read back the capture range and verify that each block holds the last
+ * stream block written to it.
+ */
+static void verify(const unvme_ns_t* ns, const unvme_capture_params_t* params, u64 written)
+{
+    // range size as aligned to the write size by unvme_capture_open
+    u64 nlb = params->nlb ? params->nlb : ns->blockcount - params->slba;
+    nlb -= nlb % ns->maxbpio;
+    u64 nblocks = (written + ns->blocksize - 1) / ns->blocksize;
+    u64 count = nblocks < nlb ? nblocks : nlb;
+
+    void* buf = unvme_alloc(ns, (u64)ns->maxbpio * ns->blocksize);
+    if (!buf) errx(1, "unvme_alloc");
+    u64 b, i;
+    for (b = 0; b < count; b += ns->maxbpio) {
+        u32 n = (count - b) < ns->maxbpio ? count - b : ns->maxbpio;
+        if (unvme_read(ns, 0, buf, params->slba + b, n))
+            errx(1, "read lba %#lx failed", params->slba + b);
+        for (i = 0; i < n; i++) {
+            u64 pos = b + i;
+            u64 expect = pos + (nblocks - 1 - pos) / nlb * nlb;
+            u64 val = *(u64*)(buf + i * ns->blocksize);
+            if (val != expect)
+                errx(1, "lba %#lx has stream block %#lx (expected %#lx)",
+                     params->slba + pos, val, expect);
+        }
+    }
+    unvme_free(ns, buf);
+    printf("verified %#lx blocks\n", count);
+}
+
+/*
+ * Print capture statistics.
+ */
+static void print_stats(const unvme_capture_stats_t* st, double elapsed)
+{
+    printf("%6.1fs: %.3f GB/s written=%luMB dropped=%luMB fill=%lu%% peak=%lu%% "
+           "lat=%lu/%luus seg=%lu wrap=%lu thr=%lu err=%lu\n",
+           elapsed, elapsed ? st->written / elapsed / 1e9 : 0.0,
+           st->written >> 20, st->dropped >> 20,
+           st->ringfill * 100 / st->ringsize, st->ringpeak * 100 / st->ringsize,
+           st->latavg / 1000, st->latmax / 1000,
+           st->segments, st->wraps, st->throttles, st->errors);
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME\n\
+         -a LBA       capture range starting LBA (default 0)\n\
+         -n COUNT     capture range number of blocks (default to end)\n\
+         -g COUNT     segment size in blocks (default range size)\n\
+         -s MB        ring size in MB (default 64)\n\
+         -q QCOUNT    number of queues (default all)\n\
+         -d QDEPTH    writes in flight per queue (default 8)\n\
+         -r MBPS      producer rate in MB/s (default unlimited)\n\
+         -t SECONDS   run time (default 10)\n\
+         -b           block the producer instead of dropping data\n\
+         -o           stop at the end of range instead of wrapping\n\
+         -p INTERVAL  print statistics every INTERVAL seconds (default 1)\n\
+         -c           produce in place with reserve/commit (instead of copy)\n\
+         -v           read back and verify the capture range after closing\n\
+         PCINAME      PCI device name (as 01:00.0[/1] format)";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    unvme_capture_params_t params;
+    memset(&params, 0, sizeof(params));
+    double rate = 0, runtime = 10, interval = 1;
+    int opt, inplace = 0, check = 0;
+
+    while ((opt = getopt(argc, argv, "a:n:g:s:q:d:r:t:bop:cv")) != -1) {
+        switch (opt) {
+        case 'a':
+            params.slba = strtoull(optarg, 0, 0);
+            break;
+        case 'n':
+            params.nlb = strtoull(optarg, 0, 0);
+            break;
+        case 'g':
+            params.segnlb = strtoull(optarg, 0, 0);
+            break;
+        case 's':
+            params.ringsize = strtoull(optarg, 0, 0) << 20;
+            break;
+        case 'q':
+            params.qcount = strtol(optarg, 0, 0);
+            break;
+        case 'd':
+            params.qdepth = strtol(optarg, 0, 0);
+            break;
+        case 'r':
+            rate = strtod(optarg, 0) * 1e6;
+            break;
+        case 't':
+            runtime = strtod(optarg, 0);
+            break;
+        case 'b':
+            params.flags |= UNVME_CAPTURE_BLOCK;
+            break;
+        case 'o':
+            params.flags |= UNVME_CAPTURE_NOWRAP;
+            break;
+        case 'p':
+            interval = strtod(optarg, 0);
+            break;
+        case 'c':
+            inplace = 1;
+            break;
+        case 'v':
+            check = 1;
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 1) != argc || runtime <= 0 || interval <= 0) {
+        warnx(usage, prog);
+        exit(1);
+    }
+
+    const unvme_ns_t* ns = unvme_open(argv[optind]);
+    if (!ns) exit(1);
+    unvme_capture_t* cap = unvme_capture_open(ns, &params);
+    if (!cap) errx(1, "unvme_capture_open: %s", strerror(errno));
+
+    void* rec = malloc(RECSIZE);
+    u64 produced = 0, accepted = 0;
+    double start = now(), t = start, tprint = start + interval;
+    while ((t - start) < runtime) {
+        if (rate && produced >= (t - start) * rate) {
+            t = now();
+            continue;
+        }
+        if (inplace) {
+            // fill the reserved ring space (the rest is dropped if throttled)
+            u64 left = RECSIZE;
+            while (left) {
+                u64 len = left;
+                void* p = unvme_capture_reserve(cap, &len);
+                if (!p) break;
+                stamp(p, len, accepted, ns->blocksize);
+                if (unvme_capture_commit(cap, len)) errx(1, "unvme_capture_commit");
+                accepted += len;
+                left -= len;
+            }
+        } else {
+            stamp(rec, RECSIZE, accepted, ns->blocksize);
+            accepted += unvme_capture_write(cap, rec, RECSIZE);
+        }
+        produced += RECSIZE;
+        t = now();
+        if (t >= tprint) {
+            unvme_capture_stats_t st;
+            unvme_capture_stats(cap, &st);
+            print_stats(&st, t - start);
+            tprint += interval;
+        }
+    }
+
+    unvme_capture_stats_t st;
+    int err = unvme_capture_close(cap, &st);
+    print_stats(&st, now() - start);
+    if (!err && check) verify(ns, &params, st.written);
+    printf("received=%luMB %s\n", st.received >> 20, err ? "FAILED" : "DONE");
+    free(rec);
+    unvme_close(ns);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,386 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNVMe device copy (clone) utility.
+ *
+ * A source namespace range is streamed to a destination namespace using max
+ * size commands on multiple queue pairs.  Each queue pair thread cycles a
+ * ring of DMA buffers through read from the source and write of the same
+ * buffer to the destination, so there is no data copy in between (all
+ * devices share the same DMA memory).  The copy may be verified by reading
+ * back the destination, and may be resumed from a checkpoint file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <err.h>
+
+#include "unvme.h"
+
+/// Buffer state
+enum { SLOT_FREE, SLOT_READ, SLOT_READY, SLOT_WRITE, SLOT_VERIFY };
+
+/// Buffer ring slot
+typedef struct {
+    void*               buf;        ///< data buffer
+    void*               vbuf;       ///< verification buffer
+    u64                 lba;        ///< starting LBA
+    u32                 nlb;        ///< number of blocks
+    volatile int        state;      ///< slot state
+    unvme_iod_t         iod;        ///< pending I/O descriptor
+    time_t              tsubmit;    ///< submission time
+} slot_t;
+
+// Global static variables
+static const unvme_ns_t* src;   ///< source namespace
+static const unvme_ns_t* dst;   ///< destination namespace
+static u64 startlba = 0;        ///< starting LBA
+static u64 lbacount = 0;        ///< number of blocks to copy
+static u64 lbaend;              ///< end LBA
+static u32 qcount = 4;          ///< number of queue pairs
+static u32 qdepth = 32;         ///< queue depth per device queue
+static u32 nbpio;               ///< number of blocks per I/O
+static int verify = 0;          ///< verify flag
+static u64 nextlba;             ///< next LBA to copy
+static volatile u64* claimlba;  ///< LBA being claimed per queue pair (or ~0)
+static volatile u64 copycount = 0; ///< number of blocks copied
+static slot_t* slots;           ///< buffer ring (2 * qdepth per queue pair)
+static const char* ckptfile = NULL; ///< checkpoint file name
+
+
+/*
+ * Submit a slot I/O.
+ */
+static void submit(int q, slot_t* s, int state)
+{
+    switch (state) {
+    case SLOT_READ:
+        s->iod = unvme_aread(src, q, s->buf, s->lba, s->nlb);
+        break;
+    case SLOT_WRITE:
+        s->iod = unvme_awrite(dst, q, s->buf, s->lba, s->nlb);
+        break;
+    default:
+        s->iod = unvme_aread(dst, q, s->vbuf, s->lba, s->nlb);
+        break;
+    }
+    if (!s->iod)
+        errx(1, "submit q=%d lba=%#lx nlb=%#x failed: %s",
+             q, s->lba, s->nlb, unvme_strerror(-errno));
+    s->tsubmit = time(0);
+    __sync_synchronize();
+    s->state = state;
+}
+
+/*
+ * Queue pair copy thread.
+ */
+static void* copy_queue(void* arg)
+{
+    int q = (long)arg;
+    int nslots = qdepth * 2;
+    slot_t* ring = slots + q * nslots;
+    int nread = 0, nwrite = 0, pending = 0, eod = 0;
+
+    while (!eod || pending) {
+        int i, progress = 0;
+        for (i = 0; i < nslots; i++) {
+            slot_t* s = ring + i;
+            if (s->state == SLOT_FREE) {
+                if (eod || nread >= qdepth) continue;
+
+                // the range claimed is covered by the claim low-water mark
+                // until the slot is published (for copied_lba)
+                claimlba[q] = nextlba;
+                __sync_synchronize();
+                s->lba = __sync_fetch_and_add(&nextlba, nbpio);
+                if (s->lba >= lbaend) {
+                    claimlba[q] = ~0UL;
+                    eod = 1;
+                    continue;
+                }
+                s->nlb = nbpio;
+                if ((s->lba + s->nlb) > lbaend) s->nlb = lbaend - s->lba;
+                submit(q, s, SLOT_READ);
+                __sync_synchronize();
+                claimlba[q] = ~0UL;
+                nread++;
+                pending++;
+                progress = 1;
+                continue;
+            }
+
+            // a read buffer is written when the destination queue has room
+            // (which is shared by writes and verify reads)
+            if (s->state == SLOT_READY) {
+                if (nwrite < qdepth) {
+                    submit(q, s, SLOT_WRITE);
+                    nwrite++;
+                    progress = 1;
+                }
+                continue;
+            }
+
+            int stat = unvme_apoll(s->iod, 0);
+            if (stat == -ETIMEDOUT) {
+                if ((time(0) - s->tsubmit) > UNVME_TIMEOUT)
+                    errx(1, "timeout q=%d lba=%#lx nlb=%#x", q, s->lba, s->nlb);
+                continue;
+            }
+            if (stat)
+                errx(1, "%s error q=%d lba=%#lx nlb=%#x: %s",
+                     s->state == SLOT_READ ? "read" : "write",
+                     q, s->lba, s->nlb, unvme_strerror(stat));
+            progress = 1;
+
+            if (s->state == SLOT_READ) {
+                nread--;
+                if (nwrite < qdepth) {
+                    submit(q, s, SLOT_WRITE);
+                    nwrite++;
+                } else {
+                    s->state = SLOT_READY;
+                }
+            } else if (s->state == SLOT_WRITE && verify) {
+                submit(q, s, SLOT_VERIFY);
+            } else {
+                if (s->state == SLOT_VERIFY &&
+                    memcmp(s->buf, s->vbuf, (u64)s->nlb * src->blocksize))
+                    errx(1, "verify mismatch q=%d lba=%#lx nlb=%#x",
+                         q, s->lba, s->nlb);
+                nwrite--;
+                pending--;
+                __sync_fetch_and_add(&copycount, s->nlb);
+                __sync_synchronize();
+                s->state = SLOT_FREE;
+            }
+        }
+        if (!progress) sched_yield();
+    }
+    return 0;
+}
+
+/*
+ * Get the LBA below which all blocks have been copied.  The claims in
+ * progress are checked before the slots, as a claim is cleared only after
+ * its slot is published.
+ */
+static u64 copied_lba(void)
+{
+    u64 lba = nextlba;
+    __sync_synchronize();
+    int i;
+    for (i = 0; i < qcount; i++) {
+        if (claimlba[i] < lba) lba = claimlba[i];
+    }
+    __sync_synchronize();
+    for (i = 0; i < qcount * qdepth * 2; i++) {
+        if (slots[i].state != SLOT_FREE && slots[i].lba < lba) lba = slots[i].lba;
+    }
+    return lba < lbaend ? lba : lbaend;
+}
+
+/*
+ * Save checkpoint.
+ */
+static void checkpoint_save(const char* srcname, const char* dstname, u64 lba)
+{
+    char tmpfile[256];
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", ckptfile);
+    FILE* fp = fopen(tmpfile, "w");
+    if (!fp) err(1, "%s", tmpfile);
+    fprintf(fp, "%s %s %#lx %#lx %#lx\n", srcname, dstname, startlba, lbaend, lba);
+    if (fclose(fp) || rename(tmpfile, ckptfile)) err(1, "%s", ckptfile);
+}
+
+/*
+ * Load checkpoint and return the LBA to resume from.
+ */
+static u64 checkpoint_load(const char* srcname, const char* dstname)
+{
+    FILE* fp = fopen(ckptfile, "r");
+    if (!fp) return startlba;
+
+    char sname[32], dname[32];
+    u64 slba, elba, lba;
+    if (fscanf(fp, "%31s %31s %lx %lx %lx", sname, dname, &slba, &elba, &lba) != 5 ||
+        strcmp(sname, srcname) || strcmp(dname, dstname) ||
+        slba != startlba || elba != lbaend || lba < slba || lba > elba)
+        errx(1, "checkpoint %s does not match this copy", ckptfile);
+    fclose(fp);
+    return lba;
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... SRCNAME DSTNAME\n\
+         -a LBA       starting at LBA (default 0)\n\
+         -n COUNT     number of blocks to copy (default to end of source)\n\
+         -q QCOUNT    number of queue pairs (default 4)\n\
+         -d QDEPTH    queue depth (default 32)\n\
+         -v           verify by reading back the destination\n\
+         -c FILE      checkpoint file to save progress and resume from\n\
+         -p INTERVAL  print progress (and checkpoint) every INTERVAL seconds\n\
+         SRCNAME      source PCI device name (as 01:00.0[/1] format)\n\
+         DSTNAME      destination PCI device name";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt, i;
+    time_t interval = 10;
+
+    while ((opt = getopt(argc, argv, "a:n:q:d:vc:p:")) != -1) {
+        switch (opt) {
+        case 'a':
+            startlba = strtoull(optarg, 0, 0);
+            break;
+        case 'n':
+            lbacount = strtoull(optarg, 0, 0);
+            break;
+        case 'q':
+            qcount = strtoul(optarg, 0, 0);
+            break;
+        case 'd':
+            qdepth = strtoul(optarg, 0, 0);
+            break;
+        case 'v':
+            verify = 1;
+            break;
+        case 'c':
+            ckptfile = optarg;
+            break;
+        case 'p':
+            interval = strtoul(optarg, 0, 0);
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 2) != argc || qcount == 0 || qdepth == 0 || interval == 0) {
+        warnx(usage, prog);
+        exit(1);
+    }
+    const char* srcname = argv[optind];
+    const char* dstname = argv[optind + 1];
+
+    if (!(src = unvme_open(srcname))) exit(1);
+    if (!(dst = unvme_open(dstname))) exit(1);
+    if (src->blocksize != dst->blocksize)
+        errx(1, "block size mismatch %d != %d", src->blocksize, dst->blocksize);
+    if (lbacount == 0) lbacount = src->blockcount - startlba;
+    lbaend = startlba + lbacount;
+    if (lbaend > src->blockcount || lbaend > dst->blockcount)
+        errx(1, "max block count is %#lx", src->blockcount < dst->blockcount ?
+             src->blockcount : dst->blockcount);
+    if (qcount > src->qcount || qcount > dst->qcount)
+        errx(1, "max qcount=%d", src->qcount < dst->qcount ?
+             src->qcount : dst->qcount);
+    if (qdepth >= src->qsize || qdepth >= dst->qsize)
+        errx(1, "max qdepth=%d", (src->qsize < dst->qsize ?
+             src->qsize : dst->qsize) - 1);
+    nbpio = src->maxbpio < dst->maxbpio ? src->maxbpio : dst->maxbpio;
+
+    nextlba = ckptfile ? checkpoint_load(srcname, dstname) : startlba;
+    printf("COPY %s -> %s lba=%#lx-%#lx qc=%d qd=%d nbpio=%d%s\n",
+           src->device, dst->device, startlba, lbaend - 1, qcount, qdepth,
+           nbpio, verify ? " verify" : "");
+    if (nextlba != startlba) printf("resume at lba=%#lx\n", nextlba);
+
+    // allocate the buffer ring (source buffers are also written by dst)
+    int nslots = qcount * qdepth * 2;
+    u64 bufsize = (u64)nbpio * src->blocksize;
+    slots = calloc(nslots, sizeof(slot_t));
+    claimlba = malloc(qcount * sizeof(u64));
+    for (i = 0; i < qcount; i++) claimlba[i] = ~0UL;
+    for (i = 0; i < nslots; i++) {
+        if (!(slots[i].buf = unvme_alloc(src, bufsize)))
+            errx(1, "unvme_alloc %#lx failed", bufsize);
+        if (verify && !(slots[i].vbuf = unvme_alloc(dst, bufsize)))
+            errx(1, "unvme_alloc %#lx failed", bufsize);
+    }
+
+    u64 resumelba = nextlba;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double tstart = ts.tv_sec + ts.tv_nsec * 1e-9;
+    double tlast = tstart;
+    u64 lastcount = 0;
+
+    pthread_t* qt = calloc(qcount, sizeof(pthread_t));
+    for (i = 0; i < qcount; i++) pthread_create(&qt[i], 0, copy_queue, (void*)(long)i);
+
+    // report progress and save checkpoints until done
+    u64 total = lbaend - resumelba;
+    while (copycount < total) {
+        usleep(100000);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        double t = ts.tv_sec + ts.tv_nsec * 1e-9;
+        if ((t - tlast) < interval) continue;
+        u64 count = copycount;
+        printf("%5.1f%% lba=%#lx %.2f GB/s\n", count * 100.0 / total,
+               resumelba + count, (double)(count - lastcount) *
+               src->blocksize / (t - tlast) / 1e9);
+        fflush(stdout);
+        if (ckptfile) checkpoint_save(srcname, dstname, copied_lba());
+        tlast = t;
+        lastcount = count;
+    }
+    for (i = 0; i < qcount; i++) pthread_join(qt[i], 0);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double tend = ts.tv_sec + ts.tv_nsec * 1e-9;
+    if (ckptfile) checkpoint_save(srcname, dstname, lbaend);
+
+    printf("Copied %#lx blocks in %.1f seconds (%.2f GB/s)\n", total,
+           tend - tstart, (double)total * src->blocksize / (tend - tstart) / 1e9);
+
+    for (i = 0; i < nslots; i++) {
+        unvme_free(src, slots[i].buf);
+        if (slots[i].vbuf) unvme_free(dst, slots[i].vbuf);
+    }
+    free(slots);
+    free((void*)claimlba);
+    free(qt);
+    unvme_close(dst);
+    unvme_close(src);
+    return 0;
+}
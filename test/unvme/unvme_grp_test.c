@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe device group test.
+ *
+ * Multiple devices are opened concurrently as a group, and a single thread
+ * keeps a number of random reads outstanding on every device, reaping the
+ * completions of all the devices with unvme_group_poll.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "unvme.h"
+
+/*
+ * Get the monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME...\n\
+         -d QDEPTH    reads outstanding per device (default 32)\n\
+         -b NLB       number of blocks per read (default a page)\n\
+         -t SECONDS   run time (default 10)\n\
+         PCINAME      PCI device names (as 01:00.0[/1] format)";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt, qdepth = 32, nlb = 0;
+    double runtime = 10;
+
+    while ((opt = getopt(argc, argv, "d:b:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            qdepth = strtol(optarg, 0, 0);
+            break;
+        case 'b':
+            nlb = strtol(optarg, 0, 0);
+            break;
+        case 't':
+            runtime = strtod(optarg, 0);
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    int count = argc - optind;
+    if (count < 1 || qdepth < 1 || runtime <= 0) {
+        warnx(usage, prog);
+        exit(1);
+    }
+
+    double t = now();
+    unvme_group_t* grp = unvme_group_open((const char**)argv + optind, count,
+                                          1, qdepth + 1, 0);
+    if (!grp) errx(1, "unvme_group_open failed");
+    printf("opened %d devices in %.3f seconds\n", count, now() - t);
+
+    int i, k;
+    u64* reads = calloc(count, sizeof(u64));
+    unvme_comp_t* comps = calloc(count * qdepth, sizeof(unvme_comp_t));
+    unsigned seed = 1;
+    for (i = 0; i < count; i++) {
+        const unvme_ns_t* ns = grp->ns[i];
+        int bnlb = nlb ? nlb : ns->nbpp;
+        for (k = 0; k < qdepth; k++) {
+            void* buf = unvme_alloc(ns, (u64)bnlb * ns->blocksize);
+            if (!buf) errx(1, "unvme_alloc");
+            u64 lba = (rand_r(&seed) % (ns->blockcount / bnlb)) * bnlb;
+            if (!unvme_aread(ns, 0, buf, lba, bnlb)) errx(1, "unvme_aread");
+        }
+    }
+
+    // resubmit each completed read to the same device and buffer
+    double start = now(), end = start + runtime;
+    int pending = count * qdepth;
+    while (pending) {
+        int n = unvme_group_poll(grp, 0, comps, count * qdepth, UNVME_TIMEOUT);
+        if (n < 0) errx(1, "unvme_group_poll %s", unvme_strerror(n));
+        if (n == 0) errx(1, "unvme_group_poll timed out");
+        int stop = now() >= end;
+        for (k = 0; k < n; k++) {
+            unvme_comp_t* c = comps + k;
+            if (c->err) errx(1, "%s read lba %#lx: %s", c->ns->device, c->slba, unvme_strerror(c->err));
+            for (i = 0; grp->ns[i] != c->ns; i++);
+            reads[i]++;
+            if (stop) {
+                unvme_free(c->ns, c->buf);
+                pending--;
+                continue;
+            }
+            u64 lba = (rand_r(&seed) % (c->ns->blockcount / c->nlb)) * c->nlb;
+            if (!unvme_aread(c->ns, 0, c->buf, lba, c->nlb)) errx(1, "unvme_aread");
+        }
+    }
+    double elapsed = now() - start;
+
+    u64 total = 0;
+    for (i = 0; i < count; i++) {
+        printf("%s: %.0f IOPS\n", grp->ns[i]->device, reads[i] / elapsed);
+        total += reads[i];
+    }
+    printf("total: %.0f IOPS from one thread\n", total / elapsed);
+
+    free(comps);
+    free(reads);
+    unvme_group_close(grp);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe I/O latency jitter test.
+ *
+ * Synchronous random reads are timed on one queue, first in the default
+ * mode and then in real-time mode (UNVME_OPEN_RT with the test thread
+ * pinned and scheduled SCHED_FIFO), and the latency percentiles of both
+ * runs are reported along with the tail latency improvement.  Each run
+ * (and its warmup) reads its own random LBA sequence, so that neither run
+ * reads blocks just cached by the controller for the other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "unvme.h"
+
+/// Latency percentiles reported
+static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+#define NPCT    (sizeof(pct) / sizeof(pct[0]))
+
+// Global static variables
+static const char* pciname;     ///< device name
+static u32 count = 100000;      ///< number of timed reads
+static u32 nlb = 0;             ///< blocks per read (default a page)
+static u32 qsize = 64;          ///< queue size
+static u64* lat;                ///< latency samples (ns)
+
+
+/*
+ * Get the monotonic time in nanoseconds.
+ */
+static inline u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Compare latency samples.
+ */
+static int cmp_u64(const void* a, const void* b)
+{
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Time synchronous random reads and return the latency percentiles.
+ * The warmup reads use seed 2*run and the timed reads seed 2*run+1.
+ */
+static void run(int flags, unsigned runid, int cpu, int prio, u64 res[NPCT + 1])
+{
+    const unvme_ns_t* ns = unvme_openf(pciname, 1, qsize, flags);
+    if (!ns) exit(1);
+    if ((flags & UNVME_OPEN_RT) && unvme_rt_thread(cpu, prio))
+        warnx("real-time scheduling is not available");
+    if (!nlb) nlb = ns->nbpp;
+    void* buf = unvme_alloc(ns, (u64)nlb * ns->blocksize);
+    if (!buf) errx(1, "unvme_alloc");
+
+    u64 maxlba = (ns->blockcount - nlb) / nlb;
+    unsigned seed = 2 * runid;
+    u32 i;
+    for (i = 0; i < count / 10; i++) {
+        if (unvme_read(ns, 0, buf, (rand_r(&seed) % maxlba) * nlb, nlb))
+            errx(1, "read failed");
+    }
+    seed = 2 * runid + 1;
+    for (i = 0; i < count; i++) {
+        u64 lba = (rand_r(&seed) % maxlba) * nlb;
+        u64 t = now_ns();
+        if (unvme_read(ns, 0, buf, lba, nlb)) errx(1, "read lba %#lx failed", lba);
+        lat[i] = now_ns() - t;
+    }
+
+    unvme_free(ns, buf);
+    unvme_close(ns);
+
+    qsort(lat, count, sizeof(u64), cmp_u64);
+    for (i = 0; i < NPCT; i++) res[i] = lat[(u64)(pct[i] * (count - 1) / 100)];
+    res[NPCT] = lat[count - 1];
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME\n\
+         -n COUNT     number of timed reads (default 100000)\n\
+         -b NLB       number of blocks per read (default a page)\n\
+         -c CPU       CPU to pin the real-time run to (default 1)\n\
+         -p PRIORITY  SCHED_FIFO priority (default max)\n\
+         PCINAME      PCI device name (as 01:00.0[/1] format)";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt, cpu = 1, prio = 0;
+
+    while ((opt = getopt(argc, argv, "n:b:c:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoul(optarg, 0, 0);
+            break;
+        case 'b':
+            nlb = strtoul(optarg, 0, 0);
+            break;
+        case 'c':
+            cpu = strtol(optarg, 0, 0);
+            break;
+        case 'p':
+            prio = strtol(optarg, 0, 0);
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 1) != argc || count < 100) {
+        warnx(usage, prog);
+        exit(1);
+    }
+    pciname = argv[optind];
+
+    // allocated up front, so the real-time run does no allocation
+    lat = malloc(count * sizeof(u64));
+    if (!lat) errx(1, "malloc");
+
+    u64 def[NPCT + 1], rt[NPCT + 1];
+    printf("%s: %u reads (default mode)\n", pciname, count);
+    run(0, 1, cpu, prio, def);
+    printf("%s: %u reads (real-time mode)\n", pciname, count);
+    run(UNVME_OPEN_RT, 2, cpu, prio, rt);
+
+    u32 i;
+    printf("\n%10s %12s %12s\n", "latency", "default", "real-time");
+    for (i = 0; i < NPCT; i++) {
+        char name[16];
+        sprintf(name, "p%g", pct[i]);
+        printf("%10s %10.1fus %10.1fus\n", name, def[i] / 1e3, rt[i] / 1e3);
+    }
+    printf("%10s %10.1fus %10.1fus\n", "max", def[NPCT] / 1e3, rt[NPCT] / 1e3);
+    printf("\np99.99 improvement %.1f%%\n",
+           100.0 * ((double)def[NPCT - 1] - rt[NPCT - 1]) / def[NPCT - 1]);
+
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,602 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe key-value store benchmark (YCSB-like).
+ *
+ * The store is loaded with a number of records and then run with one of
+ * the YCSB core workloads, with the keys chosen by a (scrambled) zipfian
+ * distribution.  Each thread does its gets on its own queue, optionally
+ * batching consecutive reads into multiple gets.
+ *
+ *   A  50% read, 50% update
+ *   B  95% read, 5% update
+ *   C  100% read
+ *   D  95% read (latest records), 5% insert
+ *   F  50% read, 50% read-modify-write
+ *
+ * A correctness check (of puts, deletes, cleaning and log replay) may be
+ * run on a small store before the benchmark.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <math.h>
+#include <time.h>
+#include <err.h>
+
+#include "unvme.h"
+#include "unvme_kv.h"
+
+/// Latency percentiles reported
+static const double pct[] = { 50, 99, 99.9 };
+#define NPCT    (sizeof(pct) / sizeof(pct[0]))
+
+/// Number of segments of the correctness check store
+#define CHECK_SEGS      32
+/// Max number of overwrite rounds of the correctness check
+#define CHECK_ROUNDS    1000
+/// Deleted record generation of the correctness check
+#define CHECK_DELETED   0xffffffff
+
+/// Operation types
+enum { OP_READ, OP_UPDATE, OP_INSERT, OP_RMW, OP_TYPES };
+static const char* opname[OP_TYPES] = { "read", "update", "insert", "rmw" };
+
+/// Zipfian generator
+typedef struct {
+    u64                 n;          ///< number of items
+    double              theta;      ///< skew
+    double              alpha;      ///< 1 / (1 - theta)
+    double              zetan;      ///< zeta(n)
+    double              eta;        ///< eta
+    double              half;       ///< 1 + 0.5^theta
+} zipf_t;
+
+/// Thread context
+typedef struct {
+    pthread_t           thread;     ///< thread
+    int                 qid;        ///< get queue
+    u64                 seed;       ///< random state
+    u64                 ops;        ///< number of operations to do
+    u64*                lat[OP_TYPES]; ///< latency samples (ns)
+    u64                 count[OP_TYPES]; ///< number of samples
+} thr_t;
+
+// Global static variables
+static unvme_kv_t* kv;          ///< store
+static u64 records = 100000;    ///< number of records loaded
+static u64 opcount = 1000000;   ///< number of operations run
+static u32 vlen = 128;          ///< value length
+static int threads = 1;         ///< number of threads
+static int batch = 1;           ///< reads per multiple get
+static char workload = 'a';     ///< workload
+static double theta = 0.99;     ///< zipfian skew (0 for uniform)
+static int verify = 0;          ///< verify values flag
+static zipf_t zipf;             ///< key distribution
+static volatile u64 inserted;   ///< number of records readable
+static u64 nextrec;             ///< next record to insert
+
+
+/*
+ * Get the monotonic time in nanoseconds.
+ */
+static inline u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Get a random number (xorshift64*).
+ */
+static inline u64 rnd(u64* s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545f4914f6cdd1dUL;
+}
+
+/*
+ * Get a random number in [0, 1).
+ */
+static inline double rnd01(u64* s)
+{
+    return (rnd(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Initialize a zipfian generator (as in YCSB).
+ */
+static void zipf_init(zipf_t* z, u64 n, double theta)
+{
+    u64 i;
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (i = 1; i <= n; i++) z->zetan += 1.0 / pow(i, theta);
+    double zeta2 = 1.0 + 1.0 / pow(2, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+    z->half = 1.0 + pow(0.5, theta);
+}
+
+/*
+ * Get the next zipfian item rank (0 is the most popular).
+ */
+static u64 zipf_next(zipf_t* z, u64* s)
+{
+    double u = rnd01(s);
+    double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < z->half) return 1;
+    u64 r = z->n * pow(z->eta * u - z->eta + 1.0, z->alpha);
+    return r < z->n ? r : z->n - 1;
+}
+
+/*
+ * Hash a record number (FNV-1a), to scramble the popular records.
+ */
+static u64 fnv(u64 v)
+{
+    u64 h = 0xcbf29ce484222325UL;
+    int i;
+    for (i = 0; i < 8; i++) {
+        h ^= v & 0xff;
+        h *= 0x100000001b3UL;
+        v >>= 8;
+    }
+    return h;
+}
+
+/*
+ * Choose a record to access.
+ */
+static u64 next_record(u64* s)
+{
+    u64 n = inserted;
+    if (theta == 0) return rnd(s) % n;
+    if (workload == 'd') {
+        u64 r = zipf_next(&zipf, s);
+        return r < n ? n - 1 - r : 0;
+    }
+    return fnv(zipf_next(&zipf, s)) % n;
+}
+
+/*
+ * Format the key of a record.
+ */
+static u32 make_key(u64 rec, char* key)
+{
+    return sprintf(key, "user%016lx", fnv(rec));
+}
+
+/*
+ * Fill the value of a record (tagged with the record number).
+ */
+static void make_value(u64 rec, u64* s, char* val)
+{
+    u32 i;
+    memcpy(val, &rec, sizeof(rec));
+    for (i = sizeof(rec); i < vlen; i++) val[i] = rnd(s);
+}
+
+/*
+ * Check a value read for a record.
+ */
+static void check_value(u64 rec, int stat, u32 len, const char* val)
+{
+    if (stat) errx(1, "get record %lu: %s", rec, unvme_strerror(stat));
+    if (verify && (len != vlen || memcmp(val, &rec, sizeof(rec))))
+        errx(1, "record %lu value mismatch", rec);
+}
+
+/*
+ * Fill the value of a record of a correctness check generation.
+ */
+static void check_fill(u64 rec, u32 gen, char* val)
+{
+    u64 tag = rec + ((u64)gen << 40);
+    memcpy(val, &tag, sizeof(tag));
+    memset(val + sizeof(tag), (int)(rec + gen), vlen - sizeof(tag));
+}
+
+/*
+ * Verify all the records of the correctness check, by gets and by
+ * multiple gets.
+ */
+static void check_verify(unvme_kv_t* kvs, const u32* gens, u64 nrec, const char* when)
+{
+    char key[32], val[vlen], exp[vlen];
+    char keys[16][32];
+    char vals[16][vlen];
+    unvme_kv_item_t items[16];
+    u64 r;
+    int i, n = 0;
+    for (r = 0; r < nrec; r++) {
+        u32 len = 0;
+        u32 klen = make_key(r, key);
+        int stat = unvme_kv_get(kvs, 2, key, klen, val, vlen, &len);
+        if (gens[r] == CHECK_DELETED) {
+            if (stat != -ENOENT) errx(1, "%s: deleted record %lu get: %s", when, r, unvme_strerror(stat));
+            continue;
+        }
+        if (stat) errx(1, "%s: record %lu get: %s", when, r, unvme_strerror(stat));
+        check_fill(r, gens[r], exp);
+        if (len != vlen || memcmp(val, exp, vlen))
+            errx(1, "%s: record %lu generation %u mismatch", when, r, gens[r]);
+    }
+    for (r = 0; r < nrec; r += n) {
+        n = (nrec - r) < 16 ? (nrec - r) : 16;
+        for (i = 0; i < n; i++) {
+            items[i].key = keys[i];
+            items[i].klen = make_key(r + i, keys[i]);
+            items[i].val = vals[i];
+            items[i].vsize = vlen;
+        }
+        int found = unvme_kv_mget(kvs, 2, items, n);
+        if (found < 0) errx(1, "%s: mget: %s", when, unvme_strerror(found));
+        for (i = 0; i < n; i++) {
+            if (gens[r + i] == CHECK_DELETED) {
+                if (items[i].stat != -ENOENT) errx(1, "%s: deleted record %lu mget", when, r + i);
+                continue;
+            }
+            check_fill(r + i, gens[r + i], exp);
+            if (items[i].stat || items[i].vlen != vlen || memcmp(vals[i], exp, vlen))
+                errx(1, "%s: record %lu mget mismatch", when, r + i);
+        }
+    }
+}
+
+/*
+ * Check the store correctness on a small store (at the start of the range):
+ * put records, delete a third of them, and overwrite another third until the
+ * log has been cleaned all around (moving the records left as they were,
+ * and with some deleted records put back), then
+ * verify the records, and verify them again after reopening the store
+ * (replaying the log).
+ */
+static void kv_check(const unvme_ns_t* ns, unvme_kv_params_t params)
+{
+    params.segnlb = (1 << 20) >> ns->blockshift;
+    params.nlb = 1 + (u64)CHECK_SEGS * params.segnlb;
+    u64 nrec = ((u64)(CHECK_SEGS / 4) << 20) / (vlen + 64);
+    if (nrec > records) nrec = records;
+    params.maxkeys = nrec;
+
+    int stat = unvme_kv_format(ns, &params);
+    if (stat) errx(1, "check format: %s", unvme_strerror(stat));
+    unvme_kv_t* kvs = unvme_kv_open(ns, &params);
+    if (!kvs) errx(1, "check open: %s", unvme_strerror(-errno));
+
+    char key[32], val[vlen];
+    u32* gens = calloc(nrec, sizeof(u32));
+    u64 r;
+    for (r = 0; r < nrec; r++) {
+        u32 klen = make_key(r, key);
+        check_fill(r, 0, val);
+        if ((stat = unvme_kv_put(kvs, 2, key, klen, val, vlen)))
+            errx(1, "check put %lu: %s", r, unvme_strerror(stat));
+    }
+    for (r = 0; r < nrec; r += 3) {
+        u32 klen = make_key(r, key);
+        if ((stat = unvme_kv_delete(kvs, 2, key, klen)))
+            errx(1, "check delete %lu: %s", r, unvme_strerror(stat));
+        if ((stat = unvme_kv_delete(kvs, 2, key, klen)) != -ENOENT)
+            errx(1, "check delete %lu again: %s", r, unvme_strerror(stat));
+        gens[r] = CHECK_DELETED;
+    }
+
+    unvme_kv_stats_t st;
+    u32 gen;
+    for (gen = 1; gen <= CHECK_ROUNDS; gen++) {
+        unvme_kv_stats(kvs, &st);
+        if (st.gcsegs >= st.segcount) break;
+        for (r = 0; r < nrec; r++) {
+            if ((r % 3) == 1 || (gens[r] == CHECK_DELETED && (r % 6 || gen == 1))) continue;
+            u32 klen = make_key(r, key);
+            check_fill(r, gen, val);
+            if ((stat = unvme_kv_put(kvs, 2, key, klen, val, vlen)))
+                errx(1, "check put %lu: %s", r, unvme_strerror(stat));
+            gens[r] = gen;
+        }
+    }
+    if (gen > CHECK_ROUNDS) errx(1, "check: log not cleaned");
+    u64 moved = st.gcbytes;
+    check_verify(kvs, gens, nrec, "check");
+    if ((stat = unvme_kv_close(kvs))) errx(1, "check close: %s", unvme_strerror(stat));
+
+    if (!(kvs = unvme_kv_open(ns, &params))) errx(1, "check reopen: %s", unvme_strerror(-errno));
+    unvme_kv_stats(kvs, &st);
+    u64 keys = 0;
+    for (r = 0; r < nrec; r++) keys += gens[r] != CHECK_DELETED;
+    if (st.keys != keys) errx(1, "check reopen: %lu keys (expected %lu)", st.keys, keys);
+    check_verify(kvs, gens, nrec, "check reopen");
+    if ((stat = unvme_kv_close(kvs))) errx(1, "check close: %s", unvme_strerror(stat));
+    free(gens);
+    printf("check: %lu records, %u rounds, %luKB moved by cleaning, replayed and verified\n",
+           nrec, gen - 1, moved >> 10);
+}
+
+/*
+ * Run the workload operations of a thread.
+ */
+static void* run_thread(void* arg)
+{
+    thr_t* t = arg;
+    char key[32], val[vlen];
+    char keys[batch][32];
+    char* vals = malloc((u64)(u32)batch * vlen);
+    unvme_kv_item_t items[batch];
+    u64 recs[batch];
+    int rd = workload == 'c' ? 100 : (workload == 'b' || workload == 'd') ? 95 : 50;
+    int i, n = 0;
+    u64 op, tbatch = 0;
+
+    for (op = 0; op < t->ops; op++) {
+        int type = (rnd(&t->seed) % 100) < rd ? OP_READ :
+                   workload == 'd' ? OP_INSERT : workload == 'f' ? OP_RMW : OP_UPDATE;
+        if (type == OP_INSERT) {
+            u64 rec = __sync_fetch_and_add(&nextrec, 1);
+            u64 ts = now_ns();
+            u32 klen = make_key(rec, key);
+            make_value(rec, &t->seed, val);
+            int stat = unvme_kv_put(kv, t->qid, key, klen, val, vlen);
+            if (stat) errx(1, "put record %lu: %s", rec, unvme_strerror(stat));
+            // make the records readable in order
+            while (inserted != rec) sched_yield();
+            inserted = rec + 1;
+            t->lat[type][t->count[type]++] = now_ns() - ts;
+            continue;
+        }
+
+        u64 rec = next_record(&t->seed);
+        if (type == OP_READ) {
+            // reads are batched into a multiple get
+            if (!n) tbatch = now_ns();
+            recs[n] = rec;
+            items[n].key = keys[n];
+            items[n].klen = make_key(rec, keys[n]);
+            items[n].val = vals + (u64)n * vlen;
+            items[n].vsize = vlen;
+            if (++n < batch && (op + 1) < t->ops) continue;
+            int found = unvme_kv_mget(kv, t->qid, items, n);
+            if (found < 0) errx(1, "mget: %s", unvme_strerror(found));
+            u64 lat = now_ns() - tbatch;
+            for (i = 0; i < n; i++) {
+                check_value(recs[i], items[i].stat, items[i].vlen, items[i].val);
+                t->lat[OP_READ][t->count[OP_READ]++] = lat;
+            }
+            n = 0;
+            continue;
+        }
+
+        u64 ts = now_ns();
+        u32 klen = make_key(rec, key);
+        if (type == OP_RMW) {
+            u32 len;
+            int stat = unvme_kv_get(kv, t->qid, key, klen, val, vlen, &len);
+            check_value(rec, stat, len, val);
+        }
+        make_value(rec, &t->seed, val);
+        int stat = unvme_kv_put(kv, t->qid, key, klen, val, vlen);
+        if (stat) errx(1, "put record %lu: %s", rec, unvme_strerror(stat));
+        t->lat[type][t->count[type]++] = now_ns() - ts;
+    }
+    if (n) {
+        int found = unvme_kv_mget(kv, t->qid, items, n);
+        if (found < 0) errx(1, "mget: %s", unvme_strerror(found));
+        for (i = 0; i < n; i++) {
+            check_value(recs[i], items[i].stat, items[i].vlen, items[i].val);
+            t->lat[OP_READ][t->count[OP_READ]++] = now_ns() - tbatch;
+        }
+    }
+    free(vals);
+    return 0;
+}
+
+/*
+ * Compare latency samples.
+ */
+static int cmp_u64(const void* a, const void* b)
+{
+    u64 x = *(const u64*)a, y = *(const u64*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME\n\
+         -w WORKLOAD  YCSB workload a, b, c, d or f (default a)\n\
+         -r RECORDS   number of records to load (default 100000)\n\
+         -o OPS       number of operations to run (default 1000000)\n\
+         -v VLEN      value length (default 128)\n\
+         -t THREADS   number of threads (default 1)\n\
+         -b BATCH     reads per multiple get (default 1)\n\
+         -z THETA     zipfian skew (default 0.99, 0 for uniform)\n\
+         -s SLBA      store starting lba (default 0)\n\
+         -n NLB       store size in blocks (default to end)\n\
+         -k           keep the store (do not format and load)\n\
+         -c           check the store correctness first (not with -k)\n\
+         -V           verify the values read\n\
+         PCINAME      PCI device name (as 01:00.0[/1] format)";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    unvme_kv_params_t params;
+    memset(&params, 0, sizeof(params));
+    int opt, i, j, keep = 0, check = 0;
+
+    while ((opt = getopt(argc, argv, "w:r:o:v:t:b:z:s:n:kcV")) != -1) {
+        switch (opt) {
+        case 'w':
+            workload = optarg[0] | 0x20;
+            break;
+        case 'r':
+            records = strtoull(optarg, 0, 0);
+            break;
+        case 'o':
+            opcount = strtoull(optarg, 0, 0);
+            break;
+        case 'v':
+            vlen = strtoul(optarg, 0, 0);
+            break;
+        case 't':
+            threads = strtol(optarg, 0, 0);
+            break;
+        case 'b':
+            batch = strtol(optarg, 0, 0);
+            break;
+        case 'z':
+            theta = strtod(optarg, 0);
+            break;
+        case 's':
+            params.slba = strtoull(optarg, 0, 0);
+            break;
+        case 'n':
+            params.nlb = strtoull(optarg, 0, 0);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'c':
+            check = 1;
+            break;
+        case 'V':
+            verify = 1;
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 1) != argc || !strchr("abcdf", workload) || !records || !opcount ||
+        vlen < sizeof(u64) || threads < 1 || batch < 1 || theta < 0 || theta >= 1 ||
+        (check && keep)) {
+        warnx(usage, prog);
+        exit(1);
+    }
+
+    // queue 0 writes the log, 1 cleans it, and the threads get on the rest
+    const unvme_ns_t* ns = unvme_openq(argv[optind], threads + 2, 0);
+    if (!ns) exit(1);
+    u64 maxrecs = records + (workload == 'd' ? opcount : 0);
+    params.maxkeys = maxrecs;
+    params.maxvlen = vlen;
+    params.qid = 0;
+    params.gcqid = 1;
+    printf("KV TEST BEGIN\n");
+    printf("%s workload=%c records=%lu ops=%lu vlen=%u threads=%d batch=%d theta=%g\n",
+           ns->device, workload, records, opcount, vlen, threads, batch, theta);
+
+    if (check) kv_check(ns, params);
+    int stat;
+    if (!keep && (stat = unvme_kv_format(ns, &params)))
+        errx(1, "format: %s", unvme_strerror(stat));
+    if (!(kv = unvme_kv_open(ns, &params)))
+        errx(1, "open: %s", unvme_strerror(-errno));
+
+    u64 seed = 1;
+    if (!keep) {
+        char key[32], val[vlen];
+        u64 ts = now_ns();
+        u64 r;
+        for (r = 0; r < records; r++) {
+            u32 klen = make_key(r, key);
+            make_value(r, &seed, val);
+            if ((stat = unvme_kv_put(kv, 2, key, klen, val, vlen)))
+                errx(1, "load record %lu: %s", r, unvme_strerror(stat));
+        }
+        if ((stat = unvme_kv_sync(kv))) errx(1, "sync: %s", unvme_strerror(stat));
+        double sec = (now_ns() - ts) * 1e-9;
+        printf("load: %lu records in %.2f sec (%.0f ops/sec)\n", records, sec, records / sec);
+    }
+    inserted = nextrec = records;
+    if (theta) zipf_init(&zipf, workload == 'd' ? maxrecs : records, theta);
+
+    thr_t* thr = calloc(threads, sizeof(thr_t));
+    for (i = 0; i < threads; i++) {
+        thr[i].qid = i + 2;
+        thr[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+        thr[i].ops = opcount / threads + (i < (opcount % threads));
+        for (j = 0; j < OP_TYPES; j++) thr[i].lat[j] = malloc(thr[i].ops * sizeof(u64));
+    }
+    u64 ts = now_ns();
+    for (i = 0; i < threads; i++) pthread_create(&thr[i].thread, 0, run_thread, thr + i);
+    for (i = 0; i < threads; i++) pthread_join(thr[i].thread, 0);
+    double sec = (now_ns() - ts) * 1e-9;
+    printf("run: %lu ops in %.2f sec (%.0f ops/sec)\n", opcount, sec, opcount / sec);
+
+    // merge the latency samples per operation type
+    for (j = 0; j < OP_TYPES; j++) {
+        u64 count = 0, sum = 0, k;
+        for (i = 0; i < threads; i++) count += thr[i].count[j];
+        if (!count) continue;
+        u64* lat = malloc(count * sizeof(u64));
+        for (count = 0, i = 0; i < threads; i++) {
+            memcpy(lat + count, thr[i].lat[j], thr[i].count[j] * sizeof(u64));
+            count += thr[i].count[j];
+        }
+        qsort(lat, count, sizeof(u64), cmp_u64);
+        for (k = 0; k < count; k++) sum += lat[k];
+        printf("%-6s count=%-9lu avg=%.1f", opname[j], count, sum / count / 1000.0);
+        for (k = 0; k < NPCT; k++)
+            printf(" p%g=%.1f", pct[k], lat[(u64)(pct[k] * (count - 1) / 100)] / 1000.0);
+        printf(" max=%.1f us\n", lat[count - 1] / 1000.0);
+        free(lat);
+    }
+
+    unvme_kv_stats_t st;
+    unvme_kv_stats(kv, &st);
+    printf("keys=%lu live=%luMB segments=%u/%u free gc=%lu segments (%luMB moved) writes=%lu\n",
+           st.keys, st.livebytes >> 20, st.segfree, st.segcount, st.gcsegs,
+           st.gcbytes >> 20, st.writes);
+    if ((stat = unvme_kv_close(kv))) errx(1, "close: %s", unvme_strerror(stat));
+    unvme_close(ns);
+    for (i = 0; i < threads; i++) {
+        for (j = 0; j < OP_TYPES; j++) free(thr[i].lat[j]);
+    }
+    free(thr);
+    printf("KV TEST COMPLETE\n");
+    return 0;
+}
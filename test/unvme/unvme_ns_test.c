@@ -0,0 +1,194 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe namespace management test.
+ *
+ * The LBA formats of the namespace are listed and invalid format and create
+ * requests are checked to be rejected.  With -f the namespace is formatted
+ * (after checking that a format is refused while another session of the
+ * controller has I/O pending), and with -c a namespace is created, written,
+ * read back and deleted.  Both options destroy data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+
+#include "unvme.h"
+
+/*
+ * Write a pattern to the first and last block of a namespace and read it
+ * back.
+ */
+static void verify(const unvme_ns_t* ns)
+{
+    u64 lbas[2] = { 0, ns->blockcount - 1 };
+    u64* buf = unvme_alloc(ns, ns->blocksize);
+    if (!buf) errx(1, "unvme_alloc failed");
+    u64 w, n = ns->blocksize / sizeof(u64);
+    int i, err;
+
+    for (i = 0; i < 2; i++) {
+        for (w = 0; w < n; w++) buf[w] = (lbas[i] << 16) | w;
+        if ((err = unvme_write(ns, 0, buf, lbas[i], 1)))
+            errx(1, "%s write lba %#lx: %s", ns->device, lbas[i], unvme_strerror(err));
+        memset(buf, 0, ns->blocksize);
+        if ((err = unvme_read(ns, 0, buf, lbas[i], 1)))
+            errx(1, "%s read lba %#lx: %s", ns->device, lbas[i], unvme_strerror(err));
+        for (w = 0; w < n; w++) {
+            if (buf[w] != ((lbas[i] << 16) | w))
+                errx(1, "%s miscompare lba %#lx word %#lx", ns->device, lbas[i], w);
+        }
+    }
+    unvme_free(ns, buf);
+    printf("%s verified %#lx blocks of %u bytes\n", ns->device, ns->blockcount, ns->blocksize);
+}
+
+/*
+ * Format the namespace, first checking that the format is refused while
+ * a read is pending on another session of the same controller.
+ */
+static void format(const unvme_ns_t* ns, const char* pciname, int lbaf, u32 blocksize)
+{
+    const unvme_ns_t* ns2 = unvme_open(pciname);
+    if (!ns2) errx(1, "unvme_open %s failed", pciname);
+    void* buf = unvme_alloc(ns2, ns2->blocksize);
+    if (!buf) errx(1, "unvme_alloc failed");
+    unvme_iod_t iod = unvme_aread(ns2, 0, buf, 0, 1);
+    if (!iod) errx(1, "unvme_aread failed");
+    if (unvme_format(ns, lbaf) == 0) errx(1, "format accepted with I/O pending");
+    int err = unvme_apoll(iod, UNVME_TIMEOUT);
+    if (err) errx(1, "unvme_apoll: %s", unvme_strerror(err));
+    unvme_free(ns2, buf);
+    unvme_close(ns2);
+    printf("format refused with I/O pending on another session\n");
+
+    if ((err = unvme_format(ns, lbaf)))
+        errx(1, "unvme_format lbaf %d: %s", lbaf, unvme_strerror(err));
+    if (ns->blocksize != blocksize)
+        errx(1, "formatted block size %u, expected %u", ns->blocksize, blocksize);
+    printf("formatted lbaf %d\n", lbaf);
+    verify(ns);
+}
+
+/*
+ * Create a namespace, verify it through its own session and delete it.
+ */
+static void create(const unvme_ns_t* ns, const char* pciname, u64 nlb)
+{
+    int nsid = unvme_ns_create(ns, nlb, UNVME_LBAF_BEST);
+    if (nsid <= 0) errx(1, "unvme_ns_create %#lx blocks failed", nlb);
+    printf("created namespace %d\n", nsid);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%.*s/%d", (int)strcspn(pciname, "/"), pciname, nsid);
+    const unvme_ns_t* cns = unvme_open(name);
+    if (!cns) errx(1, "unvme_open %s failed", name);
+    if (cns->blockcount != nlb)
+        errx(1, "%s has %#lx blocks, expected %#lx", name, cns->blockcount, nlb);
+    verify(cns);
+    unvme_close(cns);
+
+    if (unvme_ns_delete(ns, nsid)) errx(1, "unvme_ns_delete %d failed", nsid);
+    printf("deleted namespace %d\n", nsid);
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME\n\
+         -f LBAF      format the namespace with LBA format LBAF (data lost)\n\
+         -c NLB       create, verify and delete a namespace of NLB blocks\n\
+         PCINAME      PCI device name (as 01:00.0[/1] format)";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt, fmt = -1;
+    u64 nlb = 0;
+
+    while ((opt = getopt(argc, argv, "f:c:")) != -1) {
+        switch (opt) {
+        case 'f':
+            fmt = strtol(optarg, 0, 0);
+            break;
+        case 'c':
+            nlb = strtoull(optarg, 0, 0);
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 1) != argc) {
+        warnx(usage, prog);
+        exit(1);
+    }
+    const char* pciname = argv[optind];
+
+    printf("NAMESPACE TEST BEGIN\n");
+    const unvme_ns_t* ns = unvme_open(pciname);
+    if (!ns) exit(1);
+
+    unvme_lbaf_t lbaf[16];
+    int i, count = unvme_get_lbaf(ns, lbaf);
+    if (count <= 0) errx(1, "unvme_get_lbaf failed");
+    for (i = 0; i < count; i++) {
+        printf("lbaf %-2d bs=%-5u ms=%-3u rp=%u%s\n", i, lbaf[i].blocksize,
+               lbaf[i].ms, lbaf[i].rp, lbaf[i].formatted ? " (formatted)" : "");
+    }
+
+    // invalid requests are rejected before any command is issued
+    if (unvme_format(ns, count) == 0) errx(1, "format lbaf %d accepted", count);
+    if (unvme_ns_create(ns, 1, count) > 0) errx(1, "create lbaf %d accepted", count);
+    for (i = 0; i < count; i++) {
+        if (lbaf[i].blocksize <= ns->pagesize) continue;
+        if (unvme_format(ns, i) == 0) errx(1, "format lbaf %d accepted", i);
+        if (unvme_ns_create(ns, 1, i) > 0) errx(1, "create lbaf %d accepted", i);
+    }
+    printf("invalid LBA formats rejected\n");
+
+    if (fmt >= 0) {
+        if (fmt >= count) errx(1, "no lbaf %d", fmt);
+        format(ns, pciname, fmt, lbaf[fmt].blocksize);
+    }
+    if (nlb) create(ns, pciname, nlb);
+
+    unvme_close(ns);
+    printf("NAMESPACE TEST COMPLETE\n");
+    return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe raw queue test.
+ *
+ * A queue is taken over as a raw queue, and a range of blocks is written
+ * through it in batches of max size commands (from buffers at page, dword
+ * and block offsets), read back through it and verified, with each command
+ * id mapped to its request by the ctx table.  The queue is then closed and
+ * the range read again with the regular API.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "unvme.h"
+#include "unvme_rawq.h"
+
+/// I/O request tracked by the application
+typedef struct _req {
+    u64*                buf;        ///< I/O buffer
+    u64                 slba;       ///< starting lba
+    int                 done;       ///< completed flag
+} req_t;
+
+/*
+ * Fill or check the data pattern of a request (tagging each word with its
+ * block address).
+ */
+static void pattern(const unvme_ns_t* ns, req_t* r, u32 nlb, int check)
+{
+    u64 w, n = (u64)nlb * ns->blocksize / sizeof(u64);
+    u64 wpb = ns->blocksize / sizeof(u64);
+    for (w = 0; w < n; w++) {
+        u64 val = ((r->slba + w / wpb) << 16) | (w % wpb);
+        if (!check) r->buf[w] = val;
+        else if (r->buf[w] != val)
+            errx(1, "miscompare lba %#lx word %#lx: %#lx", r->slba + w / wpb, w % wpb, r->buf[w]);
+    }
+}
+
+/*
+ * Submit a command per request through the raw queue and consume all of
+ * their completions.
+ */
+static void rawq_io(unvme_rawq_t* rq, int opc, req_t* reqs, int count, u32 nlb)
+{
+    u64 bufsz = (u64)nlb * rq->ns->blocksize;
+    time_t end = time(0) + UNVME_TIMEOUT;
+    int sent = 0, done = 0;
+
+    while (done < count) {
+        // the command id is the request index (unique and below the queue size)
+        int n = unvme_rawq_reserve(rq, count - sent);
+        for (; n > 0; n--, sent++) {
+            req_t* r = reqs + sent;
+            u64 addr;
+            if (unvme_rawq_map(rq, r->buf, bufsz, &addr))
+                errx(1, "unvme_rawq_map %p failed", r->buf);
+            nvme_sq_entry_t* sqe = unvme_rawq_sqe(rq);
+            if (!sqe) errx(1, "unvme_rawq_sqe failed");
+            unvme_rawq_rw(rq, sqe, opc, sent, addr, r->slba, nlb);
+            rq->ctx[sent] = r;
+            r->done = 0;
+        }
+        unvme_rawq_publish(rq);
+
+        if (!unvme_rawq_peek(rq)) {
+            if (time(0) > end) errx(1, "raw queue timed out (%d/%d)", done, count);
+            continue;
+        }
+        int stat;
+        int cid = unvme_rawq_consume(rq, &stat, NULL);
+        if (cid < 0 || cid >= count || !rq->ctx[cid])
+            errx(1, "unexpected cid %d", cid);
+        req_t* r = rq->ctx[cid];
+        if (stat) errx(1, "lba %#lx: %s", r->slba, unvme_strerror(stat));
+        rq->ctx[cid] = NULL;
+        r->done = 1;
+        done++;
+    }
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME\n\
+         -q QID       client queue index to use (default 0)\n\
+         -a LBA       starting LBA (default 0)\n\
+         -i COUNT     number of batches (default 4)\n\
+         PCINAME      PCI device name (as 01:00.0[/1] format)";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt, qid = 0, batches = 4;
+    u64 slba = 0;
+
+    while ((opt = getopt(argc, argv, "q:a:i:")) != -1) {
+        switch (opt) {
+        case 'q':
+            qid = strtol(optarg, 0, 0);
+            break;
+        case 'a':
+            slba = strtoull(optarg, 0, 0);
+            break;
+        case 'i':
+            batches = strtol(optarg, 0, 0);
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 1) != argc || batches <= 0) {
+        warnx(usage, prog);
+        exit(1);
+    }
+
+    printf("RAW QUEUE TEST BEGIN\n");
+    const unvme_ns_t* ns = unvme_open(argv[optind]);
+    if (!ns) exit(1);
+    unvme_rawq_t* rq = unvme_rawq_open(ns, qid);
+    if (!rq) errx(1, "unvme_rawq_open q%d failed", qid);
+
+    // a batch fills the queue with max size commands
+    u32 nlb = ns->maxbpio;
+    int count = rq->size - 1;
+    u64 bufsz = (u64)nlb * ns->blocksize;
+    u64 stride = bufsz + ns->pagesize;
+    if (slba + (u64)batches * count * nlb > ns->blockcount)
+        errx(1, "range exceeds %#lx blocks", ns->blockcount);
+    u8* mem = unvme_alloc(ns, count * stride);
+    if (!mem) errx(1, "unvme_alloc failed");
+    req_t* reqs = calloc(count, sizeof(req_t));
+    u64 offs[] = { 0, 4, ns->blocksize };
+    int b, i;
+    for (i = 0; i < count; i++) reqs[i].buf = (u64*)(mem + i * stride + offs[i % 3]);
+
+    for (b = 0; b < batches; b++) {
+        printf("batch %d: write/read %d x %u blocks at lba %#lx\n",
+               b, count, nlb, slba + (u64)b * count * nlb);
+        for (i = 0; i < count; i++) {
+            reqs[i].slba = slba + ((u64)b * count + i) * nlb;
+            pattern(ns, reqs + i, nlb, 0);
+        }
+        rawq_io(rq, NVME_CMD_WRITE, reqs, count, nlb);
+        for (i = 0; i < count; i++) memset(reqs[i].buf, 0, bufsz);
+        rawq_io(rq, NVME_CMD_READ, reqs, count, nlb);
+        for (i = 0; i < count; i++) pattern(ns, reqs + i, nlb, 1);
+    }
+    if (rq->resets) errx(1, "controller reset during the test");
+    if (unvme_rawq_close(rq)) errx(1, "unvme_rawq_close failed");
+
+    printf("read back with the regular API\n");
+    for (i = 0; i < count; i++) {
+        memset(reqs[i].buf, 0, bufsz);
+        int err = unvme_read(ns, qid, reqs[i].buf, reqs[i].slba, nlb);
+        if (err) errx(1, "unvme_read lba %#lx: %s", reqs[i].slba, unvme_strerror(err));
+        pattern(ns, reqs + i, nlb, 1);
+    }
+
+    free(reqs);
+    unvme_free(ns, mem);
+    unvme_close(ns);
+    printf("RAW QUEUE TEST COMPLETE\n");
+    return 0;
+}
@@ -0,0 +1,375 @@
+/**
+ * Copyright (c) 2015-2016, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNVMe thin provisioned volume utility.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "unvme.h"
+#include "unvme_vol.h"
+
+/// Concurrent I/O and trim test context
+typedef struct {
+    const unvme_ns_t*   ns;         ///< namespace
+    unvme_vol_t*        vol;        ///< volume
+    u64                 slba;       ///< starting lba of the extent tested
+    u32                 nlb;        ///< number of blocks of the extent
+    volatile int        stop;       ///< stop flag
+} race_t;
+
+/// Number of trims of the concurrent I/O and trim test
+#define RACE_TRIMS      200
+
+/*
+ * Fill a buffer with the test pattern (of a given generation) of a range.
+ */
+static void fill_pattern(const unvme_ns_t* ns, u64* buf, u64 lba, u32 nlb, u64 gen)
+{
+    u64 i, n = ((u64)nlb * ns->blocksize) / sizeof(u64);
+    for (i = 0; i < n; i++) buf[i] = (gen << 56) + (lba << 16) + i;
+}
+
+/*
+ * Check that each block of a range read holds either its test pattern or
+ * zeroes (if trimmed).
+ * @return  the number of zero blocks.
+ */
+static u32 check_blocks(const unvme_ns_t* ns, const u64* buf, u64 lba, u32 nlb, int zero)
+{
+    u32 b, nz = 0, nw = ns->blocksize / sizeof(u64);
+    for (b = 0; b < nlb; b++) {
+        const u64* p = buf + (u64)b * nw;
+        u64 base = (lba << 16) + (u64)b * nw;
+        u32 i, z = 1, m = 1;
+        for (i = 0; i < nw; i++) {
+            if (p[i]) z = 0;
+            if (p[i] != base + i) m = 0;
+        }
+        if (z) nz++;
+        else if (!m || zero)
+            errx(1, "verify mismatch lba=%#lx block %#x", lba, b);
+    }
+    return nz;
+}
+
+/*
+ * Read a range and check it by check_blocks.
+ */
+static u32 read_check(const unvme_ns_t* ns, unvme_vol_t* vol, int qid, u64* buf,
+                      u64 lba, u32 nlb, int zero)
+{
+    int stat = unvme_vol_read(vol, qid, buf, lba, nlb);
+    if (stat) errx(1, "read lba=%#lx nlb=%#x: %s", lba, nlb, unvme_strerror(stat));
+    return check_blocks(ns, buf, lba, nlb, zero);
+}
+
+/*
+ * Write and read back the first half of an extent while the extent is
+ * being trimmed (on queue 1).
+ */
+static void* race_io(void* arg)
+{
+    race_t* r = arg;
+    const unvme_ns_t* ns = r->ns;
+    u32 nlb = (r->nlb / 2) < ns->maxbpio ? (r->nlb / 2) : ns->maxbpio;
+    u64* wbuf = unvme_alloc(ns, (u64)nlb * ns->blocksize);
+    u64* rbuf = unvme_alloc(ns, (u64)nlb * ns->blocksize);
+    if (!wbuf || !rbuf) errx(1, "unvme_alloc failed");
+    u64 lba = r->slba;
+    while (!r->stop) {
+        fill_pattern(ns, wbuf, lba, nlb, 0);
+        int stat = unvme_vol_write(r->vol, 1, wbuf, lba, nlb);
+        if (stat) errx(1, "write lba=%#lx nlb=%#x: %s", lba, nlb, unvme_strerror(stat));
+        read_check(ns, r->vol, 1, rbuf, lba, nlb, 0);
+        lba += nlb;
+        if (lba >= r->slba + r->nlb / 2) lba = r->slba;
+    }
+    unvme_free(ns, rbuf);
+    unvme_free(ns, wbuf);
+    return 0;
+}
+
+/*
+ * Write a volume range with a pattern and read it back to verify, then
+ * trim the middle half of the range and check that it reads as zeroes
+ * (and the rest is intact), and finally trim an extent of the range over
+ * and over while it is being written and read.
+ */
+static void vol_test(const unvme_ns_t* ns, unvme_pool_t* pool, unvme_vol_t* vol,
+                     u64 slba, u64 nlb)
+{
+    u32 nbpio = ns->maxbpio;
+    u64 size = (u64)nbpio * ns->blocksize;
+    u64* wbuf = unvme_alloc(ns, size);
+    u64* rbuf = unvme_alloc(ns, size);
+    if (!wbuf || !rbuf) errx(1, "unvme_alloc %#lx failed", size);
+
+    u64 lba;
+    for (lba = slba; lba < slba + nlb; lba += nbpio) {
+        u32 n = (slba + nlb - lba) < nbpio ? (slba + nlb - lba) : nbpio;
+        fill_pattern(ns, wbuf, lba, n, 0);
+        int stat = unvme_vol_write(vol, 0, wbuf, lba, n);
+        if (stat) errx(1, "write lba=%#lx nlb=%#x: %s", lba, n, unvme_strerror(stat));
+        stat = unvme_vol_read(vol, 0, rbuf, lba, n);
+        if (stat) errx(1, "read lba=%#lx nlb=%#x: %s", lba, n, unvme_strerror(stat));
+        if (memcmp(wbuf, rbuf, (u64)n * ns->blocksize))
+            errx(1, "verify mismatch lba=%#lx nlb=%#x", lba, n);
+    }
+
+    u64 tslba = slba + nlb / 4;
+    u64 tnlb = nlb / 2;
+    if (tnlb) {
+        int stat = unvme_vol_trim(vol, 0, tslba, tnlb);
+        if (stat) errx(1, "trim lba=%#lx nlb=%#lx: %s", tslba, tnlb, unvme_strerror(stat));
+        for (lba = slba; lba < slba + nlb; lba += nbpio) {
+            u32 n = (slba + nlb - lba) < nbpio ? (slba + nlb - lba) : nbpio;
+            u32 b = 0;
+            if (lba < tslba) {
+                // intact blocks before the trimmed range
+                b = (tslba - lba) < n ? (tslba - lba) : n;
+                if (read_check(ns, vol, 0, rbuf, lba, b, 0))
+                    errx(1, "untrimmed lba=%#lx read zero", lba);
+            }
+            while (b < n) {
+                u64 l = lba + b;
+                u64 end = l < tslba + tnlb ? tslba + tnlb : slba + nlb;
+                u32 c = (end - l) < (n - b) ? (end - l) : (n - b);
+                u32 nz = read_check(ns, vol, 0, rbuf, l, c, l < tslba + tnlb);
+                if (l >= tslba + tnlb && nz)
+                    errx(1, "untrimmed lba=%#lx read zero", l);
+                b += c;
+            }
+        }
+        printf("trim lba=%#lx nlb=%#lx verified\n", tslba, tnlb);
+    }
+
+    unvme_pool_stats_t ps;
+    unvme_pool_stats(pool, &ps);
+    race_t r = { .ns = ns, .vol = vol, .nlb = ps.extnlb };
+    r.slba = (slba + ps.extnlb - 1) & ~((u64)ps.extnlb - 1);
+    if ((r.slba + r.nlb) <= (slba + nlb)) {
+        pthread_t t;
+        pthread_create(&t, 0, race_io, &r);
+        int i;
+        for (i = 0; i < RACE_TRIMS; i++) {
+            // alternate whole extent (unmap) and partial (zeroing) trims,
+            // the latter off the blocks being written (as a block written
+            // and zeroed at once may read as either or torn)
+            u64 tl = r.slba + ((i & 1) ? r.nlb / 2 : 0);
+            u64 tn = (i & 1) ? r.nlb / 2 : r.nlb;
+            int stat = unvme_vol_trim(vol, 0, tl, tn ? tn : 1);
+            if (stat) errx(1, "trim lba=%#lx: %s", tl, unvme_strerror(stat));
+            usleep(100);
+        }
+        r.stop = 1;
+        pthread_join(t, 0);
+        printf("concurrent I/O and trim of lba=%#lx nlb=%#x verified\n", r.slba, r.nlb);
+    }
+    unvme_free(ns, rbuf);
+    unvme_free(ns, wbuf);
+}
+
+/*
+ * Write a volume range with the test pattern of a generation, or read it
+ * back and verify it.
+ */
+static void vol_pattern(const unvme_ns_t* ns, unvme_vol_t* vol, u64 slba, u64 nlb,
+                        u64 gen, int verify)
+{
+    u32 nbpio = ns->maxbpio;
+    u64 size = (u64)nbpio * ns->blocksize;
+    u64* wbuf = unvme_alloc(ns, size);
+    u64* rbuf = unvme_alloc(ns, size);
+    if (!wbuf || !rbuf) errx(1, "unvme_alloc %#lx failed", size);
+
+    u64 lba;
+    for (lba = slba; lba < slba + nlb; lba += nbpio) {
+        u32 n = (slba + nlb - lba) < nbpio ? (slba + nlb - lba) : nbpio;
+        fill_pattern(ns, wbuf, lba, n, gen);
+        int stat = verify ? unvme_vol_read(vol, 0, rbuf, lba, n)
+                          : unvme_vol_write(vol, 0, wbuf, lba, n);
+        if (stat) errx(1, "%s lba=%#lx nlb=%#x: %s", verify ? "read" : "write",
+                       lba, n, unvme_strerror(stat));
+        if (verify && memcmp(wbuf, rbuf, (u64)n * ns->blocksize))
+            errx(1, "verify mismatch lba=%#lx nlb=%#x", lba, n);
+    }
+    unvme_free(ns, rbuf);
+    unvme_free(ns, wbuf);
+}
+
+/*
+ * Test the point-in-time semantics of a snapshot: write a volume range,
+ * snapshot the volume, overwrite the range (of the still open volume), and
+ * check that the snapshot reads the old data and the volume the new data.
+ * The snapshot is deleted when done.
+ */
+static void vol_snaptest(const unvme_ns_t* ns, unvme_pool_t* pool, const char* name,
+                         u64 slba, u64 nlb)
+{
+    char snapname[UNVME_VOL_NAMELEN];
+    snprintf(snapname, sizeof(snapname), "%.22s-snaptest", name);
+    unvme_vol_t* vol = unvme_vol_open(pool, name);
+    if (!vol) errx(1, "%s: %s", name, unvme_strerror(-errno));
+
+    vol_pattern(ns, vol, slba, nlb, 1, 0);
+    int stat = unvme_vol_snapshot(pool, name, snapname);
+    if (stat) errx(1, "snapshot %s: %s", snapname, unvme_strerror(stat));
+    vol_pattern(ns, vol, slba, nlb, 2, 0);
+    vol_pattern(ns, vol, slba, nlb, 2, 1);
+
+    unvme_vol_t* snap = unvme_vol_open(pool, snapname);
+    if (!snap) errx(1, "%s: %s", snapname, unvme_strerror(-errno));
+    vol_pattern(ns, snap, slba, nlb, 1, 1);
+    if ((stat = unvme_vol_write(snap, 0, 0, slba, 1)) != -EROFS)
+        errx(1, "snapshot write: %s", unvme_strerror(stat));
+    unvme_vol_close(snap);
+    unvme_vol_close(vol);
+    if ((stat = unvme_vol_delete(pool, snapname)))
+        errx(1, "delete %s: %s", snapname, unvme_strerror(stat));
+    printf("snapshot lba=%#lx nlb=%#lx verified\n", slba, nlb);
+}
+
+/*
+ * Main.
+ */
+int main(int argc, char** argv)
+{
+    const char* usage = "Usage: %s [OPTION]... PCINAME COMMAND [ARG]...\n\
+         -e EXTNLB    format extent size in blocks (default 1MB)\n\
+         -v MAXVOLS   format max number of volumes (default 64)\n\
+         -m MAXNLB    format max volume size in blocks (default namespace size)\n\
+         PCINAME      PCI device name (as 01:00.0[/1] format)\n\
+         COMMAND      format | list\n\
+                      create NAME NLB | delete NAME\n\
+                      snapshot NAME SNAPNAME | snaptest NAME SLBA NLB\n\
+                      test NAME SLBA NLB | trim NAME SLBA NLB\n\
+         (test writes and verifies a range, then trims and verifies it,\n\
+         and snaptest verifies a snapshot of a range being overwritten)";
+
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    unvme_pool_params_t params;
+    memset(&params, 0, sizeof(params));
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "e:v:m:")) != -1) {
+        switch (opt) {
+        case 'e':
+            params.extnlb = strtoul(optarg, 0, 0);
+            break;
+        case 'v':
+            params.maxvols = strtoul(optarg, 0, 0);
+            break;
+        case 'm':
+            params.maxvnlb = strtoull(optarg, 0, 0);
+            break;
+        default:
+            warnx(usage, prog);
+            exit(1);
+        }
+    }
+    if ((optind + 2) > argc) {
+        warnx(usage, prog);
+        exit(1);
+    }
+    const char* cmd = argv[optind + 1];
+    char** args = argv + optind + 2;
+    int nargs = argc - optind - 2;
+    if ((!strcmp(cmd, "create") && nargs != 2) || (!strcmp(cmd, "delete") && nargs != 1) ||
+        (!strcmp(cmd, "snapshot") && nargs != 2) ||
+        ((!strcmp(cmd, "test") || !strcmp(cmd, "trim") || !strcmp(cmd, "snaptest")) &&
+         nargs != 3)) {
+        warnx(usage, prog);
+        exit(1);
+    }
+
+    // queue 1 is used by the concurrent I/O of the test command
+    const unvme_ns_t* ns = unvme_openq(argv[optind], 2, 0);
+    if (!ns) exit(1);
+
+    int stat = 0;
+    if (!strcmp(cmd, "format")) {
+        stat = unvme_pool_format(ns, 0, &params);
+        if (stat) errx(1, "format: %s", unvme_strerror(stat));
+    }
+    unvme_pool_t* pool = unvme_pool_open(ns, 0);
+    if (!pool) errx(1, "pool open: %s", unvme_strerror(-errno));
+
+    if (!strcmp(cmd, "create")) {
+        stat = unvme_vol_create(pool, args[0], strtoull(args[1], 0, 0));
+    } else if (!strcmp(cmd, "delete")) {
+        stat = unvme_vol_delete(pool, args[0]);
+    } else if (!strcmp(cmd, "snapshot")) {
+        stat = unvme_vol_snapshot(pool, args[0], args[1]);
+    } else if (!strcmp(cmd, "snaptest")) {
+        vol_snaptest(ns, pool, args[0], strtoull(args[1], 0, 0), strtoull(args[2], 0, 0));
+    } else if (!strcmp(cmd, "test") || !strcmp(cmd, "trim")) {
+        unvme_vol_t* vol = unvme_vol_open(pool, args[0]);
+        if (!vol) errx(1, "%s: %s", args[0], unvme_strerror(-errno));
+        u64 slba = strtoull(args[1], 0, 0);
+        u64 nlb = strtoull(args[2], 0, 0);
+        if (!strcmp(cmd, "test")) vol_test(ns, pool, vol, slba, nlb);
+        else stat = unvme_vol_trim(vol, 0, slba, nlb);
+        unvme_vol_close(vol);
+    } else if (strcmp(cmd, "format") && strcmp(cmd, "list")) {
+        warnx(usage, prog);
+        exit(1);
+    }
+    if (stat) errx(1, "%s: %s", cmd, unvme_strerror(stat));
+
+    unvme_pool_stats_t ps;
+    unvme_pool_stats(pool, &ps);
+    printf("%s pool: %lu/%lu extents used (%u blocks), %d/%d volumes (%d deleting)\n",
+           ns->device, ps.extused, ps.extcount, ps.extnlb, ps.volcount, ps.maxvols,
+           ps.delcount);
+    unvme_vol_info_t* info = calloc(ps.maxvols, sizeof(*info));
+    int n = unvme_pool_list(pool, info, ps.maxvols);
+    for (i = 0; i < n; i++) {
+        printf("  %-32s nlb=%#lx mapped=%lu/%lu%s\n", info[i].name, info[i].nlb,
+               info[i].mapped, (info[i].nlb + ps.extnlb - 1) / ps.extnlb,
+               (info[i].flags & UNVME_VOL_SNAPSHOT) ? " snapshot" : "");
+    }
+    free(info);
+
+    unvme_pool_close(pool);
+    unvme_close(ns);
+    return 0;
+}
@@ -1,6 +1,11 @@
 /**
  * @file
  * @brief Device read/write utility.
+ *
+ * The I/O runs as a pipeline:  one submitter thread per queue keeps the
+ * queue busy while a pool of worker threads generates the write data
+ * patterns and verifies the read data.  Each queue slot has two DMA
+ * buffers, so one can be filled or verified while the other is in flight.
  */
 
 #include <sys/types.h>
@@ -12,12 +17,28 @@
 #include <fcntl.h>
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
 #include <err.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "unvme.h"
 
 #define PDEBUG(fmt, arg...)     //fprintf(stderr, fmt "\n", ##arg)
 
+/// I/O buffer pipeline state
+enum { BUF_FREE, BUF_FILL, BUF_READY, BUF_BUSY, BUF_VERIFY };
+
+/// I/O buffer
+typedef struct {
+    void*               buf;        ///< DMA buffer
+    u64                 lba;        ///< starting LBA
+    u32                 nlb;        ///< number of blocks
+    volatile int        state;      ///< pipeline state
+    unvme_iod_t         iod;        ///< I/O descriptor (if busy)
+    time_t              tsubmit;    ///< submission time
+} iobuf_t;
+
 // Global static variables
 static const unvme_ns_t* ns;    ///< namespace handle
 static u32 rw = 0;              ///< read-write flag
@@ -28,12 +49,23 @@ static u64 patinc = 0;          ///< pattern increment per LBA
 static u32 qcount = 16;         ///< IO queue count
 static u32 qdepth = 64;         ///< IO queue depth
 static u32 nbpio = 0;           ///< number of blocks per IO
+static u32 nworkers = 2;        ///< number of pattern/verify workers
 static time_t dumptime = 0;     ///< interval to display data
 static int dump = 0;            ///< dump count
-static int mismatch = 0;        ///< data miscompare flag
-static unvme_iod_t* iods;       ///< array IO descriptors
-static void** iobufs;           ///< array of IO buffers
+static volatile int mismatch = 0; ///< data miscompare flag
+static volatile int done = 0;   ///< all submitters are done
+static u64 nextlba;             ///< next LBA to be submitted
+static u64 lbaend;              ///< end LBA
+static volatile u64 completecount = 0; ///< number of blocks completed
+static iobuf_t* iobufs;         ///< I/O buffers (2 per queue slot)
 static u64* fixedbuf;           ///< fixed data block buffer
+static iobuf_t** workq;         ///< worker queue of buffers
+static int workqsize;           ///< worker queue size
+static int workqhead = 0;       ///< worker queue head
+static int workqcount = 0;      ///< worker queue count
+static pthread_mutex_t worklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workcond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t dumplock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /*
@@ -63,39 +95,241 @@ static void dumpblock(void* buf, u64 lba)
 }
 
 /*
- * Submit next IO to a queue.
+ * Dump the requested number of blocks of a buffer.
  */
-unvme_iod_t submit(int q, int d, void* buf, u64 lba, u32 nlb)
+static void dumpbuf(iobuf_t* b)
 {
-    unvme_iod_t iod;
+    pthread_mutex_lock(&dumplock);
+    void* bbuf = b->buf;
+    int i;
+    for (i = 0; i < b->nlb && dump > 0; i++) {
+        dumpblock(bbuf, b->lba + i);
+        bbuf += ns->blocksize;
+        dump--;
+    }
+    pthread_mutex_unlock(&dumplock);
+}
 
-    if (rw == 'w') {
-        int b, i;
+/*
+ * Get current time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Set a buffer state (ordering prior buffer accesses before it).
+ */
+static void set_bufstate(iobuf_t* b, int state)
+{
+    __sync_synchronize();
+    b->state = state;
+}
+
+/*
+ * Queue a buffer for pattern generation or verification.
+ */
+static void workq_put(iobuf_t* b, int state)
+{
+    pthread_mutex_lock(&worklock);
+    set_bufstate(b, state);
+    workq[(workqhead + workqcount) % workqsize] = b;
+    workqcount++;
+    pthread_cond_signal(&workcond);
+    pthread_mutex_unlock(&worklock);
+}
+
+/*
+ * Generate the incrementing data pattern of a write buffer.
+ */
+static void fill(iobuf_t* b)
+{
+    u64* pbuf = b->buf;
+    int wib = ns->blocksize / sizeof(u64);
+    int i, j;
+    for (i = 0; i < b->nlb; i++) {
+        u64 p = pattern + ((b->lba + i - startlba) * patinc);
+        for (j = 0; j < wib; j++) *pbuf++ = p;
+    }
+    if (dump) dumpbuf(b);
+}
+
+/*
+ * Compare a read buffer against the data pattern.
+ */
+static void verify(iobuf_t* b)
+{
+    if (dump) dumpbuf(b);
+
+    void* bbuf = b->buf;
+    int wib = ns->blocksize / sizeof(u64);
+    int i, j;
+    for (i = 0; i < b->nlb; i++) {
+        u64 lba = b->lba + i;
         if (patinc) {
-            u64* pbuf = buf;
-            int wib = ns->blocksize / sizeof(u64);
-            for (b = 0; b < nlb; b++) {
-                u64 p = pattern + ((b + lba - startlba) * patinc);
-                for (i = 0; i < wib; i++) *pbuf++ = p;
+            u64 p = pattern + ((lba - startlba) * patinc);
+            u64* pbuf = bbuf;
+            for (j = 0; j < wib; j++) {
+                if (pbuf[j] != p) {
+                    pthread_mutex_lock(&dumplock);
+                    dumpblock(bbuf, lba);
+                    warnx("ERROR: data mismatch at LBA %#lx "
+                          "offset %#lx exp %#016lx obs %#016lx",
+                          lba, j * sizeof(u64), p, pbuf[j]);
+                    pthread_mutex_unlock(&dumplock);
+                    mismatch = 1;
+                    return;
+                }
             }
+        } else if (memcmp(bbuf, fixedbuf, ns->blocksize)) {
+            pthread_mutex_lock(&dumplock);
+            dumpblock(bbuf, lba);
+            warnx("ERROR: data mismatch at LBA %#lx exp %#016lx", lba, pattern);
+            pthread_mutex_unlock(&dumplock);
+            mismatch = 1;
+            return;
         }
-        if (dump) {
-            void* bbuf = buf;
-            for (b = 0; b < nlb; b++) {
-                dumpblock(bbuf, lba + b);
-                bbuf += ns->blocksize;
-                if (--dump == 0) break;
-            }
+        bbuf += ns->blocksize;
+    }
+}
+
+/*
+ * Pattern generation and verification worker thread.
+ */
+static void* worker(void* arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&worklock);
+        while (workqcount == 0 && !done) pthread_cond_wait(&workcond, &worklock);
+        if (workqcount == 0) {
+            pthread_mutex_unlock(&worklock);
+            break;
         }
-        PDEBUG("@W q%d.%d %p %#lx %d", q, d, buf, lba, nlb);
-        iod = unvme_awrite(ns, q, buf, lba, nlb);
-        if (!iod) errx(1, "unvme_awrite q=%d lba=%#lx nlb=%#x failed", q, lba, nlb);
+        iobuf_t* b = workq[workqhead];
+        workqhead = (workqhead + 1) % workqsize;
+        workqcount--;
+        pthread_mutex_unlock(&worklock);
+
+        if (b->state == BUF_FILL) {
+            fill(b);
+            set_bufstate(b, BUF_READY);
+        } else {
+            if (!mismatch) verify(b);
+            __sync_fetch_and_add(&completecount, b->nlb);
+            set_bufstate(b, BUF_FREE);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Submit the I/O of a buffer.
+ */
+static void submit(int q, iobuf_t* b)
+{
+    if (rw == 'w') {
+        PDEBUG("@W q%d %p %#lx %d", q, b->buf, b->lba, b->nlb);
+        b->iod = unvme_awrite(ns, q, b->buf, b->lba, b->nlb);
+        if (!b->iod) errx(1, "unvme_awrite q=%d lba=%#lx nlb=%#x failed: %s",
+                          q, b->lba, b->nlb, unvme_strerror(-errno));
     } else {
-        PDEBUG("@R q%d.%d %p %#lx %d", q,  d, buf, lba, nlb);
-        iod = unvme_aread(ns, q, buf, lba, nlb);
-        if (!iod) errx(1, "unvme_aread q=%d lba=%#lx nlb=%#x failed", q, lba, nlb);
+        PDEBUG("@R q%d %p %#lx %d", q, b->buf, b->lba, b->nlb);
+        b->iod = unvme_aread(ns, q, b->buf, b->lba, b->nlb);
+        if (!b->iod) errx(1, "unvme_aread q=%d lba=%#lx nlb=%#x failed: %s",
+                          q, b->lba, b->nlb, unvme_strerror(-errno));
+    }
+    b->tsubmit = time(0);
+    set_bufstate(b, BUF_BUSY);
+}
+
+/*
+ * Queue submitter thread.
+ */
+static void* submitter(void* arg)
+{
+    int q = (long)arg;
+    int nbufs = qdepth * 2;
+    iobuf_t* bufs = iobufs + q * nbufs;
+    int busy = 0, pending = 0;
+    int eod = 0;
+
+    while (!eod || pending) {
+        int i, progress = 0;
+        for (i = 0; i < nbufs; i++) {
+            iobuf_t* b = bufs + i;
+            switch (b->state) {
+            case BUF_FREE:
+                if (eod) break;
+                if (mismatch) {
+                    eod = 1;
+                    break;
+                }
+                b->lba = __sync_fetch_and_add(&nextlba, nbpio);
+                if (b->lba >= lbaend) {
+                    eod = 1;
+                    break;
+                }
+                b->nlb = nbpio;
+                if ((b->lba + b->nlb) > lbaend) b->nlb = lbaend - b->lba;
+                pending++;
+                progress = 1;
+                if (rw == 'w' && patinc) {
+                    workq_put(b, BUF_FILL);
+                    break;
+                }
+                if (rw == 'w' && dump) dumpbuf(b);
+                set_bufstate(b, BUF_READY);
+                // fall through
+
+            case BUF_READY:
+                if (busy < qdepth) {
+                    submit(q, b);
+                    busy++;
+                    progress = 1;
+                }
+                break;
+
+            case BUF_BUSY: {
+                unvme_iod_t iod = b->iod;
+                int stat = unvme_apoll(iod, 0);
+                if (stat == -ETIMEDOUT) {
+                    if ((time(0) - b->tsubmit) > UNVME_TIMEOUT)
+                        errx(1, "unvme_apoll timeout q=%d lba=%#lx nlb=%#x",
+                             q, b->lba, b->nlb);
+                    break;
+                }
+                if (stat)
+                    errx(1, "unvme_apoll error=%#x (%s) q=%d lba=%#lx nlb=%#x",
+                         stat, unvme_strerror(stat), q, b->lba, b->nlb);
+                PDEBUG("@C q%d %p %#lx %d", q, b->buf, b->lba, b->nlb);
+                busy--;
+                pending--;
+                progress = 1;
+                if (rw == 'r') {
+                    workq_put(b, BUF_VERIFY);
+                } else {
+                    __sync_fetch_and_add(&completecount, b->nlb);
+                    set_bufstate(b, BUF_FREE);
+                }
+                break;
+            }
+
+            default:
+                break;
+            }
+        }
+        if (!progress) sched_yield();
+    }
+
+    // wait for the verification of this queue's buffers to finish
+    int i;
+    for (i = 0; i < nbufs; i++) {
+        while (bufs[i].state != BUF_FREE) sched_yield();
     }
-    return iod;
+    return 0;
 }
 
 /*
@@ -110,9 +344,10 @@ int main(int argc, char** argv)
          -i PATINC    increment data pattern at each LBA (default 0)\n\
          -a LBA       starting at LBA (default 0)\n\
          -n COUNT     number of blocks to read/write (default to end)\n\
-         -q QCOUNT    use number of queues for async IO (default 16)\n\
+         -q QCOUNT    use number of queues (submitter threads) (default 16)\n\
          -d QDEPTH    use queue depth for async IO (default 64)\n\
          -m NBPIO     use number of blocks per IO (default max support)\n\
+         -t WORKERS   number of pattern/verify threads (default 2)\n\
          -p INTERVAL  print progress with LBA data every INTERVAL seconds\n\
          PCINAME      PCI device name (as 01:00.0[/1] format)\n\n\
          either -w or -r must be specified";
@@ -121,7 +356,7 @@ int main(int argc, char** argv)
     prog = prog ? prog + 1 : argv[0];
     int opt, b, i;
 
-    while ((opt = getopt(argc, argv, "w:r:i:a:n:q:d:m:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "w:r:i:a:n:q:d:m:t:p:")) != -1) {
         switch (opt) {
         case 'w':
         case 'r':
@@ -146,6 +381,9 @@ int main(int argc, char** argv)
         case 'm':
             nbpio = strtoul(optarg, 0, 0);
             break;
+        case 't':
+            nworkers = strtoul(optarg, 0, 0);
+            break;
         case 'p':
             dumptime = strtoul(optarg, 0, 0);
             dump = 2;
@@ -155,7 +393,8 @@ int main(int argc, char** argv)
             exit(1);
         }
     }
-    if ((optind + 1) != argc || !rw) {
+    if ((optind + 1) != argc || !rw || qcount == 0 || qdepth == 0 ||
+        nworkers == 0) {
         warnx(usage, prog);
         exit(1);
     }
@@ -180,25 +419,25 @@ int main(int argc, char** argv)
         errx(1, "invalid nbpio %d", nbpio);
     }
 
-    printf("%s qc=%d/%d qd=%d/%d bc=%#lx bs=%d nbpio=%d/%d\n",
+    printf("%s qc=%d/%d qd=%d/%d bc=%#lx bs=%d nbpio=%d/%d workers=%d\n",
             ns->device, qcount, ns->qcount, qdepth, ns->qsize-1,
-            ns->blockcount, ns->blocksize, nbpio, ns->maxbpio);
+            ns->blockcount, ns->blocksize, nbpio, ns->maxbpio, nworkers);
 
-    int iomax = qcount * qdepth;
-    iods = calloc(iomax, sizeof(unvme_iod_t));
-    iobufs = calloc(iomax, sizeof(void*));
+    // allocate double buffers for each queue slot
+    int nbufs = qcount * qdepth * 2;
+    iobufs = calloc(nbufs, sizeof(iobuf_t));
+    workqsize = nbufs;
+    workq = calloc(workqsize, sizeof(iobuf_t*));
 
     int iobufsize = nbpio * ns->blocksize;
-    for (i = 0; i < iomax; i++) {
-        iobufs[i] = unvme_alloc(ns, iobufsize);
-        if (!iobufs[i]) errx(1, "unvme_alloc %#x failed", iobufsize);
+    for (i = 0; i < nbufs; i++) {
+        iobufs[i].buf = unvme_alloc(ns, iobufsize);
+        if (!iobufs[i].buf) errx(1, "unvme_alloc %#x failed", iobufsize);
     }
 
     int wib = ns->blocksize / sizeof(u64);
-    if (patinc == 0) {
-        fixedbuf = malloc(ns->blocksize);
-        for (i = 0; i < wib; i++) fixedbuf[i] = pattern;
-    }
+    fixedbuf = malloc(ns->blocksize);
+    for (i = 0; i < wib; i++) fixedbuf[i] = pattern;
 
     // setup for write and read
     if (rw == 'w') {
@@ -207,8 +446,8 @@ int main(int argc, char** argv)
 
         // if fixed pattern then fill all buffers with the pattern
         if (patinc == 0) {
-            for (i = 0; i < iomax; i++) {
-                void* buf = iobufs[i];
+            for (i = 0; i < nbufs; i++) {
+                void* buf = iobufs[i].buf;
                 for (b = 0; b < nbpio; b++) {
                     memcpy(buf, fixedbuf, ns->blocksize);
                     buf += ns->blocksize;
@@ -220,129 +459,55 @@ int main(int argc, char** argv)
                startlba, startlba + lbacount - 1, pattern, patinc);
     }
 
-    // submit async IOs until all are completed
-    u64 submitcount = lbacount;
-    u64 completecount = lbacount;
-    u64 nextlba = startlba;
-    time_t tio = time(0);
-    time_t dumplast = tio;
-    int q = 0, d = 0;
-
-    while (completecount > 0) {
-        int x = q * qdepth + d;
-        unvme_iod_t iod = iods[x];
-
-        // check to submit next IO
-        if (!iod) {
-            if (submitcount > 0) {
-                if (!mismatch) {
-                    int nlb = nbpio;
-                    if (nlb > submitcount) nlb = submitcount;
-                    iods[x] = submit(q, d, iobufs[x], nextlba, nlb);
-                    nextlba += nlb;
-                    submitcount -= nlb;
-                } else {
-                    completecount -= submitcount;
-                    submitcount = 0;
-                }
-            }
-
-            // next slot
-            if (++d >= qdepth) {
-                d = 0;
-                if (++q >= qcount) q = 0;
-            }
-            continue;
-        }
+    // start the pipeline
+    nextlba = startlba;
+    lbaend = startlba + lbacount;
+    pthread_t* wt = calloc(nworkers, sizeof(pthread_t));
+    pthread_t* st = calloc(qcount, sizeof(pthread_t));
+    for (i = 0; i < nworkers; i++) pthread_create(&wt[i], 0, worker, 0);
+    double tio = now();
+    for (i = 0; i < qcount; i++) pthread_create(&st[i], 0, submitter, (void*)(long)i);
 
-        // save iod content as unvme_apoll() will clear it on completion
-        void* cbuf = iod->buf;
-        u64 clba = iod->slba;
-        u32 cnlb = iod->nlb;
-
-        // check IO completion
-        int stat = unvme_apoll(iod, 0);
-        if (stat) {
-            // terminate on error
-            if (stat != -1)
-                errx(1, "unvme_apoll error=%#x slba=%#lx nlb=%#x", stat, iod->slba, iod->nlb);
-            else if ((time(0) - tio) > UNVME_TIMEOUT)
-                errx(1, "unvme_apoll timeout slba=%#lx nlb=%#x", iod->slba, iod->nlb);
-            // if no completion go on to next queue
-            if (++q >= qcount) q = 0;
-            continue;
-        }
-
-        // IO completion
-        PDEBUG("@C q%d.%d %p %#lx %d", q, d, cbuf, clba, cnlb);
-        completecount -= cnlb;
-        iods[x] = NULL;
-        tio = time(0);
-        if (dumptime && (tio - dumplast) > dumptime) {
-            dumplast = tio;
+    // report progress until all I/O are completed
+    double tlast = tio;
+    u64 lastcount = 0;
+    while (completecount < lbacount && !mismatch) {
+        usleep(100000);
+        double t = now();
+        if (dumptime && (t - tlast) >= dumptime) {
+            u64 count = completecount;
+            printf("%5.1f%% lba=%#lx %.2f GB/s\n", count * 100.0 / lbacount,
+                   startlba + count, (double)(count - lastcount) *
+                   ns->blocksize / (t - tlast) / 1e9);
+            fflush(stdout);
+            tlast = t;
+            lastcount = count;
+            pthread_mutex_lock(&dumplock);
             dump++;
-        }
-
-        // compare read result unless (there's already a data mismatch)
-        if (rw == 'r' && !mismatch) {
-            // print block contents
-            if (dump) {
-                void* bbuf = cbuf;
-                for (b = 0; b < cnlb; b++) {
-                    dumpblock(bbuf, clba + b);
-                    bbuf += ns->blocksize;
-                    if (--dump == 0) break;
-                }
-            }
-
-            // compare read results against data pattern
-            if (patinc) {
-                void* bbuf = cbuf;
-                u64 blba = clba;
-                for (b = 0; b < cnlb; b++) {
-                    u64 p = pattern + ((blba - startlba) * patinc);
-                    u64* pbuf = bbuf;
-                    for (i = 0; i < wib; i++) {
-                        if (*pbuf != p) {
-                            dumpblock(bbuf, blba);
-                            warnx("ERROR: data mismatch at LBA %#lx "
-                                    "offset %#lx exp %#016lx obs %#016lx",
-                                    blba, i * sizeof(u64), p, *pbuf);
-                            mismatch++;
-                            break;
-                        }
-                        pbuf++;
-                    }
-                    if (mismatch) break;
-                    bbuf += ns->blocksize;
-                    blba++;
-                }
-            } else {
-                void* bbuf = cbuf;
-                u64 plba = clba;
-                for (b = 0; b < cnlb; b++) {
-                    if (memcmp(bbuf, fixedbuf, ns->blocksize)) {
-                        dumpblock(bbuf, plba);
-                        warnx("ERROR: data mismatch at LBA %#lx exp %#016lx",
-                                plba, pattern);
-                        mismatch++;
-                        break;
-                    }
-                    bbuf += ns->blocksize;
-                    plba++;
-                }
-            }
+            pthread_mutex_unlock(&dumplock);
         }
     }
+    for (i = 0; i < qcount; i++) pthread_join(st[i], 0);
+    double tend = now();
+    pthread_mutex_lock(&worklock);
+    done = 1;
+    pthread_cond_broadcast(&workcond);
+    pthread_mutex_unlock(&worklock);
+    for (i = 0; i < nworkers; i++) pthread_join(wt[i], 0);
 
-    for (i = 0; i < iomax; i++) unvme_free(ns, iobufs[i]);
+    double gbps = (double)lbacount * ns->blocksize / (tend - tio) / 1e9;
+    for (i = 0; i < nbufs; i++) unvme_free(ns, iobufs[i].buf);
+    free(st);
+    free(wt);
+    free(workq);
     free(fixedbuf);
     free(iobufs);
-    free(iods);
     unvme_close(ns);
 
-    if (!mismatch) printf("Completion time: %ld seconds\n", time(0) - tstart);
+    if (!mismatch) {
+        printf("Completion time: %ld seconds (%.2f GB/s)\n",
+               time(0) - tstart, gbps);
+    }
 
     return mismatch;
 }
-